@@ -0,0 +1,1059 @@
+#include "../include/em/concurrent_index_map.h"
+#include "../include/em/index_map.h"
+#include "../include/em/segmented_vector.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Commands to run this:
+//    clang++ bench/bench.cpp -std=c++20 -O3 -DNDEBUG -o build/bench && echo running... && build/bench >bench_output.txt && echo ok
+//    cl /EHsc /O2 /DNDEBUG bench/bench.cpp /std:c++latest /Fe:build/bench /Fo:build/bench.obj && echo running... && build\bench.exe >bench_output.txt && echo ok
+//
+// Flags (all optional):
+//    --sizes=1e3,1e4,...   Map sizes. Up to 1e8 makes sense, if you have the memory.
+//    --keys=8,16,32,64     Bit widths of `KeyType` to test. Map sizes are clamped to what the key type can hold.
+//    --values=4,64,256     Value sizes in bytes.
+//    --persistent=16,64    Persistent data sizes in bytes, for the `lookup_persistent_N` benchmarks that compare the index layouts.
+//    --churn=0.5           Fraction of elements erased (and reinserted) by the erasing benchmarks.
+//    --readers=1,4,16      Reader thread counts, for the `concurrent_lookup_N` benchmarks.
+//    --filter=text         Only run benchmarks whose name contains this text, e.g. `--filter=lookup/index_map`.
+//
+// The output is tab-separated: `benchmark  container  key_bits  value_bytes  size  ns_per_op`.
+
+namespace
+{
+    volatile std::uint64_t sink = 0;
+
+    template <std::size_t N>
+    struct Payload
+    {
+        static_assert(N % 4 == 0);
+        std::uint32_t words[N / 4]{};
+
+        Payload() {}
+        explicit Payload(std::uint32_t x) {words[0] = x;}
+
+        [[nodiscard]] std::uint32_t get() const {return words[0];}
+    };
+
+    // Adapters. Each one exposes the same minimal interface, so the benchmarks can be written once.
+
+    struct SeparateLayoutOptions : em::IndexMapOptions
+    {
+        using index_layout = em::IndexLayout::separate;
+    };
+    struct PagedLayoutOptions : em::IndexMapOptions
+    {
+        using index_layout = em::IndexLayout::paged<>;
+    };
+
+    template <typename Layout> constexpr const char *index_map_name = "index_map";
+    template <> constexpr const char *index_map_name<em::IndexLayout::separate> = "index_map/separate";
+    template <> constexpr const char *index_map_name<em::IndexLayout::paged<>> = "index_map/paged";
+
+    // `em::IndexMap` as is.
+    template <typename V, typename K, typename P = void, typename Options = em::IndexMapOptions, template <typename...> typename ValueContainer = std::vector>
+    struct IndexMapAdapter
+    {
+        static constexpr const char *name = index_map_name<typename Options::index_layout>;
+        static constexpr bool supports_erase_key = true;
+        static constexpr bool supports_erase_index = true;
+
+        using map_type = em::IndexMap<V, K, P, std::allocator<K>, std::vector, ValueContainer, Options>;
+        using key = typename map_type::key;
+
+        map_type map;
+
+        [[nodiscard]] static constexpr std::size_t max_size() {return map_type::max_size();}
+        [[nodiscard]] std::size_t size() const {return map.size();}
+        void reserve(std::size_t n) {map.values_reserve(n); map.keys_reserve(n);}
+
+        key insert(std::uint32_t x) {return map.emplace(x).key;}
+        void erase_key(key k) {map.erase(k);}
+        void erase_index(std::size_t i) {map.erase(i);}
+        void erase_keys(std::span<const key> keys) {map.erase_keys(keys);}
+        // Erases `keys`, and inserts as many new elements, whose keys are written back into `keys`.
+        // Each of the 4 command buffers records a quarter of the work, like separate threads would.
+        void churn_deferred(std::span<key> keys)
+        {
+            std::array<typename map_type::command_buffer, 4> buffers;
+            for (std::size_t i = 0; i < keys.size(); i++)
+            {
+                buffers[i % 4].erase(keys[i]);
+                buffers[i % 4].emplace(std::uint32_t(i));
+            }
+            std::size_t first = map.apply(buffers);
+            for (std::size_t i = 0; i < keys.size(); i++)
+                keys[i] = map.index_to_key(first + i);
+        }
+        [[nodiscard]] const V &lookup(key k) const {return map[k];}
+        [[nodiscard]] std::uint64_t lookup_batch(std::span<const key> keys) const
+        {
+            std::uint64_t ret = 0;
+            map.for_each_key(keys, [&](typename map_type::key_value_const_reference elem){ret += elem.value().get();});
+            return ret;
+        }
+
+        // The `_scalar` versions are the baseline for the SIMD ones.
+        std::size_t contains_many(std::span<const key> keys, std::span<std::uint64_t> mask) const {return map.contains_many(keys, mask);}
+        std::size_t contains_many_scalar(std::span<const key> keys, std::span<std::uint64_t> mask) const
+        {
+            std::size_t ret = 0;
+            std::fill(mask.begin(), mask.end(), std::uint64_t(0));
+            for (std::size_t j = 0; j < keys.size(); j++)
+            {
+                if (map.contains(keys[j]))
+                {
+                    mask[j / 64] |= std::uint64_t(1) << (j % 64);
+                    ret++;
+                }
+            }
+            return ret;
+        }
+        void keys_to_indices(std::span<const key> keys, std::span<std::size_t> out) const {map.keys_to_indices(keys, out);}
+        void keys_to_indices_scalar(std::span<const key> keys, std::span<std::size_t> out) const
+        {
+            for (std::size_t j = 0; j < keys.size(); j++)
+                out[j] = map.key_to_index(keys[j]);
+        }
+
+        [[nodiscard]] std::uint64_t sum_values() const
+        {
+            std::uint64_t ret = 0;
+            if constexpr (requires{map.values().segments();})
+            {
+                // Loop over each segment separately, so the inner loop can be vectorized.
+                for (std::span<const V> segment : map.values().segments())
+                {
+                    for (const V &v : segment)
+                        ret += v.get();
+                }
+            }
+            else
+            {
+                for (const V &v : map.values())
+                    ret += v.get();
+            }
+            return ret;
+        }
+        [[nodiscard]] std::uint64_t sum_keys_and_values() const
+        {
+            std::uint64_t ret = 0;
+            for (auto elem : map.keys_and_values())
+                ret += std::uint64_t(elem.key()) + elem.value().get();
+            return ret;
+        }
+        std::size_t erase_if(std::uint32_t threshold)
+        {
+            return em::erase_if(map.values(), [&](const V &v){return v.get() < threshold;});
+        }
+        // Sorts by `proj(v.get())`. The `_swaps` version is the baseline: it sorts the same way, but then puts the elements in place with `swap_elems()`.
+        void sort(auto proj) {map.sort_by([&](const V &v){return proj(v.get());});}
+        void sort_swaps(auto proj)
+        {
+            std::vector<std::size_t> order(map.size());
+            std::iota(order.begin(), order.end(), std::size_t(0));
+            std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b){return proj(map[a].get()) < proj(map[b].get());});
+            for (std::size_t i = 0; i < order.size(); i++)
+            {
+                std::size_t j = i;
+                while (order[j] != i)
+                {
+                    map.swap_elems(j, order[j]);
+                    j = std::exchange(order[j], j);
+                }
+                order[j] = j;
+            }
+        }
+    };
+
+    template <typename V, typename K>
+    using SeparateIndexMapAdapter = IndexMapAdapter<V, K, void, SeparateLayoutOptions>;
+    template <typename V, typename K>
+    using PagedIndexMapAdapter = IndexMapAdapter<V, K, void, PagedLayoutOptions>;
+
+    // `em::IndexMap` with the values in `em::SegmentedVector`.
+    template <typename V, typename K>
+    struct SegmentedIndexMapAdapter : IndexMapAdapter<V, K, void, em::IndexMapOptions, em::SegmentedVector>
+    {
+        static constexpr const char *name = "index_map/segmented";
+    };
+
+    // `em::IndexMap` used as a slot map: generation counters in the persistent data, checked on every access.
+    template <typename V, typename K>
+    struct SlotMapAdapter
+    {
+        static constexpr const char *name = "index_map+gen";
+        static constexpr bool supports_erase_key = true;
+        static constexpr bool supports_erase_index = true;
+
+        using map_type = em::IndexMap<V, K, std::uint32_t>;
+        struct key
+        {
+            typename map_type::key k{};
+            std::uint32_t gen = 0;
+        };
+
+        map_type map;
+
+        [[nodiscard]] static constexpr std::size_t max_size() {return map_type::max_size();}
+        [[nodiscard]] std::size_t size() const {return map.size();}
+        void reserve(std::size_t n) {map.values_reserve(n); map.keys_reserve(n);}
+
+        key insert(std::uint32_t x)
+        {
+            auto ret = map.emplace(x);
+            return {ret.key, ret.persistent_data};
+        }
+        void erase_key(key k)
+        {
+            if (map.contains(k.k) && map.get_persistent_data(k.k) == k.gen)
+            {
+                map.get_persistent_data(k.k)++;
+                map.erase(k.k);
+            }
+        }
+        void erase_index(std::size_t i)
+        {
+            map.get_persistent_data(i)++;
+            map.erase(i);
+        }
+        [[nodiscard]] const V &lookup(key k) const
+        {
+            if (!map.contains(k.k) || map.get_persistent_data(k.k) != k.gen)
+                std::abort();
+            return map[k.k];
+        }
+
+        [[nodiscard]] std::uint64_t sum_values() const
+        {
+            std::uint64_t ret = 0;
+            for (const V &v : map.values())
+                ret += v.get();
+            return ret;
+        }
+        [[nodiscard]] std::uint64_t sum_keys_and_values() const
+        {
+            std::uint64_t ret = 0;
+            for (auto elem : map.keys_and_values())
+                ret += std::uint64_t(elem.key()) + elem.value().get();
+            return ret;
+        }
+        std::size_t erase_if(std::uint32_t threshold)
+        {
+            return em::erase_if(map.keys_and_values(), [&](const typename map_type::key_value_const_reference &elem)
+            {
+                if (elem.value().get() < threshold)
+                {
+                    // Bumping the generation through a const reference isn't possible, so do it by key.
+                    const_cast<map_type &>(elem.map()).get_persistent_data(elem.key())++;
+                    return true;
+                }
+                return false;
+            });
+        }
+    };
+
+    // `em::IndexMap` with the built-in generational handles. Same as above, but the map bumps the generations itself.
+    template <typename V, typename K>
+    struct HandleIndexMapAdapter
+    {
+        static constexpr const char *name = "index_map+handle";
+        static constexpr bool supports_erase_key = true;
+        static constexpr bool supports_erase_index = true;
+
+        struct Options : em::IndexMapOptions
+        {
+            using generation_type = std::uint32_t;
+        };
+
+        using map_type = em::IndexMap<V, K, void, std::allocator<K>, std::vector, std::vector, Options>;
+        using key = typename map_type::handle;
+
+        map_type map;
+
+        [[nodiscard]] static constexpr std::size_t max_size() {return map_type::max_size();}
+        [[nodiscard]] std::size_t size() const {return map.size();}
+        void reserve(std::size_t n) {map.values_reserve(n); map.keys_reserve(n);}
+
+        key insert(std::uint32_t x) {return map.emplace(x).handle;}
+        void erase_key(key k)
+        {
+            if (map.contains(k))
+                map.erase(k);
+        }
+        void erase_index(std::size_t i) {map.erase(i);}
+        [[nodiscard]] const V &lookup(key k) const
+        {
+            const V *ret = map.try_get(k);
+            if (!ret)
+                std::abort();
+            return *ret;
+        }
+
+        [[nodiscard]] std::uint64_t sum_values() const
+        {
+            std::uint64_t ret = 0;
+            for (const V &v : map.values())
+                ret += v.get();
+            return ret;
+        }
+        [[nodiscard]] std::uint64_t sum_keys_and_values() const
+        {
+            std::uint64_t ret = 0;
+            for (auto elem : map.keys_and_values())
+                ret += std::uint64_t(elem.key()) + elem.value().get();
+            return ret;
+        }
+        std::size_t erase_if(std::uint32_t threshold)
+        {
+            return em::erase_if(map.values(), [&](const V &v){return v.get() < threshold;});
+        }
+    };
+
+    // `std::unordered_map` with keys from a counter. The keys are never reused.
+    template <typename V, typename K>
+    struct UnorderedMapAdapter
+    {
+        static constexpr const char *name = "unordered_map";
+        static constexpr bool supports_erase_key = true;
+        static constexpr bool supports_erase_index = false;
+
+        using key = K;
+
+        std::unordered_map<K, V> map;
+        K next_key = 0;
+
+        [[nodiscard]] static constexpr std::size_t max_size() {return em::IndexMap<void, K>::max_size();}
+        [[nodiscard]] std::size_t size() const {return map.size();}
+        void reserve(std::size_t n) {map.reserve(n);}
+
+        key insert(std::uint32_t x) {K k = next_key++; map.try_emplace(k, x); return k;}
+        void erase_key(key k) {map.erase(k);}
+        void erase_index(std::size_t) {}
+        [[nodiscard]] const V &lookup(key k) const {return map.find(k)->second;}
+
+        [[nodiscard]] std::uint64_t sum_values() const
+        {
+            std::uint64_t ret = 0;
+            for (const auto &[k, v] : map)
+                ret += v.get();
+            return ret;
+        }
+        [[nodiscard]] std::uint64_t sum_keys_and_values() const
+        {
+            std::uint64_t ret = 0;
+            for (const auto &[k, v] : map)
+                ret += std::uint64_t(k) + v.get();
+            return ret;
+        }
+        std::size_t erase_if(std::uint32_t threshold)
+        {
+            return std::size_t(std::erase_if(map, [&](const auto &elem){return elem.second.get() < threshold;}));
+        }
+    };
+
+    // A plain `std::vector` with swap-and-pop erasure. The "keys" are indices, so this is the lower bound for everything.
+    template <typename V, typename K>
+    struct VectorAdapter
+    {
+        static constexpr const char *name = "vector";
+        static constexpr bool supports_erase_key = false;
+        static constexpr bool supports_erase_index = true;
+
+        using key = std::size_t;
+
+        std::vector<V> vec;
+
+        [[nodiscard]] static constexpr std::size_t max_size() {return em::IndexMap<void, K>::max_size();}
+        [[nodiscard]] std::size_t size() const {return vec.size();}
+        void reserve(std::size_t n) {vec.reserve(n);}
+
+        key insert(std::uint32_t x) {vec.emplace_back(x); return vec.size() - 1;}
+        void erase_key(key) {}
+        void erase_index(std::size_t i) {vec[i] = std::move(vec.back()); vec.pop_back();}
+        [[nodiscard]] const V &lookup(key k) const {return vec[k];}
+
+        [[nodiscard]] std::uint64_t sum_values() const
+        {
+            std::uint64_t ret = 0;
+            for (const V &v : vec)
+                ret += v.get();
+            return ret;
+        }
+        [[nodiscard]] std::uint64_t sum_keys_and_values() const
+        {
+            std::uint64_t ret = 0;
+            for (std::size_t i = 0; i < vec.size(); i++)
+                ret += i + vec[i].get();
+            return ret;
+        }
+        std::size_t erase_if(std::uint32_t threshold)
+        {
+            return std::size_t(std::erase_if(vec, [&](const V &v){return v.get() < threshold;}));
+        }
+    };
+
+
+    struct Config
+    {
+        std::vector<std::size_t> sizes = {1000, 10'000, 100'000, 1'000'000};
+        std::vector<int> key_bits = {32};
+        std::vector<int> value_bytes = {4, 64};
+        std::vector<int> persistent_bytes = {16, 64};
+        std::vector<int> readers = {1, 2, 4, 8};
+        double churn = 0.5;
+        std::string filter;
+    };
+
+    Config config;
+
+    [[nodiscard]] bool ShouldRun(std::string_view name)
+    {
+        return name.find(config.filter) != std::string_view::npos;
+    }
+
+    void Report(std::string_view benchmark, std::string_view container, int key_bits, int value_bytes, std::size_t size, double ns_per_op)
+    {
+        std::printf("%.*s\t%.*s\t%d\t%d\t%zu\t%.2f\n", int(benchmark.size()), benchmark.data(), int(container.size()), container.data(), key_bits, value_bytes, size, ns_per_op);
+        std::fflush(stdout);
+    }
+
+    // Runs `func` once, returns nanoseconds per operation.
+    [[nodiscard]] double Time(std::size_t num_ops, auto &&func)
+    {
+        auto start = std::chrono::steady_clock::now();
+        func();
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count() / double(std::max(num_ops, std::size_t(1)));
+    }
+
+    // How many times to repeat the cheap benchmarks (lookups and iteration), to get stable numbers on small maps.
+    [[nodiscard]] std::size_t NumRepeats(std::size_t n)
+    {
+        return std::max(std::size_t(1), std::size_t(10'000'000) / std::max(n, std::size_t(1)));
+    }
+
+    template <typename Adapter>
+    void Fill(Adapter &a, std::vector<typename Adapter::key> &keys, std::size_t n)
+    {
+        a.reserve(n);
+        keys.clear();
+        keys.reserve(n);
+        for (std::size_t i = 0; i < n; i++)
+            keys.push_back(a.insert(std::uint32_t(i)));
+    }
+
+    template <template <typename, typename> typename AdapterTemplate, typename V, typename K>
+    void RunContainer(int key_bits, int value_bytes, std::size_t n)
+    {
+        using Adapter = AdapterTemplate<V, K>;
+
+        auto name = [&](std::string_view benchmark)
+        {
+            return std::string(benchmark) + "/" + Adapter::name;
+        };
+        auto report = [&](std::string_view benchmark, double ns)
+        {
+            Report(benchmark, Adapter::name, key_bits, value_bytes, n, ns);
+        };
+
+        std::mt19937_64 rng(42);
+        std::size_t num_churn = std::min(n, std::size_t(double(n) * config.churn));
+
+        if (ShouldRun(name("insert")))
+        {
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            keys.reserve(n);
+            report("insert", Time(n, [&]{for (std::size_t i = 0; i < n; i++) keys.push_back(a.insert(std::uint32_t(i)));}));
+        }
+
+        // The slowest single insertion, which is where the reallocations show up.
+        if (ShouldRun(name("insert_worst")))
+        {
+            Adapter a;
+            double worst = 0;
+            for (std::size_t i = 0; i < n; i++)
+                worst = std::max(worst, Time(1, [&]{(void)a.insert(std::uint32_t(i));}));
+            report("insert_worst", worst);
+        }
+
+        if (ShouldRun(name("lookup")))
+        {
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            Fill(a, keys, n);
+            std::shuffle(keys.begin(), keys.end(), rng);
+            std::size_t reps = NumRepeats(n);
+            report("lookup", Time(n * reps, [&]
+            {
+                std::uint64_t sum = 0;
+                for (std::size_t r = 0; r < reps; r++)
+                {
+                    for (const auto &k : keys)
+                        sum += a.lookup(k).get();
+                }
+                sink = sum;
+            }));
+        }
+
+        // The same random lookups, but in batches, which lets the map prefetch ahead.
+        if constexpr (requires(const Adapter &a, std::span<const typename Adapter::key> keys){a.lookup_batch(keys);})
+        {
+            if (ShouldRun(name("lookup_batch")))
+            {
+                Adapter a;
+                std::vector<typename Adapter::key> keys;
+                Fill(a, keys, n);
+                std::shuffle(keys.begin(), keys.end(), rng);
+                constexpr std::size_t batch_size = 256;
+                std::size_t reps = NumRepeats(n);
+                report("lookup_batch", Time(n * reps, [&]
+                {
+                    std::uint64_t sum = 0;
+                    for (std::size_t r = 0; r < reps; r++)
+                    {
+                        for (std::size_t i = 0; i < n; i += batch_size)
+                            sum += a.lookup_batch(std::span(keys).subspan(i, std::min(batch_size, n - i)));
+                    }
+                    sink = sum;
+                }));
+            }
+        }
+
+        // Checking batches of keys, half of them invalid, and converting valid keys to indices. SIMD where supported, against the scalar loops.
+        if constexpr (requires(const Adapter &a, std::span<const typename Adapter::key> keys, std::span<std::uint64_t> mask){a.contains_many(keys, mask);})
+        {
+            constexpr std::size_t batch_size = 1024;
+            std::size_t reps = NumRepeats(n);
+
+            auto run_batches = [&](std::string_view benchmark, const std::vector<typename Adapter::key> &keys, auto &&func)
+            {
+                if (!ShouldRun(name(benchmark)))
+                    return;
+                std::vector<std::uint64_t> mask(batch_size / 64);
+                std::vector<std::size_t> out(batch_size);
+                report(benchmark, Time(keys.size() * reps, [&]
+                {
+                    std::uint64_t sum = 0;
+                    for (std::size_t r = 0; r < reps; r++)
+                    {
+                        for (std::size_t i = 0; i < keys.size(); i += batch_size)
+                            sum += func(std::span(keys).subspan(i, std::min(batch_size, keys.size() - i)), std::span(mask), std::span(out));
+                    }
+                    sink = sum;
+                }));
+            };
+
+            if (ShouldRun(name("contains_many")) || ShouldRun(name("keys_to_indices")))
+            {
+                Adapter a;
+                std::vector<typename Adapter::key> keys;
+                Fill(a, keys, n);
+                std::shuffle(keys.begin(), keys.end(), rng);
+
+                run_batches("keys_to_indices", keys, [&](auto batch, auto, auto out){a.keys_to_indices(batch, out.first(batch.size())); return out[0];});
+                run_batches("keys_to_indices_scalar", keys, [&](auto batch, auto, auto out){a.keys_to_indices_scalar(batch, out.first(batch.size())); return out[0];});
+
+                for (std::size_t i = 0; i < keys.size(); i += 2)
+                    keys[i] = typename Adapter::key(rng() % (std::uint64_t(Adapter::max_size() - 1)));
+                run_batches("contains_many", keys, [&](auto batch, auto mask, auto){return a.contains_many(batch, mask);});
+                run_batches("contains_many_scalar", keys, [&](auto batch, auto mask, auto){return a.contains_many_scalar(batch, mask);});
+            }
+        }
+
+        if (ShouldRun(name("iterate_values")))
+        {
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            Fill(a, keys, n);
+            std::size_t reps = NumRepeats(n);
+            report("iterate_values", Time(n * reps, [&]
+            {
+                std::uint64_t sum = 0;
+                for (std::size_t r = 0; r < reps; r++)
+                    sum += a.sum_values();
+                sink = sum;
+            }));
+        }
+
+        if (ShouldRun(name("iterate_keys_and_values")))
+        {
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            Fill(a, keys, n);
+            std::size_t reps = NumRepeats(n);
+            report("iterate_keys_and_values", Time(n * reps, [&]
+            {
+                std::uint64_t sum = 0;
+                for (std::size_t r = 0; r < reps; r++)
+                    sum += a.sum_keys_and_values();
+                sink = sum;
+            }));
+        }
+
+        if constexpr (Adapter::supports_erase_key)
+        {
+            if (ShouldRun(name("erase_key")))
+            {
+                Adapter a;
+                std::vector<typename Adapter::key> keys;
+                Fill(a, keys, n);
+                std::shuffle(keys.begin(), keys.end(), rng);
+                report("erase_key", Time(num_churn, [&]{for (std::size_t i = 0; i < num_churn; i++) a.erase_key(keys[i]);}));
+            }
+
+            if constexpr (requires(Adapter &a, std::span<const typename Adapter::key> keys){a.erase_keys(keys);})
+            {
+                if (ShouldRun(name("erase_keys")))
+                {
+                    Adapter a;
+                    std::vector<typename Adapter::key> keys;
+                    Fill(a, keys, n);
+                    std::shuffle(keys.begin(), keys.end(), rng);
+                    report("erase_keys", Time(num_churn, [&]{a.erase_keys(std::span(keys).first(num_churn));}));
+                }
+            }
+
+            // Erase a fraction of the elements, then insert as many new ones. Repeated a few times, so the key reuse kicks in.
+            if (ShouldRun(name("churn")))
+            {
+                Adapter a;
+                std::vector<typename Adapter::key> keys;
+                Fill(a, keys, n);
+                constexpr int rounds = 4;
+                report("churn", Time(num_churn * rounds * 2, [&]
+                {
+                    for (int r = 0; r < rounds; r++)
+                    {
+                        std::shuffle(keys.begin(), keys.end(), rng);
+                        for (std::size_t i = 0; i < num_churn; i++)
+                            a.erase_key(keys[i]);
+                        for (std::size_t i = 0; i < num_churn; i++)
+                            keys[i] = a.insert(std::uint32_t(i));
+                    }
+                }));
+            }
+
+            // The same, but through command buffers, which erase and insert everything at once.
+            if constexpr (requires(Adapter &a, std::span<typename Adapter::key> keys){a.churn_deferred(keys);})
+            {
+                if (ShouldRun(name("churn_deferred")))
+                {
+                    Adapter a;
+                    std::vector<typename Adapter::key> keys;
+                    Fill(a, keys, n);
+                    constexpr int rounds = 4;
+                    report("churn_deferred", Time(num_churn * rounds * 2, [&]
+                    {
+                        for (int r = 0; r < rounds; r++)
+                        {
+                            std::shuffle(keys.begin(), keys.end(), rng);
+                            a.churn_deferred(std::span(keys).first(num_churn));
+                        }
+                    }));
+                }
+            }
+        }
+
+        if constexpr (Adapter::supports_erase_index)
+        {
+            if (ShouldRun(name("erase_index")))
+            {
+                Adapter a;
+                std::vector<typename Adapter::key> keys;
+                Fill(a, keys, n);
+                // Pre-generate the indices, so that the RNG doesn't affect the timing.
+                std::vector<std::size_t> indices(num_churn);
+                for (std::size_t i = 0; i < num_churn; i++)
+                    indices[i] = std::uniform_int_distribution<std::size_t>(0, n - i - 1)(rng);
+                report("erase_index", Time(num_churn, [&]{for (std::size_t i : indices) a.erase_index(i);}));
+            }
+        }
+
+        // Shuffle the order by sorting by a hash, then sort it back.
+        for (const char *sort_name : {"sort", "sort_swaps"})
+        {
+            if constexpr (requires(Adapter &a){a.sort([](std::uint32_t x){return x;});})
+            {
+                if (ShouldRun(name(sort_name)))
+                {
+                    Adapter a;
+                    std::vector<typename Adapter::key> keys;
+                    Fill(a, keys, n);
+                    bool swaps = sort_name == std::string_view("sort_swaps");
+                    auto hash = [](std::uint32_t x){return std::uint32_t(x * 2654435761u);};
+                    auto identity = [](std::uint32_t x){return x;};
+                    report(sort_name, Time(n * 2, [&]
+                    {
+                        if (swaps)
+                        {
+                            a.sort_swaps(hash);
+                            a.sort_swaps(identity);
+                        }
+                        else
+                        {
+                            a.sort(hash);
+                            a.sort(identity);
+                        }
+                    }));
+                }
+            }
+        }
+
+        if (ShouldRun(name("erase_if")))
+        {
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            Fill(a, keys, n);
+            // The values are `0..n-1`, so this erases the `churn` fraction of them.
+            std::uint32_t threshold = std::uint32_t(num_churn);
+            report("erase_if", Time(n, [&]{sink = a.erase_if(threshold);}));
+        }
+    }
+
+    // The writer side of `em::ConcurrentIndexMap`: `publish()` copies the whole map, so its cost grows with the map size, not with the number of changes.
+    // `publish` is nanoseconds per `publish()` call, with one value changed before each. `write_publish_1000` is nanoseconds per write,
+    //   when publishing every 1000 writes, compared with taking a `std::shared_mutex` exclusively for each write.
+    template <typename V, typename K>
+    void RunConcurrentWrites(int key_bits, int value_bytes, std::size_t n)
+    {
+        using Map = em::IndexMap<V, K>;
+
+        Map initial;
+        initial.values_reserve(n);
+        for (std::size_t i = 0; i < n; i++)
+            (void)initial.emplace(std::uint32_t(i));
+
+        std::size_t reps = NumRepeats(n);
+
+        if (ShouldRun("publish/concurrent_index_map"))
+        {
+            em::ConcurrentIndexMap<Map> map(1, initial);
+            Report("publish", "concurrent_index_map", key_bits, value_bytes, n, Time(reps, [&]
+            {
+                for (std::size_t r = 0; r < reps; r++)
+                {
+                    map.map()[r % n] = V(std::uint32_t(r));
+                    map.publish();
+                }
+            }));
+        }
+
+        std::size_t num_writes = reps * 1000;
+
+        if (ShouldRun("write_publish_1000/index_map+shared_mutex"))
+        {
+            Map map = initial;
+            std::shared_mutex mutex;
+            Report("write_publish_1000", "index_map+shared_mutex", key_bits, value_bytes, n, Time(num_writes, [&]
+            {
+                for (std::size_t i = 0; i < num_writes; i++)
+                {
+                    std::unique_lock lock(mutex);
+                    map[i % n] = V(std::uint32_t(i));
+                }
+            }));
+            sink = map[std::size_t(0)].get();
+        }
+
+        if (ShouldRun("write_publish_1000/concurrent_index_map"))
+        {
+            em::ConcurrentIndexMap<Map> map(1, initial);
+            Report("write_publish_1000", "concurrent_index_map", key_bits, value_bytes, n, Time(num_writes, [&]
+            {
+                for (std::size_t i = 0; i < num_writes; i++)
+                {
+                    map.map()[i % n] = V(std::uint32_t(i));
+                    if ((i + 1) % 1000 == 0)
+                        map.publish();
+                }
+            }));
+        }
+    }
+
+    template <typename V, typename K>
+    void RunAllContainers(int key_bits, int value_bytes, std::size_t n)
+    {
+        RunContainer<IndexMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<SeparateIndexMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<PagedIndexMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<SegmentedIndexMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<SlotMapAdapter, V, K>(key_bits, value_bytes, n);
+        if constexpr (sizeof(K) <= 4) // The key and the 32-bit generation must fit into 64 bits.
+            RunContainer<HandleIndexMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<UnorderedMapAdapter, V, K>(key_bits, value_bytes, n);
+        RunContainer<VectorAdapter, V, K>(key_bits, value_bytes, n);
+
+        RunConcurrentWrites<V, K>(key_bits, value_bytes, n);
+    }
+
+    // Random lookups by key, with large persistent data. This compares the index layouts.
+    template <typename K, std::size_t PersistentBytes>
+    void RunPersistentDataLookups(int key_bits, std::size_t n)
+    {
+        using P = Payload<PersistentBytes>;
+        std::string benchmark = "lookup_persistent_" + std::to_string(PersistentBytes);
+
+        auto run = [&]<typename Adapter>
+        {
+            if (!ShouldRun(benchmark + "/" + Adapter::name))
+                return;
+
+            std::mt19937_64 rng(42);
+            Adapter a;
+            std::vector<typename Adapter::key> keys;
+            Fill(a, keys, n);
+            std::shuffle(keys.begin(), keys.end(), rng);
+            std::size_t reps = NumRepeats(n);
+            Report(benchmark, Adapter::name, key_bits, 4, n, Time(n * reps, [&]
+            {
+                std::uint64_t sum = 0;
+                for (std::size_t r = 0; r < reps; r++)
+                {
+                    for (const auto &k : keys)
+                        sum += a.lookup(k).get();
+                }
+                sink = sum;
+            }));
+        };
+        run.template operator()<IndexMapAdapter<Payload<4>, K, P>>();
+        run.template operator()<IndexMapAdapter<Payload<4>, K, P, SeparateLayoutOptions>>();
+    }
+
+    // Random lookups from several reader threads at once, while a writer thread keeps modifying the values.
+    // Compares `em::ConcurrentIndexMap` with locking a `std::shared_mutex` around each lookup. Reported in nanoseconds per lookup in one thread.
+    template <typename K>
+    void RunConcurrentLookups(int key_bits, std::size_t n)
+    {
+        using V = Payload<4>;
+        using Map = em::IndexMap<V, K>;
+
+        for (int num_readers : config.readers)
+        {
+            std::string benchmark = "concurrent_lookup_" + std::to_string(num_readers);
+
+            // Runs `num_readers` threads that call `lookup(thread_index, keys)` once, and the writer that calls `write()` until they finish.
+            auto run = [&](const char *container, auto &&lookup, auto &&write)
+            {
+                if (!ShouldRun(benchmark + "/" + container))
+                    return;
+
+                std::size_t reps = NumRepeats(n);
+                std::atomic<int> num_running = num_readers;
+                double total_ns = 0;
+                std::atomic<std::uint64_t> sum = 0;
+                {
+                    std::vector<std::jthread> readers;
+                    for (int t = 0; t < num_readers; t++)
+                    {
+                        readers.emplace_back([&, t]
+                        {
+                            std::vector<K> keys(n);
+                            std::iota(keys.begin(), keys.end(), K(0));
+                            std::shuffle(keys.begin(), keys.end(), std::mt19937_64(std::uint64_t(t)));
+                            double ns = Time(n * reps, [&]{sum += lookup(t, keys, reps);});
+                            num_running--;
+                            std::atomic_ref(total_ns).fetch_add(ns);
+                        });
+                    }
+                    while (num_running > 0)
+                        write();
+                }
+                sink = sum;
+                Report(benchmark, container, key_bits, 4, n, total_ns / num_readers);
+            };
+
+            Map initial;
+            initial.values_reserve(n);
+            for (std::size_t i = 0; i < n; i++)
+                (void)initial.emplace(std::uint32_t(i));
+
+            { // Locking a `std::shared_mutex` around each lookup.
+                Map map = initial;
+                std::shared_mutex mutex;
+                std::uint32_t counter = 0;
+                run("index_map+shared_mutex",
+                    [&](int, const std::vector<K> &keys, std::size_t reps)
+                    {
+                        std::uint64_t sum = 0;
+                        for (std::size_t r = 0; r < reps; r++)
+                        {
+                            for (K k : keys)
+                            {
+                                std::shared_lock lock(mutex);
+                                sum += map[typename Map::key(k)].get();
+                            }
+                        }
+                        return sum;
+                    },
+                    [&]
+                    {
+                        std::unique_lock lock(mutex);
+                        counter++;
+                        map[std::size_t(counter % n)] = V(counter);
+                    }
+                );
+            }
+
+            { // `em::ConcurrentIndexMap`, pinning a snapshot for every 256 lookups. The writer publishes every 1000 changes.
+                em::ConcurrentIndexMap<Map> map(std::size_t(num_readers), initial);
+                std::vector<typename em::ConcurrentIndexMap<Map>::reader> readers;
+                for (int t = 0; t < num_readers; t++)
+                    readers.push_back(map.make_reader());
+                std::uint32_t counter = 0;
+                run("concurrent_index_map",
+                    [&](int t, const std::vector<K> &keys, std::size_t reps)
+                    {
+                        std::uint64_t sum = 0;
+                        for (std::size_t r = 0; r < reps; r++)
+                        {
+                            for (std::size_t i = 0; i < keys.size(); i += 256)
+                            {
+                                auto snapshot = readers[std::size_t(t)].pin();
+                                for (std::size_t j = i; j < std::min(i + 256, keys.size()); j++)
+                                    sum += (*snapshot)[typename Map::key(keys[j])].get();
+                            }
+                        }
+                        return sum;
+                    },
+                    [&]
+                    {
+                        counter++;
+                        map.map()[std::size_t(counter % n)] = V(counter);
+                        if (counter % 1000 == 0)
+                            map.publish();
+                    }
+                );
+            }
+        }
+    }
+
+    template <typename K>
+    void RunForKey(int key_bits)
+    {
+        std::size_t prev_n = 0;
+        for (std::size_t n : config.sizes)
+        {
+            n = std::min(n, em::IndexMap<void, K>::max_size());
+            if (n == prev_n)
+                continue; // Clamped to the same size as before.
+            prev_n = n;
+
+            for (int persistent_bytes : config.persistent_bytes)
+            {
+                switch (persistent_bytes)
+                {
+                    case 16: RunPersistentDataLookups<K, 16>(key_bits, n); break;
+                    case 64: RunPersistentDataLookups<K, 64>(key_bits, n); break;
+                    default:
+                        std::fprintf(stderr, "Unsupported persistent data size: %d (expected 16 or 64)\n", persistent_bytes);
+                        std::exit(1);
+                }
+            }
+
+            RunConcurrentLookups<K>(key_bits, n);
+
+            for (int value_bytes : config.value_bytes)
+            {
+                switch (value_bytes)
+                {
+                    case 4:   RunAllContainers<Payload<4>,   K>(key_bits, value_bytes, n); break;
+                    case 16:  RunAllContainers<Payload<16>,  K>(key_bits, value_bytes, n); break;
+                    case 64:  RunAllContainers<Payload<64>,  K>(key_bits, value_bytes, n); break;
+                    case 256: RunAllContainers<Payload<256>, K>(key_bits, value_bytes, n); break;
+                    default:
+                        std::fprintf(stderr, "Unsupported value size: %d (expected 4, 16, 64 or 256)\n", value_bytes);
+                        std::exit(1);
+                }
+            }
+        }
+    }
+
+    template <typename T>
+    [[nodiscard]] std::vector<T> ParseList(std::string_view str)
+    {
+        std::vector<T> ret;
+        while (!str.empty())
+        {
+            std::size_t sep = str.find(',');
+            // Going through `double` to support the `1e6` syntax.
+            ret.push_back(T(std::strtod(std::string(str.substr(0, sep)).c_str(), nullptr)));
+            str = sep == std::string_view::npos ? std::string_view{} : str.substr(sep + 1);
+        }
+        return ret;
+    }
+
+    void ParseFlags(int argc, char **argv)
+    {
+        for (int i = 1; i < argc; i++)
+        {
+            std::string_view arg = argv[i];
+            auto flag = [&](std::string_view prefix, std::string_view &value)
+            {
+                if (!arg.starts_with(prefix))
+                    return false;
+                value = arg.substr(prefix.size());
+                return true;
+            };
+
+            std::string_view value;
+            if (flag("--sizes=", value))
+                config.sizes = ParseList<std::size_t>(value);
+            else if (flag("--keys=", value))
+                config.key_bits = ParseList<int>(value);
+            else if (flag("--values=", value))
+                config.value_bytes = ParseList<int>(value);
+            else if (flag("--persistent=", value))
+                config.persistent_bytes = ParseList<int>(value);
+            else if (flag("--readers=", value))
+                config.readers = ParseList<int>(value);
+            else if (flag("--churn=", value))
+                config.churn = std::strtod(std::string(value).c_str(), nullptr);
+            else if (flag("--filter=", value))
+                config.filter = value;
+            else
+            {
+                std::fprintf(stderr, "Unknown flag: %s\n", argv[i]);
+                std::exit(1);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    ParseFlags(argc, argv);
+
+    std::printf("benchmark\tcontainer\tkey_bits\tvalue_bytes\tsize\tns_per_op\n");
+
+    for (int key_bits : config.key_bits)
+    {
+        switch (key_bits)
+        {
+            case 8:  RunForKey<unsigned char     >(key_bits); break;
+            case 16: RunForKey<unsigned short    >(key_bits); break;
+            case 32: RunForKey<unsigned int      >(key_bits); break;
+            case 64: RunForKey<unsigned long long>(key_bits); break;
+            default:
+                std::fprintf(stderr, "Unsupported key width: %d (expected 8, 16, 32 or 64)\n", key_bits);
+                return 1;
+        }
+    }
+}
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#ifndef DETAIL_EM_CONCURRENTINDEXMAP_ASSERT
+#include <cassert>
+#define DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(...) assert(__VA_ARGS__)
+#endif
+
+#ifndef DETAIL_EM_CONCURRENTINDEXMAP_THROW
+#if __cpp_exceptions
+#define DETAIL_EM_CONCURRENTINDEXMAP_THROW(...) (throw(__VA_ARGS__))
+#else
+#define DETAIL_EM_CONCURRENTINDEXMAP_THROW(...) std::terminate()
+#endif
+#endif
+
+namespace em
+{
+    // Wraps an `em::IndexMap` (or any other copyable map) for one writer thread and many reader threads, where the readers never take locks.
+    //
+    // The writer modifies `map()` as usual, and calls `publish()` to make a snapshot of it visible to the readers.
+    // Each reader thread gets a `reader` from `make_reader()`, then calls `.pin()` on it to get the latest published snapshot.
+    //   Pinning is wait-free: two atomic loads and one store. The snapshot can then be read without any synchronization, since nobody modifies it.
+    //
+    // A snapshot is kept alive while it's pinned, or while it's the latest one. The writer never waits for the readers:
+    //   it frees the old snapshots once they are no longer pinned, in `publish()` or `reclaim()`.
+    // `publish()` copies the whole map (reusing the memory of an old snapshot if possible), so it's `O(n)` even if only one element changed.
+    //   This is for maps that are read much more often than published, and are small enough to copy in the publishing interval. See `write_publish_1000` in the benchmarks.
+    template <typename Map>
+    class ConcurrentIndexMap
+    {
+        struct Snapshot
+        {
+            Map map;
+            std::uint64_t version = 0;
+        };
+
+        // One per reader, on its own cache line.
+        struct alignas(64) ReaderSlot
+        {
+            // Zero when the reader isn't pinning anything. Otherwise a version that the pinned snapshot is not older than.
+            std::atomic<std::uint64_t> pinned_version{0};
+            std::atomic<bool> in_use{false};
+        };
+
+        Map working_map;
+
+        std::unique_ptr<ReaderSlot[]> slots;
+        std::size_t num_slots = 0;
+
+        // The latest published snapshot. Owned by us.
+        std::atomic<Snapshot *> current{nullptr};
+        // The version of `current`. It's updated after `current`, so a reader that loads this and then `current` gets a snapshot that is at least this new.
+        std::atomic<std::uint64_t> current_version{0};
+
+        // The writer-only state: [
+        // The old snapshots that might still be pinned.
+        std::vector<std::unique_ptr<Snapshot>> retired;
+        // A snapshot nobody uses anymore, kept to reuse its memory in the next `publish()`.
+        std::unique_ptr<Snapshot> spare;
+        // ]
+
+      public:
+        using map_type = Map;
+
+        class reader;
+
+        // A pinned snapshot. Unpins it when destroyed.
+        class snapshot
+        {
+            friend reader;
+
+            ReaderSlot *slot = nullptr;
+            const Snapshot *target = nullptr;
+
+            constexpr snapshot(ReaderSlot *slot, const Snapshot *target) : slot(slot), target(target) {}
+
+          public:
+            constexpr snapshot() {}
+
+            snapshot(snapshot &&other) noexcept : slot(std::exchange(other.slot, nullptr)), target(std::exchange(other.target, nullptr)) {}
+            snapshot &operator=(snapshot other) noexcept
+            {
+                std::swap(slot, other.slot);
+                std::swap(target, other.target);
+                return *this;
+            }
+            ~snapshot()
+            {
+                // Release, so our reads of the snapshot happen before the writer frees it.
+                if (slot)
+                    slot->pinned_version.store(0, std::memory_order_release);
+            }
+
+            [[nodiscard]] explicit operator bool() const noexcept {return bool(target);}
+
+            [[nodiscard]] const Map &map() const noexcept {DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(target); return target->map;}
+            [[nodiscard]] const Map &operator*() const noexcept {return map();}
+            [[nodiscard]] const Map *operator->() const noexcept {return &map();}
+
+            // Increases by one with each `publish()`.
+            [[nodiscard]] std::uint64_t version() const noexcept {DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(target); return target->version;}
+        };
+
+        // A registered reader. Only one thread at a time can use it, and it can pin only one snapshot at a time.
+        class reader
+        {
+            friend ConcurrentIndexMap;
+
+            const ConcurrentIndexMap *owner = nullptr;
+            ReaderSlot *slot = nullptr;
+
+            constexpr reader(const ConcurrentIndexMap *owner, ReaderSlot *slot) : owner(owner), slot(slot) {}
+
+          public:
+            constexpr reader() {}
+
+            reader(reader &&other) noexcept : owner(std::exchange(other.owner, nullptr)), slot(std::exchange(other.slot, nullptr)) {}
+            reader &operator=(reader other) noexcept
+            {
+                std::swap(owner, other.owner);
+                std::swap(slot, other.slot);
+                return *this;
+            }
+            ~reader()
+            {
+                if (slot)
+                {
+                    DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(slot->pinned_version.load(std::memory_order_relaxed) == 0 && "Destroying a reader while its snapshot is still pinned.");
+                    slot->in_use.store(false, std::memory_order_release);
+                }
+            }
+
+            [[nodiscard]] explicit operator bool() const noexcept {return bool(slot);}
+
+            // Returns the latest published snapshot, which stays valid until the returned object is destroyed. Wait-free.
+            [[nodiscard]] snapshot pin() const noexcept
+            {
+                DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(slot && slot->pinned_version.load(std::memory_order_relaxed) == 0 && "This reader already has a pinned snapshot.");
+                // This must be sequentially consistent with the writer's store to `current` and the load of our slot in `reclaim()`:
+                //   either the writer sees our slot and keeps the snapshots not older than it, or we see the new `current`.
+                slot->pinned_version.store(owner->current_version.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+                return snapshot(slot, owner->current.load(std::memory_order_seq_cst));
+            }
+        };
+
+        // Up to `max_readers` can exist at the same time. Publishes `initial` as the first snapshot.
+        explicit ConcurrentIndexMap(std::size_t max_readers = 64, Map initial = {})
+            : working_map(std::move(initial)), slots(std::make_unique<ReaderSlot[]>(max_readers)), num_slots(max_readers)
+        {
+            publish();
+        }
+
+        ConcurrentIndexMap(const ConcurrentIndexMap &) = delete;
+        ConcurrentIndexMap &operator=(const ConcurrentIndexMap &) = delete;
+
+        // All readers must be destroyed before this.
+        ~ConcurrentIndexMap()
+        {
+            for (std::size_t i = 0; i < num_slots; i++)
+                DETAIL_EM_CONCURRENTINDEXMAP_ASSERT(!slots[i].in_use.load(std::memory_order_relaxed) && "Destroying a concurrent index map while it still has readers.");
+            delete current.load(std::memory_order_relaxed);
+        }
+
+
+        // Reader side:
+
+        // Registers a new reader. Thread-safe. Throws if there are already `max_readers()` readers.
+        [[nodiscard]] reader make_reader()
+        {
+            for (std::size_t i = 0; i < num_slots; i++)
+            {
+                bool expected = false;
+                if (!slots[i].in_use.load(std::memory_order_relaxed) && slots[i].in_use.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                    return reader(this, &slots[i]);
+            }
+            DETAIL_EM_CONCURRENTINDEXMAP_THROW(std::length_error("Too many concurrent index map readers."));
+        }
+
+        [[nodiscard]] std::size_t max_readers() const noexcept {return num_slots;}
+
+
+        // Writer side: only one thread at a time can call those.
+
+        // The map that `publish()` copies. Modifying it doesn't affect the readers.
+        [[nodiscard]]       Map &map()       noexcept {return working_map;}
+        [[nodiscard]] const Map &map() const noexcept {return working_map;}
+
+        // The version of the latest published snapshot.
+        [[nodiscard]] std::uint64_t version() const noexcept {return current_version.load(std::memory_order_relaxed);}
+
+        // Makes a copy of `map()` visible to the readers. Then frees the old snapshots that are no longer pinned.
+        // This copies the whole map, so it's `O(size())` regardless of how much changed since the last call.
+        // If the copying throws, nothing is published.
+        void publish()
+        {
+            reclaim();
+
+            std::unique_ptr<Snapshot> new_snapshot;
+            if (spare)
+            {
+                new_snapshot = std::move(spare);
+                new_snapshot->map = working_map;
+            }
+            else
+            {
+                new_snapshot.reset(new Snapshot{working_map});
+            }
+            new_snapshot->version = version() + 1;
+
+            retired.reserve(retired.size() + 1);
+            std::uint64_t new_version = new_snapshot->version;
+            Snapshot *old_snapshot = current.exchange(new_snapshot.release(), std::memory_order_seq_cst);
+            current_version.store(new_version, std::memory_order_seq_cst);
+            if (old_snapshot)
+                retired.emplace_back(old_snapshot);
+
+            reclaim();
+        }
+
+        // Frees the old snapshots that are no longer pinned. Returns how many old snapshots are still alive.
+        // `publish()` calls this automatically, you only need it to free memory sooner.
+        std::size_t reclaim() noexcept
+        {
+            // A reader pins a snapshot that is not older than the version in its slot, so everything older than all slots can be freed.
+            std::uint64_t oldest_pinned = std::numeric_limits<std::uint64_t>::max();
+            for (std::size_t i = 0; i < num_slots; i++)
+            {
+                std::uint64_t v = slots[i].pinned_version.load(std::memory_order_seq_cst);
+                if (v != 0)
+                    oldest_pinned = std::min(oldest_pinned, v);
+            }
+
+            std::erase_if(retired, [&](std::unique_ptr<Snapshot> &s)
+            {
+                if (s->version >= oldest_pinned)
+                    return false;
+                if (!spare)
+                    spare = std::move(s);
+                return true;
+            });
+            return retired.size();
+        }
+    };
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <compare>
 #include <concepts>
 #include <cstddef>
@@ -10,6 +14,7 @@
 #include <limits>
 #include <memory>
 #include <ranges>
+#include <span>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
@@ -36,8 +41,140 @@
 #endif
 #endif
 
+#ifndef DETAIL_EM_INDEXMAP_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define DETAIL_EM_INDEXMAP_PREFETCH(ptr) __builtin_prefetch(ptr)
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define DETAIL_EM_INDEXMAP_PREFETCH(ptr) _mm_prefetch((const char *)(ptr), _MM_HINT_T0)
+#else
+#define DETAIL_EM_INDEXMAP_PREFETCH(ptr) (void)(ptr)
+#endif
+#endif
+
+// Define to 0 to disable the SIMD kernels for the batched key checks.
+#ifndef DETAIL_EM_INDEXMAP_SIMD
+#if defined(__x86_64__) || defined(_M_X64)
+#define DETAIL_EM_INDEXMAP_SIMD 1
+#else
+#define DETAIL_EM_INDEXMAP_SIMD 0
+#endif
+#endif
+
+#if DETAIL_EM_INDEXMAP_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define DETAIL_EM_INDEXMAP_TARGET_AVX2 __attribute__((__target__("avx2")))
+#else
+#define DETAIL_EM_INDEXMAP_TARGET_AVX2
+#endif
+#endif
+
 namespace em
 {
+    // How `IndexMap` stores the key<->index tables and the persistent data. Set via `IndexMapOptions::index_layout`.
+    namespace IndexLayout
+    {
+        // A single array, where each element stores the index for a key, the key for an index, and the persistent data for a key. The default.
+        // Erasure and insertion touch fewer cache lines this way.
+        struct interleaved {};
+        // Three separate arrays, for the indices, the keys, and the persistent data.
+        // Key lookups only touch the first one, which is better if the persistent data is large.
+        struct separate {};
+        // The key->index table is split into pages of `PageSize` keys, which are allocated on first use and freed when they become empty.
+        // The index->key table stores only the keys that are actually used (or were used and still have persistent data).
+        // The memory usage then depends on the number of keys, rather than on the largest key.
+        // In this mode `insert_at()` and `emplace_at()` accept any key, without calling `prepare_keys_for_insertion()` first.
+        // `keys_size()` is the number of keys known to the map, rather than the largest key plus one.
+        // And `remove_unused_key()` removes any unused key, not necessarily the largest one.
+        template <std::size_t PageSize = 4096>
+        requires (PageSize > 0)
+        struct paged {};
+    }
+
+    // Whether `IndexMap` gives unused memory back by itself. Set via `IndexMapOptions::shrink_policy`.
+    namespace ShrinkPolicy
+    {
+        // Only when asked to, with `remove_unused_key()`, `keys_shrink_to_fit()` and `values_shrink_to_fit()`. The default.
+        struct manual {};
+        // After each erasure, removes up to `MaxKeysPerErasure` unused keys (see `remove_unused_key()`, this is skipped with the generations).
+        //   This includes the keys added by `prepare_keys_for_insertion()`, so insert right after preparing them.
+        // Then if the key tables or the values are less than `LowPercent` full, reallocates them to be `HighPercent` full.
+        //   Containers with the capacity of at most `MinCapacity` are left alone, so that small maps don't reallocate all the time.
+        // The reallocation moves all elements, but there's at most `LowPercent` of the old capacity of them, and there are
+        //   at least `HighPercent - LowPercent` (of the new capacity) erasures between two reallocations, so the cost per erasure is bounded.
+        // The values are only reallocated if they're nothrow-movable. Segmented containers simply free their spare segments.
+        template <unsigned LowPercent = 25, unsigned HighPercent = 50, std::size_t MaxKeysPerErasure = 16, std::size_t MinCapacity = 64>
+        requires (LowPercent > 0 && LowPercent < HighPercent && HighPercent <= 100)
+        struct watermarks
+        {
+            static constexpr std::size_t max_keys_per_erasure = MaxKeysPerErasure;
+
+            // Whether a container with this `size` and `capacity` should be reallocated.
+            [[nodiscard]] static constexpr bool should_shrink(std::size_t size, std::size_t capacity) noexcept
+            {
+                return capacity > MinCapacity && double(size) * 100 < double(capacity) * LowPercent;
+            }
+            // The capacity to reallocate to.
+            [[nodiscard]] static constexpr std::size_t new_capacity(std::size_t size) noexcept
+            {
+                return std::max(MinCapacity, std::size_t(double(size) * 100 / HighPercent));
+            }
+        };
+    }
+
+    // What `IndexMap` does with the hole left by an erased element. Set via `IndexMapOptions::erase_policy`.
+    namespace ErasePolicy
+    {
+        // Moves the last element into the hole. This is O(1), but changes the order of the elements. The default.
+        struct swap_and_pop {};
+        // Leaves a tombstone in the hole: the value stays in place until the next `compact()`, but its key no longer refers to it.
+        //   So the remaining elements never change their order, which helps when something depends on the iteration order being deterministic.
+        // `compact()` removes all tombstones in one pass, shifting the elements down. It's called automatically after an erasure
+        //   if the tombstones are at least `CompactPercent` of `size()`, and there are at least `MinTombstones` of them. `CompactPercent == 0` disables that.
+        // The tombstones count towards `size()`, and are visible in `values()` and `keys_and_values()`, but not to `valid_index()` and `contains()`.
+        //   Use `live_keys_and_values()` or `for_each_live_index()` to iterate over the rest. The tombstones at the end are removed immediately, so the last element is never a tombstone.
+        // The keys of the tombstones become free (and the persistent data can be reused) only after compacting.
+        // The operations that move the elements around (`reorder()`, `sort_by()`, `compact_keys()`) compact first, `save()` throws if there are tombstones.
+        // `swap_elems()` and `move_elem()` (and so the standard algorithms on `keys_and_values()`) throw if they hit a tombstone.
+        template <unsigned CompactPercent = 25, std::size_t MinTombstones = 64>
+        requires (CompactPercent <= 100)
+        struct tombstones
+        {
+            // Whether to compact a map with this many tombstones, and this `size()`.
+            [[nodiscard]] static constexpr bool should_compact(std::size_t num_tombstones, std::size_t size) noexcept
+            {
+                return CompactPercent > 0 && num_tombstones >= MinTombstones && double(num_tombstones) * 100 >= double(size) * CompactPercent;
+            }
+        };
+    }
+
+    // What happens to a key when its generation counter would overflow. Set via `IndexMapOptions::generation_overflow`.
+    enum class GenerationOverflow
+    {
+        // The key is retired and never used again, so stale handles can never match a new element. The default.
+        // The largest generation value is reserved to mark the retired keys.
+        retire,
+        // The generation wraps around to zero, so a stale handle can match a new element after its key is reused `2^N` times.
+        wrap,
+    };
+
+    // Which free key is reused by the next insertion. Set via `IndexMapOptions::key_reuse`.
+    enum class KeyReuse
+    {
+        // The most recently freed key. The default, and needs no extra memory.
+        lifo,
+        // The least recently freed key, so the freed keys stay unused for as long as possible, and stale keys are less likely to match new elements.
+        // Costs two keys of memory per key. Snapshots don't store this order, so a loaded map can reuse the keys in a different order.
+        fifo,
+        // The smallest free key, so the used keys stay packed at the beginning, and `remove_unused_key()` can remove the rest.
+        // Costs a bit more than one bit per key.
+        lowest,
+    };
+
     namespace detail::IndexMap
     {
         template <int> struct Empty {};
@@ -45,6 +182,11 @@ namespace em
         template <typename T, int N> requires std::is_void_v<T> struct VoidToEmptyHelper<T, N> {using type = Empty<N>;};
         // Replaces `void` with an empty struct.
         template <typename T, int N = 0> using VoidToEmpty = typename VoidToEmptyHelper<T, N>::type;
+        // `sizeof(T)`, or 0 for `void`.
+        template <typename T> inline constexpr std::uint32_t SizeOfNonVoid = std::is_void_v<T> ? 0 : std::uint32_t(sizeof(VoidToEmpty<T>));
+
+        // Whether `IndexMap::sort_by()` should compute the sort keys once and sort them along with the indices, rather than calling the projection on each comparison.
+        template <typename T> inline constexpr bool CacheSortKey = std::is_trivially_copyable_v<T> && sizeof(T) <= 16;
 
         // `std::is_constructible` extended for `void`.
         template <typename T, typename ...P>
@@ -57,6 +199,220 @@ namespace em
         // Equality-comparable, in this order.
         template <typename T, typename U> concept EqComparable = requires(T &&t, U &&u){{std::forward<T>(t) == std::forward<U>(u)} -> BoolTestable;};
 
+        // Asks the CPU to start loading the cache line at `ptr`. Does nothing at compile-time.
+        constexpr void Prefetch(const void *ptr) noexcept
+        {
+            if (!std::is_constant_evaluated())
+                DETAIL_EM_INDEXMAP_PREFETCH(ptr);
+        }
+
+        #if DETAIL_EM_INDEXMAP_SIMD
+        // The SIMD kernels for the batched key checks, selected at runtime.
+        namespace Simd
+        {
+            [[nodiscard]] inline bool HaveAvx2() noexcept
+            {
+                static const bool ret = []{
+                    #if defined(_MSC_VER) && !defined(__clang__)
+                    int info[4];
+                    __cpuid(info, 0);
+                    if (info[0] < 7)
+                        return false;
+                    __cpuid(info, 1);
+                    bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 6) == 6;
+                    __cpuidex(info, 7, 0);
+                    return os_saves_ymm && (info[1] & (1 << 5));
+                    #else
+                    return bool(__builtin_cpu_supports("avx2"));
+                    #endif
+                }();
+                return ret;
+            }
+
+            // Describes where to find the indices of the keys: the index of key `k` is a `KeyType` at `base + k * stride`.
+            // Only the keys below `num_keys` have indices, and the key is valid if its index is less than `num_values`.
+            struct IndexTable
+            {
+                const std::byte *base = nullptr;
+                std::size_t stride = 0;
+                std::size_t num_keys = 0;
+                std::size_t num_values = 0;
+            };
+
+            // Checks `keys[j]` for `j` in `[0, count)`, rounded down to a multiple of the vector width, and returns that rounded count.
+            // For each key, sets its bit in `mask` (which must be zeroed beforehand), and writes its index to `out` (this is garbage for invalid keys). Either can be null.
+            // Adds the number of valid keys to `num_valid`.
+            // Returns 0 if the table is too large for the 32-bit gather offsets.
+            template <std::size_t KeySize>
+            DETAIL_EM_INDEXMAP_TARGET_AVX2 inline std::size_t CheckKeysAvx2(const void *keys, std::size_t count, IndexTable table, std::uint64_t *mask, std::size_t *out, std::size_t &num_valid) noexcept
+            {
+                std::size_t j = 0;
+
+                if constexpr (KeySize == 4)
+                {
+                    if (table.num_keys > std::size_t(std::numeric_limits<std::int32_t>::max()) / table.stride)
+                        return 0;
+
+                    // Unsigned comparisons are done as signed ones, with the sign bits flipped.
+                    const __m256i sign = _mm256_set1_epi32(std::numeric_limits<std::int32_t>::min());
+                    const __m256i num_keys = _mm256_set1_epi32(std::int32_t(std::uint32_t(table.num_keys) ^ 0x80000000u));
+                    const __m256i num_values = _mm256_set1_epi32(std::int32_t(table.num_values));
+                    const __m256i stride = _mm256_set1_epi32(std::int32_t(table.stride));
+
+                    for (; j + 8 <= count; j += 8)
+                    {
+                        __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(static_cast<const std::uint32_t *>(keys) + j));
+                        __m256i in_range = _mm256_cmpgt_epi32(num_keys, _mm256_xor_si256(k, sign));
+                        // The out-of-range lanes aren't loaded, and get `num_values`, which makes them invalid.
+                        __m256i index = _mm256_mask_i32gather_epi32(num_values, reinterpret_cast<const int *>(table.base), _mm256_mullo_epi32(k, stride), in_range, 1);
+                        auto bits = std::uint32_t(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(num_values, index))));
+
+                        if (mask)
+                            mask[j / 64] |= std::uint64_t(bits) << (j % 64);
+                        num_valid += std::size_t(std::popcount(bits));
+                        if (out)
+                        {
+                            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + j), _mm256_cvtepu32_epi64(_mm256_castsi256_si128(index)));
+                            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + j + 4), _mm256_cvtepu32_epi64(_mm256_extracti128_si256(index, 1)));
+                        }
+                    }
+                }
+                else
+                {
+                    static_assert(KeySize == 8);
+                    // `_mm256_mul_epu32()` only multiplies the low halves.
+                    if (table.num_keys > std::numeric_limits<std::uint32_t>::max() || table.stride > std::numeric_limits<std::uint32_t>::max())
+                        return 0;
+
+                    const __m256i sign = _mm256_set1_epi64x(std::numeric_limits<std::int64_t>::min());
+                    const __m256i num_keys = _mm256_set1_epi64x(std::int64_t(std::uint64_t(table.num_keys) ^ 0x8000000000000000u));
+                    const __m256i num_values = _mm256_set1_epi64x(std::int64_t(table.num_values));
+                    const __m256i stride = _mm256_set1_epi64x(std::int64_t(table.stride));
+
+                    for (; j + 4 <= count; j += 4)
+                    {
+                        __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(static_cast<const std::uint64_t *>(keys) + j));
+                        __m256i in_range = _mm256_cmpgt_epi64(num_keys, _mm256_xor_si256(k, sign));
+                        __m256i index = _mm256_mask_i64gather_epi64(num_values, reinterpret_cast<const long long *>(table.base), _mm256_mul_epu32(k, stride), in_range, 1);
+                        auto bits = std::uint32_t(_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(num_values, index))));
+
+                        if (mask)
+                            mask[j / 64] |= std::uint64_t(bits) << (j % 64);
+                        num_valid += std::size_t(std::popcount(bits));
+                        if (out)
+                            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + j), index);
+                    }
+                }
+
+                return j;
+            }
+        }
+        #endif
+
+        // What the index storage actually stores as the persistent data. If the generations are enabled, they are stored alongside the user data.
+        template <typename Generation, typename PersistentData>
+        struct GenerationAndData
+        {
+            Generation generation = 0;
+            PersistentData data{};
+        };
+        template <typename Generation>
+        struct GenerationAndData<Generation, void>
+        {
+            Generation generation = 0;
+        };
+        template <typename Generation, typename PersistentData>
+        struct StoredPersistentDataHelper {using type = GenerationAndData<Generation, PersistentData>;};
+        template <typename PersistentData>
+        struct StoredPersistentDataHelper<void, PersistentData> {using type = PersistentData;};
+        template <typename Generation, typename PersistentData>
+        using StoredPersistentData = typename StoredPersistentDataHelper<Generation, PersistentData>::type;
+
+        // The underlying type for the handles: the smallest unsigned integer that fits both the key and the generation.
+        template <typename KeyType, typename Generation, std::size_t N = sizeof(KeyType) + sizeof(VoidToEmpty<Generation>)>
+        using HandleUint =
+            std::conditional_t<std::is_void_v<Generation>, KeyType,
+            std::conditional_t<N <= 1, std::uint8_t,
+            std::conditional_t<N <= 2, std::uint16_t,
+            std::conditional_t<N <= 4, std::uint32_t,
+            std::uint64_t
+        >>>>;
+
+
+        // The header of the format written by `IndexMap::save()`. It's followed by these arrays, each starting at a multiple of `SnapshotAlignment` bytes from the beginning:
+        //   the key of every index `[0, keys_size)`,
+        //   the index of every key `[0, sparse_size)`,
+        //   the persistent data (including the generations) of every key `[0, sparse_size)`, if any,
+        //   the values `[0, size)`, if any.
+        // With the `sorted_keys` flag (used by `IndexLayout::paged`, where the keys can be far apart), the two per-key arrays are replaced with:
+        //   the indices `[0, keys_size)` sorted by their keys, to find a key with a binary search,
+        //   the persistent data of every index `[0, keys_size)`, if any.
+        //   So the size doesn't depend on how large the keys are.
+        // Everything is in the native byte order, so the file can be mapped into memory and used directly, see `em::IndexMapView`.
+        struct SnapshotHeader
+        {
+            static constexpr std::array<char, 8> expected_magic = {'e', 'm', 'I', 'n', 'd', 'e', 'x', 'M'};
+            // Increment this when changing the format.
+            static constexpr std::uint32_t current_version = 2;
+            static constexpr std::uint32_t native_byte_order = 0x01020304;
+            // The bits of `flags`.
+            static constexpr std::uint32_t sorted_keys = 1;
+
+            std::array<char, 8> magic = expected_magic;
+            std::uint32_t version = current_version;
+            std::uint32_t byte_order = native_byte_order;
+            // The sizes of the key type, the stored persistent data, and the value type. Zero if there's no persistent data or no values.
+            std::uint32_t key_bytes = 0;
+            std::uint32_t data_bytes = 0;
+            std::uint32_t value_bytes = 0;
+            std::uint32_t flags = 0;
+
+            std::uint64_t size = 0;
+            std::uint64_t keys_size = 0;
+            std::uint64_t retired_keys_size = 0;
+            // One more than the largest key. Same as `keys_size` except with `IndexLayout::paged`.
+            std::uint64_t sparse_size = 0;
+        };
+        static_assert(sizeof(SnapshotHeader) == 64);
+
+        inline constexpr std::size_t SnapshotAlignment = 64;
+
+        // The byte offsets of the arrays that follow a `SnapshotHeader`.
+        struct SnapshotLayout
+        {
+            std::uint64_t dense_to_sparse = 0;
+            std::uint64_t sparse_to_dense = 0; // Or the sorted indices, with `SnapshotHeader::sorted_keys`.
+            // Indexed by key, or by index with `SnapshotHeader::sorted_keys`.
+            std::uint64_t data = 0;
+            std::uint64_t values = 0;
+            std::uint64_t end = 0;
+
+            // Returns false if the total size would exceed `max_bytes`.
+            [[nodiscard]] constexpr bool compute(const SnapshotHeader &header, std::uint64_t max_bytes = std::uint64_t(-1)) noexcept
+            {
+                std::uint64_t offset = sizeof(SnapshotHeader);
+                // Reserves `count * elem_bytes` bytes, then pads to the alignment.
+                auto add_array = [&](std::uint64_t &array_offset, std::uint64_t count, std::uint64_t elem_bytes) -> bool
+                {
+                    array_offset = offset;
+                    if (elem_bytes != 0 && count > (max_bytes - offset) / elem_bytes)
+                        return false;
+                    offset += count * elem_bytes;
+                    std::uint64_t padding = (SnapshotAlignment - offset % SnapshotAlignment) % SnapshotAlignment;
+                    if (padding > max_bytes - offset)
+                        return false;
+                    offset += padding;
+                    return true;
+                };
+                if (!add_array(dense_to_sparse, header.keys_size, header.key_bytes)) return false;
+                std::uint64_t num_per_key = header.flags & SnapshotHeader::sorted_keys ? header.keys_size : header.sparse_size;
+                if (!add_array(sparse_to_dense, num_per_key, header.key_bytes)) return false;
+                if (!add_array(data, num_per_key, header.data_bytes)) return false;
+                if (!add_array(values, header.size, header.value_bytes)) return false;
+                end = offset;
+                return true;
+            }
+        };
 
         // A fake container with a size but no elements.
         class SizeOnlyContainer
@@ -99,168 +455,677 @@ namespace em
         };
 
 
-        // Given a `ValueView` or `KeyValueView``, returns its target map.
-        template <typename T>
-        [[nodiscard]] constexpr auto &UnderlyingMap(T &&target) {return *target.this_map;}
-
-        // `value_view` for an index map. Never const, because instead of the const view we just return a const reference to the storage.
-        template <typename IndexMap>
-        struct ValueView
+        // Containers that store the elements in several contiguous segments, such as `em::SegmentedVector`.
+        // They don't move the elements when growing, and expose the segments as `std::span`s.
+        template <typename C>
+        concept SegmentedContainer = requires(C &c, const C &cc, std::size_t i)
         {
-            template <typename T>
-            friend constexpr auto &UnderlyingMap(T &&target);
-
-            IndexMap *this_map = nullptr;
-
-            static constexpr bool IsContiguous = std::contiguous_iterator<typename IndexMap::value_container::iterator>;
+            {cc.segment_count()} -> std::convertible_to<std::size_t>;
+            c.segment(i);
+            c.segments();
+        };
 
-          public:
-            [[nodiscard]] ValueView() = default;
-            // Mostly for internal use.
-            [[nodiscard]] constexpr ValueView(IndexMap &this_map) : this_map(&this_map) {}
+        // Containers that never move the elements when growing or shrinking: the segmented ones, and the ones that say so
+        //   with `static constexpr bool never_moves_elements = true`, such as `em::ReservedVector`.
+        // For them growing is cheap, so we reserve exactly what's needed, and shrinking doesn't need a copy.
+        template <typename C>
+        concept NonMovingContainer = SegmentedContainer<C> || requires{requires C::never_moves_elements;};
 
-            constexpr typename IndexMap::value_container::iterator erase(typename IndexMap::value_container::iterator iter)
+        // Reallocates `c` with the capacity `n`, which must be at least `c.size()`. Non-moving containers instead just free their spare memory.
+        // Does nothing if the elements aren't nothrow-movable, or if the allocation fails, since this is only an optimization.
+        template <typename C>
+        constexpr void ShrinkCapacity(C &c, std::size_t n) noexcept
+        {
+            if constexpr (NonMovingContainer<C>)
             {
-                auto n = iter - this_map->value_storage.begin();
-                this_map->erase(std::size_t(n));
-                // Roundtrip the iterator through index. Otherwise the iterator validation will complain,
-                //   or perhaps some custom containers might need this.
-                return this_map->value_storage.begin() + n;
+                (void)n;
+                c.shrink_to_fit();
             }
+            else if constexpr (std::is_nothrow_move_constructible_v<typename C::value_type>)
+            {
+                #if __cpp_exceptions
+                try
+                #endif
+                {
+                    C new_c(c.get_allocator());
+                    new_c.reserve(n);
+                    for (auto &&elem : c)
+                        new_c.push_back(std::move(elem));
+                    c.swap(new_c);
+                }
+                #if __cpp_exceptions
+                catch (...) {}
+                #endif
+            }
+            else
+            {
+                (void)c;
+                (void)n;
+            }
+        }
 
-            // Standard range members:
-
-            using value_type             = typename IndexMap::value_type;
-            using size_type              = std::size_t; // Forcing `std::size_t` for simplicity, like everywhere else.
-            using difference_type        = std::ptrdiff_t;
-            using reference              = value_type &; // No fancy pointers/refs support for now.
-            using const_reference        = const value_type &;
-            using iterator               = typename IndexMap::value_container::iterator;
-            using const_iterator         = typename IndexMap::value_container::const_iterator;
-            using reverse_iterator       = typename IndexMap::value_container::reverse_iterator;
-            using const_reverse_iterator = typename IndexMap::value_container::const_reverse_iterator;
-            using pointer                = value_type *;
-            using const_pointer          = const value_type *;
-
-            [[nodiscard]] constexpr size_type size() const noexcept {return this_map->size();}
-            [[nodiscard]] constexpr bool empty() const noexcept {return this_map->empty();}
 
-            [[nodiscard]] constexpr iterator begin() const noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values()).begin();}
-            [[nodiscard]] constexpr iterator end() const noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values()).end();}
-            [[nodiscard]] constexpr const_iterator cbegin() const noexcept {return std::as_const(*this_map).values().cbegin();}
-            [[nodiscard]] constexpr const_iterator cend() const noexcept {return std::as_const(*this_map).values().cend();}
+        // Stores the key<->index tables and the persistent data of an `IndexMap`, as specified by the `Layout` (one of `em::IndexLayout::...`).
+        // `size()` is the number of keys, which is also the number of indices.
+        // Every key `k` that passes `contains(k)` has a `sparse_to_dense(k)` index and `sparse_data(k)`, and every index `i` has a `dense_to_sparse(i)` key.
+        // `grow(n)` adds new keys at the last indices, and `shrink(n)` removes the keys at the last indices.
+        // `prefetch(k)` starts loading the entry of key `k` into the cache, and does nothing if there's no such key.
+        // `shrink_capacity(n)` reduces `capacity()` to `n`, see `ShrinkCapacity()`.
+        // `memory_usage()` is the number of bytes allocated for all of the above.
+        // If `sparse_to_dense_stride` is not zero, the SIMD key checks read the indices directly: the one for key `k` is at `sparse_to_dense_bytes() + k * sparse_to_dense_stride`.
+        // If `contiguous_dense_to_sparse` is true, `dense_to_sparse_data()` points to all `dense_to_sparse(i)` stored contiguously (or is null if there are no keys).
+        template <typename Layout, typename KeyType, typename PersistentData, typename Allocator, template <typename...> typename Container>
+        class IndexStorage;
+
+        template <typename KeyType, typename PersistentData, typename Allocator, template <typename...> typename Container>
+        class IndexStorage<em::IndexLayout::interleaved, KeyType, PersistentData, Allocator, Container>
+        {
+            struct Entry
+            {
+                // Those have the same value initially, but quickly become desynchronized.
+                KeyType sparse_to_dense{};
+                KeyType dense_to_sparse{};
 
-            [[nodiscard]] constexpr pointer data() noexcept requires IsContiguous {return std::to_address(begin());}
-            [[nodiscard]] constexpr const_pointer data() const noexcept requires IsContiguous {return std::to_address(cbegin());}
+                DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS VoidToEmpty<PersistentData, 1> sparse_data{};
+            };
 
-            [[nodiscard]] constexpr reference operator[](size_type i) noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values())[i];}
-            [[nodiscard]] constexpr const_reference operator[](size_type i) const noexcept {return std::as_const(*this_map).values()[i];}
-        };
+            Container<Entry, typename std::allocator_traits<Allocator>::template rebind_alloc<Entry>> entries;
 
-        template <typename IndexMap>
-        struct SelectValueView
-        {
-            using type = ValueView<IndexMap>;
-        };
-        template <typename IndexMap> requires std::is_same_v<typename IndexMap::value_container, SizeOnlyContainer>
-        struct SelectValueView<IndexMap>
-        {
-            using type = void;
+          public:
+            // The keys are always `[0, size())`.
+            static constexpr bool dense_keys = true;
+
+            [[nodiscard]] constexpr IndexStorage() {}
+            [[nodiscard]] constexpr IndexStorage(const Allocator &alloc) : entries(alloc) {}
+
+            [[nodiscard]] constexpr std::size_t size() const noexcept {return entries.size();}
+            [[nodiscard]] constexpr bool contains(std::size_t k) const noexcept {return k < size();}
+            [[nodiscard]] constexpr std::size_t capacity() const noexcept {return entries.capacity();}
+            constexpr void reserve(std::size_t n) {entries.reserve(n);}
+            constexpr void shrink_to_fit() noexcept {entries.shrink_to_fit();}
+            constexpr void shrink_capacity(std::size_t n) noexcept {ShrinkCapacity(entries, n);}
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return entries.capacity() * sizeof(Entry);}
+            constexpr void clear() noexcept {entries.clear();}
+
+            [[nodiscard]] constexpr       KeyType &sparse_to_dense(std::size_t k)       noexcept {return entries[k].sparse_to_dense;}
+            [[nodiscard]] constexpr const KeyType &sparse_to_dense(std::size_t k) const noexcept {return entries[k].sparse_to_dense;}
+            [[nodiscard]] constexpr       KeyType &dense_to_sparse(std::size_t i)       noexcept {return entries[i].dense_to_sparse;}
+            [[nodiscard]] constexpr const KeyType &dense_to_sparse(std::size_t i) const noexcept {return entries[i].dense_to_sparse;}
+            [[nodiscard]] constexpr       VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k)       noexcept {return entries[k].sparse_data;}
+            [[nodiscard]] constexpr const VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k) const noexcept {return entries[k].sparse_data;}
+
+            constexpr void prefetch(std::size_t k) const noexcept {if (k < size()) Prefetch(&entries[k]);}
+
+            static constexpr std::size_t sparse_to_dense_stride = std::contiguous_iterator<typename decltype(entries)::const_iterator> ? sizeof(Entry) : 0;
+            [[nodiscard]] const std::byte *sparse_to_dense_bytes() const noexcept {return size() ? reinterpret_cast<const std::byte *>(&std::to_address(entries.begin())->sparse_to_dense) : nullptr;}
+
+            // The keys are interleaved with the indices.
+            static constexpr bool contiguous_dense_to_sparse = false;
+
+            // Adds keys until `size() == n`. Each new key is mapped to the index with the same value.
+            // If this throws, nothing is changed.
+            constexpr void grow(std::size_t n)
+            {
+                std::size_t i = size();
+                entries.resize(n);
+                for (; i < n; i++)
+                {
+                    entries[i].sparse_to_dense = KeyType(i);
+                    entries[i].dense_to_sparse = KeyType(i);
+                }
+            }
+            // Removes the last keys until `size() == n`.
+            constexpr void shrink(std::size_t n) noexcept
+            {
+                while (entries.size() > n)
+                    entries.pop_back();
+            }
         };
 
-
-        // A reference-like class to an element and its key.
-        template <typename IndexMap, bool IsConst>
-        class KeyValueRef
+        template <typename KeyType, typename PersistentData, typename Allocator, template <typename...> typename Container>
+        class IndexStorage<em::IndexLayout::separate, KeyType, PersistentData, Allocator, Container>
         {
-            template <typename IndexMap2, bool IsConst2>
-            friend class KeyValueIter;
-
             template <typename U>
-            using MaybeConst = std::conditional_t<IsConst, const U, U>;
+            using ContainerFor = Container<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
 
-            MaybeConst<IndexMap> *this_map = nullptr;
-            // `-1` makes it so that singular iterators compare not equal with everything else. Which isn't mandatory, but makes things safer.
-            std::size_t this_index = std::size_t(-1);
+            static constexpr bool has_persistent_data = !std::is_void_v<PersistentData>;
 
-            using Ref = std::conditional_t<IsConst, typename IndexMap::value_const_reference, typename IndexMap::value_reference>;
-            using PersistentDataRef = std::conditional_t<IsConst, typename IndexMap::persistent_data_const_reference, typename IndexMap::persistent_data_reference>;
+            ContainerFor<KeyType> sparse_to_dense_array;
+            ContainerFor<KeyType> dense_to_sparse_array;
+            // If there's no persistent data, `sparse_data()` returns a reference to `no_data` instead.
+            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS std::conditional_t<has_persistent_data, ContainerFor<VoidToEmpty<PersistentData, 1>>, Empty<1>> sparse_data_array;
+            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS Empty<1> no_data;
 
           public:
-            using map_type = MaybeConst<IndexMap>;
-
-            [[nodiscard]] KeyValueRef() = default;
-            // Primarily for internal use.
-            [[nodiscard]] constexpr KeyValueRef(MaybeConst<IndexMap> &this_map, std::size_t this_index) : this_map(&this_map), this_index(this_index) {}
-
-            // Convert non-const to const reference.
-            [[nodiscard]] constexpr KeyValueRef(const KeyValueRef<IndexMap, !IsConst> &other) requires IsConst : this_map(&other.map()), this_index(other.index()) {}
+            // The keys are always `[0, size())`.
+            static constexpr bool dense_keys = true;
+
+            [[nodiscard]] constexpr IndexStorage() {}
+            [[nodiscard]] constexpr IndexStorage(const Allocator &alloc)
+                : sparse_to_dense_array(alloc), dense_to_sparse_array(alloc), sparse_data_array([&]{if constexpr (has_persistent_data) return ContainerFor<VoidToEmpty<PersistentData, 1>>(alloc); else return Empty<1>{};}())
+            {}
+
+            [[nodiscard]] constexpr std::size_t size() const noexcept {return sparse_to_dense_array.size();}
+            [[nodiscard]] constexpr bool contains(std::size_t k) const noexcept {return k < size();}
+            [[nodiscard]] constexpr std::size_t capacity() const noexcept {return sparse_to_dense_array.capacity();}
+            constexpr void reserve(std::size_t n)
+            {
+                sparse_to_dense_array.reserve(n);
+                dense_to_sparse_array.reserve(n);
+                if constexpr (has_persistent_data)
+                    sparse_data_array.reserve(n);
+            }
+            constexpr void shrink_to_fit() noexcept
+            {
+                sparse_to_dense_array.shrink_to_fit();
+                dense_to_sparse_array.shrink_to_fit();
+                if constexpr (has_persistent_data)
+                    sparse_data_array.shrink_to_fit();
+            }
+            constexpr void shrink_capacity(std::size_t n) noexcept
+            {
+                ShrinkCapacity(sparse_to_dense_array, n);
+                ShrinkCapacity(dense_to_sparse_array, n);
+                if constexpr (has_persistent_data)
+                    ShrinkCapacity(sparse_data_array, n);
+            }
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept
+            {
+                std::size_t ret = (sparse_to_dense_array.capacity() + dense_to_sparse_array.capacity()) * sizeof(KeyType);
+                if constexpr (has_persistent_data)
+                    ret += sparse_data_array.capacity() * sizeof(VoidToEmpty<PersistentData, 1>);
+                return ret;
+            }
+            constexpr void clear() noexcept
+            {
+                sparse_to_dense_array.clear();
+                dense_to_sparse_array.clear();
+                if constexpr (has_persistent_data)
+                    sparse_data_array.clear();
+            }
 
-            // `&`-qualify the assignment operator, to not imply that you can assign to dereferenced iterators.
-            KeyValueRef(const KeyValueRef &) = default;
-            KeyValueRef &operator=(const KeyValueRef &) & = default;
+            [[nodiscard]] constexpr       KeyType &sparse_to_dense(std::size_t k)       noexcept {return sparse_to_dense_array[k];}
+            [[nodiscard]] constexpr const KeyType &sparse_to_dense(std::size_t k) const noexcept {return sparse_to_dense_array[k];}
+            [[nodiscard]] constexpr       KeyType &dense_to_sparse(std::size_t i)       noexcept {return dense_to_sparse_array[i];}
+            [[nodiscard]] constexpr const KeyType &dense_to_sparse(std::size_t i) const noexcept {return dense_to_sparse_array[i];}
+            [[nodiscard]] constexpr       VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k)       noexcept {if constexpr (has_persistent_data) return sparse_data_array[k]; else return no_data;}
+            [[nodiscard]] constexpr const VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k) const noexcept {if constexpr (has_persistent_data) return sparse_data_array[k]; else return no_data;}
 
-            // All of this is noexcept and hard fails if the iterator is invalid: [
+            // Only the index. The persistent data is in a different array, and lookups don't need it.
+            constexpr void prefetch(std::size_t k) const noexcept {if (k < size()) Prefetch(&sparse_to_dense_array[k]);}
 
-            [[nodiscard]] constexpr map_type &map() const noexcept {return *this_map;}
-            [[nodiscard]] constexpr std::size_t index() const noexcept {return this_index;}
-            [[nodiscard]] constexpr typename IndexMap::key key() const noexcept {return this_map->index_to_key_unsafe(this_index);}
-            [[nodiscard]] constexpr Ref value() const noexcept requires map_type::has_value_type {return (*this_map)[this_index];}
-            [[nodiscard]] constexpr PersistentDataRef persistent_data() const noexcept requires map_type::has_persistent_data_type {return this_map->get_persistent_data(this_map->index_to_key(this_index));}
+            static constexpr std::size_t sparse_to_dense_stride = std::contiguous_iterator<typename ContainerFor<KeyType>::const_iterator> ? sizeof(KeyType) : 0;
+            [[nodiscard]] const std::byte *sparse_to_dense_bytes() const noexcept {return size() ? reinterpret_cast<const std::byte *>(std::to_address(sparse_to_dense_array.begin())) : nullptr;}
 
-            // ]
+            static constexpr bool contiguous_dense_to_sparse = std::contiguous_iterator<typename ContainerFor<KeyType>::const_iterator>;
+            [[nodiscard]] const KeyType *dense_to_sparse_data() const noexcept requires contiguous_dense_to_sparse {return size() ? std::to_address(dense_to_sparse_array.begin()) : nullptr;}
 
-            // This is what `iter_move` returns.
-            struct moved
+            // Adds keys until `size() == n`. Each new key is mapped to the index with the same value.
+            // If this throws, nothing is changed.
+            constexpr void grow(std::size_t n)
             {
-                KeyValueRef ref;
+                std::size_t old_size = size();
+                struct Guard
+                {
+                    IndexStorage *self;
+                    std::size_t old_size;
+                    constexpr ~Guard()
+                    {
+                        if (self)
+                            self->shrink(old_size);
+                    }
+                };
+                Guard guard{this, old_size};
+                sparse_to_dense_array.resize(n);
+                dense_to_sparse_array.resize(n);
+                if constexpr (has_persistent_data)
+                    sparse_data_array.resize(n);
+                guard.self = nullptr;
 
-                // Back conversion, possibly to a const ref. Some standard concepts check this.
-                template <bool IsConst2>
-                [[nodiscard]] constexpr operator KeyValueRef<IndexMap, IsConst2>() const requires(IsConst <= IsConst2) {return ref;}
-            };
-            // Since this is reference-like, `this` is const. `other` is const just for consistency.
-            constexpr const KeyValueRef &operator=(const moved &&other) const noexcept(map_type::has_value_type <= std::is_nothrow_move_assignable_v<typename IndexMap::value_type>) requires(!IsConst)
-            {
-                DETAIL_EM_INDEXMAP_ASSERT(this_map == other.ref.this_map);
-                this_map->move_elem(other.ref.this_index, this_index);
-                return *this;
+                for (std::size_t i = old_size; i < n; i++)
+                {
+                    sparse_to_dense_array[i] = KeyType(i);
+                    dense_to_sparse_array[i] = KeyType(i);
+                }
             }
-            // A non-const overload. Needed to resolve some ambiguities.
-            constexpr const KeyValueRef &operator=(const moved &&other)       noexcept(map_type::has_value_type <= std::is_nothrow_move_assignable_v<typename IndexMap::value_type>) requires(!IsConst)
+            // Removes the last keys until `size() == n`. Also used to roll back a partially completed `grow()`, so the arrays can have different sizes here.
+            constexpr void shrink(std::size_t n) noexcept
             {
-                return std::as_const(*this) = std::move(other);
+                while (sparse_to_dense_array.size() > n)
+                    sparse_to_dense_array.pop_back();
+                while (dense_to_sparse_array.size() > n)
+                    dense_to_sparse_array.pop_back();
+                if constexpr (has_persistent_data)
+                {
+                    while (sparse_data_array.size() > n)
+                        sparse_data_array.pop_back();
+                }
             }
-
-            // Work around silly MSVC bugs. Last tested on 19.41.
-            #if !defined(__clang__) && (defined(_MSC_VER) || (defined(__GNUC__) && __GNUC__ <= 12))
-            #define DETAIL_EM_INDEXMAP_ACCESS_WORKAROUND
-            constexpr auto &__detail_this_map()       {return this_map;}
-            constexpr auto &__detail_this_map() const {return this_map;}
-            constexpr auto &__detail_this_index()       {return this_index;}
-            constexpr auto &__detail_this_index() const {return this_index;}
-            #endif
         };
 
-        // An iterator-like class to an element and its key.
-        template <typename IndexMap, bool IsConst>
-        class KeyValueIter
+
+        template <std::size_t PageSize, typename KeyType, typename PersistentData, typename Allocator, template <typename...> typename Container>
+        class IndexStorage<em::IndexLayout::paged<PageSize>, KeyType, PersistentData, Allocator, Container>
         {
-            KeyValueRef<IndexMap, IsConst> state;
+            struct PageEntry
+            {
+                KeyType sparse_to_dense{};
+                DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS VoidToEmpty<PersistentData, 1> sparse_data{};
+            };
 
-          public:
-            using map_type = typename KeyValueRef<IndexMap, IsConst>::map_type;
+            struct Page
+            {
+                // How many keys from this page are in use. The page is freed when this drops to zero.
+                std::size_t num_keys = 0;
+                PageEntry entries[PageSize]{};
+            };
 
-            [[nodiscard]] constexpr KeyValueIter() {}
-            // Primarily for internal use.
-            [[nodiscard]] constexpr KeyValueIter(map_type &this_map, std::size_t this_index) : state(this_map, this_index) {}
+            using PageAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<Page>;
+            using PageAllocatorTraits = std::allocator_traits<PageAllocator>;
 
-            // Convert non-const to const iterators.
-            [[nodiscard]] constexpr KeyValueIter(const KeyValueIter<IndexMap, !IsConst> &other) requires IsConst : state(other->map(), other->index()) {}
+            template <typename U>
+            using ContainerFor = Container<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
 
-            using value_type = KeyValueRef<IndexMap, IsConst>; // Would use `void` here to
-            using reference = KeyValueRef<IndexMap, IsConst>;
-            using difference_type = typename IndexMap::difference_type;
+            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS PageAllocator page_allocator;
+            // Null for the pages that aren't allocated.
+            ContainerFor<Page *> pages;
+            ContainerFor<KeyType> dense_to_sparse_array;
+            // All keys below this are in use. This is where `grow()` starts looking for unused keys.
+            std::size_t next_unused_key = 0;
+
+            [[nodiscard]] constexpr       PageEntry &entry(std::size_t k)       noexcept {return pages[k / PageSize]->entries[k % PageSize];}
+            [[nodiscard]] constexpr const PageEntry &entry(std::size_t k) const noexcept {return pages[k / PageSize]->entries[k % PageSize];}
+
+            constexpr void free_page(std::size_t p) noexcept
+            {
+                PageAllocatorTraits::destroy(page_allocator, pages[p]);
+                PageAllocatorTraits::deallocate(page_allocator, pages[p], 1);
+                pages[p] = nullptr;
+            }
+
+            [[nodiscard]] constexpr std::size_t find_unused_key() const noexcept
+            {
+                std::size_t k = next_unused_key;
+                while (true)
+                {
+                    std::size_t p = k / PageSize;
+                    if (p >= pages.size() || !pages[p])
+                        return k;
+                    if (pages[p]->num_keys == PageSize)
+                        k = (p + 1) * PageSize;
+                    else if (!contains(k))
+                        return k;
+                    else
+                        k++;
+                }
+            }
+
+          public:
+            // The keys can be arbitrary.
+            static constexpr bool dense_keys = false;
+
+            [[nodiscard]] constexpr IndexStorage() {}
+            [[nodiscard]] constexpr IndexStorage(const Allocator &alloc) : page_allocator(alloc), pages(alloc), dense_to_sparse_array(alloc) {}
+
+            constexpr IndexStorage(const IndexStorage &other)
+                : page_allocator(PageAllocatorTraits::select_on_container_copy_construction(other.page_allocator)),
+                pages(other.pages.size(), nullptr), dense_to_sparse_array(other.dense_to_sparse_array), next_unused_key(other.next_unused_key)
+            {
+                struct Guard
+                {
+                    IndexStorage *self;
+                    constexpr ~Guard()
+                    {
+                        if (self)
+                            self->clear();
+                    }
+                };
+                Guard guard{this};
+                for (std::size_t p = 0; p < pages.size(); p++)
+                {
+                    if (!other.pages[p])
+                        continue;
+                    Page *page = PageAllocatorTraits::allocate(page_allocator, 1);
+                    PageAllocatorTraits::construct(page_allocator, page, *other.pages[p]);
+                    pages[p] = page;
+                }
+                guard.self = nullptr;
+            }
+            constexpr IndexStorage(IndexStorage &&other) noexcept
+                : page_allocator(std::move(other.page_allocator)), pages(std::move(other.pages)), dense_to_sparse_array(std::move(other.dense_to_sparse_array)), next_unused_key(other.next_unused_key)
+            {
+                other.pages.clear();
+                other.dense_to_sparse_array.clear();
+                other.next_unused_key = 0;
+            }
+            constexpr IndexStorage &operator=(IndexStorage other) noexcept
+            {
+                std::swap(page_allocator, other.page_allocator);
+                std::swap(pages, other.pages);
+                std::swap(dense_to_sparse_array, other.dense_to_sparse_array);
+                std::swap(next_unused_key, other.next_unused_key);
+                return *this;
+            }
+            constexpr ~IndexStorage()
+            {
+                clear();
+            }
+
+            [[nodiscard]] constexpr std::size_t size() const noexcept {return dense_to_sparse_array.size();}
+            [[nodiscard]] constexpr bool contains(std::size_t k) const noexcept
+            {
+                std::size_t p = k / PageSize;
+                if (p >= pages.size() || !pages[p])
+                    return false;
+                // Stale entries are allowed in the page. The key is only valid if the index points back to it.
+                std::size_t i = std::size_t(entry(k).sparse_to_dense);
+                return i < size() && std::size_t(dense_to_sparse_array[i]) == k;
+            }
+
+            [[nodiscard]] constexpr std::size_t capacity() const noexcept {return dense_to_sparse_array.capacity();}
+            constexpr void reserve(std::size_t n) {dense_to_sparse_array.reserve(n);}
+            constexpr void shrink_to_fit() noexcept {dense_to_sparse_array.shrink_to_fit(); pages.shrink_to_fit();}
+            // The empty pages are already freed, so only the index->key table is reallocated.
+            constexpr void shrink_capacity(std::size_t n) noexcept {ShrinkCapacity(dense_to_sparse_array, n);}
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept
+            {
+                std::size_t ret = pages.capacity() * sizeof(Page *) + dense_to_sparse_array.capacity() * sizeof(KeyType);
+                for (const Page *page : pages)
+                {
+                    if (page)
+                        ret += sizeof(Page);
+                }
+                return ret;
+            }
+            constexpr void clear() noexcept
+            {
+                for (std::size_t p = 0; p < pages.size(); p++)
+                {
+                    if (pages[p])
+                        free_page(p);
+                }
+                pages.clear();
+                dense_to_sparse_array.clear();
+                next_unused_key = 0;
+            }
+
+            [[nodiscard]] constexpr       KeyType &sparse_to_dense(std::size_t k)       noexcept {return entry(k).sparse_to_dense;}
+            [[nodiscard]] constexpr const KeyType &sparse_to_dense(std::size_t k) const noexcept {return entry(k).sparse_to_dense;}
+            [[nodiscard]] constexpr       KeyType &dense_to_sparse(std::size_t i)       noexcept {return dense_to_sparse_array[i];}
+            [[nodiscard]] constexpr const KeyType &dense_to_sparse(std::size_t i) const noexcept {return dense_to_sparse_array[i];}
+            [[nodiscard]] constexpr       VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k)       noexcept {return entry(k).sparse_data;}
+            [[nodiscard]] constexpr const VoidToEmpty<PersistentData, 1> &sparse_data(std::size_t k) const noexcept {return entry(k).sparse_data;}
+
+            // The indices are scattered across the pages, so the SIMD key checks don't apply.
+            static constexpr std::size_t sparse_to_dense_stride = 0;
+
+            static constexpr bool contiguous_dense_to_sparse = std::contiguous_iterator<typename ContainerFor<KeyType>::const_iterator>;
+            [[nodiscard]] const KeyType *dense_to_sparse_data() const noexcept requires contiguous_dense_to_sparse {return size() ? std::to_address(dense_to_sparse_array.begin()) : nullptr;}
+
+            // The page table itself is small, so it's probably in the cache already.
+            constexpr void prefetch(std::size_t k) const noexcept
+            {
+                std::size_t p = k / PageSize;
+                if (p < pages.size() && pages[p])
+                    Prefetch(&entry(k));
+            }
+
+            // Adds a specific key at the last index. The key must not be in use.
+            // If this throws, nothing is changed.
+            constexpr void add_key(std::size_t k)
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(!contains(k));
+                std::size_t p = k / PageSize;
+
+                dense_to_sparse_array.push_back(KeyType(k));
+                struct Guard
+                {
+                    IndexStorage *self;
+                    constexpr ~Guard()
+                    {
+                        if (self)
+                            self->dense_to_sparse_array.pop_back();
+                    }
+                };
+                Guard guard{this};
+
+                if (p >= pages.size())
+                    pages.resize(p + 1);
+                if (!pages[p])
+                {
+                    Page *page = PageAllocatorTraits::allocate(page_allocator, 1);
+                    PageAllocatorTraits::construct(page_allocator, page);
+                    pages[p] = page;
+                }
+                else
+                {
+                    // Reset the stale persistent data, if any.
+                    entry(k).sparse_data = VoidToEmpty<PersistentData, 1>{};
+                }
+                guard.self = nullptr;
+
+                pages[p]->num_keys++;
+                entry(k).sparse_to_dense = KeyType(size() - 1);
+            }
+
+            // Adds unused keys until `size() == n`. Prefers the smallest keys.
+            // If this throws, nothing is changed.
+            constexpr void grow(std::size_t n)
+            {
+                struct Guard
+                {
+                    IndexStorage *self;
+                    std::size_t old_size = self->size();
+                    constexpr ~Guard()
+                    {
+                        if (self)
+                            self->shrink(old_size);
+                    }
+                };
+                Guard guard{this};
+                while (size() < n)
+                {
+                    std::size_t k = find_unused_key();
+                    add_key(k);
+                    next_unused_key = k + 1;
+                }
+                guard.self = nullptr;
+            }
+            // Removes the keys at the last indices until `size() == n`. Frees the pages that become empty.
+            constexpr void shrink(std::size_t n) noexcept
+            {
+                while (size() > n)
+                {
+                    std::size_t k = std::size_t(dense_to_sparse_array.back());
+                    dense_to_sparse_array.pop_back();
+                    std::size_t p = k / PageSize;
+                    if (--pages[p]->num_keys == 0)
+                        free_page(p);
+                    next_unused_key = std::min(next_unused_key, k);
+                }
+                while (!pages.empty() && !pages.back())
+                    pages.pop_back();
+            }
+        };
+
+
+        // Given a `ValueView` or `KeyValueView``, returns its target map.
+        template <typename T>
+        [[nodiscard]] constexpr auto &UnderlyingMap(T &&target) {return *target.this_map;}
+
+        // `value_view` for an index map. Never const, because instead of the const view we just return a const reference to the storage.
+        template <typename IndexMap>
+        struct ValueView
+        {
+            template <typename T>
+            friend constexpr auto &UnderlyingMap(T &&target);
+
+            IndexMap *this_map = nullptr;
+
+            static constexpr bool IsContiguous = std::contiguous_iterator<typename IndexMap::value_container::iterator>;
+
+          public:
+            [[nodiscard]] ValueView() = default;
+            // Mostly for internal use.
+            [[nodiscard]] constexpr ValueView(IndexMap &this_map) : this_map(&this_map) {}
+
+            constexpr typename IndexMap::value_container::iterator erase(typename IndexMap::value_container::iterator iter)
+            {
+                auto n = std::size_t(iter - this_map->value_storage.begin());
+                this_map->erase(n);
+                // With the tombstones, the erased element stays in place, and the trailing ones are popped, so skip to the next live element.
+                if constexpr (IndexMap::keeps_tombstones)
+                    n = this_map->next_live_index(std::min(n, this_map->size()));
+                // Roundtrip the iterator through index. Otherwise the iterator validation will complain,
+                //   or perhaps some custom containers might need this.
+                return this_map->value_storage.begin() + std::ptrdiff_t(n);
+            }
+
+            // Standard range members:
+
+            using value_type             = typename IndexMap::value_type;
+            using size_type              = std::size_t; // Forcing `std::size_t` for simplicity, like everywhere else.
+            using difference_type        = std::ptrdiff_t;
+            using reference              = value_type &; // No fancy pointers/refs support for now.
+            using const_reference        = const value_type &;
+            using iterator               = typename IndexMap::value_container::iterator;
+            using const_iterator         = typename IndexMap::value_container::const_iterator;
+            using reverse_iterator       = typename IndexMap::value_container::reverse_iterator;
+            using const_reverse_iterator = typename IndexMap::value_container::const_reverse_iterator;
+            using pointer                = value_type *;
+            using const_pointer          = const value_type *;
+
+            [[nodiscard]] constexpr size_type size() const noexcept {return this_map->size();}
+            [[nodiscard]] constexpr bool empty() const noexcept {return this_map->empty();}
+
+            [[nodiscard]] constexpr iterator begin() const noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values()).begin();}
+            [[nodiscard]] constexpr iterator end() const noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values()).end();}
+            [[nodiscard]] constexpr const_iterator cbegin() const noexcept {return std::as_const(*this_map).values().cbegin();}
+            [[nodiscard]] constexpr const_iterator cend() const noexcept {return std::as_const(*this_map).values().cend();}
+
+            [[nodiscard]] constexpr pointer data() noexcept requires IsContiguous {return std::to_address(begin());}
+            [[nodiscard]] constexpr const_pointer data() const noexcept requires IsContiguous {return std::to_address(cbegin());}
+
+            [[nodiscard]] constexpr reference operator[](size_type i) noexcept {return const_cast<typename IndexMap::value_container &>(std::as_const(*this_map).values())[i];}
+            [[nodiscard]] constexpr const_reference operator[](size_type i) const noexcept {return std::as_const(*this_map).values()[i];}
+
+            // A range of `std::span`s covering all values in order, to iterate over them in contiguous chunks (which is easier to vectorize).
+            // For a segmented container that's one span per segment, otherwise it's a single span.
+            [[nodiscard]] constexpr auto segments() const noexcept requires IsContiguous || SegmentedContainer<typename IndexMap::value_container>
+            {
+                if constexpr (SegmentedContainer<typename IndexMap::value_container>)
+                    return this_map->value_storage.segments();
+                else
+                    return std::ranges::single_view(std::span<value_type>(std::to_address(begin()), size()));
+            }
+        };
+
+        template <typename IndexMap>
+        struct SelectValueView
+        {
+            using type = ValueView<IndexMap>;
+        };
+        template <typename IndexMap> requires std::is_same_v<typename IndexMap::value_container, SizeOnlyContainer>
+        struct SelectValueView<IndexMap>
+        {
+            using type = void;
+        };
+
+
+        // A reference-like class to an element and its key.
+        template <typename IndexMap, bool IsConst>
+        class KeyValueRef
+        {
+            template <typename IndexMap2, bool IsConst2>
+            friend class KeyValueIter;
+
+            template <typename U>
+            using MaybeConst = std::conditional_t<IsConst, const U, U>;
+
+            MaybeConst<IndexMap> *this_map = nullptr;
+            // `-1` makes it so that singular iterators compare not equal with everything else. Which isn't mandatory, but makes things safer.
+            std::size_t this_index = std::size_t(-1);
+
+            using Ref = std::conditional_t<IsConst, typename IndexMap::value_const_reference, typename IndexMap::value_reference>;
+            using PersistentDataRef = std::conditional_t<IsConst, typename IndexMap::persistent_data_const_reference, typename IndexMap::persistent_data_reference>;
+
+          public:
+            using map_type = MaybeConst<IndexMap>;
+
+            [[nodiscard]] KeyValueRef() = default;
+            // Primarily for internal use.
+            [[nodiscard]] constexpr KeyValueRef(MaybeConst<IndexMap> &this_map, std::size_t this_index) : this_map(&this_map), this_index(this_index) {}
+
+            // Convert non-const to const reference.
+            [[nodiscard]] constexpr KeyValueRef(const KeyValueRef<IndexMap, !IsConst> &other) requires IsConst : this_map(&other.map()), this_index(other.index()) {}
+
+            // `&`-qualify the assignment operator, to not imply that you can assign to dereferenced iterators.
+            KeyValueRef(const KeyValueRef &) = default;
+            KeyValueRef &operator=(const KeyValueRef &) & = default;
+
+            // All of this is noexcept and hard fails if the iterator is invalid: [
+
+            [[nodiscard]] constexpr map_type &map() const noexcept {return *this_map;}
+            [[nodiscard]] constexpr std::size_t index() const noexcept {return this_index;}
+            [[nodiscard]] constexpr typename IndexMap::key key() const noexcept {return this_map->index_to_key_unsafe(this_index);}
+            [[nodiscard]] constexpr Ref value() const noexcept requires map_type::has_value_type {return (*this_map)[this_index];}
+            // For a tombstone (see `ErasePolicy::tombstones`), those return the data of the erased element, and its handle, which is no longer valid.
+            [[nodiscard]] constexpr PersistentDataRef persistent_data() const noexcept requires map_type::has_persistent_data_type {return this_map->index_to_persistent_data_low(this_index);}
+            [[nodiscard]] constexpr typename IndexMap::handle handle() const noexcept requires map_type::has_generations {return this_map->index_to_handle_low(this_index);}
+
+            // ]
+
+            // This is what `iter_move` returns.
+            struct moved
+            {
+                KeyValueRef ref;
+
+                // Back conversion, possibly to a const ref. Some standard concepts check this.
+                template <bool IsConst2>
+                [[nodiscard]] constexpr operator KeyValueRef<IndexMap, IsConst2>() const requires(IsConst <= IsConst2) {return ref;}
+            };
+            // Since this is reference-like, `this` is const. `other` is const just for consistency.
+            constexpr const KeyValueRef &operator=(const moved &&other) const noexcept(!map_type::keeps_tombstones && map_type::has_value_type <= std::is_nothrow_move_assignable_v<typename IndexMap::value_type>) requires(!IsConst)
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(this_map == other.ref.this_map);
+                this_map->move_elem(other.ref.this_index, this_index);
+                return *this;
+            }
+            // A non-const overload. Needed to resolve some ambiguities.
+            constexpr const KeyValueRef &operator=(const moved &&other)       noexcept(!map_type::keeps_tombstones && map_type::has_value_type <= std::is_nothrow_move_assignable_v<typename IndexMap::value_type>) requires(!IsConst)
+            {
+                return std::as_const(*this) = std::move(other);
+            }
+
+            // Work around silly MSVC bugs. Last tested on 19.41.
+            #if !defined(__clang__) && (defined(_MSC_VER) || (defined(__GNUC__) && __GNUC__ <= 12))
+            #define DETAIL_EM_INDEXMAP_ACCESS_WORKAROUND
+            constexpr auto &__detail_this_map()       {return this_map;}
+            constexpr auto &__detail_this_map() const {return this_map;}
+            constexpr auto &__detail_this_index()       {return this_index;}
+            constexpr auto &__detail_this_index() const {return this_index;}
+            #endif
+        };
+
+        // An iterator-like class to an element and its key.
+        template <typename IndexMap, bool IsConst>
+        class KeyValueIter
+        {
+            KeyValueRef<IndexMap, IsConst> state;
+
+          public:
+            using map_type = typename KeyValueRef<IndexMap, IsConst>::map_type;
+
+            [[nodiscard]] constexpr KeyValueIter() {}
+            // Primarily for internal use.
+            [[nodiscard]] constexpr KeyValueIter(map_type &this_map, std::size_t this_index) : state(this_map, this_index) {}
+
+            // Convert non-const to const iterators.
+            [[nodiscard]] constexpr KeyValueIter(const KeyValueIter<IndexMap, !IsConst> &other) requires IsConst : state(other->map(), other->index()) {}
+
+            using value_type = KeyValueRef<IndexMap, IsConst>; // Would use `void` here to
+            using reference = KeyValueRef<IndexMap, IsConst>;
+            using difference_type = typename IndexMap::difference_type;
             using iterator_category = std::random_access_iterator_tag;
 
             // This is what `operator->` returns.
@@ -326,7 +1191,7 @@ namespace em
             }
 
             // This is a customization point accepted by `std::ranges::iter_swap()`.
-            friend constexpr void iter_swap(const KeyValueIter &a, const KeyValueIter &b) noexcept(map_type::has_value_type <= std::is_nothrow_swappable_v<typename IndexMap::value_type>) requires(!IsConst)
+            friend constexpr void iter_swap(const KeyValueIter &a, const KeyValueIter &b) noexcept(!map_type::keeps_tombstones && map_type::has_value_type <= std::is_nothrow_swappable_v<typename IndexMap::value_type>) requires(!IsConst)
             {
                 // Work around silly MSVC bugs. Last tested on 19.41.
                 #if defined(_MSC_VER) && !defined(__clang__)
@@ -359,11 +1224,17 @@ namespace em
             // Primarily for internal use.
             [[nodiscard]] constexpr KeyValueView(typename KeyValueIter<IndexMap, IsConst>::map_type &map) : this_map(&map) {}
 
-            [[nodiscard]] constexpr KeyValueIter<IndexMap, IsConst> erase(KeyValueIter<IndexMap, IsConst> iter) noexcept requires (!IsConst)
+            // With the tombstones, returns the next element that isn't a tombstone, since the erased one stays in place.
+            [[nodiscard]] constexpr KeyValueIter<IndexMap, IsConst> erase(KeyValueIter<IndexMap, IsConst> iter) noexcept(!IndexMap::keeps_tombstones) requires (!IsConst)
             {
                 DETAIL_EM_INDEXMAP_ASSERT(&this->begin()->map() == &iter->map());
-                iter->map().erase(iter->index());
-                return iter;
+                auto &map = iter->map();
+                std::size_t i = iter->index();
+                map.erase(i);
+                if constexpr (IndexMap::keeps_tombstones)
+                    return KeyValueIter<IndexMap, IsConst>(map, map.next_live_index(std::min(i, map.size())));
+                else
+                    return iter;
             }
 
             // Standard range members:
@@ -391,22 +1262,649 @@ namespace em
             [[nodiscard]] constexpr reference operator[](size_type i) noexcept {return begin()[std::ptrdiff_t(i)];}
             [[nodiscard]] constexpr const_reference operator[](size_type i) const noexcept {return cbegin()[std::ptrdiff_t(i)];}
         };
-    }
 
-    template <
-        // The element type or `void`.
-        typename T,
-        // The type used for keys, or none.
-        std::unsigned_integral KeyType = unsigned int,
-        // This is stored persistently, even after a key is erased. Good for storing the generation counter.
-        // Also you can store your data here instead of in `T`, to have stable addresses.
-        typename PersistentData = void,
+        // A forward iterator over the elements that aren't tombstones (see `ErasePolicy::tombstones`), in order. Dereferences to the same references as `KeyValueIter`.
+        template <typename IndexMap, bool IsConst>
+        class LiveKeyValueIter
+        {
+            typename KeyValueIter<IndexMap, IsConst>::map_type *this_map = nullptr;
+            std::size_t this_index = std::size_t(-1);
+
+          public:
+            using map_type = typename KeyValueIter<IndexMap, IsConst>::map_type;
+
+            [[nodiscard]] constexpr LiveKeyValueIter() {}
+            // Primarily for internal use. Skips the tombstones starting from `this_index`.
+            [[nodiscard]] constexpr LiveKeyValueIter(map_type &this_map, std::size_t this_index) : this_map(&this_map), this_index(this_map.next_live_index(this_index)) {}
+
+            // Convert non-const to const iterators.
+            [[nodiscard]] constexpr LiveKeyValueIter(const LiveKeyValueIter<IndexMap, !IsConst> &other) requires IsConst : this_map(&other->map()), this_index(other->index()) {}
+
+            using value_type = KeyValueRef<IndexMap, IsConst>;
+            using reference = KeyValueRef<IndexMap, IsConst>;
+            using difference_type = typename IndexMap::difference_type;
+            using iterator_category = std::forward_iterator_tag;
+            using pointer = typename KeyValueIter<IndexMap, IsConst>::pointer;
+
+            [[nodiscard]] constexpr reference operator*() const noexcept {return reference(*this_map, this_index);}
+            [[nodiscard]] constexpr pointer operator->() const noexcept {return {**this};}
+
+            // Skips the tombstones 64 at a time.
+            constexpr LiveKeyValueIter &operator++() noexcept
+            {
+                this_index = this_map->next_live_index(this_index + 1);
+                return *this;
+            }
+            constexpr LiveKeyValueIter operator++(int) noexcept
+            {
+                LiveKeyValueIter ret = *this;
+                ++*this;
+                return ret;
+            }
+
+            [[nodiscard]] friend constexpr bool operator==(const LiveKeyValueIter &a, const LiveKeyValueIter &b) noexcept {return a.this_index == b.this_index;}
+        };
+
+        template <typename IndexMap, bool IsConst>
+        class LiveKeyValueView
+        {
+            typename KeyValueIter<IndexMap, IsConst>::map_type *this_map = nullptr;
+
+          public:
+            [[nodiscard]] constexpr LiveKeyValueView() {}
+            // Primarily for internal use.
+            [[nodiscard]] constexpr LiveKeyValueView(typename KeyValueIter<IndexMap, IsConst>::map_type &map) : this_map(&map) {}
+
+            using value_type      = KeyValueRef<IndexMap, IsConst>;
+            using size_type       = std::size_t;
+            using difference_type = std::ptrdiff_t;
+            using reference       = KeyValueRef<IndexMap, IsConst>;
+            using const_reference = KeyValueRef<IndexMap, true>;
+            using iterator        = LiveKeyValueIter<IndexMap, IsConst>;
+            using const_iterator  = LiveKeyValueIter<IndexMap, true>;
+
+            // The number of elements that aren't tombstones.
+            [[nodiscard]] constexpr size_type size() const noexcept {return this_map->size() - this_map->tombstones_size();}
+            [[nodiscard]] constexpr bool empty() const noexcept {return size() == 0;}
+
+            [[nodiscard]] constexpr iterator begin() const noexcept {return iterator(*this_map, 0);}
+            [[nodiscard]] constexpr iterator end() const noexcept {return iterator(*this_map, this_map->size());}
+            [[nodiscard]] constexpr const_iterator cbegin() const noexcept {return const_iterator(*this_map, 0);}
+            [[nodiscard]] constexpr const_iterator cend() const noexcept {return const_iterator(*this_map, this_map->size());}
+        };
+
+        // Hands out the free keys of a map to many threads at once. Created by `IndexMap::make_key_reserver()`.
+        // The free keys are the ones at `[size(), free_keys_end())` in `dense_to_sparse`, and this just hands out a prefix of them, using an atomic counter.
+        template <typename IndexMap>
+        class KeyReserver
+        {
+            friend IndexMap;
+
+            const IndexMap *this_map = nullptr;
+            // `this_map->size()` at creation. The `i`-th reserved key is `this_map->index_to_key_relaxed(first_index + i)`.
+            std::size_t first_index = 0;
+            std::size_t max_keys = 0;
+            std::atomic<std::size_t> num_reserved = 0;
+
+            constexpr KeyReserver(const IndexMap &map, std::size_t max_keys) : this_map(&map), first_index(map.size()), max_keys(max_keys) {}
+
+            // Reserves `n` keys, and returns the index of the first one (relative to `first_index`).
+            [[nodiscard]] std::size_t reserve_low(std::size_t n)
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(this_map && "This key reserver was already committed.");
+                std::size_t i = num_reserved.load(std::memory_order_relaxed);
+                do
+                {
+                    if (n > max_keys - i)
+                        DETAIL_EM_INDEXMAP_THROW(std::length_error("Reserving too many index map keys."));
+                }
+                while (!num_reserved.compare_exchange_weak(i, i + n, std::memory_order_relaxed));
+                return i;
+            }
+
+          public:
+            KeyReserver(const KeyReserver &) = delete;
+            KeyReserver &operator=(const KeyReserver &) = delete;
+
+            // Reserves a free key. Thread-safe and lock-free. Throws if all `capacity()` keys are already reserved.
+            [[nodiscard]] typename IndexMap::key reserve()
+            {
+                return this_map->index_to_key_unsafe(first_index + reserve_low(1));
+            }
+            // Reserves `out.size()` free keys at once, and writes them to `out`. Thread-safe and lock-free. Throws if there's not enough keys left, then reserves nothing.
+            void reserve(std::span<typename IndexMap::key> out)
+            {
+                std::size_t i = first_index + reserve_low(out.size());
+                for (typename IndexMap::key &k : out)
+                    k = this_map->index_to_key_unsafe(i++);
+            }
+
+            // How many keys were reserved so far.
+            [[nodiscard]] std::size_t size() const noexcept {return num_reserved.load(std::memory_order_relaxed);}
+            // How many keys can be reserved in total.
+            [[nodiscard]] std::size_t capacity() const noexcept {return max_keys;}
+        };
+    }
+
+    namespace detail::IndexMap
+    {
+        // Records insertions, erasures and value assignments, to apply them to a map later with `IndexMap::apply()`.
+        // Doesn't touch the map, so each thread can fill its own buffer. The values are constructed right away, and moved into the map later.
+        template <typename IndexMap, typename Allocator>
+        class CommandBuffer
+        {
+            friend IndexMap;
+
+            template <typename U>
+            using ContainerFor = std::vector<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
+
+            typename IndexMap::value_container new_values;
+            ContainerFor<typename IndexMap::key> erased_keys;
+            // Those two have the same size.
+            ContainerFor<typename IndexMap::key> assigned_keys;
+            typename IndexMap::value_container assigned_values;
+
+          public:
+            [[nodiscard]] constexpr CommandBuffer() {}
+            [[nodiscard]] constexpr CommandBuffer(const Allocator &alloc) : new_values(alloc), erased_keys(alloc), assigned_keys(alloc), assigned_values(alloc) {}
+
+            // Inserting a new element constructed from `params...`.
+            constexpr void emplace(auto &&... params) requires is_constructible<typename IndexMap::value_type, decltype(params)...>::value
+            {
+                new_values.emplace_back(decltype(params)(params)...);
+            }
+            // Erasing an element. Erasing the same key several times (in one or several buffers) is allowed.
+            constexpr void erase(typename IndexMap::key k)
+            {
+                erased_keys.push_back(k);
+            }
+            // Assigning a new value to an existing element. If the same element is assigned several times, the last assignment wins.
+            constexpr void assign(typename IndexMap::key k, auto &&value) requires IndexMap::has_value_type && std::is_constructible_v<typename IndexMap::value_type, decltype(value)>
+            {
+                assigned_values.emplace_back(decltype(value)(value));
+                struct Guard
+                {
+                    CommandBuffer *self;
+                    constexpr ~Guard()
+                    {
+                        if (self)
+                            self->assigned_values.pop_back();
+                    }
+                };
+                Guard guard{this};
+                assigned_keys.push_back(k);
+                guard.self = nullptr;
+            }
+
+            [[nodiscard]] constexpr std::size_t num_emplaced() const noexcept {return new_values.size();}
+            [[nodiscard]] constexpr std::size_t num_erased() const noexcept {return erased_keys.size();}
+            [[nodiscard]] constexpr std::size_t num_assigned() const noexcept {return assigned_keys.size();}
+            [[nodiscard]] constexpr bool empty() const noexcept {return new_values.empty() && erased_keys.empty() && assigned_keys.empty();}
+
+            // Forgets all commands, but keeps the memory for reuse.
+            constexpr void clear() noexcept
+            {
+                new_values.clear();
+                erased_keys.clear();
+                assigned_keys.clear();
+                assigned_values.clear();
+            }
+        };
+    }
+
+    namespace detail::IndexMap
+    {
+        // The keys that were changed since the last `IndexMap::consume_changes()`, see `IndexMapOptions::track_changes`.
+        template <typename Key, typename Allocator>
+        struct ChangeSet
+        {
+            using key_vector = std::vector<Key, typename std::allocator_traits<Allocator>::template rebind_alloc<Key>>;
+
+            // The keys that didn't exist at the last checkpoint, but exist now.
+            key_vector inserted;
+            // The keys that existed at the last checkpoint, but were erased since then. A key that was erased and then reused is in both `erased` and `inserted`.
+            key_vector erased;
+            // The keys that existed all the time, and were marked with `mark_modified()`, or had their value overwritten by `move_elem()` or `apply()`.
+            key_vector modified;
+
+            [[nodiscard]] constexpr bool empty() const noexcept {return inserted.empty() && erased.empty() && modified.empty();}
+            constexpr void clear() noexcept
+            {
+                inserted.clear();
+                erased.clear();
+                modified.clear();
+            }
+        };
+
+        // Remembers which keys were touched since the last checkpoint. The disabled version stores nothing.
+        // The bits and the list of touched keys always have room for all keys below `reserve()`d limit, so recording a change never throws.
+        template <bool Enabled, typename Key, typename Allocator>
+        class ChangeTracker
+        {
+          public:
+            constexpr ChangeTracker() {}
+            constexpr ChangeTracker(const Allocator &) {}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return 0;}
+        };
+
+        template <typename Key, typename Allocator>
+        class ChangeTracker<true, Key, Allocator>
+        {
+            template <typename U>
+            using ContainerFor = std::vector<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
+
+            // One bit per key in each member.
+            struct Bits
+            {
+                std::uint64_t touched = 0;
+                // Whether the key existed at the last checkpoint. Only meaningful if `touched`.
+                std::uint64_t was_present = 0;
+                std::uint64_t erased = 0;
+                std::uint64_t modified = 0;
+            };
+            ContainerFor<Bits> bits;
+            // Each touched key is listed once, in the order they were first touched.
+            ContainerFor<Key> touched_keys;
+
+            constexpr void touch(std::size_t k, bool was_present, std::uint64_t Bits::*flag) noexcept
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(k / 64 < bits.size());
+                Bits &word = bits[k / 64];
+                std::uint64_t bit = std::uint64_t(1) << (k % 64);
+                if (!(word.touched & bit))
+                {
+                    word.touched |= bit;
+                    if (was_present)
+                        word.was_present |= bit;
+                    touched_keys.push_back(Key(k)); // Doesn't reallocate, see `reserve()`.
+                }
+                if (flag)
+                    word.*flag |= bit;
+            }
+
+          public:
+            constexpr ChangeTracker() {}
+            constexpr ChangeTracker(const Allocator &alloc) : bits(alloc), touched_keys(alloc) {}
+
+            // Copying doesn't preserve the capacity, so reserve it again.
+            constexpr ChangeTracker(const ChangeTracker &other) : bits(other.bits), touched_keys(other.touched_keys) {touched_keys.reserve(bits.size() * 64);}
+            constexpr ChangeTracker &operator=(const ChangeTracker &other)
+            {
+                ChangeTracker copy(other);
+                *this = std::move(copy);
+                return *this;
+            }
+            constexpr ChangeTracker(ChangeTracker &&) = default;
+            constexpr ChangeTracker &operator=(ChangeTracker &&) = default;
+
+            // Makes room for the keys below `n`.
+            constexpr void reserve(std::size_t n)
+            {
+                std::size_t num_words = (n + 63) / 64;
+                if (num_words <= bits.size())
+                    return;
+                num_words = std::max(num_words, bits.size() * 2);
+                touched_keys.reserve(num_words * 64);
+                bits.resize(num_words);
+            }
+
+            constexpr void inserted(std::size_t k) noexcept {touch(k, false, nullptr);}
+            constexpr void erased(std::size_t k) noexcept {touch(k, true, &Bits::erased);}
+            constexpr void modified(std::size_t k) noexcept {touch(k, true, &Bits::modified);}
+
+            // Appends the changes to `out`, and forgets them. `contains(k)` must return true if the key `k` currently exists.
+            constexpr void consume(ChangeSet<Key, Allocator> &out, auto &&contains)
+            {
+                for (Key k : touched_keys)
+                {
+                    Bits &word = bits[std::size_t(k) / 64];
+                    std::uint64_t bit = std::uint64_t(1) << (std::size_t(k) % 64);
+                    bool was_present = word.was_present & bit;
+                    bool is_present = contains(k);
+                    if (was_present && (!is_present || (word.erased & bit)))
+                        out.erased.push_back(k);
+                    if (is_present && (!was_present || (word.erased & bit)))
+                        out.inserted.push_back(k);
+                    else if (is_present && (word.modified & bit))
+                        out.modified.push_back(k);
+                }
+                // Clear the bits only now, so that if the above throws, nothing is lost.
+                for (Key k : touched_keys)
+                {
+                    Bits &word = bits[std::size_t(k) / 64];
+                    std::uint64_t mask = ~(std::uint64_t(1) << (std::size_t(k) % 64));
+                    word.touched &= mask;
+                    word.was_present &= mask;
+                    word.erased &= mask;
+                    word.modified &= mask;
+                }
+                touched_keys.clear();
+            }
+
+            // How many keys were touched since the last checkpoint. Some of them might have no net change.
+            [[nodiscard]] constexpr std::size_t num_touched_keys() const noexcept {return touched_keys.size();}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return bits.capacity() * sizeof(Bits) + touched_keys.capacity() * sizeof(Key);}
+        };
+
+        // Lists the free keys in the order they should be reused in, see `IndexMapOptions::key_reuse`.
+        // `IndexMap` moves the keys it's about to reuse to the beginning of the free keys in `dense_to_sparse`, which already is the LIFO order, so that one is empty.
+        // The others have this interface:
+        //   `reserve(n)` makes room for the keys below `n`. Must be called before adding keys.
+        //   `add(k)` and `remove(k)` are called when a key becomes free and stops being free, respectively.
+        //   `first()` and `next(k)` iterate over the free keys, in the order of reuse. They return `none` at the end.
+        //   `memory_usage()` is the number of bytes allocated.
+        template <KeyReuse Policy, typename Key, typename Allocator>
+        class FreeKeyOrder
+        {
+          public:
+            constexpr FreeKeyOrder() {}
+            constexpr FreeKeyOrder(const Allocator &) {}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return 0;}
+        };
+
+        template <typename Key, typename Allocator>
+        class FreeKeyOrder<KeyReuse::fifo, Key, Allocator>
+        {
+          public:
+            static constexpr std::size_t none = std::size_t(-1);
+
+          private:
+            // A doubly-linked list through the free keys, from the least recently freed one. The ends of the list link to themselves.
+            struct Links
+            {
+                Key prev{};
+                Key next{};
+            };
+            std::vector<Links, typename std::allocator_traits<Allocator>::template rebind_alloc<Links>> links;
+            std::size_t head = none;
+            std::size_t tail = none;
+
+          public:
+            constexpr FreeKeyOrder() {}
+            constexpr FreeKeyOrder(const Allocator &alloc) : links(alloc) {}
+
+            constexpr void reserve(std::size_t n)
+            {
+                if (links.empty())
+                    head = tail = none; // In case we were moved from.
+                if (n > links.size())
+                    links.resize(std::max(n, links.size() * 2));
+            }
+
+            constexpr void add(std::size_t k) noexcept
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(k < links.size());
+                links[k] = {Key(tail == none ? k : tail), Key(k)};
+                if (tail == none)
+                    head = k;
+                else
+                    links[tail].next = Key(k);
+                tail = k;
+            }
+            constexpr void remove(std::size_t k) noexcept
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(k < links.size());
+                std::size_t prev = std::size_t(links[k].prev);
+                std::size_t next = std::size_t(links[k].next);
+                bool is_first = head == k;
+                bool is_last = tail == k;
+                if (is_first)
+                    head = is_last ? none : next;
+                else
+                    links[prev].next = Key(is_last ? prev : next);
+                if (is_last)
+                    tail = is_first ? none : prev;
+                else
+                    links[next].prev = Key(is_first ? next : prev);
+            }
+            constexpr void clear() noexcept {head = tail = none;}
+
+            [[nodiscard]] constexpr std::size_t first() const noexcept {return links.empty() ? none : head;}
+            [[nodiscard]] constexpr std::size_t next(std::size_t k) const noexcept {return k == tail ? none : std::size_t(links[k].next);}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return links.capacity() * sizeof(Links);}
+        };
+
+        template <typename Key, typename Allocator>
+        class FreeKeyOrder<KeyReuse::lowest, Key, Allocator>
+        {
+          public:
+            static constexpr std::size_t none = std::size_t(-1);
+
+          private:
+            // A hierarchical bitset of the free keys, with the levels stored one after another, starting at `level_begin[i]`.
+            // The bits of level 0 are the keys, and each bit of the next level is set if the respective word of the previous level is nonzero. The last level is one word.
+            std::vector<std::uint64_t, typename std::allocator_traits<Allocator>::template rebind_alloc<std::uint64_t>> words;
+            // 11 levels are enough for 64-bit keys.
+            std::array<std::size_t, 12> level_begin{};
+            std::size_t num_levels = 0;
+
+            [[nodiscard]] constexpr std::size_t level_size(std::size_t level) const noexcept {return level_begin[level + 1] - level_begin[level];}
+
+            // Returns the first set bit at `level` at position `pos` or later.
+            [[nodiscard]] constexpr std::size_t find_from(std::size_t level, std::size_t pos) const noexcept
+            {
+                std::size_t i = pos / 64;
+                if (i >= level_size(level))
+                    return none;
+                if (std::uint64_t word = words[level_begin[level] + i] & (~std::uint64_t(0) << (pos % 64)))
+                    return i * 64 + std::size_t(std::countr_zero(word));
+                if (level + 1 == num_levels)
+                    return none;
+                i = find_from(level + 1, i + 1);
+                return i == none ? none : i * 64 + std::size_t(std::countr_zero(words[level_begin[level] + i]));
+            }
+
+          public:
+            constexpr FreeKeyOrder() {}
+            constexpr FreeKeyOrder(const Allocator &alloc) : words(alloc) {}
+
+            constexpr void reserve(std::size_t n)
+            {
+                std::size_t old_size = words.empty() ? 0 : level_size(0); // `words` is empty if we were moved from.
+                if (n <= old_size * 64)
+                    return;
+
+                std::array<std::size_t, 12> new_level_begin{};
+                std::size_t new_num_levels = 0;
+                std::size_t size = std::max((n + 63) / 64, old_size * 2);
+                while (true)
+                {
+                    new_level_begin[new_num_levels + 1] = new_level_begin[new_num_levels] + size;
+                    new_num_levels++;
+                    if (size == 1)
+                        break;
+                    size = (size + 63) / 64;
+                }
+
+                decltype(words) new_words(new_level_begin[new_num_levels], words.get_allocator());
+                std::copy_n(words.begin(), old_size, new_words.begin());
+                for (std::size_t level = 1; level < new_num_levels; level++)
+                {
+                    for (std::size_t i = new_level_begin[level - 1]; i < new_level_begin[level]; i++)
+                    {
+                        if (new_words[i])
+                        {
+                            std::size_t j = i - new_level_begin[level - 1];
+                            new_words[new_level_begin[level] + j / 64] |= std::uint64_t(1) << (j % 64);
+                        }
+                    }
+                }
+
+                words = std::move(new_words);
+                level_begin = new_level_begin;
+                num_levels = new_num_levels;
+            }
+
+            constexpr void add(std::size_t k) noexcept
+            {
+                for (std::size_t level = 0; level < num_levels; level++, k /= 64)
+                {
+                    std::uint64_t &word = words[level_begin[level] + k / 64];
+                    bool was_empty = word == 0;
+                    word |= std::uint64_t(1) << (k % 64);
+                    if (!was_empty)
+                        break;
+                }
+            }
+            constexpr void remove(std::size_t k) noexcept
+            {
+                for (std::size_t level = 0; level < num_levels; level++, k /= 64)
+                {
+                    std::uint64_t &word = words[level_begin[level] + k / 64];
+                    word &= ~(std::uint64_t(1) << (k % 64));
+                    if (word != 0)
+                        break;
+                }
+            }
+            constexpr void clear() noexcept {std::ranges::fill(words, 0);}
+
+            [[nodiscard]] constexpr std::size_t first() const noexcept {return words.empty() ? none : find_from(0, 0);}
+            [[nodiscard]] constexpr std::size_t next(std::size_t k) const noexcept {return find_from(0, k + 1);}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return words.capacity() * sizeof(std::uint64_t);}
+        };
+
+        // Marks the elements that were erased but not removed yet, one bit per index, see `ErasePolicy::tombstones`. The disabled version stores nothing.
+        // The bits past the `reserve()`d limit are zero, and so are the ones past the map size.
+        template <bool Enabled, typename Allocator>
+        class Tombstones
+        {
+          public:
+            constexpr Tombstones() {}
+            constexpr Tombstones(const Allocator &) {}
+
+            [[nodiscard]] constexpr std::size_t size() const noexcept {return 0;}
+            [[nodiscard]] constexpr bool test(std::size_t) const noexcept {return false;}
+            [[nodiscard]] constexpr std::size_t find(bool value, std::size_t i, std::size_t end) const noexcept {return value ? end : i;}
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return 0;}
+        };
+
+        template <typename Allocator>
+        class Tombstones<true, Allocator>
+        {
+            std::vector<std::uint64_t, typename std::allocator_traits<Allocator>::template rebind_alloc<std::uint64_t>> words;
+            // The number of set bits.
+            std::size_t count = 0;
+
+          public:
+            constexpr Tombstones() {}
+            constexpr Tombstones(const Allocator &alloc) : words(alloc) {}
+
+            constexpr Tombstones(const Tombstones &) = default;
+            constexpr Tombstones &operator=(const Tombstones &) = default;
+            // Moving resets the count, same as the other members of the map.
+            constexpr Tombstones(Tombstones &&other) noexcept : words(std::move(other.words)), count(std::exchange(other.count, 0)) {}
+            constexpr Tombstones &operator=(Tombstones &&other) noexcept
+            {
+                words = std::move(other.words);
+                count = std::exchange(other.count, 0);
+                return *this;
+            }
+
+            // Makes room for the indices below `n`.
+            constexpr void reserve(std::size_t n)
+            {
+                std::size_t num_words = (n + 63) / 64;
+                if (num_words > words.size())
+                    words.resize(std::max(num_words, words.size() * 2));
+            }
+
+            [[nodiscard]] constexpr std::size_t size() const noexcept {return count;}
+            [[nodiscard]] constexpr bool test(std::size_t i) const noexcept {return i / 64 < words.size() && (words[i / 64] >> (i % 64) & 1);}
+
+            // Those need room for `i`, see `reserve()`.
+            constexpr void set(std::size_t i) noexcept
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(i / 64 < words.size() && !test(i));
+                words[i / 64] |= std::uint64_t(1) << (i % 64);
+                count++;
+            }
+            constexpr void reset(std::size_t i) noexcept
+            {
+                DETAIL_EM_INDEXMAP_ASSERT(test(i));
+                words[i / 64] &= ~(std::uint64_t(1) << (i % 64));
+                count--;
+            }
+
+            // Returns the first index in `[i, end)` whose bit is equal to `value`, or `end` if none. Checks 64 bits at a time.
+            [[nodiscard]] constexpr std::size_t find(bool value, std::size_t i, std::size_t end) const noexcept
+            {
+                while (i < end)
+                {
+                    std::size_t word_index = i / 64;
+                    if (word_index >= words.size())
+                        return value ? end : i;
+                    std::uint64_t word = (value ? words[word_index] : ~words[word_index]) >> (i % 64);
+                    if (word)
+                        return std::min(i + std::size_t(std::countr_zero(word)), end);
+                    i = (word_index + 1) * 64;
+                }
+                return end;
+            }
+
+            constexpr void clear() noexcept
+            {
+                std::ranges::fill(words, std::uint64_t(0));
+                count = 0;
+            }
+
+            [[nodiscard]] constexpr std::size_t memory_usage() const noexcept {return words.capacity() * sizeof(std::uint64_t);}
+        };
+    }
+
+    // The default options for `IndexMap`. To customize them, inherit from this struct, override some of the members, and pass it as the last template argument.
+    struct IndexMapOptions
+    {
+        // How the key<->index tables and the persistent data are stored. One of `em::IndexLayout::...`.
+        using index_layout = IndexLayout::interleaved;
+
+        // If not `void`, an unsigned integer type for the per-key generation counters, which enables `IndexMap::handle`.
+        // The key and the generation must fit into 64 bits together.
+        using generation_type = void;
+        // What happens to a key when its generation would overflow. One of `em::GenerationOverflow::...`.
+        static constexpr GenerationOverflow generation_overflow = GenerationOverflow::retire;
+
+        // If true, the map records which keys were inserted, erased, or modified, until you call `IndexMap::consume_changes()`.
+        // This costs four bits per key, plus a list with room for every key. With `IndexLayout::paged`, that's every key up to the largest one.
+        static constexpr bool track_changes = false;
+
+        // Which free key an insertion reuses. One of `em::KeyReuse::...`.
+        // The non-default policies keep a list of the free keys. With `IndexLayout::paged`, it has room for every key up to the largest one.
+        static constexpr KeyReuse key_reuse = KeyReuse::lifo;
+
+        // Whether the map gives unused keys and memory back by itself after erasures. One of `em::ShrinkPolicy::...`.
+        using shrink_policy = ShrinkPolicy::manual;
+
+        // What `erase()` does with the hole it leaves. One of `em::ErasePolicy::...`.
+        // The tombstones need one bit per element, which is allocated on the first erasure.
+        using erase_policy = ErasePolicy::swap_and_pop;
+
+        // If true, the map counts the insertions, erasures, moves and reallocations, see `IndexMap::statistics`.
+        // Otherwise the counters don't exist at all and cost nothing.
+        static constexpr bool collect_statistics = false;
+    };
+
+    template <
+        // The element type or `void`.
+        typename T,
+        // The type used for keys, or none.
+        std::unsigned_integral KeyType = unsigned int,
+        // This is stored persistently, even after a key is erased. Good for storing the generation counter (or use the built-in ones, see `IndexMapOptions::generation_type`).
+        // Also you can store your data here instead of in `T`, to have stable addresses.
+        typename PersistentData = void,
         // The allocator. We rebind it to the correct type internally.
         typename Allocator = std::allocator<KeyType>,
         // Indices are stored in this.
         template <typename...> typename IndexContainer = std::vector,
         // Values are stored in this.
-        template <typename...> typename ValueContainer = std::vector
+        template <typename...> typename ValueContainer = std::vector,
+        // Various customization options, see `IndexMapOptions`.
+        typename Options = IndexMapOptions
     >
     requires (sizeof(KeyType) <= sizeof(std::size_t)) // For simplicity.
     class IndexMap
@@ -432,26 +1930,419 @@ namespace em
         // Usually `std::vector<T>`, or a placeholder if `T == void`.
         using value_container = typename detail::IndexMap::ContainerOrCounter<T, KeyType, Allocator, ValueContainer>::type;
 
+        // Generation counters, see `IndexMapOptions::generation_type`.
+        static constexpr bool has_generations = !std::is_void_v<typename Options::generation_type>;
+        using generation_type = typename Options::generation_type;
+        static_assert(!has_generations || std::unsigned_integral<detail::IndexMap::VoidToEmpty<generation_type>>, "The generation type must be an unsigned integer.");
+        static_assert(!has_generations || sizeof(KeyType) + sizeof(detail::IndexMap::VoidToEmpty<generation_type>) <= sizeof(std::uint64_t), "The key and the generation must fit into 64 bits together.");
+
+        // Whether erasing leaves tombstones, see `IndexMapOptions::erase_policy`.
+        using erase_policy = typename Options::erase_policy;
+        static constexpr bool keeps_tombstones = !std::is_same_v<erase_policy, ErasePolicy::swap_and_pop>;
+
+        // A key combined with the generation it had when the handle was created. The key is in the low bits.
+        // Unlike keys, handles to erased elements stay invalid even after their keys are reused.
+        enum class handle : detail::IndexMap::HandleUint<KeyType, generation_type> {};
+
         struct insert_result
         {
             IndexMap::key key{};
             DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS value_reference value;
             DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS persistent_data_reference persistent_data;
+            // Only if the generations are enabled.
+            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS std::conditional_t<has_generations, IndexMap::handle, detail::IndexMap::Empty<2>> handle{};
+        };
+
+        // The operation counters, returned by `get_statistics()`. Only if `IndexMapOptions::collect_statistics` is set.
+        struct statistics
+        {
+            // The inserted and the erased elements. `load()` counts as inserting, and `clear()` as erasing.
+            std::uint64_t inserts = 0;
+            std::uint64_t erases = 0;
+            // The values moved to a different index: to fill the holes after erasures, by sorting, etc. A swap counts as two moves.
+            std::uint64_t moves = 0;
+            // How many times the key tables and the values were reallocated (or for segmented containers, got or lost segments).
+            // Those are detected by checking the capacity after each operation, so several reallocations in one operation count as one.
+            std::uint64_t keys_reallocations = 0;
+            std::uint64_t values_reallocations = 0;
+            // The largest `keys_size()` and `size()` seen.
+            std::size_t peak_keys_size = 0;
+            std::size_t peak_size = 0;
+        };
+
+        // The bytes allocated by the map, returned by `memory_usage()`. This is the capacity, not just the used part.
+        struct memory_usage_info
+        {
+            // The key<->index tables, including the persistent data and the generations.
+            std::size_t keys = 0;
+            std::size_t values = 0;
+            // The optional per-key data for `IndexMapOptions::track_changes` and `IndexMapOptions::key_reuse`, and the tombstone bits for `IndexMapOptions::erase_policy`.
+            std::size_t bookkeeping = 0;
+
+            [[nodiscard]] constexpr std::size_t total() const noexcept {return keys + values + bookkeeping;}
         };
 
       private:
-        struct IndexEntry
+        using index_storage = detail::IndexMap::IndexStorage<typename Options::index_layout, KeyType, detail::IndexMap::StoredPersistentData<generation_type, PersistentData>, Allocator, IndexContainer>;
+
+        static constexpr bool tracks_changes = Options::track_changes;
+
+        // See `IndexMapOptions::shrink_policy`.
+        using shrink_policy = typename Options::shrink_policy;
+        static constexpr bool shrinks_automatically = !std::is_same_v<shrink_policy, ShrinkPolicy::manual>;
+
+        // See `IndexMapOptions::collect_statistics`.
+        static constexpr bool collects_statistics = Options::collect_statistics;
+        struct StatisticsState
+        {
+            statistics counters;
+            // The capacities at the last check, to detect the reallocations.
+            std::size_t keys_capacity = 0;
+            std::size_t values_capacity = 0;
+        };
+
+        // Whether `free_key_order` is used. Otherwise the free keys are reused in LIFO order, which is what `dense_to_sparse` naturally has.
+        static constexpr bool orders_free_keys = Options::key_reuse != KeyReuse::lifo;
+
+        // With `GenerationOverflow::retire`, the retired keys are stored at the end of `dense_to_sparse`, after the free keys.
+        static constexpr bool retires_keys = has_generations && Options::generation_overflow == GenerationOverflow::retire;
+
+        index_storage indices;
+        value_container value_storage;
+        // Counts the retired keys. This is a `SizeOnlyContainer` because it resets when moved from, same as the other members.
+        DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS std::conditional_t<retires_keys, detail::IndexMap::SizeOnlyContainer, detail::IndexMap::Empty<3>> retired_keys;
+        // See `IndexMapOptions::track_changes`.
+        DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS detail::IndexMap::ChangeTracker<tracks_changes, key, Allocator> changes;
+        // See `IndexMapOptions::key_reuse`.
+        DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS detail::IndexMap::FreeKeyOrder<Options::key_reuse, KeyType, Allocator> free_key_order;
+        // See `IndexMapOptions::collect_statistics`.
+        DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS std::conditional_t<collects_statistics, StatisticsState, detail::IndexMap::Empty<4>> stats;
+        // See `IndexMapOptions::erase_policy`.
+        DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS detail::IndexMap::Tombstones<keeps_tombstones, Allocator> tombstones;
+
+        // Adds `n` to a counter in `stats`, if enabled.
+        constexpr void count_low(std::uint64_t statistics::*counter, std::size_t n) noexcept
+        {
+            if constexpr (collects_statistics)
+                stats.counters.*counter += n;
+            else
+            {
+                (void)counter;
+                (void)n;
+            }
+        }
+        // Checks for reallocations since the last call, and updates the peak sizes in `stats`, if enabled. Call this after anything that can change the capacity.
+        constexpr void update_statistics_low() noexcept
+        {
+            if constexpr (collects_statistics)
+            {
+                if (indices.capacity() != stats.keys_capacity)
+                {
+                    stats.keys_capacity = indices.capacity();
+                    stats.counters.keys_reallocations++;
+                }
+                if (value_storage.capacity() != stats.values_capacity)
+                {
+                    stats.values_capacity = value_storage.capacity();
+                    stats.counters.values_reallocations++;
+                }
+                stats.counters.peak_keys_size = std::max(stats.counters.peak_keys_size, indices.size());
+                stats.counters.peak_size = std::max(stats.counters.peak_size, size());
+            }
+        }
+
+        // The end of the free keys in `dense_to_sparse`. Only the retired keys are after it.
+        [[nodiscard]] constexpr std::size_t free_keys_end() const noexcept {return indices.size() - retired_keys_size();}
+
+        // Makes sure the per-key bookkeeping (`changes` and `free_key_order`) has room for the keys below `n`. Must be called before adding keys.
+        constexpr void reserve_key_bookkeeping_low(std::size_t n)
+        {
+            if constexpr (tracks_changes)
+                changes.reserve(n);
+            if constexpr (orders_free_keys)
+                free_key_order.reserve(n);
+        }
+        // Records that the keys at `[old_free_keys_end, free_keys_end())` in `dense_to_sparse` were just added, and are free.
+        constexpr void add_new_free_keys_low(std::size_t old_free_keys_end) noexcept
+        {
+            if constexpr (orders_free_keys)
+            {
+                for (std::size_t i = old_free_keys_end; i < free_keys_end(); i++)
+                    free_key_order.add(std::size_t(indices.dense_to_sparse(i)));
+            }
+        }
+        // Moves the `n` free keys that should be reused next to `[first_index, first_index + n)` in `dense_to_sparse`, in order.
+        // Those indices must be free (except they can already hold values that don't have keys yet), and there must be at least `n` free keys.
+        constexpr void select_free_keys_low(std::size_t first_index, std::size_t n) noexcept
+        {
+            if constexpr (orders_free_keys)
+            {
+                std::size_t k = free_key_order.first();
+                for (std::size_t i = first_index; i < first_index + n; i++)
+                {
+                    DETAIL_EM_INDEXMAP_ASSERT(k != free_key_order.none);
+                    swap_indices_only_relaxed({*this, key(k)}, {*this, i});
+                    k = free_key_order.next(k);
+                }
+            }
+            else
+            {
+                (void)first_index;
+                (void)n;
+            }
+        }
+        // Records that the elements at `[first_index, size())` were just inserted, so their keys are no longer free.
+        constexpr void note_inserted_low(std::size_t first_index) noexcept
+        {
+            count_low(&statistics::inserts, size() - first_index);
+            update_statistics_low();
+            if constexpr (tracks_changes || orders_free_keys)
+            {
+                for (std::size_t i = first_index; i < size(); i++)
+                {
+                    std::size_t k = std::size_t(indices.dense_to_sparse(i));
+                    if constexpr (tracks_changes)
+                        changes.inserted(k);
+                    if constexpr (orders_free_keys)
+                        free_key_order.remove(k);
+                }
+            }
+        }
+
+        [[nodiscard]] constexpr persistent_data_reference persistent_data_low(std::size_t k) noexcept
+        {
+            if constexpr (!has_persistent_data_type)
+                return {};
+            else if constexpr (has_generations)
+                return indices.sparse_data(k).data;
+            else
+                return indices.sparse_data(k);
+        }
+        [[nodiscard]] constexpr persistent_data_const_reference persistent_data_low(std::size_t k) const noexcept
+        {
+            if constexpr (!has_persistent_data_type)
+                return {};
+            else if constexpr (has_generations)
+                return indices.sparse_data(k).data;
+            else
+                return indices.sparse_data(k);
+        }
+
+        [[nodiscard]] constexpr       auto &generation_low(std::size_t k)       noexcept requires has_generations {return indices.sparse_data(k).generation;}
+        [[nodiscard]] constexpr const auto &generation_low(std::size_t k) const noexcept requires has_generations {return indices.sparse_data(k).generation;}
+
+        [[nodiscard]] constexpr handle make_handle_low(key k) const noexcept requires has_generations
+        {
+            using uint = std::underlying_type_t<handle>;
+            return handle(uint(KeyType(k)) | uint(uint(generation_low(std::size_t(k))) << (sizeof(KeyType) * 8)));
+        }
+
+        // For `KeyValueRef`, which must not throw on tombstones. For a tombstone, those return the data of the erased element, and its now stale handle.
+        friend detail::IndexMap::KeyValueRef<IndexMap, false>;
+        friend detail::IndexMap::KeyValueRef<IndexMap, true>;
+        [[nodiscard]] constexpr persistent_data_reference index_to_persistent_data_low(std::size_t i) noexcept
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(i < size());
+            return persistent_data_low(std::size_t(index_to_key_unsafe(i)));
+        }
+        [[nodiscard]] constexpr persistent_data_const_reference index_to_persistent_data_low(std::size_t i) const noexcept
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(i < size());
+            return persistent_data_low(std::size_t(index_to_key_unsafe(i)));
+        }
+        [[nodiscard]] constexpr handle index_to_handle_low(std::size_t i) const noexcept requires has_generations
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(i < size());
+            key k = index_to_key_unsafe(i);
+            generation_type generation = generation_low(std::size_t(k));
+            if (tombstones.test(i))
+                generation = generation_type(generation - 1); // Undo the increment done by the erasure.
+            using uint = std::underlying_type_t<handle>;
+            return handle(uint(KeyType(k)) | uint(uint(generation) << (sizeof(KeyType) * 8)));
+        }
+
+        // Returns the index of the element that the handle points to, or `size()` if the handle is stale or invalid.
+        [[nodiscard]] constexpr std::size_t handle_to_index_low(handle h) const noexcept requires has_generations
+        {
+            key k = handle_to_key(h);
+            if (!contains_relaxed(k) || generation_low(std::size_t(k)) != handle_to_generation(h))
+                return size();
+            // The generation changes when a key is erased, so only `clear()` can make this check fail.
+            return std::min(key_to_index_unsafe(k), size());
+        }
+
+        [[nodiscard]] constexpr insert_result make_insert_result(key k, value_reference value) noexcept
+        {
+            if constexpr (has_generations)
+            {
+                handle h = make_handle_low(k); // Not inline, to work around a GCC 12 constexpr bug.
+                return {k, value, persistent_data_low(std::size_t(k)), h};
+            }
+            else
+                return {k, value, persistent_data_low(std::size_t(k))};
+        }
+
+        // Called after adding keys at the end of `dense_to_sparse`, starting at `old_keys_size`. Moves them before the retired keys.
+        constexpr void move_new_keys_before_retired(std::size_t old_keys_size) noexcept
+        {
+            if constexpr (retires_keys)
+            {
+                std::size_t num_retired = retired_keys_size();
+                if (num_retired == 0)
+                    return;
+                // Each swap moves one new key to the end of the free keys, and shifts the retired keys by one.
+                for (std::size_t i = old_keys_size; i < indices.size(); i++)
+                    swap_indices_only_relaxed({*this, i - num_retired}, {*this, i});
+            }
+        }
+
+        // Removes the keys at `[new_keys_size, keys_size())` that were just added. Undoes `move_new_keys_before_retired()` first.
+        constexpr void remove_new_keys(std::size_t new_keys_size) noexcept
+        {
+            if constexpr (retires_keys)
+            {
+                std::size_t num_retired = retired_keys_size();
+                if (num_retired > 0)
+                {
+                    for (std::size_t i = indices.size(); i-- > new_keys_size;)
+                        swap_indices_only_relaxed({*this, i - num_retired}, {*this, i});
+                }
+            }
+            if constexpr (orders_free_keys)
+            {
+                for (std::size_t i = new_keys_size; i < indices.size(); i++)
+                    free_key_order.remove(std::size_t(indices.dense_to_sparse(i)));
+            }
+            indices.shrink(new_keys_size);
+        }
+
+        // Records that the elements at `[first_index, last_index)` are erased: counts them, records the change, and increments the generations of their keys.
+        // This happens when they're removed, or earlier when they become tombstones.
+        constexpr void note_erased_low(std::size_t first_index, std::size_t last_index) noexcept
+        {
+            count_low(&statistics::erases, last_index - first_index);
+            if constexpr (tracks_changes || has_generations)
+            {
+                for (std::size_t i = first_index; i < last_index; i++)
+                {
+                    std::size_t k = std::size_t(indices.dense_to_sparse(i));
+                    if constexpr (tracks_changes)
+                        changes.erased(k);
+                    if constexpr (has_generations)
+                        generation_low(k) = generation_type(generation_low(k) + 1);
+                }
+            }
+        }
+
+        // Destroys the values at `[new_size, size())`, after their keys were erased (moved to those indices).
+        // This is the only place where the elements are removed, so it also retires the keys if needed, and makes the rest of them free.
+        // The tombstones among those elements were already recorded as erased, so only their bits are cleared.
+        constexpr void pop_erased_values_low(std::size_t new_size) noexcept
+        {
+            if constexpr (keeps_tombstones)
+            {
+                for (std::size_t i = new_size; i < size(); i++)
+                {
+                    if (tombstones.test(i))
+                        tombstones.reset(i);
+                    else
+                        note_erased_low(i, i + 1);
+                }
+            }
+            else
+            {
+                note_erased_low(new_size, size());
+            }
+            if constexpr (retires_keys || orders_free_keys)
+            {
+                // Backwards, so that the retired keys are swapped only with the already processed keys, or the free ones.
+                for (std::size_t i = size(); i-- > new_size;)
+                {
+                    std::size_t k = std::size_t(indices.dense_to_sparse(i));
+                    bool retired = false;
+                    if constexpr (retires_keys)
+                    {
+                        if (generation_low(k) == std::numeric_limits<generation_type>::max())
+                        {
+                            swap_indices_only_relaxed({*this, i}, {*this, free_keys_end() - 1});
+                            retired_keys.emplace_back();
+                            retired = true;
+                        }
+                    }
+                    if constexpr (orders_free_keys)
+                    {
+                        if (!retired)
+                            free_key_order.add(k);
+                    }
+                    (void)retired;
+                }
+            }
+            while (value_storage.size() > new_size)
+                value_storage.pop_back();
+            shrink_after_erasure_low();
+            update_statistics_low();
+        }
+
+        // Gives memory back according to `IndexMapOptions::shrink_policy`.
+        constexpr void shrink_after_erasure_low() noexcept
+        {
+            if constexpr (shrinks_automatically)
+            {
+                if constexpr (!has_generations)
+                {
+                    for (std::size_t j = 0; j < shrink_policy::max_keys_per_erasure && remove_unused_key(); j++) {}
+                }
+                if (shrink_policy::should_shrink(indices.size(), indices.capacity()))
+                    indices.shrink_capacity(shrink_policy::new_capacity(indices.size()));
+                if constexpr (has_value_type)
+                {
+                    if (shrink_policy::should_shrink(size(), value_storage.capacity()))
+                        detail::IndexMap::ShrinkCapacity(value_storage, shrink_policy::new_capacity(size()));
+                }
+            }
+        }
+
+        // Turns the element at index `i` into a tombstone, see `ErasePolicy::tombstones`. Call `tombstones.reserve(size())` first.
+        constexpr void make_tombstone_low(std::size_t i) noexcept requires keeps_tombstones
+        {
+            note_erased_low(i, i + 1);
+            tombstones.set(i);
+        }
+        // Throws if `i` or `j` is a tombstone. `swap_elems()` and `move_elem()` check this even in release builds,
+        //   because `keys_and_values()` shows the tombstones, and swapping one with an element would mark the wrong key as erased.
+        constexpr void not_tombstones_or_throw(std::size_t i, std::size_t j) const
+        {
+            if constexpr (keeps_tombstones)
+            {
+                if (tombstones.test(i) || tombstones.test(j))
+                    DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map index."));
+            }
+            else
+            {
+                (void)i;
+                (void)j;
+            }
+        }
+        // Removes the tombstones at the end, which doesn't need to move anything.
+        constexpr void pop_trailing_tombstones_low() noexcept
         {
-            // Those have the same value initially, but quickly become desynchronized.
-            KeyType sparse_to_dense{};
-            KeyType dense_to_sparse{};
-
-            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS detail::IndexMap::VoidToEmpty<PersistentData, 1> sparse_data{};
-        };
-        using index_container = IndexContainer<IndexEntry, typename std::allocator_traits<Allocator>::template rebind_alloc<IndexEntry>>;
+            std::size_t new_size = size();
+            while (new_size > 0 && tombstones.test(new_size - 1))
+                new_size--;
+            if (new_size < size())
+                pop_erased_values_low(new_size);
+        }
+        // Called after making tombstones. Removes the ones at the end, then compacts if `IndexMapOptions::erase_policy` says so.
+        constexpr void finish_erasure_low() requires keeps_tombstones
+        {
+            pop_trailing_tombstones_low();
+            if (erase_policy::should_compact(tombstones.size(), size()))
+                compact();
+        }
 
-        index_container indices;
-        value_container value_storage;
+        // For temporary buffers.
+        template <typename U>
+        using scratch_vector = std::vector<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
 
         struct KeyAndIndex
         {
@@ -461,20 +2352,33 @@ namespace em
             constexpr KeyAndIndex(const IndexMap &self, std::size_t i) : k(self.index_to_key_unsafe(i)), i(i) {}
         };
 
+        // The indices can be tombstones, so that `compact()` can move the elements onto them.
         constexpr void swap_indices_only(KeyAndIndex a, KeyAndIndex b)
         {
-            DETAIL_EM_INDEXMAP_ASSERT(valid_index(a.i) && valid_index(b.i));
+            DETAIL_EM_INDEXMAP_ASSERT(a.i < size() && b.i < size());
             swap_indices_only_relaxed(a, b);
         }
         constexpr void swap_indices_only_relaxed(KeyAndIndex a, KeyAndIndex b)
         {
             DETAIL_EM_INDEXMAP_ASSERT(valid_index_relaxed(a.i) && valid_index_relaxed(b.i));
-            std::swap(indices[std::size_t(a.k)].sparse_to_dense, indices[std::size_t(b.k)].sparse_to_dense);
-            std::swap(indices[a.i].dense_to_sparse, indices[b.i].dense_to_sparse);
+            std::swap(indices.sparse_to_dense(std::size_t(a.k)), indices.sparse_to_dense(std::size_t(b.k)));
+            std::swap(indices.dense_to_sparse(a.i), indices.dense_to_sparse(b.i));
         }
 
-        constexpr void swap_elems_low(KeyAndIndex a, KeyAndIndex b) {swap_indices_only(a, b); if constexpr (has_value_type) std::ranges::swap((*this)[a.i], (*this)[b.i]);}
-        constexpr void move_elem_low(KeyAndIndex a, KeyAndIndex b) {swap_indices_only(a, b); if constexpr (has_value_type) (*this)[b.i] = std::move((*this)[a.i]);}
+        constexpr void swap_elems_low(KeyAndIndex a, KeyAndIndex b)
+        {
+            swap_indices_only(a, b);
+            if constexpr (has_value_type)
+                std::ranges::swap(value_storage[a.i], value_storage[b.i]);
+            count_low(&statistics::moves, a.i != b.i ? 2 : 0);
+        }
+        constexpr void move_elem_low(KeyAndIndex a, KeyAndIndex b)
+        {
+            swap_indices_only(a, b);
+            if constexpr (has_value_type)
+                value_storage[b.i] = std::move(value_storage[a.i]);
+            count_low(&statistics::moves, a.i != b.i);
+        }
 
         constexpr void can_increase_size_or_throw()
         {
@@ -484,10 +2388,12 @@ namespace em
 
         [[nodiscard]] constexpr insert_result add_key_for_inserted_value(value_reference value)
         {
-            if (size() <=/*sic*/ indices.size()) // Since we already inserted at this point, we're using `<=` here.
+            if (size() <=/*sic*/ free_keys_end()) // Since we already inserted at this point, we're using `<=` here.
             {
-                IndexEntry &e = indices[value_storage.size() - 1];
-                return {key(e.dense_to_sparse), value, e.sparse_data};
+                select_free_keys_low(size() - 1, 1);
+                KeyType k = indices.dense_to_sparse(value_storage.size() - 1);
+                note_inserted_low(size() - 1);
+                return make_insert_result(key(k), value);
             }
             else
             {
@@ -502,28 +2408,560 @@ namespace em
                 };
                 Guard guard{this}; // This destroys the last value if adding a key throws.
 
-                KeyType k = KeyType(indices.size());
-                IndexEntry &e = indices.emplace_back();
-                e.sparse_to_dense = k;
-                e.dense_to_sparse = k;
+                std::size_t old_keys_size = indices.size();
+                std::size_t old_free_keys_end = free_keys_end();
+                reserve_key_bookkeeping_low(old_keys_size + 1);
+                indices.grow(old_keys_size + 1);
+                move_new_keys_before_retired(old_keys_size);
+                add_new_free_keys_low(old_free_keys_end);
+                KeyType k = indices.dense_to_sparse(size() - 1);
 
                 guard.self = nullptr;
-                return {key(k), value, e.sparse_data};
+                note_inserted_low(size() - 1);
+                return make_insert_result(key(k), value);
+            }
+        }
+
+        // Throws if `n` more elements don't fit into the map.
+        constexpr void can_increase_size_by_or_throw(std::size_t n)
+        {
+            if (n > max_size() - size())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Index map would be too large."));
+        }
+
+        // Makes sure `n` more values can be inserted without reallocating, while keeping the geometric growth.
+        // Otherwise repeated bulk insertions of small batches would reallocate every time.
+        // Non-moving containers (segmented and reserved ones) grow cheaply, so for them we reserve exactly what's needed.
+        constexpr void values_reserve_more(std::size_t n)
+        {
+            std::size_t new_size = size() + n;
+            if (new_size > value_storage.capacity())
+            {
+                if constexpr (detail::IndexMap::NonMovingContainer<value_container>)
+                    value_storage.reserve(new_size);
+                else
+                    value_storage.reserve(std::max(new_size, value_storage.capacity() * 2));
+            }
+        }
+
+        // Used by the bulk insertion functions. Unless disarmed, destroys the values that were inserted
+        //   since it was created, and removes the keys that were added.
+        struct BulkInsertGuard
+        {
+            IndexMap *self;
+            std::size_t old_size = self->size();
+            std::size_t old_keys_size = self->keys_size();
+            // The keys added by `prepare_keys()`. Only if the free keys are ordered, because then `select_free_keys_low()` can swap them
+            //   with the old free keys (e.g. with `KeyReuse::lowest` and `IndexLayout::paged`, where the new keys can be lower than the old ones).
+            DETAIL_EM_INDEXMAP_NO_UNIQUE_ADDRESS std::conditional_t<orders_free_keys, scratch_vector<key>, detail::IndexMap::Empty<0>> new_keys{};
+
+            // Calls `prepare_keys_for_insertion(n)`, and remembers the keys it added.
+            constexpr void prepare_keys(std::size_t n)
+            {
+                self->prepare_keys_for_insertion(n);
+                if constexpr (orders_free_keys)
+                {
+                    // The new keys are inserted before the retired ones, if any.
+                    std::size_t first = old_keys_size - self->retired_keys_size();
+                    new_keys.reserve(self->free_keys_end() - first);
+                    for (std::size_t i = first; i < self->free_keys_end(); i++)
+                        new_keys.push_back(self->index_to_key_unsafe(i));
+                }
+            }
+
+            constexpr ~BulkInsertGuard()
+            {
+                if (!self)
+                    return;
+                while (self->value_storage.size() > old_size)
+                    self->value_storage.pop_back();
+                if constexpr (orders_free_keys)
+                {
+                    // Move the new keys back to where they were added, so that `remove_new_keys()` removes them and not the old free keys.
+                    std::size_t i = old_keys_size - self->retired_keys_size();
+                    for (key k : new_keys)
+                        self->swap_indices_only_relaxed({*self, k}, {*self, i++});
+                }
+                self->remove_new_keys(old_keys_size);
+            }
+        };
+
+        // Inserts `n` values, calling `emplace_one()` to insert each one into `value_storage`. Returns the index of the first new value.
+        constexpr std::size_t bulk_insert_low(std::size_t n, auto &&emplace_one)
+        {
+            can_increase_size_by_or_throw(n);
+            BulkInsertGuard guard{this};
+            // The keys for the new elements are the ones at `[size(), size() + n)` in `dense_to_sparse`, which are either unused or newly created.
+            guard.prepare_keys(size() + n);
+            select_free_keys_low(size(), n);
+            values_reserve_more(n);
+            for (std::size_t i = 0; i < n; i++)
+                emplace_one();
+            guard.self = nullptr;
+            note_inserted_low(guard.old_size);
+            return guard.old_size;
+        }
+
+        // Erases the element at index `i`, which must be valid. Either moves the last element into the hole, or leaves a tombstone there.
+        constexpr void erase_low(std::size_t i)
+        {
+            if constexpr (keeps_tombstones)
+            {
+                tombstones.reserve(size());
+                make_tombstone_low(i);
+                finish_erasure_low();
+            }
+            else
+            {
+                move_elem_low({*this, size() - 1}, {*this, i});
+                pop_erased_values_low(size() - 1);
+            }
+        }
+
+        // Erases the elements at the specified indices, which must be valid, sorted, and unique.
+        // The holes are filled with the survivors from the tail of `values()`, so that each element is moved at most once.
+        constexpr void erase_sorted_indices_low(std::span<const std::size_t> targets)
+        {
+            if constexpr (keeps_tombstones)
+            {
+                tombstones.reserve(size());
+                for (std::size_t i : targets)
+                    make_tombstone_low(i);
+                finish_erasure_low();
+                return;
+            }
+
+            std::size_t new_size = size() - targets.size();
+            // Those are the elements that are erased from the tail, they don't need to be moved.
+            auto tail_target = std::ranges::lower_bound(targets, new_size);
+            std::size_t source = new_size;
+            for (auto hole = targets.begin(); hole != targets.end() && *hole < new_size; ++hole)
+            {
+                while (tail_target != targets.end() && *tail_target == source)
+                {
+                    ++tail_target;
+                    source++;
+                }
+                move_elem_low({*this, source}, {*this, *hole});
+                source++;
+            }
+            pop_erased_values_low(new_size);
+        }
+
+        // Same, but the elements to erase are specified by a bit mask, one bit per index. `count` is the number of set bits.
+        constexpr void erase_marked_low(std::span<const std::uint64_t> marks, std::size_t count)
+        {
+            if constexpr (keeps_tombstones)
+            {
+                tombstones.reserve(size());
+                for (std::size_t word_index = 0; word_index * 64 < size(); word_index++)
+                {
+                    for (std::uint64_t word = marks[word_index]; word; word &= word - 1)
+                        make_tombstone_low(word_index * 64 + std::size_t(std::countr_zero(word)));
+                }
+                finish_erasure_low();
+                return;
+            }
+
+            std::size_t new_size = size() - count;
+            std::size_t source = new_size;
+            for (std::size_t word_index = 0; word_index * 64 < new_size; word_index++)
+            {
+                std::uint64_t word = marks[word_index];
+                if (std::size_t end = new_size - word_index * 64; end < 64)
+                    word &= (std::uint64_t(1) << end) - 1;
+                while (word)
+                {
+                    std::size_t hole = word_index * 64 + std::size_t(std::countr_zero(word));
+                    word &= word - 1;
+                    while (marks[source / 64] >> (source % 64) & 1)
+                        source++;
+                    move_elem_low({*this, source}, {*this, hole});
+                    source++;
+                }
+            }
+            pop_erased_values_low(new_size);
+        }
+
+        // See `erase_if_index()`. Moves the remaining elements from the tail into the holes.
+        constexpr std::size_t erase_if_index_unordered_low(auto &pred)
+        {
+            // `[0, front)` are the elements we keep, `[back, size())` are the ones we erase, and the rest is not processed yet.
+            struct Guard
+            {
+                IndexMap *self;
+                std::size_t front = 0;
+                std::size_t back = self->size();
+
+                // If `pred` throws, the unprocessed elements stay in the map.
+                constexpr ~Guard()
+                {
+                    self->pop_erased_values_low(back);
+                }
+            };
+            Guard guard{this};
+            std::size_t old_size = size();
+
+            while (true)
+            {
+                while (guard.front < guard.back && !pred(std::as_const(guard.front)))
+                    guard.front++;
+                if (guard.front == guard.back)
+                    break;
+
+                // `front` is erased, look for an element to fill the hole.
+                // `back` is moved only after `pred` returns true, so if it throws, that element isn't erased.
+                while (true)
+                {
+                    std::size_t last = guard.back - 1;
+                    if (last == guard.front || !pred(std::as_const(last)))
+                        break;
+                    guard.back = last;
+                }
+                guard.back--;
+                if (guard.back == guard.front)
+                    break;
+
+                move_elem_low({*this, guard.back}, {*this, guard.front});
+                guard.front++;
             }
+
+            return old_size - guard.back;
+        }
+
+        // See `erase_if_index()`. Shifts the remaining elements towards the beginning, like `std::remove_if()`.
+        constexpr std::size_t erase_if_index_ordered_low(auto &pred)
+        {
+            // `[0, write)` are the elements we keep, `[write, read)` are the ones we erase, and the rest is not processed yet.
+            struct Guard
+            {
+                IndexMap *self;
+                std::size_t write = 0;
+                std::size_t read = 0;
+
+                // If `pred` throws, the unprocessed elements stay in the map, but we still need to close the gap before them.
+                constexpr ~Guard()
+                {
+                    std::size_t old_size = self->size();
+                    for (; read < old_size; read++, write++)
+                    {
+                        if (read != write)
+                            self->move_elem_low({*self, read}, {*self, write});
+                    }
+                    self->pop_erased_values_low(write);
+                }
+            };
+            Guard guard{this};
+            std::size_t old_size = size();
+
+            for (; guard.read < old_size; guard.read++)
+            {
+                if (pred(std::as_const(guard.read)))
+                    continue;
+                if (guard.write != guard.read)
+                    move_elem_low({*this, guard.read}, {*this, guard.write});
+                guard.write++;
+            }
+
+            return old_size - guard.write;
+        }
+
+        // See `erase_if_index()`. Turns the elements into tombstones, calling `pred` only for the live ones.
+        constexpr std::size_t erase_if_index_tombstones_low(auto &pred) requires keeps_tombstones
+        {
+            tombstones.reserve(size());
+            std::size_t count = 0;
+            // If `pred` throws, the elements that were already checked stay erased.
+            struct Guard
+            {
+                IndexMap *self;
+                constexpr ~Guard() {self->pop_trailing_tombstones_low();}
+            };
+            Guard guard{this};
+            for_each_live_index([&](std::size_t i)
+            {
+                if (pred(std::as_const(i)))
+                {
+                    make_tombstone_low(i);
+                    count++;
+                }
+            });
+            finish_erasure_low();
+            return count;
         }
 
         [[nodiscard]] constexpr insert_result force_key_for_inserted_value(key k, value_reference value)
         {
-            contains_relaxed_or_throw(k);
-            if (contains(k))
+            struct Guard
+            {
+                IndexMap *self;
+                constexpr ~Guard()
+                {
+                    if (self)
+                        self->value_storage.pop_back();
+                }
+            };
+            Guard guard{this}; // This destroys the value if the key is bad.
+
+            if constexpr (index_storage::dense_keys)
+                contains_relaxed_or_throw(k);
+            else if (!contains_relaxed(k))
+            {
+                std::size_t old_keys_size = indices.size();
+                std::size_t old_free_keys_end = free_keys_end();
+                reserve_key_bookkeeping_low(std::size_t(k) + 1);
+                indices.add_key(std::size_t(k));
+                move_new_keys_before_retired(old_keys_size);
+                add_new_free_keys_low(old_free_keys_end);
+            }
+
+            // The value is already inserted, so the new element index is `size() - 1`, and the key is in use if its index is below that.
+            std::size_t new_index = size() - 1;
+            std::size_t old_index = key_to_index_unsafe(k);
+            if (old_index < new_index)
                 DETAIL_EM_INDEXMAP_THROW(std::out_of_range("This index map key is already in use."));
-            swap_indices_only_relaxed({*this, value_storage.size()}, {*this, k});
-            return {k, value, indices[std::size_t(k)].sparse_data};
+            if (old_index >= free_keys_end())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("This index map key is retired."));
+            swap_indices_only_relaxed({*this, new_index}, {*this, k});
+
+            guard.self = nullptr;
+            note_inserted_low(new_index);
+            return make_insert_result(k, value);
+        }
+
+        // Looks up the `keys` in order. Calls `found(j, i)` if `keys[j]` is valid and has index `i`, and `missing(j)` otherwise.
+        // Prefetches ahead in two stages: the index entries for the keys far ahead, then the values for the keys closer ahead, since finding a value needs its index entry.
+        // The indices found in the second stage are kept in a small ring buffer, to not look them up twice.
+        constexpr void lookup_many_low(std::span<const key> keys, auto &&found, auto &&missing) const
+        {
+            constexpr std::size_t index_distance = 16, value_distance = 8;
+
+            auto resolve = [&](std::size_t j) -> std::size_t
+            {
+                if (!contains(keys[j]))
+                    return size();
+                std::size_t i = key_to_index_unsafe(keys[j]);
+                if constexpr (has_value_type)
+                    detail::IndexMap::Prefetch(std::addressof(value_storage[i]));
+                return i;
+            };
+
+            for (std::size_t j = 0; j < std::min(index_distance, keys.size()); j++)
+                indices.prefetch(std::size_t(keys[j]));
+            std::size_t ahead[value_distance]{};
+            for (std::size_t j = 0; j < std::min(value_distance, keys.size()); j++)
+                ahead[j] = resolve(j);
+
+            for (std::size_t j = 0; j < keys.size(); j++)
+            {
+                std::size_t i = ahead[j % value_distance];
+                if (j + index_distance < keys.size())
+                    indices.prefetch(std::size_t(keys[j + index_distance]));
+                if (j + value_distance < keys.size())
+                    ahead[j % value_distance] = resolve(j + value_distance);
+
+                if (i < size())
+                    found(j, i);
+                else
+                    missing(j);
+            }
+        }
+
+        // Checks the `keys`, setting their bits in `found_mask` (which must be zeroed beforehand) and writing their indices to `out_indices`. Either can be null.
+        // The indices of invalid keys are unspecified. Returns the number of valid keys.
+        constexpr std::size_t check_keys_low(std::span<const key> keys, std::uint64_t *found_mask, std::size_t *out_indices) const noexcept
+        {
+            std::size_t j = 0;
+            std::size_t num_valid = 0;
+
+            #if DETAIL_EM_INDEXMAP_SIMD
+            if constexpr (index_storage::sparse_to_dense_stride != 0 && (sizeof(KeyType) == 4 || sizeof(KeyType) == 8) && !keeps_tombstones)
+            {
+                if (!std::is_constant_evaluated() && detail::IndexMap::Simd::HaveAvx2())
+                {
+                    detail::IndexMap::Simd::IndexTable table{indices.sparse_to_dense_bytes(), index_storage::sparse_to_dense_stride, indices.size(), size()};
+                    j = detail::IndexMap::Simd::CheckKeysAvx2<sizeof(KeyType)>(keys.data(), keys.size(), table, found_mask, out_indices, num_valid);
+                }
+            }
+            #endif
+
+            for (; j < keys.size(); j++)
+            {
+                if (contains(keys[j]))
+                {
+                    if (found_mask)
+                        found_mask[j / 64] |= std::uint64_t(1) << (j % 64);
+                    if (out_indices)
+                        out_indices[j] = key_to_index_unsafe(keys[j]);
+                    num_valid++;
+                }
+            }
+            return num_valid;
+        }
+
+        // Implements `apply()`. `buffers` is a range of `command_buffer &`.
+        constexpr std::size_t apply_low(auto &&buffers)
+        {
+            // Check all keys before changing anything.
+            scratch_vector<std::uint64_t> marks((size() + 63) / 64);
+            std::size_t num_erased = 0;
+            std::size_t num_emplaced = 0;
+            for (const command_buffer &buffer : buffers)
+            {
+                for (key k : buffer.assigned_keys)
+                    contains_or_throw(k);
+                for (key k : buffer.erased_keys)
+                {
+                    contains_or_throw(k);
+                    std::size_t i = key_to_index_unsafe(k);
+                    std::uint64_t bit = std::uint64_t(1) << (i % 64);
+                    if (!(marks[i / 64] & bit))
+                    {
+                        marks[i / 64] |= bit;
+                        num_erased++;
+                    }
+                }
+                num_emplaced += buffer.new_values.size();
+            }
+            if (num_emplaced > max_size() - (size() - num_erased))
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Index map would be too large."));
+
+            if constexpr (has_value_type)
+            {
+                for (command_buffer &buffer : buffers)
+                {
+                    for (std::size_t j = 0; j < buffer.assigned_keys.size(); j++)
+                    {
+                        value_storage[key_to_index_unsafe(buffer.assigned_keys[j])] = std::move(buffer.assigned_values[j]);
+                        if constexpr (tracks_changes)
+                            changes.modified(std::size_t(buffer.assigned_keys[j]));
+                    }
+                }
+            }
+
+            if (num_erased > 0)
+                erase_marked_low(marks, num_erased);
+
+            auto buffer_it = std::ranges::begin(buffers);
+            std::size_t j = 0;
+            std::size_t ret = bulk_insert_low(num_emplaced, [&]
+            {
+                while (j == (*buffer_it).new_values.size())
+                {
+                    ++buffer_it;
+                    j = 0;
+                }
+                if constexpr (has_value_type)
+                    value_storage.emplace_back(std::move((*buffer_it).new_values[j]));
+                else
+                    value_storage.emplace_back();
+                j++;
+            });
+
+            for (command_buffer &buffer : buffers)
+                buffer.clear();
+            return ret;
+        }
+
+        // Implements `reorder()`, without checking `order`.
+        constexpr void reorder_low(std::span<std::size_t> order)
+        {
+            std::size_t n = size();
+            if constexpr (!has_value_type || (std::is_nothrow_move_constructible_v<T> && std::is_nothrow_move_assignable_v<T>))
+            {
+                scratch_vector<KeyType> new_keys(n);
+                for (std::size_t j = 0; j < n; j++)
+                    new_keys[j] = indices.dense_to_sparse(order[j]);
+
+                if constexpr (has_value_type)
+                {
+                    // Follow each cycle of the permutation, so that each value is moved once (plus one extra move per cycle).
+                    // The processed indices are marked with `order[j] == j`.
+                    for (std::size_t i = 0; i < n; i++)
+                    {
+                        if (order[i] == i)
+                            continue;
+                        T first = std::move(value_storage[i]);
+                        std::size_t j = i;
+                        while (order[j] != i)
+                        {
+                            std::size_t source = order[j];
+                            value_storage[j] = std::move(value_storage[source]);
+                            order[j] = j;
+                            j = source;
+                        }
+                        value_storage[j] = std::move(first);
+                        order[j] = j;
+                    }
+                    if constexpr (collects_statistics)
+                    {
+                        // The values that didn't stay in place.
+                        for (std::size_t j = 0; j < n; j++)
+                            count_low(&statistics::moves, indices.dense_to_sparse(j) != new_keys[j]);
+                    }
+                }
+
+                for (std::size_t j = 0; j < n; j++)
+                {
+                    indices.dense_to_sparse(j) = new_keys[j];
+                    indices.sparse_to_dense(std::size_t(new_keys[j])) = KeyType(j);
+                }
+            }
+            else
+            {
+                // If moving can throw, swap the whole elements instead, so the keys always match the values.
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    std::size_t j = i;
+                    while (order[j] != i)
+                    {
+                        std::size_t source = order[j];
+                        swap_elems_low({*this, j}, {*this, source});
+                        order[j] = j;
+                        j = source;
+                    }
+                    order[j] = j;
+                }
+            }
+        }
+
+        // Implements `sort_by()` and `stable_sort_by()`. Calls `sort(first, last, less)` to sort a range of integers or pairs.
+        constexpr void sort_by_low(auto &proj, auto &comp, auto &&sort)
+        {
+            compact();
+            std::size_t n = size();
+            scratch_vector<std::size_t> order(n);
+            using sort_key = std::remove_cvref_t<std::invoke_result_t<decltype(proj), value_const_reference>>;
+            if constexpr (detail::IndexMap::CacheSortKey<sort_key>)
+            {
+                struct Entry
+                {
+                    sort_key key;
+                    std::size_t index;
+                };
+                scratch_vector<Entry> entries;
+                entries.reserve(n);
+                for (std::size_t i = 0; i < n; i++)
+                    entries.push_back({std::invoke(proj, std::as_const(value_storage[i])), i});
+                sort(entries.begin(), entries.end(), [&](const Entry &a, const Entry &b){return bool(std::invoke(comp, a.key, b.key));});
+                for (std::size_t j = 0; j < n; j++)
+                    order[j] = entries[j].index;
+            }
+            else
+            {
+                for (std::size_t i = 0; i < n; i++)
+                    order[i] = i;
+                sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+                {
+                    return bool(std::invoke(comp, std::invoke(proj, std::as_const(value_storage[a])), std::invoke(proj, std::as_const(value_storage[b]))));
+                });
+            }
+            reorder_low(order);
         }
 
       public:
         [[nodiscard]] IndexMap() = default;
-        [[nodiscard]] constexpr IndexMap(const Allocator &alloc) : indices(alloc), value_storage(alloc) {}
+        [[nodiscard]] constexpr IndexMap(const Allocator &alloc) : indices(alloc), value_storage(alloc), changes(alloc), free_key_order(alloc), tombstones(alloc) {}
 
         // How many values are currently inserted.
         [[nodiscard]] constexpr std::size_t size() const noexcept {return value_storage.size();}
@@ -538,8 +2976,8 @@ namespace em
         //   Here `relaxed` means including keys that used to be valid, got erased, but still have their data lingering behind.
 
         [[nodiscard]] constexpr bool contains           (key         k) const noexcept {return contains_relaxed(k) && valid_index(key_to_index_relaxed(k));}
-        [[nodiscard]] constexpr bool contains_relaxed   (key         k) const noexcept {return std::size_t(k) < indices.size();}
-        [[nodiscard]] constexpr bool valid_index        (std::size_t i) const noexcept {return i < size();}
+        [[nodiscard]] constexpr bool contains_relaxed   (key         k) const noexcept {return indices.contains(std::size_t(k));}
+        [[nodiscard]] constexpr bool valid_index        (std::size_t i) const noexcept {return i < size() && !tombstones.test(i);}
         [[nodiscard]] constexpr bool valid_index_relaxed(std::size_t i) const noexcept {return i < indices.size();}
 
         constexpr void contains_or_throw           (key         k) const {if (!contains           (k)) DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map key."));}
@@ -553,51 +2991,227 @@ namespace em
 
         [[nodiscard]] constexpr std::size_t key_to_index        (key         k) const          {contains_or_throw           (k); return key_to_index_unsafe(k);}
         [[nodiscard]] constexpr std::size_t key_to_index_relaxed(key         k) const          {contains_relaxed_or_throw   (k); return key_to_index_unsafe(k);}
-        [[nodiscard]] constexpr std::size_t key_to_index_unsafe (key         k) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(contains_relaxed(k)); return std::size_t(indices[std::size_t(k)].sparse_to_dense);}
+        [[nodiscard]] constexpr std::size_t key_to_index_unsafe (key         k) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(contains_relaxed(k)); return std::size_t(indices.sparse_to_dense(std::size_t(k)));}
         [[nodiscard]] constexpr key         index_to_key        (std::size_t i) const          {valid_index_or_throw        (i); return index_to_key_unsafe(i);}
         [[nodiscard]] constexpr key         index_to_key_relaxed(std::size_t i) const          {valid_index_relaxed_or_throw(i); return index_to_key_unsafe(i);}
-        [[nodiscard]] constexpr key         index_to_key_unsafe (std::size_t i) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(valid_index_relaxed(i)); return key(indices[i].dense_to_sparse);}
+        [[nodiscard]] constexpr key         index_to_key_unsafe (std::size_t i) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(valid_index_relaxed(i)); return key(indices.dense_to_sparse(i));}
+
+        // True if the index layout stores the keys of all indices in one array (`IndexLayout::separate` and `IndexLayout::paged`, but not `interleaved`).
+        static constexpr bool has_contiguous_keys = index_storage::contiguous_dense_to_sparse;
+        // The keys of all elements in index order, so `contiguous_keys()[i] == KeyType(index_to_key(i))`. The span is invalidated by any insertion or erasure.
+        [[nodiscard]] std::span<const KeyType> contiguous_keys() const noexcept requires has_contiguous_keys {return {indices.dense_to_sparse_data(), size()};}
+
+
+        // Element access:
+
+        // By key.
+        [[nodiscard]] constexpr value_reference       operator[](key k)       requires has_value_type {return value_storage[key_to_index(k)];}
+        [[nodiscard]] constexpr value_const_reference operator[](key k) const requires has_value_type {return value_storage[key_to_index(k)];}
+
+        // By index.
+        [[nodiscard]] constexpr value_reference       operator[](std::size_t i)       requires has_value_type {valid_index_or_throw(i); return value_storage[i];}
+        [[nodiscard]] constexpr value_const_reference operator[](std::size_t i) const requires has_value_type {valid_index_or_throw(i); return value_storage[i];}
+
+
+        // Batched lookup:
+        //   Those look up many keys at once, prefetching the index entries and the values ahead of time, to overlap the cache misses.
+        //   This helps when the keys are scattered and the map doesn't fit in the cache. Invalid keys don't throw.
+
+        // How many elements `lookup_many()` and `contains_many()` need in `found_mask` for `n` keys.
+        [[nodiscard]] static constexpr std::size_t lookup_mask_size(std::size_t n) noexcept {return (n + 63) / 64;}
+
+        // Writes the index of each of the `keys` to `out_indices`, which must have the same size. Invalid keys get `size()` instead.
+        // If `found_mask` is not empty, it must have at least `lookup_mask_size(keys.size())` elements,
+        //   and then bit `j % 64` of `found_mask[j / 64]` is set if `keys[j]` is valid, and cleared otherwise.
+        // Returns the number of valid keys.
+        constexpr std::size_t lookup_many(std::span<const key> keys, std::span<std::size_t> out_indices, std::span<std::uint64_t> found_mask = {}) const
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(out_indices.size() == keys.size());
+            DETAIL_EM_INDEXMAP_ASSERT(found_mask.empty() || found_mask.size() >= lookup_mask_size(keys.size()));
+            if (!found_mask.empty())
+                std::fill_n(found_mask.begin(), lookup_mask_size(keys.size()), std::uint64_t(0));
+
+            std::size_t num_found = 0;
+            lookup_many_low(keys,
+                [&](std::size_t j, std::size_t i)
+                {
+                    out_indices[j] = i;
+                    if (!found_mask.empty())
+                        found_mask[j / 64] |= std::uint64_t(1) << (j % 64);
+                    num_found++;
+                },
+                [&](std::size_t j)
+                {
+                    out_indices[j] = size();
+                }
+            );
+            return num_found;
+        }
+
+        // Calls `func(elem)` for each valid key in `keys`, in order, where `elem` is a `key_value_reference` (or `key_value_const_reference`).
+        // Invalid keys are skipped. `func` must not insert or erase elements. Returns the number of valid keys.
+        constexpr std::size_t for_each_key(std::span<const key> keys, auto &&func)
+        {
+            std::size_t num_found = 0;
+            lookup_many_low(keys, [&](std::size_t, std::size_t i){std::invoke(func, key_value_reference(*this, i)); num_found++;}, [](std::size_t){});
+            return num_found;
+        }
+        constexpr std::size_t for_each_key(std::span<const key> keys, auto &&func) const
+        {
+            std::size_t num_found = 0;
+            lookup_many_low(keys, [&](std::size_t, std::size_t i){std::invoke(func, key_value_const_reference(*this, i)); num_found++;}, [](std::size_t){});
+            return num_found;
+        }
+
+
+        // Batched key checks:
+        //   Those don't prefetch, and don't touch the values. Instead they check several keys at once using AVX2 gathers, if the CPU supports them (checked at runtime).
+        //   That works with 32-bit and 64-bit keys, and not with `IndexLayout::paged`. Otherwise (or if `DETAIL_EM_INDEXMAP_SIMD` is defined to 0) they check one key at a time.
+
+        // Sets bit `j % 64` of `found_mask[j / 64]` if `keys[j]` is valid, and clears it otherwise. `found_mask` must have at least `lookup_mask_size(keys.size())` elements.
+        // Returns the number of valid keys.
+        constexpr std::size_t contains_many(std::span<const key> keys, std::span<std::uint64_t> found_mask) const noexcept
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(found_mask.size() >= lookup_mask_size(keys.size()));
+            std::fill_n(found_mask.begin(), lookup_mask_size(keys.size()), std::uint64_t(0));
+            return check_keys_low(keys, found_mask.data(), nullptr);
+        }
+        // Writes the index of each of the `keys` to `out_indices`, which must have the same size.
+        // Throws if any key is invalid, and then the contents of `out_indices` are unspecified.
+        constexpr void keys_to_indices(std::span<const key> keys, std::span<std::size_t> out_indices) const
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(out_indices.size() == keys.size());
+            if (check_keys_low(keys, nullptr, out_indices.data()) != keys.size())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map key."));
+        }
+
+
+        // Insertion:
+
+        [[nodiscard]] constexpr insert_result emplace(auto &&... params                             ) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(decltype(params)(params)...));}
+        [[nodiscard]] constexpr insert_result insert (const detail::IndexMap::VoidToEmpty<T>  &value) requires std::is_copy_constructible_v<T>                                   {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(          value            ));}
+        [[nodiscard]] constexpr insert_result insert (      detail::IndexMap::VoidToEmpty<T> &&value) requires std::is_move_constructible_v<T>                                   {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(std::move(value)           ));}
+
+        // This forces a specific key for the new element. Throws if the key is already is use.
+        // Throws if `prepare_keys_for_insertion` wasn't called with at least `std::size_t(k) + 1` before (not needed with `IndexLayout::paged`).
+        // If this throws, the map is unchanged.
+        [[nodiscard]] constexpr insert_result emplace_at(key k, auto &&... params                             ) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value {return force_key_for_inserted_value(k, value_storage.emplace_back(decltype(params)(params)...));}
+                      constexpr insert_result insert_at (key k, const detail::IndexMap::VoidToEmpty<T>  &value) requires std::is_copy_constructible_v<T>                                   {return force_key_for_inserted_value(k, value_storage.emplace_back(          value            ));}
+                      constexpr insert_result insert_at (key k,       detail::IndexMap::VoidToEmpty<T> &&value) requires std::is_move_constructible_v<T>                                   {return force_key_for_inserted_value(k, value_storage.emplace_back(std::move(value)           ));}
+
+        // Bulk insertion:
+        //   Those insert all elements at once, reserving the memory once. The free keys are reused first, then the new keys are created.
+        //   The new elements end up at indices `[i, size())`, where `i` is the returned index, so `index_to_key()` gives you their keys.
+        //   If anything throws, the map is left unchanged (except for the capacity).
+
+        // Inserts `n` elements, each constructed from `params...`. The parameters are not forwarded, since they are reused for every element.
+        constexpr std::size_t emplace_n(std::size_t n, const auto &... params) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value
+        {
+            return bulk_insert_low(n, [&]{value_storage.emplace_back(params...);});
+        }
+
+        // Inserts all elements of a range.
+        template <std::ranges::input_range R>
+        requires has_value_type && std::is_constructible_v<T, std::ranges::range_reference_t<R>>
+        constexpr std::size_t insert_range(R &&range)
+        {
+            if constexpr (std::ranges::forward_range<R>)
+            {
+                auto it = std::ranges::begin(range);
+                return bulk_insert_low(std::size_t(std::ranges::distance(range)), [&]{value_storage.emplace_back(*it); ++it;});
+            }
+            else
+            {
+                // Don't know the size in advance, so insert one by one, and only then add the keys.
+                BulkInsertGuard guard{this};
+                for (auto &&elem : range)
+                {
+                    can_increase_size_or_throw();
+                    value_storage.emplace_back(decltype(elem)(elem));
+                }
+                guard.prepare_keys(size());
+                select_free_keys_low(guard.old_size, size() - guard.old_size);
+                guard.self = nullptr;
+                note_inserted_low(guard.old_size);
+                return guard.old_size;
+            }
+        }
+        // Same, but writes the keys of the new elements to `out`, and returns the updated iterator.
+        template <std::ranges::input_range R, std::output_iterator<key> O>
+        requires has_value_type && std::is_constructible_v<T, std::ranges::range_reference_t<R>>
+        constexpr O insert_range(R &&range, O out)
+        {
+            for (std::size_t i = insert_range(std::forward<R>(range)); i < size(); i++)
+                *out++ = index_to_key_unsafe(i);
+            return out;
+        }
+
+        // Increase `keys_size()` to `n` (plus `retired_keys_size()`, if any).
+        // Can help with performance or if you're preparing to `insert_at()`/`emplace_at()`.
+        constexpr void prepare_keys_for_insertion(std::size_t n)
+        {
+            if (free_keys_end() >= n)
+                return;
+            if (n > max_size() - retired_keys_size())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Index map would be too large."));
+            std::size_t old_keys_size = indices.size();
+            std::size_t old_free_keys_end = free_keys_end();
+            reserve_key_bookkeeping_low(n + retired_keys_size());
+            indices.grow(n + retired_keys_size());
+            move_new_keys_before_retired(old_keys_size);
+            add_new_free_keys_low(old_free_keys_end);
+            update_statistics_low();
+        }
 
 
-        // Element access:
+        // Deferred commands:
+        //   Record insertions, erasures and assignments into `command_buffer`s (e.g. one per thread), then apply them all at once at a sync point.
 
-        // By key.
-        [[nodiscard]] constexpr value_reference       operator[](key k)       requires has_value_type {return value_storage[key_to_index(k)];}
-        [[nodiscard]] constexpr value_const_reference operator[](key k) const requires has_value_type {return value_storage[key_to_index(k)];}
+        using command_buffer = detail::IndexMap::CommandBuffer<IndexMap, Allocator>;
 
-        // By index.
-        [[nodiscard]] constexpr value_reference       operator[](std::size_t i)       requires has_value_type {valid_index_or_throw(i); return value_storage[i];}
-        [[nodiscard]] constexpr value_const_reference operator[](std::size_t i) const requires has_value_type {valid_index_or_throw(i); return value_storage[i];}
+        // Applies the commands from all `buffers`, in the order they are passed in, then clears the buffers. Returns the index of the first new element.
+        // First the assignments are performed (a later one to the same key wins), then the erasures, then the insertions.
+        //   Erasing the same key several times is allowed. All erasures are done in one pass, moving each remaining element at most once.
+        //   All insertions are done at once, reserving memory once. The new elements are at `[i, size())`, in the order they were recorded in, where `i` is the returned index.
+        // Throws if any erased or assigned key is invalid, and then nothing is changed.
+        //   If an assignment or an insertion throws, the assignments before it (and the erasures, if the insertion throws) remain applied.
+        constexpr std::size_t apply(std::span<command_buffer> buffers)
+        {
+            return apply_low(buffers);
+        }
+        constexpr std::size_t apply(std::same_as<command_buffer> auto &... buffers)
+        {
+            std::array<command_buffer *, sizeof...(buffers)> pointers{&buffers...};
+            return apply_low(pointers | std::views::transform([](command_buffer *buffer) -> command_buffer & {return *buffer;}));
+        }
 
 
-        // Insertion:
+        // Concurrent key reservation:
+        //   Lets many threads get keys for new elements at once, while the elements themselves are inserted later, by one thread.
+        //   The map must not be modified while the keys are being reserved, since the reserver reads the key tables.
 
-        [[nodiscard]] constexpr insert_result emplace(auto &&... params                             ) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(decltype(params)(params)...));}
-        [[nodiscard]] constexpr insert_result insert (const detail::IndexMap::VoidToEmpty<T>  &value) requires std::is_copy_constructible_v<T>                                   {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(          value            ));}
-        [[nodiscard]] constexpr insert_result insert (      detail::IndexMap::VoidToEmpty<T> &&value) requires std::is_move_constructible_v<T>                                   {can_increase_size_or_throw(); return add_key_for_inserted_value(value_storage.emplace_back(std::move(value)           ));}
+        using key_reserver = detail::IndexMap::KeyReserver<IndexMap>;
 
-        // This forces a specific key for the new element. Throws if the key is already is use.
-        // Throws if `prepare_keys_for_insertion` wasn't called with at least `std::size_t(k) + 1` before.
-        [[nodiscard]] constexpr insert_result emplace_at(key k, auto &&... params                             ) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value {return force_key_for_inserted_value(k, value_storage.emplace_back(decltype(params)(params)...));}
-                      constexpr insert_result insert_at (key k, const detail::IndexMap::VoidToEmpty<T>  &value) requires std::is_copy_constructible_v<T>                                   {return force_key_for_inserted_value(k, value_storage.emplace_back(          value            ));}
-                      constexpr insert_result insert_at (key k,       detail::IndexMap::VoidToEmpty<T> &&value) requires std::is_move_constructible_v<T>                                   {return force_key_for_inserted_value(k, value_storage.emplace_back(std::move(value)           ));}
+        // Prepares `n` free keys, and returns an object that hands them out with `.reserve()`, which can be called from many threads at once.
+        // Then either call `commit_reserved_keys()` to insert elements for all reserved keys at once,
+        //   or insert them one by one with `insert_at()`/`emplace_at()`. The keys that weren't reserved stay free.
+        [[nodiscard]] key_reserver make_key_reserver(std::size_t n)
+        {
+            can_increase_size_by_or_throw(n);
+            prepare_keys_for_insertion(size() + n);
+            select_free_keys_low(size(), n);
+            return key_reserver(*this, n);
+        }
 
-        // Increase `keys_size()` to `n`.
-        // Can help with performance or if you're preparing to `insert_at()`/`emplace_at()`.
-        constexpr void prepare_keys_for_insertion(std::size_t n)
+        // Inserts an element for each key reserved with `reserver`, each constructed from `params...`. Returns the index of the first new element.
+        // The new elements end up in the same order as the keys were reserved in. The map must not have been modified since `make_key_reserver()`.
+        // `reserver` can't be used after this. If this throws, the map is left unchanged, and the keys are free again.
+        std::size_t commit_reserved_keys(key_reserver &reserver, const auto &... params) requires detail::IndexMap::is_constructible<T, decltype(params)...>::value
         {
-            std::size_t i = indices.size();
-            if (i >= n)
-                return;
-            if (n > max_size())
-                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Index map would be too large."));
-            indices.resize(n);
-            for (; i < n; i++)
-            {
-                IndexEntry &e = indices[i];
-                e.sparse_to_dense = KeyType(i);
-                e.dense_to_sparse = KeyType(i);
-            }
+            DETAIL_EM_INDEXMAP_ASSERT(reserver.this_map == this && reserver.first_index == size() && "The map was modified after the keys were reserved.");
+            std::size_t n = reserver.size();
+            reserver.this_map = nullptr;
+            return bulk_insert_low(n, [&]{value_storage.emplace_back(params...);});
         }
 
 
@@ -607,70 +3221,735 @@ namespace em
         constexpr void erase(key k)
         {
             contains_or_throw(k);
-            move_elem_low({*this, value_storage.size() - 1}, {*this, k});
-            value_storage.pop_back();
+            erase_low(key_to_index_unsafe(k));
         }
         // Erase by index. Throws if the index is invalid.
         constexpr void erase(std::size_t i)
         {
             valid_index_or_throw(i);
-            move_elem_low({*this, value_storage.size() - 1}, {*this, i});
-            value_storage.pop_back();
+            erase_low(i);
+        }
+        // Erase by handle. Throws if the handle is stale or invalid.
+        constexpr void erase(handle h) requires has_generations
+        {
+            erase(handle_to_index_or_throw(h));
+        }
+
+        // Erase several elements by keys. This is faster than erasing them one by one, since every remaining element is moved at most once.
+        // Throws if any of the keys is invalid or repeated. In that case nothing is erased.
+        constexpr void erase_keys(std::span<const key> keys)
+        {
+            // For large batches, marking the elements in a bit mask is cheaper than sorting the indices.
+            if (keys.size() >= size() / 1024)
+            {
+                scratch_vector<std::uint64_t> marks((size() + 63) / 64);
+                for (key k : keys)
+                {
+                    contains_or_throw(k);
+                    std::size_t i = key_to_index_unsafe(k);
+                    std::uint64_t bit = std::uint64_t(1) << (i % 64);
+                    if (marks[i / 64] & bit)
+                        DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Duplicate index map key."));
+                    marks[i / 64] |= bit;
+                }
+                erase_marked_low(marks, keys.size());
+                return;
+            }
+
+            scratch_vector<std::size_t> targets;
+            targets.reserve(keys.size());
+            for (key k : keys)
+            {
+                contains_or_throw(k);
+                targets.push_back(key_to_index_unsafe(k));
+            }
+            std::ranges::sort(targets);
+            if (std::ranges::adjacent_find(targets) != targets.end())
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Duplicate index map key."));
+            erase_sorted_indices_low(targets);
+        }
+
+        // Erase all elements for which `pred(i)` returns true, where `i` is the element index. Returns the number of erased elements.
+        // `pred` is called once for each element, in an unspecified order. Each remaining element is moved at most once.
+        // If `keep_order` is true, the remaining elements keep their relative order, but more of them have to be moved.
+        // If `pred` throws, the elements that weren't checked yet are kept.
+        // `em::erase_if()` uses this, usually it's more convenient.
+        // With `ErasePolicy::tombstones`, the order is always kept, and no elements are moved (unless this triggers `compact()`).
+        constexpr std::size_t erase_if_index(auto &&pred, bool keep_order = false)
+        {
+            if constexpr (keeps_tombstones)
+                return erase_if_index_tombstones_low(pred);
+            else if (keep_order)
+                return erase_if_index_ordered_low(pred);
+            else
+                return erase_if_index_unordered_low(pred);
+        }
+
+        // Erases the elements whose bits are set in `marks`: bit `i % 64` of `marks[i / 64]` for index `i`. Returns the number of erased elements.
+        // `marks` must have at least `(size() + 63) / 64` elements, the bits past `size()` are ignored.
+        // If `keep_order` is true, the remaining elements keep their relative order, but more of them have to be moved.
+        // This is useful when the elements to erase are selected in parallel, see `em::erase_if()` with a policy in `em/index_map_parallel.h`.
+        constexpr std::size_t erase_marked_indices(std::span<const std::uint64_t> marks, bool keep_order = false)
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(marks.size() >= (size() + 63) / 64);
+            auto is_marked = [&](std::size_t i){return bool(marks[i / 64] >> (i % 64) & 1);};
+            if constexpr (keeps_tombstones)
+                return erase_if_index_tombstones_low(is_marked); // This skips the existing tombstones.
+            else if (keep_order)
+                return erase_if_index_ordered_low(is_marked);
+
+            std::size_t count = 0;
+            for (std::size_t word_index = 0; word_index * 64 < size(); word_index++)
+            {
+                std::uint64_t word = marks[word_index];
+                if (std::size_t end = size() - word_index * 64; end < 64)
+                    word &= (std::uint64_t(1) << end) - 1;
+                count += std::size_t(std::popcount(word));
+            }
+            if (count > 0)
+                erase_marked_low(marks, count);
+            return count;
+        }
+
+        // Tombstones:
+        //   Only with `ErasePolicy::tombstones` (see `IndexMapOptions::erase_policy`), otherwise there are none.
+        //   Those are the erased elements that are still in `values()`, to keep the other elements in place.
+
+        // How many elements are tombstones. They count towards `size()`.
+        [[nodiscard]] constexpr std::size_t tombstones_size() const noexcept {return tombstones.size();}
+        // Whether the element at index `i` (which must be less than `size()`) is a tombstone.
+        [[nodiscard]] constexpr bool is_tombstone(std::size_t i) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(i < size()); return tombstones.test(i);}
+
+        // Returns the first index at or after `i` (which must be at most `size()`) that isn't a tombstone, or `size()` if there's none.
+        [[nodiscard]] constexpr std::size_t next_live_index(std::size_t i) const noexcept {DETAIL_EM_INDEXMAP_ASSERT(i <= size()); return tombstones.find(false, i, size());}
+
+        // Calls `func(i)` for the index of each element that isn't a tombstone, in order. Skips the tombstones 64 at a time.
+        // `func` must not modify the map.
+        constexpr void for_each_live_index(auto &&func) const
+        {
+            std::size_t n = size();
+            for (std::size_t i = tombstones.find(false, 0, n); i < n; i = tombstones.find(false, i, n))
+            {
+                std::size_t run_end = tombstones.find(true, i, n);
+                for (; i < run_end; i++)
+                    func(std::as_const(i));
+            }
+        }
+
+        // Removes all tombstones, shifting the other elements down to close the gaps. They keep their order, and each of them is moved at most once.
+        // `ErasePolicy::tombstones` can also call this automatically after erasures. Does nothing if there are no tombstones.
+        constexpr void compact() noexcept(has_value_type <= std::is_nothrow_move_assignable_v<T>)
+        {
+            if constexpr (keeps_tombstones)
+            {
+                if (tombstones.size() == 0)
+                    return;
+                std::size_t n = size();
+                // `[0, write)` are the elements in their final places, and `[write, read)` are the tombstones.
+                std::size_t write = tombstones.find(true, 0, n);
+                std::size_t read = write;
+                while ((read = tombstones.find(false, read, n)) < n)
+                {
+                    std::size_t run_end = tombstones.find(true, read, n);
+                    for (; read < run_end; read++, write++)
+                    {
+                        move_elem_low({*this, read}, {*this, write});
+                        // The key of the tombstone was moved to `read`.
+                        tombstones.reset(write);
+                        tombstones.set(read);
+                    }
+                }
+                pop_erased_values_low(write);
+            }
         }
 
         // Reduces `keys_size()` by one if possible and returns true. Returns false if not possible.
         // This is the opposite of `prepare_keys_for_insertion()`.
         // This by itself doesn't free any memory, but you can then call `keys_shrink_to_fit()` to free it.
+        //   (Except with `IndexLayout::paged`, where this can remove any unused key, and frees the pages that become empty.)
         // You can call this as `while (remove_unused_key()) {}` after every erasure to always remove all unused keys. Or less iterations, or whenever you want.
-        constexpr bool remove_unused_key() noexcept
+        // Not available with the generations, since it would forget the generation of the removed key, and the stale handles could then match it.
+        constexpr bool remove_unused_key() noexcept requires (!has_generations)
         {
-            if (indices.empty())
+            if (indices.size() == size())
                 return false;
-            std::size_t i = std::size_t(indices.back().sparse_to_dense);
-            if (i < size())
-                return false;
-            swap_indices_only_relaxed({*this, i}, {*this, indices.size() - 1});
-            indices.pop_back();
+            if constexpr (index_storage::dense_keys)
+            {
+                // Can only remove the largest key.
+                std::size_t i = std::size_t(indices.sparse_to_dense(indices.size() - 1));
+                if (i < size())
+                    return false;
+                swap_indices_only_relaxed({*this, i}, {*this, indices.size() - 1});
+            }
+            if constexpr (orders_free_keys)
+                free_key_order.remove(std::size_t(indices.dense_to_sparse(indices.size() - 1)));
+            indices.shrink(indices.size() - 1);
             return true;
         }
 
+        // The fraction of keys that are unused, from 0 to 1. This is `1 - size() / keys_size()`, or 0 if there are no keys.
+        // With the dense index layouts the key tables are as large as the largest key, so when this is high, `compact_keys()` can free a lot of memory.
+        [[nodiscard]] constexpr double key_fragmentation() const noexcept
+        {
+            return keys_size() == 0 ? 0 : 1 - double(size()) / double(keys_size());
+        }
+
+        // Renumbers the keys so that the element at index `i` gets key `i`, then removes all other keys, and frees the memory they used.
+        // This invalidates all keys! `remap(old_key, new_key)` is called for each element whose key changes, before anything is changed, so you can patch your references.
+        //   If `remap` throws, the map is unchanged.
+        // The persistent data moves along with the keys (so its address changes), and the persistent data of the unused keys is lost.
+        // With `IndexMapOptions::track_changes`, this counts as erasing the old keys and inserting the new ones. Calls `compact()` first.
+        // Not available with the generations, since the stale handles could then match the renumbered elements.
+        constexpr void compact_keys(auto &&remap) requires (!has_generations) && (!has_persistent_data_type || std::is_nothrow_swappable_v<PersistentData>)
+        {
+            compact();
+            std::size_t n = size();
+
+            // If this throws, remove the keys we've added.
+            struct Guard
+            {
+                IndexMap *self;
+                std::size_t old_keys_size = self->indices.size();
+                constexpr ~Guard()
+                {
+                    if (self)
+                        self->indices.shrink(old_keys_size);
+                }
+            };
+            Guard guard{this};
+            if constexpr (!index_storage::dense_keys)
+            {
+                // Make sure that the keys below `n` exist. With the dense layouts they already do.
+                reserve_key_bookkeeping_low(n);
+                for (std::size_t k = 0; k < n; k++)
+                {
+                    if (!indices.contains(k))
+                        indices.add_key(k);
+                }
+            }
+            for (std::size_t i = 0; i < n; i++)
+            {
+                key old_key = index_to_key_unsafe(i);
+                if (std::size_t(old_key) != i)
+                    std::invoke(remap, std::as_const(old_key), key(i));
+            }
+            guard.self = nullptr;
+
+            if constexpr (tracks_changes)
+            {
+                // All erasures first, since each key is assumed to be absent before its first insertion.
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    if (std::size_t k = std::size_t(indices.dense_to_sparse(i)); k != i)
+                        changes.erased(k);
+                }
+                for (std::size_t i = 0; i < n; i++)
+                {
+                    if (std::size_t(indices.dense_to_sparse(i)) != i)
+                        changes.inserted(i);
+                }
+            }
+
+            // Key `i` belongs to the element at index `i` or later (or is free), since the smaller keys are already taken. Swap it with the current key of element `i`.
+            for (std::size_t i = 0; i < n; i++)
+            {
+                std::size_t k = std::size_t(indices.dense_to_sparse(i));
+                if (k == i)
+                    continue;
+                swap_indices_only_relaxed({*this, key(k)}, {*this, key(i)});
+                if constexpr (has_persistent_data_type)
+                    std::ranges::swap(indices.sparse_data(k), indices.sparse_data(i));
+            }
+
+            // Now the unused keys are exactly the ones after `n`.
+            indices.shrink(n);
+            indices.shrink_to_fit();
+            if constexpr (orders_free_keys)
+                free_key_order.clear();
+            update_statistics_low();
+        }
+        constexpr void compact_keys() requires (!has_generations) && (!has_persistent_data_type || std::is_nothrow_swappable_v<PersistentData>)
+        {
+            compact_keys([](key, key){});
+        }
+
         // Clear everything, including persistent data. But keep allocated memory.
-        constexpr void clear() noexcept {value_storage.clear(); indices.clear();}
+        // This also resets the generations, so old handles can start matching new elements. Use `soft_clear()` to avoid that.
+        // With `IndexMapOptions::track_changes`, this counts as erasing all elements.
+        constexpr void clear() noexcept
+        {
+            // The tombstones were already counted as erased.
+            count_low(&statistics::erases, size() - tombstones.size());
+            if constexpr (tracks_changes)
+            {
+                for_each_live_index([&](std::size_t i){changes.erased(std::size_t(indices.dense_to_sparse(i)));});
+            }
+            if constexpr (keeps_tombstones)
+                tombstones.clear();
+            value_storage.clear();
+            indices.clear();
+            if constexpr (retires_keys)
+                retired_keys.clear();
+            if constexpr (orders_free_keys)
+                free_key_order.clear();
+        }
         // Clear values, but keep the keys and persistent data (i.e. `keys_size()` is preserved).
-        constexpr void soft_clear() noexcept {value_storage.clear();}
+        // This counts as erasing the elements, so their generations are incremented.
+        constexpr void soft_clear() noexcept {pop_erased_values_low(0);}
 
 
         // Persistent data:
 
         // Returns the persistent data by key. The key must pass `contains_relaxed(k)`, in other words be less than `keys_size()`.
-        [[nodiscard]] constexpr persistent_data_reference       get_persistent_data(key k)       requires has_persistent_data_type {contains_relaxed_or_throw(k); return indices[std::size_t(k)].sparse_data;}
-        [[nodiscard]] constexpr persistent_data_const_reference get_persistent_data(key k) const requires has_persistent_data_type {contains_relaxed_or_throw(k); return indices[std::size_t(k)].sparse_data;}
+        [[nodiscard]] constexpr persistent_data_reference       get_persistent_data(key k)       requires has_persistent_data_type {contains_relaxed_or_throw(k); return persistent_data_low(std::size_t(k));}
+        [[nodiscard]] constexpr persistent_data_const_reference get_persistent_data(key k) const requires has_persistent_data_type {contains_relaxed_or_throw(k); return persistent_data_low(std::size_t(k));}
         // Returns the persistent data by index. The index must pass `valid_index(i)`. You can't access data of freed keys using this, only by key.
         [[nodiscard]] constexpr persistent_data_reference       get_persistent_data(std::size_t i)       requires has_persistent_data_type {return get_persistent_data(index_to_key(i));}
         [[nodiscard]] constexpr persistent_data_const_reference get_persistent_data(std::size_t i) const requires has_persistent_data_type {return get_persistent_data(index_to_key(i));}
 
 
+        // Generational handles:
+        //   Only if `IndexMapOptions::generation_type` is set. Each key then has a generation counter, which is incremented when the key is erased.
+        //   A handle combines a key with its generation, so a handle stops matching once its element is erased, even if the key gets reused.
+        //   Checking a handle reads the generation and the index of its key, which are next to each other with `IndexLayout::interleaved`.
+
+        // Returns true if the handle points to an existing element.
+        [[nodiscard]] constexpr bool contains(handle h) const noexcept requires has_generations {return handle_to_index_low(h) < size();}
+        constexpr void contains_or_throw(handle h) const requires has_generations {(void)handle_to_index_or_throw(h);}
+
+        // Returns the value by handle. Throws if the handle is stale or invalid.
+        [[nodiscard]] constexpr value_reference       get(handle h)       requires has_generations && has_value_type {return value_storage[handle_to_index_or_throw(h)];}
+        [[nodiscard]] constexpr value_const_reference get(handle h) const requires has_generations && has_value_type {return value_storage[handle_to_index_or_throw(h)];}
+        // Returns a pointer to the value by handle, or null if the handle is stale or invalid.
+        [[nodiscard]] constexpr       T *try_get(handle h)       noexcept requires has_generations && has_value_type {std::size_t i = handle_to_index_low(h); return i < size() ? &value_storage[i] : nullptr;}
+        [[nodiscard]] constexpr const T *try_get(handle h) const noexcept requires has_generations && has_value_type {std::size_t i = handle_to_index_low(h); return i < size() ? &value_storage[i] : nullptr;}
+
+        // Converting between handles, keys and indices. The ones accepting a handle throw if it's stale or invalid.
+        [[nodiscard]] constexpr handle      key_to_handle           (key    k) const requires has_generations {contains_or_throw(k); return make_handle_low(k);}
+        [[nodiscard]] constexpr handle      index_to_handle         (std::size_t i) const requires has_generations {return make_handle_low(index_to_key(i));}
+        [[nodiscard]] constexpr std::size_t handle_to_index_or_throw(handle h) const requires has_generations
+        {
+            std::size_t i = handle_to_index_low(h);
+            if (i >= size())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Stale or invalid index map handle."));
+            return i;
+        }
+        // Those just unpack the handle, without checking anything.
+        [[nodiscard]] static constexpr key             handle_to_key       (handle h) noexcept requires has_generations {return key(KeyType(std::underlying_type_t<handle>(h)));}
+        [[nodiscard]] static constexpr generation_type handle_to_generation(handle h) noexcept requires has_generations {return generation_type(std::underlying_type_t<handle>(h) >> (sizeof(KeyType) * 8));}
+
+        // The current generation of a key. The key must pass `contains_relaxed(k)`.
+        [[nodiscard]] constexpr generation_type get_generation(key k) const requires has_generations {contains_relaxed_or_throw(k); return generation_low(std::size_t(k));}
+
+        // How many keys were retired with `GenerationOverflow::retire`. They count towards `keys_size()`, but are never reused.
+        [[nodiscard]] constexpr std::size_t retired_keys_size() const noexcept
+        {
+            if constexpr (retires_keys)
+                return retired_keys.size();
+            else
+                return 0;
+        }
+
+
         // Memory management:
 
         [[nodiscard]] constexpr std::size_t keys_size() const noexcept {return indices.size();}
         [[nodiscard]] constexpr std::size_t keys_capacity() const noexcept {return indices.capacity();}
-        constexpr void keys_reserve(std::size_t n) {DETAIL_EM_INDEXMAP_ASSERT(n <= max_size()); indices.reserve(n);}
-        constexpr void keys_shrink_to_fit() noexcept {indices.shrink_to_fit();}
+        constexpr void keys_reserve(std::size_t n) {DETAIL_EM_INDEXMAP_ASSERT(n <= max_size()); indices.reserve(n); update_statistics_low();}
+        constexpr void keys_shrink_to_fit() noexcept {indices.shrink_to_fit(); update_statistics_low();}
 
         // There's no `values_size()` because that's just `size()`.
         [[nodiscard]] constexpr std::size_t values_capacity() const noexcept {return value_storage.capacity();}
-        constexpr void values_reserve(std::size_t n) {DETAIL_EM_INDEXMAP_ASSERT(n <= max_size()); value_storage.reserve(n);}
-        constexpr void values_shrink_to_fit() noexcept {value_storage.shrink_to_fit();}
+        constexpr void values_reserve(std::size_t n) {DETAIL_EM_INDEXMAP_ASSERT(n <= max_size()); value_storage.reserve(n); update_statistics_low();}
+        constexpr void values_shrink_to_fit() noexcept {value_storage.shrink_to_fit(); update_statistics_low();}
+
+        // The bytes allocated for the keys, the values, and the extra bookkeeping. Not counting `sizeof(IndexMap)` itself.
+        [[nodiscard]] constexpr memory_usage_info memory_usage() const noexcept
+        {
+            memory_usage_info ret;
+            ret.keys = indices.memory_usage();
+            if constexpr (has_value_type)
+                ret.values = value_storage.capacity() * sizeof(T);
+            ret.bookkeeping = changes.memory_usage() + free_key_order.memory_usage() + tombstones.memory_usage();
+            return ret;
+        }
+
+        // The operation counters, see `IndexMapOptions::collect_statistics`.
+        [[nodiscard]] constexpr const statistics &get_statistics() const noexcept requires collects_statistics {return stats.counters;}
+        // Zeroes the counters. The peak sizes restart from the current sizes.
+        constexpr void reset_statistics() noexcept requires collects_statistics
+        {
+            stats.counters = {};
+            update_statistics_low();
+            stats.counters.keys_reallocations = 0;
+            stats.counters.values_reallocations = 0;
+        }
 
 
         // Changing element indices:
 
         // Swap the indices of two elements. Like `std::swap(m[i], m[j])`, but also swaps their keys.
-        constexpr void swap_elems(std::size_t i, std::size_t j) noexcept(has_value_type <= std::is_nothrow_swappable_v<T>) {swap_elems_low({*this, i}, {*this, j});}
+        // With `ErasePolicy::tombstones`, throws if either index is a tombstone, since the tombstones can't be moved.
+        constexpr void swap_elems(std::size_t i, std::size_t j) noexcept(!keeps_tombstones && has_value_type <= std::is_nothrow_swappable_v<T>)
+        {
+            not_tombstones_or_throw(i, j);
+            DETAIL_EM_INDEXMAP_ASSERT(valid_index(i) && valid_index(j));
+            swap_elems_low({*this, i}, {*this, j});
+        }
         // Move the element at index `from_i` to `to_i`. Like `m[to_i] = std::move(m[from_i])`, but also swaps their keys.
         // Remember that classes typically don't support self-move-assignment, and we don't work around that in any way,
         //   so moving to the same index can break the element value (put it into valid but unspecified state).
-        constexpr void move_elem(std::size_t from_i, std::size_t to_i) noexcept(has_value_type <= std::is_nothrow_move_assignable_v<T>) {move_elem_low({*this, from_i}, {*this, to_i});}
+        // With `IndexMapOptions::track_changes`, the key that was at `to_i` is marked as modified, since its value is now moved-from.
+        // With `ErasePolicy::tombstones`, throws if either index is a tombstone, same as `swap_elems()`.
+        constexpr void move_elem(std::size_t from_i, std::size_t to_i) noexcept(!keeps_tombstones && has_value_type <= std::is_nothrow_move_assignable_v<T>)
+        {
+            not_tombstones_or_throw(from_i, to_i);
+            DETAIL_EM_INDEXMAP_ASSERT(valid_index(from_i) && valid_index(to_i));
+            KeyAndIndex to{*this, to_i};
+            move_elem_low({*this, from_i}, to);
+            if constexpr (tracks_changes)
+                changes.modified(std::size_t(to.k));
+        }
+
+        // Moves the element at index `order[j]` to index `j`, for each `j`. The keys move along with the values.
+        // `order` must be a permutation of `[0, size())`, otherwise throws `std::invalid_argument` and changes nothing. The contents of `order` are destroyed.
+        // Each value is moved once (plus one extra move per cycle of the permutation), and the key tables are rebuilt in one pass.
+        // If moving `T` can throw, this falls back to swapping the elements, and if that throws, the elements are left in an unspecified order.
+        // Calls `compact()` first, so with tombstones `order` must use the indices after compacting.
+        constexpr void reorder(std::span<std::size_t> order)
+        {
+            compact();
+            if (order.size() != size())
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid index map permutation."));
+            scratch_vector<std::uint64_t> seen((size() + 63) / 64);
+            for (std::size_t i : order)
+            {
+                std::uint64_t bit = std::uint64_t(1) << (i % 64);
+                if (i >= size() || (seen[i / 64] & bit))
+                    DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid index map permutation."));
+                seen[i / 64] |= bit;
+            }
+            reorder_low(order);
+        }
+
+
+        // Sorting:
+        //   Those sort the elements by `proj(value)` using `comp`, the keys move along with the values.
+        //   This sorts an array of (sort key, index) pairs, then moves each value once and rebuilds the key tables in one pass (see `reorder()`),
+        //   which is much faster than swapping the elements into place with `swap_elems()`, since each swap also updates four key table entries.
+        //   If `proj` returns something larger than 16 bytes or not trivially copyable, only the indices are sorted, and `proj` is called on each comparison.
+        //   `em/index_map_parallel.h` has versions taking an execution policy.
+
+        template <typename Proj = std::identity, typename Comp = std::ranges::less>
+        requires has_value_type && std::indirect_strict_weak_order<Comp, std::projected<const T *, Proj>>
+        constexpr void sort_by(Proj proj = {}, Comp comp = {})
+        {
+            sort_by_low(proj, comp, [](auto first, auto last, auto less){std::sort(first, last, less);});
+        }
+        // Same, but the elements that compare equal keep their relative order. Not `constexpr` because `std::stable_sort()` isn't.
+        template <typename Proj = std::identity, typename Comp = std::ranges::less>
+        requires has_value_type && std::indirect_strict_weak_order<Comp, std::projected<const T *, Proj>>
+        void stable_sort_by(Proj proj = {}, Comp comp = {})
+        {
+            sort_by_low(proj, comp, [](auto first, auto last, auto less){std::stable_sort(first, last, less);});
+        }
+
+
+        // Change tracking:
+        //   Only if `IndexMapOptions::track_changes` is set. Then the map records which keys were inserted and erased, and which values were modified, since the last checkpoint.
+        //   Writes through `operator[]` and the like aren't noticed, call `mark_modified()` for those.
+        //   Only the keys are reported, not the indices. `swap_elems()`, `reorder()` and `sort_by()` move the keys along with the values, so they record nothing.
+        //   Sorting `keys_and_values()` with a standard algorithm mixes `swap_elems()` and `move_elem()`, so it can report some of the sorted elements
+        //     as modified (the ones temporarily left moved-from), even though every key ends up with its own value.
+
+        using change_set = detail::IndexMap::ChangeSet<key, Allocator>;
+
+        // Marks the value of an element as modified. Throws if the key or the index is invalid.
+        constexpr void mark_modified(key k) requires tracks_changes {contains_or_throw(k); changes.modified(std::size_t(k));}
+        constexpr void mark_modified(std::size_t i) requires tracks_changes {mark_modified(index_to_key(i));}
+
+        // Returns the changes since the last call (or since the map was created), and starts a new checkpoint.
+        // Only the net effect is reported: a key inserted and then erased is not mentioned at all, and the modified keys don't include the inserted ones.
+        [[nodiscard]] constexpr change_set consume_changes() requires tracks_changes
+        {
+            change_set ret;
+            consume_changes(ret);
+            return ret;
+        }
+        // Same, but writes to an existing `change_set`, to reuse its memory. Clears it first.
+        constexpr void consume_changes(change_set &out) requires tracks_changes
+        {
+            out.clear();
+            changes.consume(out, [&](key k){return contains(k);});
+        }
+        // How many keys were touched since the last checkpoint. Some of them might have no net change.
+        [[nodiscard]] constexpr std::size_t num_touched_keys() const noexcept requires tracks_changes {return changes.num_touched_keys();}
+
+
+        // Snapshots:
+        //   Only for trivially copyable values and persistent data. The format is described in `detail::IndexMap::SnapshotHeader`.
+        //   It stores all keys, including the free and the retired ones, along with their persistent data and generations, so keys and handles stay valid after loading.
+        //   `em/index_map_snapshot.h` has functions to save to and load from file descriptors, and `em::IndexMapView` to use a snapshot file without loading it.
+
+        static constexpr bool supports_snapshots = (!has_value_type || std::is_trivially_copyable_v<T>) && (!has_persistent_data_type || std::is_trivially_copyable_v<PersistentData>);
+        // What the snapshots store as the persistent data of each key. This includes the generation, if enabled.
+        using snapshot_persistent_data = detail::IndexMap::StoredPersistentData<generation_type, PersistentData>;
+
+        // Returns true if a snapshot with this header can be loaded into this map type.
+        // Only the sizes of the types are checked, so a snapshot of `IndexMap<int>` can be loaded into `IndexMap<float>`, for example.
+        [[nodiscard]] static constexpr bool is_compatible_snapshot(const detail::IndexMap::SnapshotHeader &header) noexcept
+        {
+            using header_type = detail::IndexMap::SnapshotHeader;
+            return header.magic == header_type::expected_magic &&
+                header.version == header_type::current_version &&
+                header.byte_order == header_type::native_byte_order &&
+                header.key_bytes == sizeof(KeyType) &&
+                header.data_bytes == detail::IndexMap::SizeOfNonVoid<snapshot_persistent_data> &&
+                header.value_bytes == detail::IndexMap::SizeOfNonVoid<T> &&
+                (header.flags & ~header_type::sorted_keys) == 0 &&
+                header.keys_size <= max_size() &&
+                header.size <= header.keys_size &&
+                header.retired_keys_size <= header.keys_size - header.size &&
+                (retires_keys || header.retired_keys_size == 0) &&
+                (index_storage::dense_keys ? header.sparse_size == header.keys_size : header.sparse_size >= header.keys_size && header.sparse_size <= max_size());
+        }
+
+        // Writes the map by calling `write(std::span<const std::byte>)` several times. The total size is `detail::IndexMap::SnapshotLayout::end`.
+        // Throws `std::logic_error` if there are tombstones, call `compact()` first.
+        void save(auto &&write) const requires supports_snapshots
+        {
+            if (tombstones.size() > 0)
+                DETAIL_EM_INDEXMAP_THROW(std::logic_error("Can't save an index map with tombstones."));
+            detail::IndexMap::SnapshotHeader header;
+            header.key_bytes = sizeof(KeyType);
+            header.data_bytes = detail::IndexMap::SizeOfNonVoid<snapshot_persistent_data>;
+            header.value_bytes = detail::IndexMap::SizeOfNonVoid<T>;
+            header.size = size();
+            header.keys_size = keys_size();
+            header.retired_keys_size = retired_keys_size();
+            if constexpr (index_storage::dense_keys)
+            {
+                header.sparse_size = keys_size();
+            }
+            else
+            {
+                header.flags = header.sorted_keys;
+                for (std::size_t i = 0; i < keys_size(); i++)
+                    header.sparse_size = std::max(header.sparse_size, std::uint64_t(indices.dense_to_sparse(i)) + 1);
+            }
+
+            std::uint64_t position = 0;
+            auto write_bytes = [&](std::span<const std::byte> bytes)
+            {
+                write(bytes);
+                position += bytes.size();
+            };
+            auto write_padding = [&]
+            {
+                static constexpr std::array<std::byte, detail::IndexMap::SnapshotAlignment> zeros{};
+                write_bytes(std::span(zeros).first(std::size_t((detail::IndexMap::SnapshotAlignment - position % detail::IndexMap::SnapshotAlignment) % detail::IndexMap::SnapshotAlignment)));
+            };
+            // Writes `get(i)` for `i` in `[0, n)`, in batches.
+            auto write_array = [&]<typename U>(std::type_identity<U>, std::size_t n, auto &&get)
+            {
+                scratch_vector<U> batch(std::min(n, std::size_t(4096)));
+                for (std::size_t begin = 0; begin < n; begin += batch.size())
+                {
+                    std::size_t batch_size = std::min(batch.size(), n - begin);
+                    for (std::size_t j = 0; j < batch_size; j++)
+                        batch[j] = get(begin + j);
+                    write_bytes(std::as_bytes(std::span(batch).first(batch_size)));
+                }
+                write_padding();
+            };
+
+            write_bytes(std::as_bytes(std::span(&header, 1)));
+
+            write_array(std::type_identity<KeyType>{}, keys_size(), [&](std::size_t i){return indices.dense_to_sparse(i);});
+            if constexpr (index_storage::dense_keys)
+            {
+                write_array(std::type_identity<KeyType>{}, keys_size(), [&](std::size_t k){return indices.sparse_to_dense(k);});
+                if constexpr (!std::is_void_v<snapshot_persistent_data>)
+                    write_array(std::type_identity<snapshot_persistent_data>{}, keys_size(), [&](std::size_t k){return indices.sparse_data(k);});
+            }
+            else
+            {
+                scratch_vector<KeyType> sorted(keys_size());
+                for (std::size_t i = 0; i < keys_size(); i++)
+                    sorted[i] = KeyType(i);
+                std::ranges::sort(sorted, std::ranges::less{}, [&](KeyType i){return indices.dense_to_sparse(std::size_t(i));});
+                write_array(std::type_identity<KeyType>{}, keys_size(), [&](std::size_t j){return sorted[j];});
+                if constexpr (!std::is_void_v<snapshot_persistent_data>)
+                    write_array(std::type_identity<snapshot_persistent_data>{}, keys_size(), [&](std::size_t i){return indices.sparse_data(std::size_t(indices.dense_to_sparse(i)));});
+            }
+
+            if constexpr (has_value_type)
+            {
+                if constexpr (std::contiguous_iterator<typename value_container::const_iterator>)
+                {
+                    if (!empty())
+                        write_bytes(std::as_bytes(std::span(std::to_address(value_storage.begin()), size())));
+                    write_padding();
+                }
+                else
+                {
+                    write_array(std::type_identity<T>{}, size(), [&](std::size_t i){return value_storage[i];});
+                }
+            }
+        }
+
+        // Replaces the contents of the map with a snapshot, read by calling `read(std::span<std::byte>)` several times. It must fill the whole span or throw.
+        // The first call reads the `detail::IndexMap::SnapshotHeader`. The memory is allocated as the data is read, so a truncated snapshot fails before allocating much.
+        // Throws `std::invalid_argument` if the snapshot is invalid, or was saved from an incompatible map type. If this throws, the map is left empty.
+        void load(auto &&read) requires supports_snapshots
+        {
+            clear();
+            struct Guard
+            {
+                IndexMap *self;
+                ~Guard()
+                {
+                    if (self)
+                        self->clear();
+                }
+            };
+            Guard guard{this};
+
+            auto fail = []{DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));};
+
+            detail::IndexMap::SnapshotHeader header;
+            read(std::as_writable_bytes(std::span(&header, 1)));
+            detail::IndexMap::SnapshotLayout layout;
+            if (!is_compatible_snapshot(header) || !layout.compute(header))
+                fail();
+
+            std::uint64_t position = sizeof(header);
+            auto skip_padding = [&](std::uint64_t target)
+            {
+                std::array<std::byte, detail::IndexMap::SnapshotAlignment> padding;
+                read(std::span(padding).first(std::size_t(target - position)));
+                position = target;
+            };
+            // Reads `n` elements, and calls `func(i, elem)` for each of them, in batches.
+            auto read_array = [&]<typename U>(std::type_identity<U>, std::uint64_t offset, std::size_t n, auto &&func)
+            {
+                skip_padding(offset);
+                scratch_vector<U> batch(std::min(n, std::size_t(4096)));
+                for (std::size_t begin = 0; begin < n; begin += batch.size())
+                {
+                    std::size_t batch_size = std::min(batch.size(), n - begin);
+                    read(std::as_writable_bytes(std::span(batch).first(batch_size)));
+                    for (std::size_t j = 0; j < batch_size; j++)
+                        func(begin + j, batch[j]);
+                }
+                position += n * sizeof(U);
+            };
+
+            // The sizes in the header aren't trusted until that much data was actually read,
+            //   so everything is allocated as the data arrives, and a truncated snapshot can't make us allocate much more than its real size.
+            // Growing geometrically from this many elements:
+            constexpr std::size_t min_growth = 4096;
+
+            std::size_t num_keys = std::size_t(header.keys_size);
+            std::size_t num_sparse = std::size_t(header.sparse_size);
+
+            // Rebuild the key<->index tables from the keys. Each key must appear once.
+            read_array(std::type_identity<KeyType>{}, layout.dense_to_sparse, num_keys, [&](std::size_t i, KeyType k)
+            {
+                if (std::size_t(k) >= num_sparse)
+                    fail();
+                if constexpr (index_storage::dense_keys)
+                {
+                    if (i == indices.size())
+                        indices.grow(std::min(num_keys, std::max(i * 2, min_growth)));
+                    indices.dense_to_sparse(i) = k;
+                }
+                else
+                {
+                    if (indices.contains(std::size_t(k)))
+                        fail();
+                    indices.add_key(std::size_t(k));
+                }
+            });
+            if constexpr (index_storage::dense_keys)
+            {
+                // Only now all keys exist in `sparse_to_dense`.
+                for (std::size_t i = 0; i < num_keys; i++)
+                    indices.sparse_to_dense(std::size_t(indices.dense_to_sparse(i))) = KeyType(i);
+                // If a key was repeated, some other key wasn't written, and points to a wrong index.
+                for (std::size_t i = 0; i < num_keys; i++)
+                {
+                    if (std::size_t(indices.sparse_to_dense(std::size_t(indices.dense_to_sparse(i)))) != i)
+                        fail();
+                }
+            }
+            // Either format can be loaded into any map type.
+            bool sorted_keys = header.flags & header.sorted_keys;
+            std::size_t num_per_key = sorted_keys ? num_keys : num_sparse;
+            std::size_t prev_key = 0;
+            read_array(std::type_identity<KeyType>{}, layout.sparse_to_dense, num_per_key, [&](std::size_t j, KeyType i)
+            {
+                if (sorted_keys)
+                {
+                    // The keys must be increasing, which means that each index appears once.
+                    if (std::size_t(i) >= num_keys)
+                        fail();
+                    std::size_t k = std::size_t(indices.dense_to_sparse(std::size_t(i)));
+                    if (j > 0 && k <= prev_key)
+                        fail();
+                    prev_key = k;
+                }
+                else
+                {
+                    if (contains_relaxed(key(j)) && indices.sparse_to_dense(j) != i)
+                        fail();
+                }
+            });
+            if constexpr (!std::is_void_v<snapshot_persistent_data>)
+            {
+                read_array(std::type_identity<snapshot_persistent_data>{}, layout.data, num_per_key, [&](std::size_t j, const snapshot_persistent_data &data)
+                {
+                    if (sorted_keys)
+                        indices.sparse_data(std::size_t(indices.dense_to_sparse(j))) = data;
+                    else if (contains_relaxed(key(j)))
+                        indices.sparse_data(j) = data;
+                });
+            }
+
+            reserve_key_bookkeeping_low(num_sparse);
+            if constexpr (retires_keys)
+            {
+                for (std::uint64_t i = 0; i < header.retired_keys_size; i++)
+                    retired_keys.emplace_back();
+            }
+
+            std::size_t num_values = std::size_t(header.size);
+            if constexpr (!has_value_type)
+            {
+                for (std::size_t i = 0; i < num_values; i++)
+                    value_storage.emplace_back();
+            }
+            else if constexpr (std::contiguous_iterator<typename value_container::iterator> && std::is_default_constructible_v<T>)
+            {
+                skip_padding(layout.values);
+                for (std::size_t begin = 0; begin < num_values;)
+                {
+                    std::size_t end = std::min(num_values, std::max(begin * 2, min_growth));
+                    value_storage.resize(end);
+                    read(std::as_writable_bytes(std::span(std::to_address(value_storage.begin()) + begin, end - begin)));
+                    begin = end;
+                }
+            }
+            else
+            {
+                read_array(std::type_identity<T>{}, layout.values, num_values, [&](std::size_t, const T &value){value_storage.emplace_back(value);});
+            }
+
+            guard.self = nullptr;
+            // All keys are added as free first, and then the used ones are removed from `free_key_order` as inserted. The free keys keep their order from the snapshot.
+            add_new_free_keys_low(0);
+            note_inserted_low(0);
+        }
 
 
         // Range of values:
@@ -700,75 +3979,79 @@ namespace em
         //     `.index()`, `.key()`, `.value()`, `.persistent_data()`, and also `.map()` that returns a reference to the target map.
         [[nodiscard]] constexpr key_value_view       keys_and_values()       noexcept {return *this;}
         [[nodiscard]] constexpr key_value_const_view keys_and_values() const noexcept {return *this;}
+
+        // A forward iterator over the same references, skipping the tombstones (see `ErasePolicy::tombstones`).
+        using live_key_value_iterator = detail::IndexMap::LiveKeyValueIter<IndexMap, false>;
+        using live_key_value_const_iterator = detail::IndexMap::LiveKeyValueIter<IndexMap, true>;
+        using live_key_value_view = detail::IndexMap::LiveKeyValueView<IndexMap, false>;
+        using live_key_value_const_view = detail::IndexMap::LiveKeyValueView<IndexMap, true>;
+
+        // Same as `keys_and_values()`, but a forward range that skips the tombstones, 64 at a time. Without tombstones, this is the same elements.
+        [[nodiscard]] constexpr live_key_value_view       live_keys_and_values()       noexcept {return *this;}
+        [[nodiscard]] constexpr live_key_value_const_view live_keys_and_values() const noexcept {return *this;}
     };
 
     // Erasing elements.
+    //   Those call `pred` once for each element, and move each remaining element at most once.
+    //   The `stable_...` versions preserve the relative order of the remaining elements, but have to move more of them.
 
-    // `erase_if(m.values(), lambda)`
-    template <typename F, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::BoolTestable<std::invoke_result_t<F &, const std::add_lvalue_reference_t<T>>>
-    constexpr std::size_t erase_if(detail::IndexMap::ValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>> &values, F &&func)
+    namespace detail::IndexMap
     {
-        std::size_t ret = 0;
-        std::size_t n = values.size();
-        auto &map = detail::IndexMap::UnderlyingMap(values);
-        while (true)
+        template <typename Map, typename F>
+        [[nodiscard]] constexpr std::size_t EraseValuesIf(Map &map, F &func, bool keep_order)
         {
-            if (n == 0)
-                return ret;
-            n--;
-            if (std::invoke(func, std::as_const(map[n])))
-            {
-                map.erase(n);
-                ret++;
-            }
+            return map.erase_if_index([&](std::size_t i) -> bool {return std::invoke(func, std::as_const(map).values()[i]);}, keep_order);
         }
+
+        template <typename Map, typename F>
+        [[nodiscard]] constexpr std::size_t EraseKeysAndValuesIf(Map &map, F &func, bool keep_order)
+        {
+            return map.erase_if_index([&](std::size_t i) -> bool {return std::invoke(func, typename Map::key_value_const_reference(map, i));}, keep_order);
+        }
+    }
+
+    // `erase_if(m.values(), lambda)`
+    template <typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::value_const_reference>>
+    constexpr std::size_t erase_if(detail::IndexMap::ValueView<Map> values, F &&func)
+    {
+        return detail::IndexMap::EraseValuesIf(detail::IndexMap::UnderlyingMap(values), func, false);
     }
-    template <typename F, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::BoolTestable<std::invoke_result_t<F &, const std::add_lvalue_reference_t<T>>>
-    constexpr std::size_t erase_if(detail::IndexMap::ValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>> &&values, F &&func)
+    // `stable_erase_if(m.values(), lambda)`
+    template <typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::value_const_reference>>
+    constexpr std::size_t stable_erase_if(detail::IndexMap::ValueView<Map> values, F &&func)
     {
-        return (erase_if)(values, func);
+        return detail::IndexMap::EraseValuesIf(detail::IndexMap::UnderlyingMap(values), func, true);
     }
 
     // `erase(m.values(), value)`
-    template <typename Elem, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::EqComparable<const T &, Elem &&>
-    constexpr std::size_t erase(detail::IndexMap::ValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>> &values, Elem &&value)
+    template <typename Map, typename Elem>
+    requires detail::IndexMap::EqComparable<typename Map::value_const_reference, Elem &&>
+    constexpr std::size_t erase(detail::IndexMap::ValueView<Map> values, Elem &&value)
     {
-        return (erase_if)(values, [&](const T &elem){return elem == value;});
+        return (erase_if)(values, [&](typename Map::value_const_reference elem){return elem == value;});
     }
-    template <typename Elem, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::EqComparable<const T &, Elem &&>
-    constexpr std::size_t erase(detail::IndexMap::ValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>> &&values, Elem &&value)
+    // `stable_erase(m.values(), value)`
+    template <typename Map, typename Elem>
+    requires detail::IndexMap::EqComparable<typename Map::value_const_reference, Elem &&>
+    constexpr std::size_t stable_erase(detail::IndexMap::ValueView<Map> values, Elem &&value)
     {
-        return (erase_if)(values, [&](const T &elem){return elem == value;});
+        return (stable_erase_if)(values, [&](typename Map::value_const_reference elem){return elem == value;});
     }
 
     // `erase_if(m.keys_and_values(), lambda)`
-    template <typename F, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename detail::IndexMap::KeyValueRef<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>, true>>>
-    constexpr std::size_t erase_if(detail::IndexMap::KeyValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>, false> &keys_and_values, F &&func)
+    template <typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::key_value_const_reference>>
+    constexpr std::size_t erase_if(detail::IndexMap::KeyValueView<Map, false> keys_and_values, F &&func)
     {
-        auto &map = detail::IndexMap::UnderlyingMap(keys_and_values);
-        std::size_t ret = 0;
-        std::size_t n = map.size();
-        while (true)
-        {
-            if (n == 0)
-                return ret;
-            n--;
-            if (std::invoke(func, std::as_const(keys_and_values)[n]))
-            {
-                map.erase(n);
-                ret++;
-            }
-        }
+        return detail::IndexMap::EraseKeysAndValuesIf(detail::IndexMap::UnderlyingMap(keys_and_values), func, false);
     }
-    template <typename F, typename T, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ValueContainer>
-    requires (!std::is_void_v<T>) && detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename detail::IndexMap::KeyValueRef<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>, true>>>
-    constexpr std::size_t erase_if(detail::IndexMap::KeyValueView<IndexMap<T, KeyType, PersistentData, Allocator, IndexContainer, ValueContainer>, false> &&keys_and_values, F &&func)
+    // `stable_erase_if(m.keys_and_values(), lambda)`
+    template <typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::key_value_const_reference>>
+    constexpr std::size_t stable_erase_if(detail::IndexMap::KeyValueView<Map, false> keys_and_values, F &&func)
     {
-        return (erase_if)(keys_and_values, func);
+        return detail::IndexMap::EraseKeysAndValuesIf(detail::IndexMap::UnderlyingMap(keys_and_values), func, true);
     }
 }
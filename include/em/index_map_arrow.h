@@ -0,0 +1,395 @@
+#pragma once
+
+#include "index_map.h"
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Exporting `em::IndexMap` contents through the Arrow C Data Interface (https://arrow.apache.org/docs/format/CDataInterface.html).
+// Doesn't depend on Arrow: the interface is just two C structs, defined below unless some other header already did.
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema
+{
+    // Array type description
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowSchema *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+struct ArrowArray
+{
+    // Array data description
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+
+    // Release callback
+    void (*release)(struct ArrowArray *);
+    // Opaque producer-specific data
+    void *private_data;
+};
+
+#endif
+
+namespace em
+{
+    // Describes a field of the value type, to export it as a separate column. See `ArrowExporter::export_table()`.
+    template <typename T, typename M>
+    struct ArrowField
+    {
+        const char *name = nullptr;
+        M T::*member = nullptr;
+
+        constexpr ArrowField(const char *name, M T::*member) : name(name), member(member) {}
+    };
+
+    namespace detail::ArrowExport
+    {
+        // The Arrow format string for `T`, see the link at the top of the file.
+        template <typename T>
+        [[nodiscard]] std::string Format()
+        {
+            if constexpr (std::is_same_v<T, bool>)
+                return "b";
+            else if constexpr (std::is_integral_v<T> && sizeof(T) <= 8 && std::has_single_bit(sizeof(T)))
+            {
+                constexpr const char *formats[2][4] = {{"C", "S", "I", "L"}, {"c", "s", "i", "l"}};
+                return formats[std::is_signed_v<T>][std::countr_zero(sizeof(T))];
+            }
+            else if constexpr (std::is_same_v<T, float>)
+                return "f";
+            else if constexpr (std::is_same_v<T, double>)
+                return "g";
+            else
+                // Fixed-size binary.
+                return "w:" + std::to_string(sizeof(T));
+        }
+
+        // Owns the memory of one export, shared by its arrays. Keeps the map pinned until destroyed.
+        struct ExportData
+        {
+            std::shared_ptr<std::atomic<std::size_t>> pins;
+            // The columns that had to be copied.
+            std::vector<std::shared_ptr<void>> owned_buffers;
+
+            explicit ExportData(std::shared_ptr<std::atomic<std::size_t>> pins) : pins(std::move(pins))
+            {
+                this->pins->fetch_add(1, std::memory_order_relaxed);
+            }
+            ExportData(const ExportData &) = delete;
+            ExportData &operator=(const ExportData &) = delete;
+            ~ExportData()
+            {
+                // Release, so that the consumer's reads happen before the map is modified.
+                pins->fetch_sub(1, std::memory_order_release);
+            }
+        };
+
+        // The private data of one `ArrowArray`. Each one is released separately, since the consumer can move the children out.
+        struct ArrayNode
+        {
+            std::shared_ptr<ExportData> data;
+            const void *buffers[2] = {};
+            std::vector<ArrowArray> children;
+            std::vector<ArrowArray *> child_pointers;
+
+            static void Release(ArrowArray *array)
+            {
+                ArrayNode *self = static_cast<ArrayNode *>(array->private_data);
+                for (ArrowArray &child : self->children)
+                {
+                    if (child.release)
+                        child.release(&child);
+                }
+                delete self;
+                array->release = nullptr;
+            }
+        };
+
+        // The private data of one `ArrowSchema`.
+        struct SchemaNode
+        {
+            std::string format;
+            std::string name;
+            std::vector<ArrowSchema> children;
+            std::vector<ArrowSchema *> child_pointers;
+
+            static void Release(ArrowSchema *schema)
+            {
+                SchemaNode *self = static_cast<SchemaNode *>(schema->private_data);
+                for (ArrowSchema &child : self->children)
+                {
+                    if (child.release)
+                        child.release(&child);
+                }
+                delete self;
+                schema->release = nullptr;
+            }
+        };
+
+        // One exported column: its format, and the buffer with `length` elements.
+        struct Column
+        {
+            std::string format;
+            std::string name;
+            const void *values = nullptr;
+        };
+
+        // Arrow wants the buffers to be non-null, even if empty.
+        inline constexpr std::uint64_t empty_buffer = 0;
+
+        // Copies `get(i)` for `i` in `[0, n)` into a new buffer owned by `data`, and returns it.
+        template <typename U>
+        [[nodiscard]] const void *CopyColumn(ExportData &data, std::size_t n, auto &&get)
+        {
+            if constexpr (std::is_same_v<U, bool>)
+            {
+                // Arrow packs booleans into bits.
+                auto buffer = std::make_shared<std::vector<std::uint8_t>>((n + 7) / 8);
+                for (std::size_t i = 0; i < n; i++)
+                    (*buffer)[i / 8] |= std::uint8_t(std::uint8_t(bool(get(i))) << (i % 8));
+                data.owned_buffers.push_back(buffer);
+                return buffer->empty() ? &empty_buffer : static_cast<const void *>(buffer->data());
+            }
+            else
+            {
+                auto buffer = std::make_shared<std::vector<U>>();
+                buffer->reserve(n);
+                for (std::size_t i = 0; i < n; i++)
+                    buffer->push_back(get(i));
+                data.owned_buffers.push_back(buffer);
+                return buffer->empty() ? &empty_buffer : static_cast<const void *>(buffer->data());
+            }
+        }
+
+        [[nodiscard]] inline ArrowArray MakeArray(std::shared_ptr<ExportData> data, std::size_t length, const void *values, std::vector<ArrowArray> children = {})
+        {
+            auto node = std::make_unique<ArrayNode>();
+            node->data = std::move(data);
+            node->buffers[1] = values;
+            node->children = std::move(children);
+            for (ArrowArray &child : node->children)
+                node->child_pointers.push_back(&child);
+
+            ArrowArray ret{};
+            ret.length = std::int64_t(length);
+            ret.null_count = 0;
+            ret.offset = 0;
+            // The validity bitmap (always null, since there are no nulls), then the values if it's not a struct.
+            ret.n_buffers = values ? 2 : 1;
+            ret.n_children = std::int64_t(node->children.size());
+            ret.buffers = node->buffers;
+            ret.children = node->child_pointers.empty() ? nullptr : node->child_pointers.data();
+            ret.dictionary = nullptr;
+            ret.release = ArrayNode::Release;
+            ret.private_data = node.release();
+            return ret;
+        }
+
+        [[nodiscard]] inline ArrowSchema MakeSchema(std::string format, std::string name, std::vector<ArrowSchema> children = {})
+        {
+            auto node = std::make_unique<SchemaNode>();
+            node->format = std::move(format);
+            node->name = std::move(name);
+            node->children = std::move(children);
+            for (ArrowSchema &child : node->children)
+                node->child_pointers.push_back(&child);
+
+            ArrowSchema ret{};
+            ret.format = node->format.c_str();
+            ret.name = node->name.c_str();
+            ret.metadata = nullptr;
+            ret.flags = 0; // Not nullable.
+            ret.n_children = std::int64_t(node->children.size());
+            ret.children = node->child_pointers.empty() ? nullptr : node->child_pointers.data();
+            ret.dictionary = nullptr;
+            ret.release = SchemaNode::Release;
+            ret.private_data = node.release();
+            return ret;
+        }
+    }
+
+    // Owns an `em::IndexMap` with trivially copyable values, and exports its contents through the Arrow C Data Interface.
+    //
+    // The values are exported without copying if the value container is contiguous (e.g. `std::vector`), and the keys
+    //   if the index layout stores them contiguously (`IndexLayout::separate` and `IndexLayout::paged`, see `IndexMap::has_contiguous_keys`). Otherwise they are copied.
+    // Arithmetic types map to the matching Arrow types, and the other types to fixed-size binary. `bool` is always copied, since Arrow stores it as bits.
+    //
+    // Each export pins the map until the consumer calls its `release` callback (from any thread). While pinned, `modify()` throws.
+    // The map must use the default `ErasePolicy::swap_and_pop`, since the tombstones would be exported as live rows.
+    template <typename Map>
+    requires (!Map::has_value_type || std::is_trivially_copyable_v<typename Map::value_type>)
+    class ArrowExporter
+    {
+        Map target;
+        std::shared_ptr<std::atomic<std::size_t>> pins = std::make_shared<std::atomic<std::size_t>>(0);
+
+        // Arrow would see the tombstones as live rows, and compacting on export would move the elements under the previous exports.
+        static_assert(!Map::keeps_tombstones, "Can't export an index map with tombstones.");
+
+        using key_type = std::underlying_type_t<typename Map::key>;
+
+        [[nodiscard]] std::shared_ptr<detail::ArrowExport::ExportData> new_export() const
+        {
+            return std::make_shared<detail::ArrowExport::ExportData>(pins);
+        }
+
+        [[nodiscard]] detail::ArrowExport::Column key_column(detail::ArrowExport::ExportData &data) const
+        {
+            detail::ArrowExport::Column ret{detail::ArrowExport::Format<key_type>(), "key"};
+            if constexpr (Map::has_contiguous_keys)
+                ret.values = target.size() ? static_cast<const void *>(target.contiguous_keys().data()) : &detail::ArrowExport::empty_buffer;
+            else
+                ret.values = detail::ArrowExport::CopyColumn<key_type>(data, target.size(), [&](std::size_t i){return key_type(target.index_to_key(i));});
+            return ret;
+        }
+
+        [[nodiscard]] detail::ArrowExport::Column value_column(detail::ArrowExport::ExportData &data) const requires Map::has_value_type
+        {
+            using T = typename Map::value_type;
+            detail::ArrowExport::Column ret{detail::ArrowExport::Format<T>(), "value"};
+            if constexpr (!std::is_same_v<T, bool> && std::contiguous_iterator<typename Map::value_container::const_iterator>)
+                ret.values = target.size() ? static_cast<const void *>(std::to_address(target.values().begin())) : &detail::ArrowExport::empty_buffer;
+            else
+                ret.values = detail::ArrowExport::CopyColumn<T>(data, target.size(), [&](std::size_t i) -> const T & {return target.values()[i];});
+            return ret;
+        }
+
+        template <typename T, typename M>
+        [[nodiscard]] detail::ArrowExport::Column field_column(detail::ArrowExport::ExportData &data, const ArrowField<T, M> &field) const
+        {
+            static_assert(std::is_trivially_copyable_v<M>, "The exported fields must be trivially copyable.");
+            return {detail::ArrowExport::Format<M>(), field.name, detail::ArrowExport::CopyColumn<M>(data, target.size(), [&](std::size_t i) -> const M & {return target.values()[i].*field.member;})};
+        }
+
+        // Exports a single column.
+        void export_column(ArrowArray *out_array, ArrowSchema *out_schema, auto &&make_column) const
+        {
+            auto data = new_export();
+            detail::ArrowExport::Column column = make_column(*data);
+            // Make the schema first, so that if that throws, the array isn't leaked.
+            ArrowSchema schema{};
+            if (out_schema)
+                schema = detail::ArrowExport::MakeSchema(column.format, column.name);
+            *out_array = detail::ArrowExport::MakeArray(std::move(data), target.size(), column.values);
+            if (out_schema)
+                *out_schema = schema;
+        }
+
+      public:
+        using map_type = Map;
+
+        [[nodiscard]] explicit ArrowExporter(Map initial = {}) : target(std::move(initial)) {}
+
+        ArrowExporter(const ArrowExporter &) = delete;
+        ArrowExporter &operator=(const ArrowExporter &) = delete;
+
+        // All exports must be released before this.
+        ~ArrowExporter()
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(!pinned() && "Destroying an Arrow exporter while its map is still exported.");
+        }
+
+        // Read-only access, which is always allowed.
+        [[nodiscard]] const Map &map() const noexcept {return target;}
+
+        // Access for modification. Throws if any export wasn't released yet.
+        [[nodiscard]] Map &modify()
+        {
+            if (pinned())
+                DETAIL_EM_INDEXMAP_THROW(std::logic_error("This index map is pinned by an Arrow export."));
+            return target;
+        }
+
+        // How many exports weren't released yet.
+        [[nodiscard]] std::size_t num_exports() const noexcept {return pins->load(std::memory_order_acquire);}
+        [[nodiscard]] bool pinned() const noexcept {return num_exports() > 0;}
+
+        // Exports the keys as an array of unsigned integers, in index order. `out_schema` can be null.
+        void export_keys(ArrowArray *out_array, ArrowSchema *out_schema = nullptr) const
+        {
+            export_column(out_array, out_schema, [&](detail::ArrowExport::ExportData &data){return key_column(data);});
+        }
+
+        // Exports the values in index order. `out_schema` can be null.
+        void export_values(ArrowArray *out_array, ArrowSchema *out_schema = nullptr) const requires Map::has_value_type
+        {
+            export_column(out_array, out_schema, [&](detail::ArrowExport::ExportData &data){return value_column(data);});
+        }
+
+        // Exports a struct array (a record batch), with the `key` column followed by the value columns.
+        // If `fields` are empty, the whole value is one `value` column. Otherwise each field is a separate column, e.g.:
+        //     exporter.export_table(&array, &schema, em::ArrowField("x", &Vec3::x), em::ArrowField("y", &Vec3::y));
+        // The fields are always copied, since Arrow needs each column to be contiguous. `out_schema` can be null.
+        template <typename ...P>
+        void export_table(ArrowArray *out_array, ArrowSchema *out_schema, const P &... fields) const
+        {
+            static_assert(Map::has_value_type || sizeof...(P) == 0, "This map has no values.");
+
+            auto data = new_export();
+            std::vector<detail::ArrowExport::Column> columns;
+            columns.push_back(key_column(*data));
+            if constexpr (sizeof...(P) > 0)
+                (columns.push_back(field_column(*data, fields)), ...);
+            else if constexpr (Map::has_value_type)
+                columns.push_back(value_column(*data));
+
+            ArrowSchema schema{};
+            if (out_schema)
+            {
+                std::vector<ArrowSchema> child_schemas;
+                child_schemas.reserve(columns.size());
+                struct Guard
+                {
+                    std::vector<ArrowSchema> &schemas;
+                    ~Guard()
+                    {
+                        for (ArrowSchema &s : schemas)
+                            s.release(&s);
+                    }
+                };
+                Guard guard{child_schemas};
+                for (const auto &column : columns)
+                    child_schemas.push_back(detail::ArrowExport::MakeSchema(column.format, column.name));
+                schema = detail::ArrowExport::MakeSchema("+s", "", std::move(child_schemas));
+            }
+
+            std::vector<ArrowArray> child_arrays;
+            child_arrays.reserve(columns.size());
+            for (const auto &column : columns)
+                child_arrays.push_back(detail::ArrowExport::MakeArray(data, target.size(), column.values));
+            *out_array = detail::ArrowExport::MakeArray(std::move(data), target.size(), nullptr, std::move(child_arrays));
+            if (out_schema)
+                *out_schema = schema;
+        }
+    };
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "index_map.h"
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Parallel algorithms for `em::IndexMap`, taking the standard execution policies (`std::execution::par`, etc).
+// This is a separate header because `<execution>` can require linking extra libraries (TBB with libstdc++), even if you don't use the parallel policies.
+//
+// The elements are split into chunks of `em::index_map_parallel_chunk_size`, and the chunks are processed according to the policy.
+// As with the standard algorithms, if a callback throws, `std::terminate()` is called.
+
+namespace em
+{
+    // How many elements are processed by one task. A multiple of 64, so that each chunk writes its own words of the erasure bitmask.
+    inline constexpr std::size_t index_map_parallel_chunk_size = 4096;
+
+    namespace detail::IndexMap
+    {
+        template <typename Policy>
+        concept ExecutionPolicy = std::is_execution_policy_v<std::remove_cvref_t<Policy>>;
+
+        // Splits `[0, n)` into chunks and calls `func(begin, end)` for each of them, according to the `policy`.
+        template <typename Policy>
+        void ForEachChunkParallel(Policy &&policy, std::size_t n, auto &&func)
+        {
+            std::vector<std::size_t> chunks((n + index_map_parallel_chunk_size - 1) / index_map_parallel_chunk_size);
+            for (std::size_t j = 0; j < chunks.size(); j++)
+                chunks[j] = j * index_map_parallel_chunk_size;
+            std::for_each(std::forward<Policy>(policy), chunks.begin(), chunks.end(), [&](std::size_t begin)
+            {
+                func(begin, std::min(begin + index_map_parallel_chunk_size, n));
+            });
+        }
+
+        // Calls `pred(i)` for each element index in parallel, marking the elements to erase in a bitmask, then erases them in one serial pass.
+        // Skips the tombstones (see `ErasePolicy::tombstones`), like the serial version.
+        template <typename Policy, typename Map>
+        std::size_t EraseIfIndexParallel(Policy &&policy, Map &map, auto &&pred, bool keep_order)
+        {
+            std::vector<std::uint64_t> marks((map.size() + 63) / 64);
+            ForEachChunkParallel(std::forward<Policy>(policy), map.size(), [&](std::size_t begin, std::size_t end)
+            {
+                for (std::size_t i = begin; i < end; i++)
+                {
+                    if (map.valid_index(i) && pred(std::as_const(i)))
+                        marks[i / 64] |= std::uint64_t(1) << (i % 64);
+                }
+            });
+            return map.erase_marked_indices(marks, keep_order);
+        }
+
+        // Computes the sort keys and sorts in parallel, then reorders the map serially.
+        template <typename Policy, typename Map>
+        void SortByParallel(Policy &&policy, Map &map, auto &proj, auto &comp, bool stable)
+        {
+            auto sort = [&](auto first, auto last, auto less)
+            {
+                if (stable)
+                    std::stable_sort(policy, first, last, less);
+                else
+                    std::sort(policy, first, last, less);
+            };
+
+            map.compact(); // `reorder()` would do that anyway, and `order` must use the indices after it.
+            std::size_t n = map.size();
+            std::vector<std::size_t> order(n);
+            using sort_key = std::remove_cvref_t<std::invoke_result_t<decltype(proj), typename Map::value_const_reference>>;
+            if constexpr (CacheSortKey<sort_key> && std::default_initializable<sort_key>)
+            {
+                struct Entry
+                {
+                    sort_key key;
+                    std::size_t index;
+                };
+                std::vector<Entry> entries(n);
+                ForEachChunkParallel(policy, n, [&](std::size_t begin, std::size_t end)
+                {
+                    for (std::size_t i = begin; i < end; i++)
+                        entries[i] = {std::invoke(proj, std::as_const(map).values()[i]), i};
+                });
+                sort(entries.begin(), entries.end(), [&](const Entry &a, const Entry &b){return bool(std::invoke(comp, a.key, b.key));});
+                ForEachChunkParallel(policy, n, [&](std::size_t begin, std::size_t end)
+                {
+                    for (std::size_t j = begin; j < end; j++)
+                        order[j] = entries[j].index;
+                });
+            }
+            else
+            {
+                for (std::size_t i = 0; i < n; i++)
+                    order[i] = i;
+                const auto &values = std::as_const(map).values();
+                sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+                {
+                    return bool(std::invoke(comp, std::invoke(proj, values[a]), std::invoke(proj, values[b])));
+                });
+            }
+            map.reorder(order);
+        }
+    }
+
+    // `for_each_parallel(policy, m.keys_and_values(), lambda)`
+    // Calls `func(elem)` for each element, in an unspecified order, possibly from several threads at once. Skips the tombstones (see `ErasePolicy::tombstones`).
+    //   `elem` is a `key_value_reference` (or `key_value_const_reference`), which gives the key, the value, and the persistent data.
+    // `func` can modify the value and the persistent data of the element it was given, but not of the other elements, and must not insert or erase.
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, bool IsConst, typename F>
+    void for_each_parallel(Policy &&policy, detail::IndexMap::KeyValueView<Map, IsConst> keys_and_values, F &&func)
+    {
+        const auto &map = detail::IndexMap::UnderlyingMap(keys_and_values);
+        auto first = keys_and_values.begin();
+        detail::IndexMap::ForEachChunkParallel(std::forward<Policy>(policy), std::size_t(keys_and_values.size()), [&](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; i++)
+            {
+                if (map.valid_index(i))
+                    std::invoke(func, first[std::ptrdiff_t(i)]);
+            }
+        });
+    }
+
+    // Erasing elements in parallel.
+    //   Those call `func` in parallel and mark the elements to erase, then erase them in one serial pass (see `IndexMap::erase_marked_indices()`).
+    //   `func` must not modify the map.
+
+    // `erase_if(policy, m.values(), lambda)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::value_const_reference>>
+    std::size_t erase_if(Policy &&policy, detail::IndexMap::ValueView<Map> values, F &&func)
+    {
+        Map &map = detail::IndexMap::UnderlyingMap(values);
+        return detail::IndexMap::EraseIfIndexParallel(std::forward<Policy>(policy), map, [&](std::size_t i) -> bool {return std::invoke(func, std::as_const(map).values()[i]);}, false);
+    }
+    // `stable_erase_if(policy, m.values(), lambda)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::value_const_reference>>
+    std::size_t stable_erase_if(Policy &&policy, detail::IndexMap::ValueView<Map> values, F &&func)
+    {
+        Map &map = detail::IndexMap::UnderlyingMap(values);
+        return detail::IndexMap::EraseIfIndexParallel(std::forward<Policy>(policy), map, [&](std::size_t i) -> bool {return std::invoke(func, std::as_const(map).values()[i]);}, true);
+    }
+
+    // `erase_if(policy, m.keys_and_values(), lambda)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::key_value_const_reference>>
+    std::size_t erase_if(Policy &&policy, detail::IndexMap::KeyValueView<Map, false> keys_and_values, F &&func)
+    {
+        Map &map = detail::IndexMap::UnderlyingMap(keys_and_values);
+        return detail::IndexMap::EraseIfIndexParallel(std::forward<Policy>(policy), map, [&](std::size_t i) -> bool {return std::invoke(func, typename Map::key_value_const_reference(map, i));}, false);
+    }
+    // `stable_erase_if(policy, m.keys_and_values(), lambda)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename F>
+    requires detail::IndexMap::BoolTestable<std::invoke_result_t<F &, typename Map::key_value_const_reference>>
+    std::size_t stable_erase_if(Policy &&policy, detail::IndexMap::KeyValueView<Map, false> keys_and_values, F &&func)
+    {
+        Map &map = detail::IndexMap::UnderlyingMap(keys_and_values);
+        return detail::IndexMap::EraseIfIndexParallel(std::forward<Policy>(policy), map, [&](std::size_t i) -> bool {return std::invoke(func, typename Map::key_value_const_reference(map, i));}, true);
+    }
+
+    // Sorting in parallel.
+    //   Same as `m.sort_by()` and `m.stable_sort_by()`, but the sort keys are computed and sorted according to the `policy`.
+    //   Moving the elements into their new places is serial (see `IndexMap::reorder()`). `proj` and `comp` must not modify the map.
+
+    // `sort_by(policy, m, proj, comp)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename Proj = std::identity, typename Comp = std::ranges::less>
+    requires Map::has_value_type && std::indirect_strict_weak_order<Comp, std::projected<const typename Map::value_type *, Proj>>
+    void sort_by(Policy &&policy, Map &map, Proj proj = {}, Comp comp = {})
+    {
+        detail::IndexMap::SortByParallel(std::forward<Policy>(policy), map, proj, comp, false);
+    }
+    // `stable_sort_by(policy, m, proj, comp)`
+    template <detail::IndexMap::ExecutionPolicy Policy, typename Map, typename Proj = std::identity, typename Comp = std::ranges::less>
+    requires Map::has_value_type && std::indirect_strict_weak_order<Comp, std::projected<const typename Map::value_type *, Proj>>
+    void stable_sort_by(Policy &&policy, Map &map, Proj proj = {}, Comp comp = {})
+    {
+        detail::IndexMap::SortByParallel(std::forward<Policy>(policy), map, proj, comp, true);
+    }
+}
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "index_map.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+// Saving and loading `em::IndexMap` snapshots (see `IndexMap::save()` and `IndexMap::load()`) with file descriptors,
+//   and `em::IndexMapView`, which uses a snapshot in memory (e.g. a memory-mapped file) without loading it.
+// The file descriptor and memory mapping functions are POSIX-only. `em::IndexMapView` itself works with any memory.
+
+#ifndef DETAIL_EM_INDEXMAP_POSIX
+#if __has_include(<sys/mman.h>) && __has_include(<sys/stat.h>) && __has_include(<fcntl.h>) && __has_include(<unistd.h>)
+#define DETAIL_EM_INDEXMAP_POSIX 1
+#else
+#define DETAIL_EM_INDEXMAP_POSIX 0
+#endif
+#endif
+
+#if DETAIL_EM_INDEXMAP_POSIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace em
+{
+    // A read-only view of an `IndexMap` snapshot, that reads the keys, the values, and the persistent data directly from the snapshot bytes.
+    // `Map` is the type of the map that saved the snapshot. Opening a view only checks the header, so it's instant regardless of the size.
+    //   The lookups are bounds-checked, so a corrupted snapshot can give wrong results, but not crash.
+    //   With `IndexLayout::paged`, looking up a key is a binary search, see `detail::IndexMap::SnapshotHeader::sorted_keys`.
+    template <typename Map>
+    requires Map::supports_snapshots
+    class IndexMapView
+    {
+      public:
+        using map_type = Map;
+        using key = typename Map::key;
+        using value_type = typename Map::value_type;
+        using persistent_data_type = typename Map::persistent_data_type;
+
+      private:
+        using key_type = std::underlying_type_t<typename Map::key>;
+        using stored_data = typename Map::snapshot_persistent_data;
+
+        std::size_t num_values = 0;
+        std::size_t num_keys = 0;
+        std::size_t num_retired_keys = 0;
+        std::size_t num_sparse = 0;
+        // See `detail::IndexMap::SnapshotHeader::sorted_keys`. Then `sparse_to_dense_array` has the indices sorted by key, and `data_array` is indexed by index.
+        bool sorted_keys = false;
+
+        const key_type *dense_to_sparse_array = nullptr;
+        const key_type *sparse_to_dense_array = nullptr;
+        const detail::IndexMap::VoidToEmpty<stored_data> *data_array = nullptr;
+        const detail::IndexMap::VoidToEmpty<typename Map::value_type> *value_array = nullptr;
+
+        // If this view owns a memory mapping, it's unmapped in the destructor.
+        void *mapping = nullptr;
+        std::size_t mapping_size = 0;
+
+        void unmap() noexcept
+        {
+            #if DETAIL_EM_INDEXMAP_POSIX
+            if (mapping)
+                ::munmap(mapping, mapping_size);
+            #endif
+            mapping = nullptr;
+            mapping_size = 0;
+        }
+
+        // Returns the index of `k`, or `size()` if it's invalid.
+        [[nodiscard]] std::size_t find(key k) const noexcept
+        {
+            std::size_t i = find_relaxed(k);
+            return i < num_values ? i : num_values;
+        }
+
+        // Same as `find()`, but also accepts the free and the retired keys, which still have persistent data. Returns `keys_size()` if invalid.
+        [[nodiscard]] std::size_t find_relaxed(key k) const noexcept
+        {
+            std::size_t sparse = std::size_t(key_type(k));
+            if (sparse >= num_sparse)
+                return num_keys;
+            if (sorted_keys)
+            {
+                // A binary search over the sorted indices.
+                std::size_t begin = 0, end = num_keys;
+                while (begin < end)
+                {
+                    std::size_t mid = begin + (end - begin) / 2;
+                    std::size_t i = std::size_t(sparse_to_dense_array[mid]);
+                    if (i >= num_keys)
+                        return num_keys;
+                    std::size_t mid_key = std::size_t(dense_to_sparse_array[i]);
+                    if (mid_key == sparse)
+                        return i;
+                    if (mid_key < sparse)
+                        begin = mid + 1;
+                    else
+                        end = mid;
+                }
+                return num_keys;
+            }
+            std::size_t i = std::size_t(sparse_to_dense_array[sparse]);
+            if (i >= num_keys || std::size_t(dense_to_sparse_array[i]) != sparse)
+                return num_keys;
+            return i;
+        }
+
+        // The stored persistent data of a key, including the erased keys. Throws if the key is invalid.
+        [[nodiscard]] const detail::IndexMap::VoidToEmpty<stored_data> &stored_data_of(key k) const
+        {
+            std::size_t i = find_relaxed(k);
+            if (i == num_keys)
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map key."));
+            return data_array[sorted_keys ? i : std::size_t(key_type(k))];
+        }
+
+      public:
+        // An empty view.
+        [[nodiscard]] IndexMapView() {}
+
+        // Views a snapshot in `bytes`, which must stay alive while the view exists.
+        // `bytes` must be aligned at least for the key, value, and persistent data types. Throws `std::invalid_argument` if the snapshot is invalid or incompatible.
+        [[nodiscard]] explicit IndexMapView(std::span<const std::byte> bytes)
+        {
+            constexpr std::size_t alignment = std::max({alignof(key_type), alignof(detail::IndexMap::VoidToEmpty<stored_data>), alignof(detail::IndexMap::VoidToEmpty<value_type>)});
+            if (reinterpret_cast<std::uintptr_t>(bytes.data()) % alignment != 0)
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Misaligned index map snapshot."));
+
+            detail::IndexMap::SnapshotHeader header;
+            detail::IndexMap::SnapshotLayout layout;
+            if (bytes.size() < sizeof(header))
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));
+            std::memcpy(&header, bytes.data(), sizeof(header));
+            if (!Map::is_compatible_snapshot(header) || !layout.compute(header, bytes.size()))
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));
+
+            num_values = std::size_t(header.size);
+            num_keys = std::size_t(header.keys_size);
+            num_retired_keys = std::size_t(header.retired_keys_size);
+            num_sparse = std::size_t(header.sparse_size);
+            sorted_keys = header.flags & header.sorted_keys;
+            dense_to_sparse_array = reinterpret_cast<const key_type *>(bytes.data() + layout.dense_to_sparse);
+            sparse_to_dense_array = reinterpret_cast<const key_type *>(bytes.data() + layout.sparse_to_dense);
+            data_array = reinterpret_cast<const detail::IndexMap::VoidToEmpty<stored_data> *>(bytes.data() + layout.data);
+            value_array = reinterpret_cast<const detail::IndexMap::VoidToEmpty<value_type> *>(bytes.data() + layout.values);
+        }
+
+        IndexMapView(IndexMapView &&other) noexcept
+            : num_values(std::exchange(other.num_values, 0)), num_keys(std::exchange(other.num_keys, 0)),
+            num_retired_keys(std::exchange(other.num_retired_keys, 0)), num_sparse(std::exchange(other.num_sparse, 0)), sorted_keys(std::exchange(other.sorted_keys, false)),
+            dense_to_sparse_array(std::exchange(other.dense_to_sparse_array, nullptr)), sparse_to_dense_array(std::exchange(other.sparse_to_dense_array, nullptr)),
+            data_array(std::exchange(other.data_array, nullptr)), value_array(std::exchange(other.value_array, nullptr)),
+            mapping(std::exchange(other.mapping, nullptr)), mapping_size(std::exchange(other.mapping_size, 0))
+        {}
+        IndexMapView &operator=(IndexMapView other) noexcept
+        {
+            std::swap(num_values, other.num_values);
+            std::swap(num_keys, other.num_keys);
+            std::swap(num_retired_keys, other.num_retired_keys);
+            std::swap(num_sparse, other.num_sparse);
+            std::swap(sorted_keys, other.sorted_keys);
+            std::swap(dense_to_sparse_array, other.dense_to_sparse_array);
+            std::swap(sparse_to_dense_array, other.sparse_to_dense_array);
+            std::swap(data_array, other.data_array);
+            std::swap(value_array, other.value_array);
+            std::swap(mapping, other.mapping);
+            std::swap(mapping_size, other.mapping_size);
+            return *this;
+        }
+        ~IndexMapView()
+        {
+            unmap();
+        }
+
+        #if DETAIL_EM_INDEXMAP_POSIX
+        // Maps a snapshot file into memory (read-only), and returns a view that owns the mapping. The descriptor can be closed afterwards.
+        // Throws `std::system_error` if the mapping fails, and `std::invalid_argument` if the snapshot is invalid or incompatible.
+        [[nodiscard]] static IndexMapView map_fd(int fd)
+        {
+            struct stat info{};
+            if (::fstat(fd, &info) != 0)
+                DETAIL_EM_INDEXMAP_THROW(std::system_error(errno, std::generic_category(), "Can't get the size of an index map snapshot file"));
+            std::size_t size = std::size_t(info.st_size);
+            if (size == 0)
+                DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));
+
+            void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (mapping == MAP_FAILED)
+                DETAIL_EM_INDEXMAP_THROW(std::system_error(errno, std::generic_category(), "Can't map an index map snapshot file"));
+
+            struct Guard
+            {
+                void *mapping;
+                std::size_t size;
+                ~Guard()
+                {
+                    if (mapping)
+                        ::munmap(mapping, size);
+                }
+            };
+            Guard guard{mapping, size};
+
+            IndexMapView ret(std::span(static_cast<const std::byte *>(mapping), size));
+            ret.mapping = mapping;
+            ret.mapping_size = size;
+            guard.mapping = nullptr;
+            return ret;
+        }
+
+        // Same, but opens the file by name.
+        [[nodiscard]] static IndexMapView map_file(const char *path)
+        {
+            int fd = ::open(path, O_RDONLY);
+            if (fd == -1)
+                DETAIL_EM_INDEXMAP_THROW(std::system_error(errno, std::generic_category(), "Can't open an index map snapshot file"));
+            struct Guard
+            {
+                int fd;
+                ~Guard() {::close(fd);}
+            };
+            Guard guard{fd};
+            return map_fd(fd);
+        }
+        #endif
+
+        // How many values there are.
+        [[nodiscard]] std::size_t size() const noexcept {return num_values;}
+        [[nodiscard]] bool empty() const noexcept {return num_values == 0;}
+        // The same as in the map that saved the snapshot.
+        [[nodiscard]] std::size_t keys_size() const noexcept {return num_keys;}
+        [[nodiscard]] std::size_t retired_keys_size() const noexcept {return num_retired_keys;}
+
+        [[nodiscard]] bool contains(key k) const noexcept {return find(k) < num_values;}
+        // Including the erased keys, which still have the persistent data.
+        [[nodiscard]] bool contains_relaxed(key k) const noexcept {return find_relaxed(k) < num_keys;}
+
+        [[nodiscard]] std::size_t key_to_index(key k) const
+        {
+            std::size_t i = find(k);
+            if (i == num_values)
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map key."));
+            return i;
+        }
+        [[nodiscard]] key index_to_key(std::size_t i) const
+        {
+            if (i >= num_values)
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map index."));
+            return key(dense_to_sparse_array[i]);
+        }
+
+        // By key.
+        [[nodiscard]] typename Map::value_const_reference operator[](key k) const requires Map::has_value_type {return value_array[key_to_index(k)];}
+        // By index.
+        [[nodiscard]] typename Map::value_const_reference operator[](std::size_t i) const requires Map::has_value_type
+        {
+            if (i >= num_values)
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map index."));
+            return value_array[i];
+        }
+
+        // All values, in the same order as in the map.
+        [[nodiscard]] std::span<const detail::IndexMap::VoidToEmpty<value_type>> values() const noexcept requires Map::has_value_type {return {value_array, num_values};}
+
+        // The persistent data of a key, including the erased keys.
+        [[nodiscard]] typename Map::persistent_data_const_reference get_persistent_data(key k) const requires Map::has_persistent_data_type
+        {
+            if constexpr (Map::has_generations)
+                return stored_data_of(k).data;
+            else
+                return stored_data_of(k);
+        }
+
+        // The current generation of a key, including the erased keys.
+        [[nodiscard]] typename Map::generation_type get_generation(key k) const requires Map::has_generations
+        {
+            return stored_data_of(k).generation;
+        }
+    };
+
+    #if DETAIL_EM_INDEXMAP_POSIX
+    // Writes a snapshot of `map` to a file descriptor, at its current position. Throws `std::system_error` on failure.
+    template <typename Map>
+    requires Map::supports_snapshots
+    void save_snapshot(int fd, const Map &map)
+    {
+        map.save([&](std::span<const std::byte> bytes)
+        {
+            while (!bytes.empty())
+            {
+                ssize_t n = ::write(fd, bytes.data(), bytes.size());
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    DETAIL_EM_INDEXMAP_THROW(std::system_error(errno, std::generic_category(), "Can't write an index map snapshot"));
+                }
+                bytes = bytes.subspan(std::size_t(n));
+            }
+        });
+    }
+
+    // Replaces the contents of `map` with a snapshot read from a file descriptor, at its current position.
+    // Throws `std::system_error` on failure, and `std::invalid_argument` if the snapshot is invalid, truncated, or incompatible. If this throws, `map` is left empty.
+    // For regular files, the sizes in the header are checked against the file size before anything is allocated.
+    template <typename Map>
+    requires Map::supports_snapshots
+    void load_snapshot(int fd, Map &map)
+    {
+        // How many bytes are left in the file, or `-1` if unknown (not a regular file).
+        std::uint64_t available = std::uint64_t(-1);
+        struct stat info{};
+        if (::fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+        {
+            off_t position = ::lseek(fd, 0, SEEK_CUR);
+            if (position >= 0 && position <= info.st_size)
+                available = std::uint64_t(info.st_size - position);
+        }
+        bool read_header = false;
+
+        map.load([&](std::span<std::byte> bytes)
+        {
+            std::span<std::byte> target = bytes;
+            while (!bytes.empty())
+            {
+                ssize_t n = ::read(fd, bytes.data(), bytes.size());
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    DETAIL_EM_INDEXMAP_THROW(std::system_error(errno, std::generic_category(), "Can't read an index map snapshot"));
+                }
+                if (n == 0)
+                    DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));
+                bytes = bytes.subspan(std::size_t(n));
+            }
+
+            // The first read is the header.
+            if (!std::exchange(read_header, true))
+            {
+                detail::IndexMap::SnapshotHeader header;
+                detail::IndexMap::SnapshotLayout layout;
+                DETAIL_EM_INDEXMAP_ASSERT(target.size() == sizeof(header));
+                std::memcpy(&header, target.data(), sizeof(header));
+                if (!layout.compute(header, available))
+                    DETAIL_EM_INDEXMAP_THROW(std::invalid_argument("Invalid or incompatible index map snapshot."));
+            }
+        });
+    }
+    #endif
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include "index_map.h"
+
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// `em::IndexMultiColumn`, which stores several value types in parallel arrays ("structure of arrays"), sharing one set of keys.
+// This is a separate header because most users don't need it.
+
+namespace em
+{
+    // Lists the column types of `em::BasicIndexMultiColumn`.
+    template <typename ...Ts>
+    struct Columns {};
+
+    namespace detail::IndexMultiColumn
+    {
+        // The index of `C` in `Ts...`, or `sizeof...(Ts)` if it's not there or repeated.
+        template <typename C, typename ...Ts>
+        [[nodiscard]] consteval std::size_t ColumnIndex()
+        {
+            constexpr bool matches[]{std::is_same_v<C, Ts>...};
+            std::size_t ret = sizeof...(Ts);
+            for (std::size_t i = 0; i < sizeof...(Ts); i++)
+            {
+                if (matches[i])
+                {
+                    if (ret != sizeof...(Ts))
+                        return sizeof...(Ts);
+                    ret = i;
+                }
+            }
+            return ret;
+        }
+    }
+
+    template <
+        // `em::Columns<Ts...>`, the value types.
+        typename ColumnList,
+        // Same as in `em::IndexMap`.
+        std::unsigned_integral KeyType = unsigned int,
+        typename PersistentData = void,
+        typename Allocator = std::allocator<KeyType>,
+        template <typename...> typename IndexContainer = std::vector,
+        // Each column is stored in this. Must be contiguous.
+        template <typename...> typename ColumnContainer = std::vector,
+        // Same as in `em::IndexMap`, except `erase_policy` must be `em::ErasePolicy::swap_and_pop`.
+        typename Options = IndexMapOptions
+    >
+    class BasicIndexMultiColumn;
+
+    // Like an `em::IndexMap` whose values are split into several columns, one per type in `Ts...`, each stored in its own contiguous array.
+    // The elements are still created and erased as a whole: there's one key<->index table, and element `i` consists of the `i`-th value of every column.
+    // So `column<Position>()` is a plain `std::span<Position>` that a loop can vectorize over, while the keys work like in `em::IndexMap`.
+    // Erasing moves the last element into the hole in every column at once, as `IndexMap::erase()` does.
+    // The column types must be nothrow-movable, so the columns can't get out of sync.
+    template <typename ...Ts, std::unsigned_integral KeyType, typename PersistentData, typename Allocator, template <typename...> typename IndexContainer, template <typename...> typename ColumnContainer, typename Options>
+    requires (sizeof...(Ts) > 0) && (std::is_nothrow_move_constructible_v<Ts> && ...) && (std::is_nothrow_move_assignable_v<Ts> && ...)
+    class BasicIndexMultiColumn<Columns<Ts...>, KeyType, PersistentData, Allocator, IndexContainer, ColumnContainer, Options>
+    {
+      public:
+        // The key<->index table. It has no values of its own, `size()` counts the elements.
+        using key_map = IndexMap<void, KeyType, PersistentData, Allocator, IndexContainer, std::vector, Options>;
+        static_assert(std::is_same_v<typename Options::erase_policy, ErasePolicy::swap_and_pop>, "The columns don't support the tombstones.");
+
+        using key = typename key_map::key;
+        using handle = typename key_map::handle;
+        using insert_result = typename key_map::insert_result;
+        using size_type = std::size_t;
+        using difference_type = std::ptrdiff_t;
+
+        static constexpr std::size_t column_count = sizeof...(Ts);
+        template <std::size_t I>
+        using column_type = std::tuple_element_t<I, std::tuple<Ts...>>;
+        // The index of the column of type `C`, which must appear once in `Ts...`.
+        template <typename C>
+        static constexpr std::size_t column_index = detail::IndexMultiColumn::ColumnIndex<C, Ts...>();
+
+        template <typename C>
+        using column_container = ColumnContainer<C, typename std::allocator_traits<Allocator>::template rebind_alloc<C>>;
+        static_assert((std::ranges::contiguous_range<column_container<Ts>> && ...), "The columns must be contiguous.");
+
+      private:
+        key_map keys_low;
+        std::tuple<column_container<Ts>...> columns;
+
+        // For temporary buffers.
+        template <typename U>
+        using scratch_vector = std::vector<U, typename std::allocator_traits<Allocator>::template rebind_alloc<U>>;
+
+        // Calls `func(column)` for each column.
+        constexpr void for_each_column(auto &&func)
+        {
+            std::apply([&](auto &... c){(func(c), ...);}, columns);
+        }
+
+        // Removes the last element of every column.
+        constexpr void pop_back_all() noexcept
+        {
+            for_each_column([](auto &c){c.pop_back();});
+        }
+
+      public:
+        [[nodiscard]] BasicIndexMultiColumn() = default;
+        [[nodiscard]] constexpr BasicIndexMultiColumn(const Allocator &alloc) : keys_low(alloc), columns(column_container<Ts>(alloc)...) {}
+
+        // The key<->index table, for the lookups not listed here.
+        // It's not modifiable, since it must stay in sync with the columns. Use `get_persistent_data()` below to modify the persistent data.
+        [[nodiscard]] constexpr const key_map &keys() const noexcept {return keys_low;}
+
+        [[nodiscard]] constexpr std::size_t size() const noexcept {return keys_low.size();}
+        [[nodiscard]] constexpr bool empty() const noexcept {return keys_low.empty();}
+        [[nodiscard]] static constexpr std::size_t max_size() noexcept {return key_map::max_size();}
+
+        [[nodiscard]] constexpr bool contains(key k) const noexcept {return keys_low.contains(k);}
+        [[nodiscard]] constexpr bool contains(handle h) const noexcept requires key_map::has_generations {return keys_low.contains(h);}
+        [[nodiscard]] constexpr std::size_t key_to_index(key k) const {return keys_low.key_to_index(k);}
+        [[nodiscard]] constexpr key index_to_key(std::size_t i) const {return keys_low.index_to_key(i);}
+
+        // Converting handles, same as in `em::IndexMap`. The ones accepting a handle throw if it's stale or invalid.
+        [[nodiscard]] constexpr handle key_to_handle(key k) const requires key_map::has_generations {return keys_low.key_to_handle(k);}
+        [[nodiscard]] constexpr handle index_to_handle(std::size_t i) const requires key_map::has_generations {return keys_low.index_to_handle(i);}
+        [[nodiscard]] constexpr std::size_t handle_to_index_or_throw(handle h) const requires key_map::has_generations {return keys_low.handle_to_index_or_throw(h);}
+
+        // The persistent data by key or by index, same as in `em::IndexMap`. It doesn't affect the columns, so it's writable.
+        [[nodiscard]] constexpr typename key_map::persistent_data_reference       get_persistent_data(key k)       requires key_map::has_persistent_data_type {return keys_low.get_persistent_data(k);}
+        [[nodiscard]] constexpr typename key_map::persistent_data_const_reference get_persistent_data(key k) const requires key_map::has_persistent_data_type {return keys_low.get_persistent_data(k);}
+        [[nodiscard]] constexpr typename key_map::persistent_data_reference       get_persistent_data(std::size_t i)       requires key_map::has_persistent_data_type {return keys_low.get_persistent_data(i);}
+        [[nodiscard]] constexpr typename key_map::persistent_data_const_reference get_persistent_data(std::size_t i) const requires key_map::has_persistent_data_type {return keys_low.get_persistent_data(i);}
+
+        // The whole columns, by type (which must be unique) or by index. Element `i` of each column belongs to the element with index `i`.
+        template <typename C> requires (column_index<C> < column_count)
+        [[nodiscard]] constexpr std::span<      C> column()       noexcept {return column<column_index<C>>();}
+        template <typename C> requires (column_index<C> < column_count)
+        [[nodiscard]] constexpr std::span<const C> column() const noexcept {return column<column_index<C>>();}
+        template <std::size_t I> requires (I < column_count)
+        [[nodiscard]] constexpr std::span<      column_type<I>> column()       noexcept {return std::get<I>(columns);}
+        template <std::size_t I> requires (I < column_count)
+        [[nodiscard]] constexpr std::span<const column_type<I>> column() const noexcept {return std::get<I>(columns);}
+
+        // One value by key. Throws if the key is invalid.
+        template <typename C> requires (column_index<C> < column_count)
+        [[nodiscard]] constexpr       C &get(key k)       {return column<C>()[key_to_index(k)];}
+        template <typename C> requires (column_index<C> < column_count)
+        [[nodiscard]] constexpr const C &get(key k) const {return column<C>()[key_to_index(k)];}
+        template <std::size_t I> requires (I < column_count)
+        [[nodiscard]] constexpr       column_type<I> &get(key k)       {return column<I>()[key_to_index(k)];}
+        template <std::size_t I> requires (I < column_count)
+        [[nodiscard]] constexpr const column_type<I> &get(key k) const {return column<I>()[key_to_index(k)];}
+
+        // One value by handle. Throws if the handle is stale or invalid.
+        template <typename C> requires (column_index<C> < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr       C &get(handle h)       {return column<C>()[handle_to_index_or_throw(h)];}
+        template <typename C> requires (column_index<C> < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr const C &get(handle h) const {return column<C>()[handle_to_index_or_throw(h)];}
+        template <std::size_t I> requires (I < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr       column_type<I> &get(handle h)       {return column<I>()[handle_to_index_or_throw(h)];}
+        template <std::size_t I> requires (I < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr const column_type<I> &get(handle h) const {return column<I>()[handle_to_index_or_throw(h)];}
+
+        // A pointer to one value by handle, or null if the handle is stale or invalid.
+        template <typename C> requires (column_index<C> < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr       C *try_get(handle h)       noexcept {return try_get<column_index<C>>(h);}
+        template <typename C> requires (column_index<C> < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr const C *try_get(handle h) const noexcept {return try_get<column_index<C>>(h);}
+        template <std::size_t I> requires (I < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr       column_type<I> *try_get(handle h)       noexcept {return contains(h) ? &column<I>()[keys_low.handle_to_index_or_throw(h)] : nullptr;}
+        template <std::size_t I> requires (I < column_count) && key_map::has_generations
+        [[nodiscard]] constexpr const column_type<I> *try_get(handle h) const noexcept {return contains(h) ? &column<I>()[keys_low.handle_to_index_or_throw(h)] : nullptr;}
+
+        // Inserts an element, constructing each column value from the respective parameter. If this throws, nothing is inserted.
+        template <typename ...Us>
+        requires (sizeof...(Us) == sizeof...(Ts)) && (std::is_constructible_v<Ts, Us> && ...)
+        constexpr insert_result insert(Us &&... values)
+        {
+            if (size() >= max_size())
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Index map is too large."));
+
+            // If anything throws, remove the values that were already added.
+            struct Guard
+            {
+                BasicIndexMultiColumn *self;
+                std::size_t old_size = self->size();
+                constexpr ~Guard()
+                {
+                    if (self)
+                        self->for_each_column([&](auto &c){if (c.size() > old_size) c.pop_back();});
+                }
+            };
+            Guard guard{this};
+            [&]<std::size_t ...I>(std::index_sequence<I...>)
+            {
+                (std::get<I>(columns).emplace_back(std::forward<Us>(values)), ...);
+            }(std::index_sequence_for<Ts...>{});
+            insert_result ret = keys_low.emplace();
+            guard.self = nullptr;
+            return ret;
+        }
+
+        // Erase by key, index, or handle. Throws if it's invalid.
+        // The last element is moved into the hole, in all columns.
+        constexpr void erase(key k) {erase(key_to_index(k));}
+        constexpr void erase(std::size_t i)
+        {
+            if (!keys_low.valid_index(i))
+                DETAIL_EM_INDEXMAP_THROW(std::out_of_range("Invalid index map index."));
+            std::size_t last = size() - 1;
+            for_each_column([&](auto &c)
+            {
+                if (i != last)
+                    c[i] = std::move(c[last]);
+                c.pop_back();
+            });
+            keys_low.erase(i); // This also moves the key of the last element to `i`.
+        }
+        constexpr void erase(handle h) requires key_map::has_generations {erase(keys_low.handle_to_index_or_throw(h));}
+
+        // Erases all elements for which `pred(i)` returns true, where `i` is the element index. Returns the number of erased elements.
+        // The remaining elements keep their relative order. `pred` is called for all elements before erasing anything, so if it throws, nothing is erased.
+        constexpr std::size_t erase_if_index(auto &&pred)
+        {
+            std::size_t n = size();
+            scratch_vector<std::uint64_t> marks((n + 63) / 64);
+            std::size_t count = 0;
+            for (std::size_t i = 0; i < n; i++)
+            {
+                if (pred(std::as_const(i)))
+                {
+                    marks[i / 64] |= std::uint64_t(1) << (i % 64);
+                    count++;
+                }
+            }
+            if (count == 0)
+                return 0;
+
+            for_each_column([&](auto &c)
+            {
+                std::size_t write = 0;
+                for (std::size_t read = 0; read < n; read++)
+                {
+                    if (marks[read / 64] >> (read % 64) & 1)
+                        continue;
+                    if (write != read)
+                        c[write] = std::move(c[read]);
+                    write++;
+                }
+                while (c.size() > write)
+                    c.pop_back();
+            });
+            keys_low.erase_marked_indices(marks, true);
+            return count;
+        }
+
+        // Erases everything, see `IndexMap::clear()`.
+        constexpr void clear() noexcept
+        {
+            for_each_column([](auto &c){c.clear();});
+            keys_low.clear();
+        }
+
+        // Swaps the indices of two elements, in all columns. Both must be valid.
+        constexpr void swap_elems(std::size_t i, std::size_t j) noexcept((std::is_nothrow_swappable_v<Ts> && ...))
+        {
+            keys_low.swap_elems(i, j);
+            for_each_column([&](auto &c){std::ranges::swap(c[i], c[j]);});
+        }
+
+        // Moves the element at index `order[j]` to index `j`, for each `j`, in all columns. See `IndexMap::reorder()`.
+        // `order` must be a permutation of `[0, size())`, otherwise throws `std::invalid_argument` and changes nothing. The contents of `order` are destroyed.
+        constexpr void reorder(std::span<std::size_t> order)
+        {
+            scratch_vector<std::size_t> key_order(order.begin(), order.end());
+            keys_low.reorder(key_order); // This checks `order`.
+
+            // Follow each cycle of the permutation, moving the values of all columns together. The processed indices are marked with `order[j] == j`.
+            std::size_t n = size();
+            for (std::size_t i = 0; i < n; i++)
+            {
+                if (order[i] == i)
+                    continue;
+                std::tuple<Ts...> first = std::apply([&](auto &... c){return std::tuple<Ts...>(std::move(c[i])...);}, columns);
+                std::size_t j = i;
+                while (order[j] != i)
+                {
+                    std::size_t source = order[j];
+                    for_each_column([&](auto &c){c[j] = std::move(c[source]);});
+                    order[j] = j;
+                    j = source;
+                }
+                [&]<std::size_t ...I>(std::index_sequence<I...>)
+                {
+                    ((std::get<I>(columns)[j] = std::move(std::get<I>(first))), ...);
+                }(std::index_sequence_for<Ts...>{});
+                order[j] = j;
+            }
+        }
+
+        // Sorts the elements by `proj(value)` using `comp`, where `value` is from the column of type (or index) `C`. The other columns and the keys follow along.
+        template <typename C, typename Proj = std::identity, typename Comp = std::ranges::less>
+        requires (column_index<C> < column_count)
+        constexpr void sort_by(Proj proj = {}, Comp comp = {})
+        {
+            sort_by<column_index<C>>(std::move(proj), std::move(comp));
+        }
+        template <std::size_t I, typename Proj = std::identity, typename Comp = std::ranges::less>
+        requires (I < column_count) && std::indirect_strict_weak_order<Comp, std::projected<const column_type<I> *, Proj>>
+        constexpr void sort_by(Proj proj = {}, Comp comp = {})
+        {
+            std::span<const column_type<I>> values = std::as_const(*this).template column<I>();
+            scratch_vector<std::size_t> order(size());
+            for (std::size_t i = 0; i < order.size(); i++)
+                order[i] = i;
+            std::ranges::sort(order, comp, [&](std::size_t i) -> decltype(auto) {return std::invoke(proj, values[i]);});
+            reorder(order);
+        }
+
+        // Memory management:
+
+        // Reserves room for `n` elements in the key tables and in every column.
+        constexpr void reserve(std::size_t n)
+        {
+            DETAIL_EM_INDEXMAP_ASSERT(n <= max_size());
+            keys_low.keys_reserve(n);
+            for_each_column([&](auto &c){c.reserve(n);});
+        }
+        constexpr void shrink_to_fit() noexcept
+        {
+            keys_low.keys_shrink_to_fit();
+            for_each_column([](auto &c){c.shrink_to_fit();});
+        }
+
+        // The bytes allocated for the keys, the columns (as `values`), and the extra bookkeeping. See `IndexMap::memory_usage()`.
+        [[nodiscard]] constexpr typename key_map::memory_usage_info memory_usage() const noexcept
+        {
+            typename key_map::memory_usage_info ret = keys_low.memory_usage();
+            std::apply([&](const auto &... c){((ret.values += c.capacity() * sizeof(typename std::remove_cvref_t<decltype(c)>::value_type)), ...);}, columns);
+            return ret;
+        }
+    };
+
+    // `BasicIndexMultiColumn` with the default key type and options, e.g. `em::IndexMultiColumn<Position, Velocity, Flags>`.
+    template <typename ...Ts>
+    using IndexMultiColumn = BasicIndexMultiColumn<Columns<Ts...>>;
+}
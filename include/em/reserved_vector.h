@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef DETAIL_EM_RESERVEDVECTOR_NO_UNIQUE_ADDRESS
+#ifdef _MSC_VER
+#define DETAIL_EM_RESERVEDVECTOR_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#else
+#define DETAIL_EM_RESERVEDVECTOR_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+#endif
+
+#ifndef DETAIL_EM_RESERVEDVECTOR_ASSERT
+#include <cassert>
+#define DETAIL_EM_RESERVEDVECTOR_ASSERT(...) assert(__VA_ARGS__)
+#endif
+
+#ifndef DETAIL_EM_RESERVEDVECTOR_THROW
+#if __cpp_exceptions
+#define DETAIL_EM_RESERVEDVECTOR_THROW(...) (throw(__VA_ARGS__))
+#else
+#define DETAIL_EM_RESERVEDVECTOR_THROW(...) std::terminate()
+#endif
+#endif
+
+namespace em
+{
+    namespace detail::ReservedVector
+    {
+        [[nodiscard]] inline std::size_t PageSize() noexcept
+        {
+            static const std::size_t ret = std::size_t(sysconf(_SC_PAGESIZE));
+            return ret;
+        }
+
+        [[nodiscard]] inline std::size_t RoundUpToPages(std::size_t bytes) noexcept
+        {
+            std::size_t page = PageSize();
+            return (bytes + page - 1) / page * page;
+        }
+    }
+
+    // A contiguous random-access container that reserves `MaxBytes` of address space on first use, and then commits the pages as it grows.
+    // Unlike `std::vector`, growing it never moves the existing elements, so element addresses are stable (until the element is erased),
+    //   and there are no reallocation spikes in time or memory. Unlike `SegmentedVector`, the elements stay contiguous.
+    // `shrink_to_fit()` gives the unused pages back to the OS, also without moving anything.
+    // The reserved range only costs address space, not memory, but it's fixed: the container can't grow past `MaxBytes`.
+    // The address space is limited too: each non-empty instance holds `MaxBytes` of it, and a 64-bit process typically has 128 TiB in total,
+    //   so many instances with a large `MaxBytes` can exhaust it. Pick `MaxBytes` from the expected maximum size.
+    // If `HugePages` is true, asks the OS to back the memory with transparent huge pages, which can make random access faster for large arrays.
+    // The allocator is only stored, not used, since the memory comes directly from `mmap()`. Only available on POSIX systems.
+    // Can be used as `IndexMap`'s `IndexContainer` and `ValueContainer`, see `ReservedVector` below.
+    template <
+        typename T,
+        typename Allocator = std::allocator<T>,
+        // 1 GiB by default. Rounded up to the page size.
+        std::size_t MaxBytes = std::size_t(1) << 30,
+        bool HugePages = false
+    >
+    requires (MaxBytes >= sizeof(T))
+    class BasicReservedVector
+    {
+        DETAIL_EM_RESERVEDVECTOR_NO_UNIQUE_ADDRESS Allocator alloc;
+        // The beginning of the reserved range, or null if it's not reserved yet.
+        T *ptr = nullptr;
+        std::size_t count = 0;
+        // The first bytes of the reserved range that are readable and writable. Always a multiple of the page size.
+        std::size_t committed_bytes = 0;
+
+        [[nodiscard]] static std::size_t reserved_bytes() noexcept {return detail::ReservedVector::RoundUpToPages(MaxBytes);}
+
+        // Reserves the address range, if not done yet.
+        void reserve_range()
+        {
+            if (ptr)
+                return;
+            void *range = mmap(nullptr, reserved_bytes(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (range == MAP_FAILED)
+                DETAIL_EM_RESERVEDVECTOR_THROW(std::bad_alloc());
+            #ifdef MADV_HUGEPAGE
+            if constexpr (HugePages)
+                madvise(range, reserved_bytes(), MADV_HUGEPAGE); // Only a hint, ignore failures.
+            #endif
+            ptr = static_cast<T *>(range);
+        }
+
+        // Releases the address range. There must be no elements.
+        void release_range() noexcept
+        {
+            DETAIL_EM_RESERVEDVECTOR_ASSERT(count == 0);
+            if (!ptr)
+                return;
+            munmap(ptr, reserved_bytes());
+            ptr = nullptr;
+            committed_bytes = 0;
+        }
+
+        // Destroys all elements and releases the memory.
+        void destroy_all() noexcept
+        {
+            clear();
+            release_range();
+        }
+
+        // Copies or moves the elements from `other` to the end of this container, which must be empty.
+        void append_from(auto &&other)
+        {
+            reserve(other.size());
+            for (auto &elem : other)
+            {
+                if constexpr (std::is_rvalue_reference_v<decltype(other)>)
+                    emplace_back(std::move(elem));
+                else
+                    emplace_back(elem);
+            }
+        }
+
+      public:
+        // Standard container members:
+
+        using value_type             = T;
+        using allocator_type         = Allocator;
+        using size_type              = std::size_t; // Forcing `std::size_t` for simplicity.
+        using difference_type        = std::ptrdiff_t;
+        using reference              = T &;
+        using const_reference        = const T &;
+        using pointer                = T *;
+        using const_pointer          = const T *;
+        using iterator               = T *;
+        using const_iterator         = const T *;
+        using reverse_iterator       = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+        // Growing and shrinking never move the elements. `IndexMap` then reserves exactly what it needs, and shrinks without copying.
+        static constexpr bool never_moves_elements = true;
+
+        [[nodiscard]] BasicReservedVector() = default;
+        [[nodiscard]] explicit BasicReservedVector(const Allocator &alloc) : alloc(alloc) {}
+        [[nodiscard]] BasicReservedVector(size_type n, const T &value, const Allocator &alloc = Allocator()) : alloc(alloc)
+        {
+            resize(n, value);
+        }
+
+        [[nodiscard]] BasicReservedVector(const BasicReservedVector &other)
+            : alloc(std::allocator_traits<Allocator>::select_on_container_copy_construction(other.alloc))
+        {
+            struct Guard
+            {
+                BasicReservedVector *self;
+                ~Guard() {if (self) self->destroy_all();}
+            };
+            Guard guard{this};
+            append_from(other);
+            guard.self = nullptr;
+        }
+
+        [[nodiscard]] BasicReservedVector(BasicReservedVector &&other) noexcept
+            : alloc(std::move(other.alloc)), ptr(std::exchange(other.ptr, nullptr)), count(std::exchange(other.count, 0)), committed_bytes(std::exchange(other.committed_bytes, 0))
+        {}
+
+        // The allocator isn't used, so it never prevents moving the memory.
+        BasicReservedVector &operator=(const BasicReservedVector &other)
+        {
+            if (this != &other)
+            {
+                BasicReservedVector copy(other);
+                swap(copy);
+            }
+            return *this;
+        }
+        BasicReservedVector &operator=(BasicReservedVector &&other) noexcept
+        {
+            if (this != &other)
+            {
+                destroy_all();
+                swap(other);
+            }
+            return *this;
+        }
+
+        ~BasicReservedVector() {destroy_all();}
+
+        void swap(BasicReservedVector &other) noexcept
+        {
+            if constexpr (std::allocator_traits<Allocator>::propagate_on_container_swap::value)
+                std::ranges::swap(alloc, other.alloc);
+            std::swap(ptr, other.ptr);
+            std::swap(count, other.count);
+            std::swap(committed_bytes, other.committed_bytes);
+        }
+        friend void swap(BasicReservedVector &a, BasicReservedVector &b) noexcept {a.swap(b);}
+
+        [[nodiscard]] allocator_type get_allocator() const noexcept {return alloc;}
+
+        [[nodiscard]] size_type size() const noexcept {return count;}
+        [[nodiscard]] bool empty() const noexcept {return count == 0;}
+        [[nodiscard]] static constexpr size_type max_size() noexcept {return MaxBytes / sizeof(T);}
+
+        // The committed pages, in elements.
+        [[nodiscard]] size_type capacity() const noexcept {return committed_bytes / sizeof(T);}
+        // Commits pages until the capacity is at least `n`. This never moves the elements.
+        // When growing, commits at least twice the old amount, to make fewer system calls. The untouched pages still don't use any memory.
+        void reserve(size_type n)
+        {
+            if (n > max_size())
+                DETAIL_EM_RESERVEDVECTOR_THROW(std::length_error("Reserved vector would be too large."));
+            if (n <= capacity())
+                return;
+            reserve_range();
+            std::size_t new_bytes = std::max(detail::ReservedVector::RoundUpToPages(n * sizeof(T)), std::min(committed_bytes * 2, reserved_bytes()));
+            if (mprotect(reinterpret_cast<char *>(ptr) + committed_bytes, new_bytes - committed_bytes, PROT_READ | PROT_WRITE) != 0)
+                DETAIL_EM_RESERVEDVECTOR_THROW(std::bad_alloc());
+            committed_bytes = new_bytes;
+        }
+        // Gives the pages past the last element back to the OS. When empty, also releases the address range.
+        void shrink_to_fit() noexcept
+        {
+            if (count == 0)
+            {
+                release_range();
+                return;
+            }
+            std::size_t needed_bytes = detail::ReservedVector::RoundUpToPages(count * sizeof(T));
+            if (needed_bytes >= committed_bytes)
+                return;
+            char *unused = reinterpret_cast<char *>(ptr) + needed_bytes;
+            madvise(unused, committed_bytes - needed_bytes, MADV_DONTNEED);
+            mprotect(unused, committed_bytes - needed_bytes, PROT_NONE);
+            committed_bytes = needed_bytes;
+        }
+
+        // Destroys the elements, but keeps the pages committed.
+        void clear() noexcept
+        {
+            while (count > 0)
+                pop_back();
+        }
+
+        reference emplace_back(auto &&... params)
+        {
+            if (count == capacity())
+                reserve(count + 1);
+            T *elem = std::construct_at(ptr + count, decltype(params)(params)...);
+            count++;
+            return *elem;
+        }
+        void push_back(const T  &value) {emplace_back(          value );}
+        void push_back(      T &&value) {emplace_back(std::move(value));}
+
+        void pop_back() noexcept
+        {
+            DETAIL_EM_RESERVEDVECTOR_ASSERT(count > 0);
+            count--;
+            std::destroy_at(ptr + count);
+        }
+
+        // Value-initializes the new elements, or copies them from `value`.
+        void resize(size_type n)
+        {
+            reserve(n);
+            while (count < n)
+                emplace_back();
+            while (count > n)
+                pop_back();
+        }
+        void resize(size_type n, const T &value)
+        {
+            reserve(n);
+            while (count < n)
+                emplace_back(value);
+            while (count > n)
+                pop_back();
+        }
+
+        // Element access:
+
+        [[nodiscard]] reference       operator[](size_type i)       noexcept {DETAIL_EM_RESERVEDVECTOR_ASSERT(i < count); return ptr[i];}
+        [[nodiscard]] const_reference operator[](size_type i) const noexcept {DETAIL_EM_RESERVEDVECTOR_ASSERT(i < count); return ptr[i];}
+
+        [[nodiscard]] reference       at(size_type i)       {if (i >= count) DETAIL_EM_RESERVEDVECTOR_THROW(std::out_of_range("Invalid reserved vector index.")); return ptr[i];}
+        [[nodiscard]] const_reference at(size_type i) const {if (i >= count) DETAIL_EM_RESERVEDVECTOR_THROW(std::out_of_range("Invalid reserved vector index.")); return ptr[i];}
+
+        [[nodiscard]] reference       front()       noexcept {return (*this)[0];}
+        [[nodiscard]] const_reference front() const noexcept {return (*this)[0];}
+        [[nodiscard]] reference       back()       noexcept {return (*this)[count - 1];}
+        [[nodiscard]] const_reference back() const noexcept {return (*this)[count - 1];}
+
+        [[nodiscard]]       T *data()       noexcept {return ptr;}
+        [[nodiscard]] const T *data() const noexcept {return ptr;}
+
+        // Iterators:
+
+        [[nodiscard]] iterator       begin()       noexcept {return ptr;}
+        [[nodiscard]] const_iterator begin() const noexcept {return ptr;}
+        [[nodiscard]] iterator       end()       noexcept {return ptr + count;}
+        [[nodiscard]] const_iterator end() const noexcept {return ptr + count;}
+        [[nodiscard]] const_iterator cbegin() const noexcept {return begin();}
+        [[nodiscard]] const_iterator cend() const noexcept {return end();}
+
+        [[nodiscard]] reverse_iterator       rbegin()       noexcept {return reverse_iterator(end());}
+        [[nodiscard]] const_reverse_iterator rbegin() const noexcept {return const_reverse_iterator(end());}
+        [[nodiscard]] reverse_iterator       rend()       noexcept {return reverse_iterator(begin());}
+        [[nodiscard]] const_reverse_iterator rend() const noexcept {return const_reverse_iterator(begin());}
+        [[nodiscard]] const_reverse_iterator crbegin() const noexcept {return rbegin();}
+        [[nodiscard]] const_reverse_iterator crend() const noexcept {return rend();}
+
+        [[nodiscard]] friend bool operator==(const BasicReservedVector &a, const BasicReservedVector &b) {return std::ranges::equal(a, b);}
+    };
+
+    // `BasicReservedVector` with the default size limit.
+    // This takes the same template parameters as `std::vector`, so it can be passed to `IndexMap` as the `IndexContainer` or the `ValueContainer`:
+    //     em::IndexMap<T, unsigned int, void, std::allocator<unsigned int>, em::ReservedVector, em::ReservedVector>
+    template <typename T, typename Allocator = std::allocator<T>>
+    using ReservedVector = BasicReservedVector<T, Allocator>;
+}
+#endif
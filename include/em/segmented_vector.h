@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <compare>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <ranges>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#ifndef DETAIL_EM_SEGMENTEDVECTOR_NO_UNIQUE_ADDRESS
+#ifdef _MSC_VER
+#define DETAIL_EM_SEGMENTEDVECTOR_NO_UNIQUE_ADDRESS [[msvc::no_unique_address]]
+#else
+#define DETAIL_EM_SEGMENTEDVECTOR_NO_UNIQUE_ADDRESS [[no_unique_address]]
+#endif
+#endif
+
+#ifndef DETAIL_EM_SEGMENTEDVECTOR_ASSERT
+#include <cassert>
+#define DETAIL_EM_SEGMENTEDVECTOR_ASSERT(...) assert(__VA_ARGS__)
+#endif
+
+#ifndef DETAIL_EM_SEGMENTEDVECTOR_THROW
+#if __cpp_exceptions
+#define DETAIL_EM_SEGMENTEDVECTOR_THROW(...) (throw(__VA_ARGS__))
+#else
+#define DETAIL_EM_SEGMENTEDVECTOR_THROW(...) std::terminate()
+#endif
+#endif
+
+namespace em
+{
+    namespace detail::SegmentedVector
+    {
+        // Aim for segments of about 16 KiB, rounded down to a power of two elements.
+        template <typename T>
+        inline constexpr std::size_t default_segment_size = std::bit_floor(std::max(std::size_t(1), std::size_t(16384) / sizeof(T)));
+
+        // A random-access iterator. Stores a pointer to the array of segment pointers, and an index.
+        template <typename T, std::size_t SegmentSize, bool IsConst>
+        class Iter
+        {
+            template <typename T2, std::size_t SegmentSize2, bool IsConst2>
+            friend class Iter;
+
+            T *const *segments = nullptr;
+            std::size_t index = 0;
+
+          public:
+            using value_type = std::remove_cv_t<T>;
+            using reference = std::conditional_t<IsConst, const T &, T &>;
+            using pointer = std::conditional_t<IsConst, const T *, T *>;
+            using difference_type = std::ptrdiff_t;
+            using iterator_category = std::random_access_iterator_tag;
+
+            [[nodiscard]] constexpr Iter() {}
+            // Primarily for internal use.
+            [[nodiscard]] constexpr Iter(T *const *segments, std::size_t index) : segments(segments), index(index) {}
+
+            // Convert non-const to const iterators.
+            [[nodiscard]] constexpr Iter(const Iter<T, SegmentSize, !IsConst> &other) requires IsConst : segments(other.segments), index(other.index) {}
+
+            [[nodiscard]] constexpr reference operator*() const noexcept {return segments[index / SegmentSize][index % SegmentSize];}
+            [[nodiscard]] constexpr pointer operator->() const noexcept {return &**this;}
+
+            constexpr Iter &operator++() noexcept {index++; return *this;}
+            constexpr Iter operator++(int) noexcept {Iter ret = *this; ++*this; return ret;}
+            constexpr Iter &operator--() noexcept {index--; return *this;}
+            constexpr Iter operator--(int) noexcept {Iter ret = *this; --*this; return ret;}
+
+            friend constexpr Iter &operator+=(Iter &a, difference_type n) noexcept {a.index += (std::size_t)n; return a;}
+            friend constexpr Iter &operator-=(Iter &a, difference_type n) noexcept {a.index -= (std::size_t)n; return a;}
+
+            [[nodiscard]] friend constexpr Iter operator+(const Iter &a, difference_type n) noexcept {Iter ret = a; ret += n; return ret;}
+            [[nodiscard]] friend constexpr Iter operator+(difference_type n, const Iter &a) noexcept {Iter ret = a; ret += n; return ret;}
+            [[nodiscard]] friend constexpr Iter operator-(const Iter &a, difference_type n) noexcept {Iter ret = a; ret -= n; return ret;}
+            [[nodiscard]] friend constexpr difference_type operator-(const Iter &b, const Iter &a) noexcept {return std::ptrdiff_t(b.index) - std::ptrdiff_t(a.index);}
+
+            [[nodiscard]] constexpr reference operator[](difference_type n) const noexcept {return *(*this + n);}
+
+            // Only compare the indices, same as in `IndexMap`'s iterators.
+            [[nodiscard]] friend constexpr bool operator==(const Iter &a, const Iter &b) noexcept {return a.index == b.index;}
+            [[nodiscard]] friend constexpr std::strong_ordering operator<=>(const Iter &a, const Iter &b) noexcept {return a.index <=> b.index;}
+        };
+    }
+
+    // A random-access container that stores the elements in fixed-size segments of `SegmentSize` elements.
+    // Unlike `std::vector`, growing it never moves the existing elements: it just allocates one more segment.
+    //   So element addresses are stable (until the element is erased), and there are no reallocation spikes in time or memory.
+    // The price is an extra indirection on every access, and the elements not being contiguous.
+    //   Use `segments()` to iterate over the contiguous parts, e.g. in loops that should be vectorized.
+    // Can be used as `IndexMap`'s `ValueContainer`, see `SegmentedVector` below.
+    template <
+        typename T,
+        typename Allocator = std::allocator<T>,
+        // Must be a power of two, so the index math compiles to shifts and masks.
+        std::size_t SegmentSize = detail::SegmentedVector::default_segment_size<T>
+    >
+    requires (std::has_single_bit(SegmentSize))
+    class BasicSegmentedVector
+    {
+        static_assert(std::is_same_v<typename std::allocator_traits<Allocator>::pointer, T *>, "Fancy pointers are not supported.");
+
+        using segment_list = std::vector<T *, typename std::allocator_traits<Allocator>::template rebind_alloc<T *>>;
+
+        DETAIL_EM_SEGMENTEDVECTOR_NO_UNIQUE_ADDRESS Allocator alloc;
+        // All allocated segments. The ones past the elements are spare capacity.
+        segment_list segment_ptrs;
+        std::size_t count = 0;
+
+        // Appends one more segment, doesn't change the size.
+        constexpr void add_segment()
+        {
+            segment_ptrs.reserve(segment_ptrs.size() + 1); // If this throws, nothing happens.
+            segment_ptrs.push_back(std::allocator_traits<Allocator>::allocate(alloc, SegmentSize)); // This can't throw after the `reserve()`.
+        }
+
+        // Destroys all elements and deallocates all segments.
+        constexpr void destroy_all() noexcept
+        {
+            clear();
+            for (T *segment : segment_ptrs)
+                std::allocator_traits<Allocator>::deallocate(alloc, segment, SegmentSize);
+            segment_ptrs.clear();
+        }
+
+        // Copies or moves the elements from `other` to the end of this container, which must be empty.
+        constexpr void append_from(auto &&other)
+        {
+            reserve(other.size());
+            for (auto &elem : other)
+            {
+                if constexpr (std::is_rvalue_reference_v<decltype(other)>)
+                    emplace_back(std::move(elem));
+                else
+                    emplace_back(elem);
+            }
+        }
+
+      public:
+        // Standard container members:
+
+        using value_type             = T;
+        using allocator_type         = Allocator;
+        using size_type              = std::size_t; // Forcing `std::size_t` for simplicity.
+        using difference_type        = std::ptrdiff_t;
+        using reference              = T &;
+        using const_reference        = const T &;
+        using pointer                = T *;
+        using const_pointer          = const T *;
+        using iterator               = detail::SegmentedVector::Iter<T, SegmentSize, false>;
+        using const_iterator         = detail::SegmentedVector::Iter<T, SegmentSize, true>;
+        using reverse_iterator       = std::reverse_iterator<iterator>;
+        using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+        // How many elements are in a segment.
+        static constexpr std::size_t segment_size = SegmentSize;
+
+        [[nodiscard]] BasicSegmentedVector() = default;
+        [[nodiscard]] constexpr explicit BasicSegmentedVector(const Allocator &alloc) : alloc(alloc), segment_ptrs(alloc) {}
+
+        [[nodiscard]] constexpr BasicSegmentedVector(const BasicSegmentedVector &other)
+            : alloc(std::allocator_traits<Allocator>::select_on_container_copy_construction(other.alloc)), segment_ptrs(alloc)
+        {
+            struct Guard
+            {
+                BasicSegmentedVector *self;
+                constexpr ~Guard() {if (self) self->destroy_all();}
+            };
+            Guard guard{this};
+            append_from(other);
+            guard.self = nullptr;
+        }
+
+        [[nodiscard]] constexpr BasicSegmentedVector(BasicSegmentedVector &&other) noexcept
+            : alloc(std::move(other.alloc)), segment_ptrs(std::move(other.segment_ptrs)), count(std::exchange(other.count, 0))
+        {
+            other.segment_ptrs.clear();
+        }
+
+        constexpr BasicSegmentedVector &operator=(const BasicSegmentedVector &other)
+        {
+            if (this == &other)
+                return *this;
+            if constexpr (std::allocator_traits<Allocator>::propagate_on_container_copy_assignment::value)
+            {
+                if (alloc != other.alloc)
+                    destroy_all();
+                alloc = other.alloc;
+            }
+            clear();
+            append_from(other);
+            return *this;
+        }
+
+        constexpr BasicSegmentedVector &operator=(BasicSegmentedVector &&other)
+            noexcept(std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value || std::allocator_traits<Allocator>::is_always_equal::value)
+        {
+            if (this == &other)
+                return *this;
+            if (std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value || alloc == other.alloc)
+            {
+                destroy_all();
+                if constexpr (std::allocator_traits<Allocator>::propagate_on_container_move_assignment::value)
+                    alloc = std::move(other.alloc);
+                segment_ptrs = std::move(other.segment_ptrs);
+                other.segment_ptrs.clear();
+                count = std::exchange(other.count, 0);
+            }
+            else
+            {
+                // Different allocators, have to move element-wise.
+                clear();
+                append_from(std::move(other));
+                other.clear();
+            }
+            return *this;
+        }
+
+        constexpr ~BasicSegmentedVector() {destroy_all();}
+
+        constexpr void swap(BasicSegmentedVector &other) noexcept
+        {
+            if constexpr (std::allocator_traits<Allocator>::propagate_on_container_swap::value)
+                std::ranges::swap(alloc, other.alloc);
+            else
+                DETAIL_EM_SEGMENTEDVECTOR_ASSERT(alloc == other.alloc);
+            segment_ptrs.swap(other.segment_ptrs);
+            std::swap(count, other.count);
+        }
+        friend constexpr void swap(BasicSegmentedVector &a, BasicSegmentedVector &b) noexcept {a.swap(b);}
+
+        [[nodiscard]] constexpr allocator_type get_allocator() const noexcept {return alloc;}
+
+        [[nodiscard]] constexpr size_type size() const noexcept {return count;}
+        [[nodiscard]] constexpr bool empty() const noexcept {return count == 0;}
+        [[nodiscard]] constexpr size_type max_size() const noexcept {return std::size_t(-1) / sizeof(T);}
+
+        // Capacity is always a multiple of `segment_size`.
+        [[nodiscard]] constexpr size_type capacity() const noexcept {return segment_ptrs.size() * SegmentSize;}
+        // Allocates segments until the capacity is at least `n`. This never moves the elements.
+        constexpr void reserve(size_type n)
+        {
+            if (n > max_size())
+                DETAIL_EM_SEGMENTEDVECTOR_THROW(std::length_error("Segmented vector would be too large."));
+            segment_ptrs.reserve((n + SegmentSize - 1) / SegmentSize);
+            while (capacity() < n)
+                add_segment();
+        }
+        // Frees the spare segments.
+        constexpr void shrink_to_fit() noexcept
+        {
+            while (segment_ptrs.size() > segment_count())
+            {
+                std::allocator_traits<Allocator>::deallocate(alloc, segment_ptrs.back(), SegmentSize);
+                segment_ptrs.pop_back();
+            }
+        }
+
+        // Destroys the elements, but keeps the segments allocated.
+        constexpr void clear() noexcept
+        {
+            while (count > 0)
+                pop_back();
+        }
+
+        constexpr reference emplace_back(auto &&... params)
+        {
+            if (count == capacity())
+                add_segment();
+            T *ptr = segment_ptrs[count / SegmentSize] + count % SegmentSize;
+            std::allocator_traits<Allocator>::construct(alloc, ptr, decltype(params)(params)...);
+            count++;
+            return *ptr;
+        }
+        constexpr void push_back(const T  &value) {emplace_back(          value );}
+        constexpr void push_back(      T &&value) {emplace_back(std::move(value));}
+
+        constexpr void pop_back() noexcept
+        {
+            DETAIL_EM_SEGMENTEDVECTOR_ASSERT(count > 0);
+            count--;
+            std::allocator_traits<Allocator>::destroy(alloc, segment_ptrs[count / SegmentSize] + count % SegmentSize);
+        }
+
+        // Element access:
+
+        [[nodiscard]] constexpr reference       operator[](size_type i)       noexcept {DETAIL_EM_SEGMENTEDVECTOR_ASSERT(i < count); return segment_ptrs[i / SegmentSize][i % SegmentSize];}
+        [[nodiscard]] constexpr const_reference operator[](size_type i) const noexcept {DETAIL_EM_SEGMENTEDVECTOR_ASSERT(i < count); return segment_ptrs[i / SegmentSize][i % SegmentSize];}
+
+        [[nodiscard]] constexpr reference       at(size_type i)       {if (i >= count) DETAIL_EM_SEGMENTEDVECTOR_THROW(std::out_of_range("Invalid segmented vector index.")); return (*this)[i];}
+        [[nodiscard]] constexpr const_reference at(size_type i) const {if (i >= count) DETAIL_EM_SEGMENTEDVECTOR_THROW(std::out_of_range("Invalid segmented vector index.")); return (*this)[i];}
+
+        [[nodiscard]] constexpr reference       front()       noexcept {return (*this)[0];}
+        [[nodiscard]] constexpr const_reference front() const noexcept {return (*this)[0];}
+        [[nodiscard]] constexpr reference       back()       noexcept {return (*this)[count - 1];}
+        [[nodiscard]] constexpr const_reference back() const noexcept {return (*this)[count - 1];}
+
+        // Iterators:
+
+        [[nodiscard]] constexpr iterator       begin()       noexcept {return iterator(segment_ptrs.data(), 0);}
+        [[nodiscard]] constexpr const_iterator begin() const noexcept {return const_iterator(segment_ptrs.data(), 0);}
+        [[nodiscard]] constexpr iterator       end()       noexcept {return iterator(segment_ptrs.data(), count);}
+        [[nodiscard]] constexpr const_iterator end() const noexcept {return const_iterator(segment_ptrs.data(), count);}
+        [[nodiscard]] constexpr const_iterator cbegin() const noexcept {return begin();}
+        [[nodiscard]] constexpr const_iterator cend() const noexcept {return end();}
+
+        [[nodiscard]] constexpr reverse_iterator       rbegin()       noexcept {return reverse_iterator(end());}
+        [[nodiscard]] constexpr const_reverse_iterator rbegin() const noexcept {return const_reverse_iterator(end());}
+        [[nodiscard]] constexpr reverse_iterator       rend()       noexcept {return reverse_iterator(begin());}
+        [[nodiscard]] constexpr const_reverse_iterator rend() const noexcept {return const_reverse_iterator(begin());}
+        [[nodiscard]] constexpr const_reverse_iterator crbegin() const noexcept {return rbegin();}
+        [[nodiscard]] constexpr const_reverse_iterator crend() const noexcept {return rend();}
+
+        // Contiguous segments:
+
+        // How many segments contain elements.
+        [[nodiscard]] constexpr size_type segment_count() const noexcept {return (count + SegmentSize - 1) / SegmentSize;}
+        // The elements of the `i`-th segment. All segments except the last one are full.
+        [[nodiscard]] constexpr std::span<      T> segment(size_type i)       noexcept {DETAIL_EM_SEGMENTEDVECTOR_ASSERT(i < segment_count()); return {segment_ptrs[i], std::min(SegmentSize, count - i * SegmentSize)};}
+        [[nodiscard]] constexpr std::span<const T> segment(size_type i) const noexcept {DETAIL_EM_SEGMENTEDVECTOR_ASSERT(i < segment_count()); return {segment_ptrs[i], std::min(SegmentSize, count - i * SegmentSize)};}
+        // A range of `std::span`s, one per segment, covering all elements in order.
+        [[nodiscard]] constexpr auto segments()       noexcept {return std::views::iota(size_type(0), segment_count()) | std::views::transform([this](size_type i){return segment(i);});}
+        [[nodiscard]] constexpr auto segments() const noexcept {return std::views::iota(size_type(0), segment_count()) | std::views::transform([this](size_type i){return segment(i);});}
+
+        [[nodiscard]] friend constexpr bool operator==(const BasicSegmentedVector &a, const BasicSegmentedVector &b) {return std::ranges::equal(a, b);}
+    };
+
+    // `BasicSegmentedVector` with the default segment size.
+    // This takes the same template parameters as `std::vector`, so it can be passed to `IndexMap` as the `ValueContainer`:
+    //     em::IndexMap<T, unsigned int, void, std::allocator<unsigned int>, std::vector, em::SegmentedVector>
+    template <typename T, typename Allocator = std::allocator<T>>
+    using SegmentedVector = BasicSegmentedVector<T, Allocator>;
+}
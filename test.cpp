@@ -1,6 +1,23 @@
+// Use the serial backend of libstdc++'s parallel algorithms, so this doesn't need to be linked with TBB.
+#define _GLIBCXX_USE_TBB_PAR_BACKEND 0
+
+#include "include/em/concurrent_index_map.h"
 #include "include/em/index_map.h"
+#include "include/em/index_map_arrow.h"
+#include "include/em/index_map_parallel.h"
+#include "include/em/index_map_snapshot.h"
+#include "include/em/index_multi_column.h"
+#include "include/em/segmented_vector.h"
+#if __has_include(<sys/mman.h>)
+#include "include/em/reserved_vector.h"
+#define HAS_RESERVED_VECTOR 1
+#endif
 
+#include <array>
+#include <atomic>
+#include <execution>
 #include <string>
+#include <thread>
 
 // Commands to test this:
 //    clang++ test.cpp -std=c++20 -Wall -Wextra -pedantic-errors -Wconversion -Werror -g -o build/test -D_GLIBCXX_DEBUG -fsanitize=address -fsanitize=undefined && echo running... && build/test && echo ok
@@ -8,6 +25,67 @@
 
 struct Data {int data = 0;};
 
+struct SeparateLayout : em::IndexMapOptions
+{
+    using index_layout = em::IndexLayout::separate;
+};
+struct PagedLayout : em::IndexMapOptions
+{
+    using index_layout = em::IndexLayout::paged<4>;
+};
+template <typename T, typename KeyType = unsigned int, typename PersistentData = void>
+using PagedIndexMap = em::IndexMap<T, KeyType, PersistentData, std::allocator<KeyType>, std::vector, std::vector, PagedLayout>;
+
+template <typename T, typename KeyType = unsigned int, typename PersistentData = void>
+using SeparateIndexMap = em::IndexMap<T, KeyType, PersistentData, std::allocator<KeyType>, std::vector, std::vector, SeparateLayout>;
+
+// Small generations, to test the overflow.
+template <typename BaseOptions, em::GenerationOverflow Overflow = em::GenerationOverflow::retire>
+struct Generations : BaseOptions
+{
+    using generation_type = unsigned char;
+    static constexpr em::GenerationOverflow generation_overflow = Overflow;
+};
+// Enables the change tracking.
+template <typename BaseOptions>
+struct TrackChanges : BaseOptions
+{
+    static constexpr bool track_changes = true;
+};
+// Sets the key reuse policy.
+template <typename BaseOptions, em::KeyReuse Policy>
+struct ReuseKeys : BaseOptions
+{
+    static constexpr em::KeyReuse key_reuse = Policy;
+};
+// Enables the statistics.
+template <typename BaseOptions>
+struct CollectStatistics : BaseOptions
+{
+    static constexpr bool collect_statistics = true;
+};
+// Enables the automatic shrinking.
+template <typename BaseOptions, typename Policy = em::ShrinkPolicy::watermarks<>>
+struct AutoShrink : BaseOptions
+{
+    using shrink_policy = Policy;
+};
+// Erases by leaving tombstones.
+template <typename BaseOptions, typename Policy = em::ErasePolicy::tombstones<>>
+struct KeepTombstones : BaseOptions
+{
+    using erase_policy = Policy;
+};
+
+template <typename T, typename Options = Generations<em::IndexMapOptions>, typename PersistentData = void>
+using GenerationIndexMap = em::IndexMap<T, unsigned int, PersistentData, std::allocator<unsigned int>, std::vector, std::vector, Options>;
+
+// Tiny segments, to test the segment boundaries.
+template <typename T, typename Allocator>
+using TinySegmentedVector = em::BasicSegmentedVector<T, Allocator, 2>;
+template <typename T, typename KeyType = unsigned int, typename PersistentData = void>
+using SegmentedIndexMap = em::IndexMap<T, KeyType, PersistentData, std::allocator<KeyType>, std::vector, TinySegmentedVector>;
+
 
 #define CHECK_ARGS(...) \
     template class em::IndexMap<__VA_ARGS__>; \
@@ -32,6 +110,37 @@ CHECK_ARGS        (void       , unsigned int            )
 CHECK_ARGS        (void       , unsigned long long      )
 CHECK_ARGS        (void       , unsigned int      , Data)
 CHECK_ARGS        (void       , unsigned long long, Data)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, std::vector, std::vector, SeparateLayout)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , Data, std::allocator<unsigned int>, std::vector, std::vector, SeparateLayout)
+CHECK_ARGS        (void       , unsigned long long, void, std::allocator<unsigned int>, std::vector, std::vector, SeparateLayout)
+CHECK_ARGS        (void       , unsigned long long, Data, std::allocator<unsigned int>, std::vector, std::vector, SeparateLayout)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, std::vector, std::vector, PagedLayout)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , Data, std::allocator<unsigned int>, std::vector, std::vector, PagedLayout)
+CHECK_ARGS        (void       , unsigned long long, void, std::allocator<unsigned int>, std::vector, std::vector, PagedLayout)
+CHECK_ARGS        (void       , unsigned long long, Data, std::allocator<unsigned int>, std::vector, std::vector, PagedLayout)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, std::vector, em::SegmentedVector)
+CHECK_ARGS_NONVOID(std::string, unsigned long long, Data, std::allocator<unsigned int>, std::vector, em::SegmentedVector, SeparateLayout)
+#if HAS_RESERVED_VECTOR
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, em::ReservedVector, em::ReservedVector)
+CHECK_ARGS        (void       , unsigned long long, Data, std::allocator<unsigned int>, em::ReservedVector, em::ReservedVector, PagedLayout)
+#endif
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, std::vector, std::vector, Generations<em::IndexMapOptions>)
+CHECK_ARGS        (void       , unsigned short    , Data, std::allocator<unsigned int>, std::vector, std::vector, Generations<SeparateLayout>)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , Data, std::allocator<unsigned int>, std::vector, std::vector, Generations<PagedLayout, em::GenerationOverflow::wrap>)
+CHECK_ARGS_NONVOID(std::string, unsigned int      , void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<em::IndexMapOptions>)
+CHECK_ARGS        (void       , unsigned int      , Data, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<Generations<PagedLayout>>)
+
+template class em::BasicSegmentedVector<std::string>;
+static_assert(std::ranges::random_access_range<em::SegmentedVector<std::string>>);
+static_assert(std::ranges::random_access_range<const em::SegmentedVector<std::string>>);
+static_assert(!std::ranges::contiguous_range<em::SegmentedVector<std::string>>);
+
+#if HAS_RESERVED_VECTOR
+template class em::BasicReservedVector<std::string>;
+static_assert(std::ranges::contiguous_range<em::ReservedVector<std::string>>);
+static_assert(std::ranges::contiguous_range<const em::ReservedVector<std::string>>);
+static_assert(em::ReservedVector<int>::max_size() == (std::size_t(1) << 30) / sizeof(int));
+#endif
 
 struct A
 {
@@ -42,6 +151,17 @@ struct A
     #endif
 };
 
+// Counts how many times the value was moved around.
+struct MoveCounter
+{
+    int x = 0;
+    int moves = 0;
+
+    constexpr MoveCounter(int x) : x(x) {}
+    constexpr MoveCounter(MoveCounter &&other) noexcept : x(other.x), moves(other.moves + 1) {}
+    constexpr MoveCounter &operator=(MoveCounter &&other) noexcept {x = other.x; moves = other.moves + 1; return *this;}
+};
+
 constexpr void Check(bool value)
 {
     if (!value)
@@ -305,6 +425,8 @@ int main()
         Check(!m.remove_unused_key());
     };
     basic_checks.operator()<em::IndexMap<A>>();
+    basic_checks.operator()<SegmentedIndexMap<A>>();
+    basic_checks.operator()<SeparateIndexMap<A>>();
 
     { // Exception checks.
         em::IndexMap<A> m;
@@ -381,7 +503,9 @@ int main()
         i3.persistent_data.data = 400;
 
         m.erase(i1.key);
-        Check(m.emplace(21).key == i1.key);
+        typename M::insert_result i1_reused = m.emplace(21);
+        Check(i1_reused.key == i1.key);
+        Check(i1_reused.persistent_data.data == 200); // The persistent data of the reused key, not of whatever key sits at this index.
         m.erase(i2.key); // This finally desyncs `dense_to_sparse` and `sparse_to_dense` indices.
 
         Check(m.get_persistent_data(i0.key).data == 100);
@@ -408,6 +532,8 @@ int main()
         Check(m.get_persistent_data(2).data == 200);
     };
     persistent_data_checks.operator()<em::IndexMap<A, unsigned int, Data>>();
+    persistent_data_checks.operator()<PagedIndexMap<A, unsigned int, Data>>();
+    persistent_data_checks.operator()<SeparateIndexMap<A, unsigned int, Data>>();
 
     // Check `T == void`.
     constexpr auto void_value_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
@@ -581,6 +707,7 @@ int main()
         Check(!m.remove_unused_key());
     };
     void_value_checks.operator()<em::IndexMap<void>>();
+    void_value_checks.operator()<SeparateIndexMap<void>>();
 
     // Check the `.values()` interface.
     constexpr auto value_range_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
@@ -621,6 +748,7 @@ int main()
         Check(i == 4);
     };
     value_range_checks.operator()<em::IndexMap<A>>();
+    value_range_checks.operator()<SegmentedIndexMap<A>>();
 
     // Check the `.keys_and_values()` interface.
     constexpr auto key_value_range_basic_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
@@ -950,6 +1078,1014 @@ int main()
         }
     };
     nonmember_erase_checks.operator()<em::IndexMap<int>>();
+    nonmember_erase_checks.operator()<SegmentedIndexMap<int>>();
+    nonmember_erase_checks.operator()<PagedIndexMap<int>>();
+    nonmember_erase_checks.operator()<SeparateIndexMap<int>>();
+
+    // Compaction in `erase_if()` and `stable_erase_if()`.
+    constexpr auto erase_if_compaction_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        auto make_map = []
+        {
+            M m;
+            m.values_reserve(8); // Don't count the moves caused by the reallocation.
+            for (int i = 0; i < 8; i++)
+                (void)m.emplace(i * 10);
+            return m;
+        };
+        auto check_keys = [](const M &m)
+        {
+            for (std::size_t i = 0; i < m.size(); i++)
+            {
+                Check(m[i].moves <= 1);
+                Check(std::size_t(m.index_to_key(i)) * 10 == std::size_t(m[i].x));
+                Check(m.key_to_index(m.index_to_key(i)) == i);
+            }
+            for (std::size_t i = m.size(); i < m.keys_size(); i++)
+                Check(!m.contains(m.index_to_key_relaxed(i)));
+        };
+
+        { // Unordered: the holes are filled from the tail.
+            M m = make_map();
+            int num_calls = 0;
+            Check(em::erase_if(m.values(), [&](const MoveCounter &x){num_calls++; return x.x == 10 || x.x == 30 || x.x == 40 || x.x == 60;}) == 4);
+            Check(num_calls == 8);
+            Check(m.size() == 4);
+            Check(m[0].x == 0);
+            Check(m[1].x == 70);
+            Check(m[2].x == 20);
+            Check(m[3].x == 50);
+            check_keys(m);
+        }
+
+        { // Ordered.
+            M m = make_map();
+            int num_calls = 0;
+            Check(em::stable_erase_if(m.keys_and_values(), [&](const typename M::key_value_const_reference &x){num_calls++; return x.value().x == 10 || x.value().x == 30 || x.value().x == 40 || x.value().x == 60;}) == 4);
+            Check(num_calls == 8);
+            Check(m.size() == 4);
+            Check(m[0].x == 0);
+            Check(m[1].x == 20);
+            Check(m[2].x == 50);
+            Check(m[3].x == 70);
+            Check(m[0].moves == 0);
+            check_keys(m);
+        }
+
+        { // Erase everything, or nothing.
+            M m = make_map();
+            Check(em::stable_erase_if(m.values(), [](const MoveCounter &){return false;}) == 0);
+            Check(em::erase_if(m.values(), [](const MoveCounter &){return false;}) == 0);
+            Check(m.size() == 8);
+            for (std::size_t i = 0; i < 8; i++)
+                Check(m[i].moves == 0);
+            Check(em::erase_if(m.values(), [](const MoveCounter &){return true;}) == 8);
+            Check(m.empty());
+            Check(m.keys_size() == 8);
+        }
+    };
+    erase_if_compaction_checks.operator()<em::IndexMap<MoveCounter>>();
+    erase_if_compaction_checks.operator()<SegmentedIndexMap<MoveCounter>>();
+    erase_if_compaction_checks.operator()<PagedIndexMap<MoveCounter>>();
+    erase_if_compaction_checks.operator()<SeparateIndexMap<MoveCounter>>();
+
+    { // `stable_erase()` by value, and a throwing predicate.
+        em::IndexMap<int> m;
+        for (int x : {1, 2, 1, 3, 1, 4})
+            (void)m.insert(x);
+        Check(em::stable_erase(m.values(), 1) == 3);
+        Check(m.size() == 3);
+        Check(m[0] == 2);
+        Check(m[1] == 3);
+        Check(m[2] == 4);
+
+        for (bool keep_order : {false, true})
+        {
+            em::IndexMap<int> m2;
+            for (int x : {1, 2, 3, 4, 5, 6})
+                (void)m2.insert(x);
+            // Throw on `4`. Everything that was erased before that stays erased, and the map remains consistent.
+            MUST_THROW("Predicate failed.", m2.erase_if_index([&](std::size_t i)
+            {
+                if (m2[i] == 4)
+                    throw std::runtime_error("Predicate failed.");
+                return m2[i] % 2 == 1;
+            }, keep_order));
+            Check(m2.size() < 6);
+            Check(m2.size() >= 3);
+            for (std::size_t i = 0; i < m2.size(); i++)
+                Check(m2[m2.index_to_key(i)] == m2[i]);
+            if (keep_order)
+            {
+                Check(m2.size() == 4);
+                Check(m2[0] == 2);
+                Check(m2[1] == 4);
+                Check(m2[2] == 5);
+                Check(m2[3] == 6);
+            }
+        }
+
+        // The unordered erasure checks the elements from both ends. The ones it didn't check, including the one that threw, are kept.
+        // Throw on `4` before anything is erased, or on `3` after `0` and `5` are erased.
+        for (auto [size, throwing, remaining] : {std::tuple(5, 4, std::vector{0, 1, 2, 3, 4}), std::tuple(6, 3, std::vector{1, 2, 3, 4})})
+        {
+            em::IndexMap<int> m2;
+            for (int x = 0; x < size; x++)
+                (void)m2.insert(x);
+            MUST_THROW("Predicate failed.", em::erase_if(m2.values(), [&](int x)
+            {
+                if (x == throwing)
+                    throw std::runtime_error("Predicate failed.");
+                return x == 0 || x == 5;
+            }));
+            std::vector<int> values(m2.values().begin(), m2.values().end());
+            std::ranges::sort(values);
+            Check(values == remaining);
+            for (std::size_t i = 0; i < m2.size(); i++)
+                Check(m2[m2.index_to_key(i)] == m2[i]);
+        }
+    }
+
+    // `erase_marked_indices()`.
+    constexpr auto erase_marked_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        for (bool keep_order : {false, true})
+        {
+            M m;
+            for (int i = 0; i < 70; i++)
+                (void)m.emplace(i);
+            std::array<std::uint64_t, 2> marks{};
+            for (int i : {0, 5, 63, 64, 69})
+                marks[std::size_t(i) / 64] |= std::uint64_t(1) << (i % 64);
+            marks[1] |= std::uint64_t(1) << 10; // Past the end, ignored.
+
+            Check(m.erase_marked_indices(marks, keep_order) == 5);
+            Check(m.size() == 65);
+            for (std::size_t i = 0; i < m.size(); i++)
+            {
+                Check(m[i] != 0 && m[i] != 5 && m[i] != 63 && m[i] != 64 && m[i] != 69);
+                Check(std::size_t(m.index_to_key(i)) == std::size_t(m[i]));
+                Check(m.key_to_index(m.index_to_key(i)) == i);
+                if (keep_order && i > 0)
+                    Check(m[i - 1] < m[i]);
+            }
+
+            marks = {};
+            Check(m.erase_marked_indices(marks, keep_order) == 0);
+            Check(m.size() == 65);
+            marks = {~std::uint64_t(0), ~std::uint64_t(0)};
+            Check(m.erase_marked_indices(marks, keep_order) == 65);
+            Check(m.empty());
+        }
+    };
+    erase_marked_checks.operator()<em::IndexMap<int>>();
+    erase_marked_checks.operator()<SegmentedIndexMap<int>>();
+    erase_marked_checks.operator()<PagedIndexMap<int>>();
+    erase_marked_checks.operator()<SeparateIndexMap<int>>();
+
+    // Change tracking.
+    constexpr auto change_tracking_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        // Compares ignoring the order.
+        auto same_keys = [](std::vector<key> a, std::vector<key> b)
+        {
+            std::ranges::sort(a);
+            std::ranges::sort(b);
+            return a == b;
+        };
+
+        M m;
+        Check(m.consume_changes().empty());
+        key a = m.insert(10).key;
+        key b = m.insert(20).key;
+        key c = m.insert(30).key;
+        auto changes = m.consume_changes();
+        Check(same_keys(changes.inserted, {a, b, c}) && changes.erased.empty() && changes.modified.empty());
+        Check(m.num_touched_keys() == 0);
+        Check(m.consume_changes().empty());
+
+        // `b` is erased, then its key is reused.
+        m.mark_modified(a);
+        m[c] = 31;
+        m.mark_modified(m.key_to_index(c));
+        m.erase(b);
+        Check(m.insert(40).key == b);
+        // Inserted and erased, so no net change.
+        m.erase(m.insert(50).key);
+        m.consume_changes(changes);
+        Check(same_keys(changes.inserted, {b}) && same_keys(changes.erased, {b}) && same_keys(changes.modified, {a, c}));
+
+        // Modified, then erased.
+        m.mark_modified(a);
+        m.erase(a);
+        changes = m.consume_changes();
+        Check(changes.inserted.empty() && same_keys(changes.erased, {a}) && changes.modified.empty());
+
+        // Bulk operations.
+        std::size_t first = m.emplace_n(3, 1);
+        std::vector<key> bulk = {m.index_to_key(first), m.index_to_key(first + 1), m.index_to_key(first + 2)};
+        changes = m.consume_changes();
+        Check(same_keys(changes.inserted, bulk));
+        Check(em::erase_if(m.values(), [](int x){return x == 1;}) == 3);
+        changes = m.consume_changes();
+        Check(same_keys(changes.erased, bulk) && changes.inserted.empty());
+
+        // `move_elem()` leaves a moved-from value behind.
+        key d = m.index_to_key(0);
+        m.move_elem(1, 0);
+        changes = m.consume_changes();
+        Check(same_keys(changes.modified, {d}));
+
+        // Reordering moves the keys along with the values, so nothing counts as modified.
+        m.swap_elems(0, 1);
+        m.sort_by();
+        std::size_t order[]{1, 0};
+        m.reorder(order);
+        Check(m.consume_changes().empty());
+
+        // Deferred assignments.
+        typename M::command_buffer buffer;
+        buffer.assign(c, 32);
+        m.apply(buffer);
+        changes = m.consume_changes();
+        Check(same_keys(changes.modified, {c}));
+
+        // A copy keeps the pending changes.
+        m.mark_modified(c);
+        M copy = m;
+        (void)copy.insert(60);
+        (void)copy.insert(70);
+        Check(copy.consume_changes().inserted.size() == 2);
+        Check(same_keys(m.consume_changes().modified, {c}));
+
+        // `clear()` erases everything.
+        std::vector<key> all;
+        for (std::size_t i = 0; i < m.size(); i++)
+            all.push_back(m.index_to_key(i));
+        m.clear();
+        changes = m.consume_changes();
+        Check(same_keys(changes.erased, all) && changes.inserted.empty());
+    };
+    change_tracking_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<em::IndexMapOptions>>>();
+    change_tracking_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<SeparateLayout>>>();
+    change_tracking_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<PagedLayout>>>();
+    change_tracking_checks.operator()<GenerationIndexMap<int, TrackChanges<Generations<em::IndexMapOptions>>>>();
+    change_tracking_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, TinySegmentedVector, TrackChanges<em::IndexMapOptions>>>();
+    {
+        em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<em::IndexMapOptions>> m;
+        MUST_THROW("Invalid index map key.", m.mark_modified(decltype(m)::key(0)));
+    }
+
+    // Key compaction.
+    constexpr auto compact_keys_checks = []<typename M>(bool dense_keys) PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        M m;
+        Check(m.key_fragmentation() == 0);
+        for (int i = 0; i < 10; i++)
+        {
+            auto r = m.insert(i * 10);
+            r.persistent_data.data = i * 10 + 1;
+        }
+        // A high key, which pins the key tables.
+        if (dense_keys)
+            m.prepare_keys_for_insertion(41);
+        {
+            auto r = m.insert_at(key(40), 400);
+            r.persistent_data.data = 401;
+        }
+        for (unsigned k : {0u, 2u, 5u, 9u})
+            m.erase(key(k));
+        Check(m.size() == 7);
+        Check(m.keys_size() == (dense_keys ? 41 : 11));
+        Check(m.key_fragmentation() == 1 - 7.0 / double(m.keys_size()));
+
+        std::vector<std::pair<key, key>> remapped;
+        std::vector<int> old_values(m.values().begin(), m.values().end());
+        std::vector<int> old_data;
+        for (std::size_t i = 0; i < m.size(); i++)
+            old_data.push_back(m.get_persistent_data(i).data);
+        std::vector<key> old_keys;
+        for (std::size_t i = 0; i < m.size(); i++)
+            old_keys.push_back(m.index_to_key(i));
+
+        m.compact_keys([&](key old_key, key new_key){remapped.emplace_back(old_key, new_key);});
+        Check(m.keys_size() == 7);
+        Check(m.key_fragmentation() == 0);
+        Check(std::ranges::equal(m.values(), old_values));
+        for (std::size_t i = 0; i < m.size(); i++)
+        {
+            Check(m.index_to_key(i) == key(i));
+            Check(m.key_to_index(key(i)) == i);
+            Check(m.get_persistent_data(i).data == old_data[i]);
+            Check(m[key(i)] == old_values[i]);
+        }
+        std::size_t num_remapped = 0;
+        for (std::size_t i = 0; i < m.size(); i++)
+        {
+            bool was_remapped = std::ranges::find(remapped, std::pair(old_keys[i], key(i))) != remapped.end();
+            Check(was_remapped == (old_keys[i] != key(i)));
+            num_remapped += was_remapped;
+        }
+        Check(remapped.size() == num_remapped && num_remapped > 0);
+
+        // Already compact.
+        m.compact_keys([](key, key){Check(false);});
+        Check(m.keys_size() == 7);
+
+        // New keys continue from there.
+        Check(m.insert(70).key == key(7));
+        m.clear();
+        m.compact_keys();
+        Check(m.keys_size() == 0);
+    };
+
+    // Sorting.
+    constexpr auto sort_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        auto make_map = []
+        {
+            M m;
+            m.values_reserve(20); // Don't count the moves caused by the reallocation.
+            for (int i = 0; i < 20; i++)
+                (void)m.emplace(i * 7 % 20);
+            m.erase(typename M::key(3)); // Have a free key.
+            return m;
+        };
+        auto reset_moves = [](M &m)
+        {
+            for (MoveCounter &v : m.values())
+                v.moves = 0;
+        };
+        // The keys must still point to the same values, which are `key * 7 % 20`.
+        auto check_keys = [](const M &m)
+        {
+            for (std::size_t i = 0; i < m.size(); i++)
+            {
+                Check(m[i].moves <= 2);
+                Check(std::size_t(m.index_to_key(i)) * 7 % 20 == std::size_t(m[i].x));
+                Check(m.key_to_index(m.index_to_key(i)) == i);
+            }
+            Check(!m.contains(typename M::key(3)));
+            Check(m.keys_size() == 20);
+        };
+
+        { // Cached sort keys.
+            M m = make_map();
+            reset_moves(m);
+            m.sort_by(&MoveCounter::x);
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(m[i].x == int(i + (i >= 1))); // 1 was erased.
+            check_keys(m);
+
+            reset_moves(m);
+            m.sort_by(&MoveCounter::x, std::ranges::greater{});
+            for (std::size_t i = 1; i < m.size(); i++)
+                Check(m[i - 1].x > m[i].x);
+            check_keys(m);
+        }
+
+        { // The projection is called on each comparison.
+            M m = make_map();
+            reset_moves(m);
+            m.sort_by([](const MoveCounter &v){return std::array<int, 5>{v.x % 2, v.x};});
+            for (std::size_t i = 1; i < m.size(); i++)
+                Check(m[i - 1].x % 2 < m[i].x % 2 || (m[i - 1].x % 2 == m[i].x % 2 && m[i - 1].x < m[i].x));
+            check_keys(m);
+        }
+
+        { // Any permutation.
+            M m = make_map();
+            std::vector<std::size_t> order(m.size());
+            for (std::size_t i = 0; i < m.size(); i++)
+                order[i] = (i + 5) % m.size();
+            std::vector<int> expected;
+            for (std::size_t i : order)
+                expected.push_back(m[i].x);
+            reset_moves(m);
+            m.reorder(order);
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(m[i].x == expected[i]);
+            check_keys(m);
+
+            M empty;
+            empty.sort_by(&MoveCounter::x);
+            empty.reorder({});
+        }
+    };
+    compact_keys_checks.operator()<em::IndexMap<int, unsigned int, Data>>(true);
+    compact_keys_checks.operator()<SeparateIndexMap<int, unsigned int, Data>>(true);
+    compact_keys_checks.operator()<PagedIndexMap<int, unsigned int, Data>>(false);
+    compact_keys_checks.operator()<SegmentedIndexMap<int, unsigned int, Data>>(true);
+    compact_keys_checks.operator()<em::IndexMap<int, unsigned int, Data, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<em::IndexMapOptions>>>(true);
+    compact_keys_checks.operator()<em::IndexMap<int, unsigned int, Data, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<PagedLayout>>>(false);
+    static_assert(![]<typename M>(){return requires(M &m){m.compact_keys();};}.operator()<GenerationIndexMap<int>>());
+    { // If `remap` throws, nothing changes.
+        PagedIndexMap<int> m;
+        (void)m.insert_at(PagedIndexMap<int>::key(100), 1);
+        (void)m.insert_at(PagedIndexMap<int>::key(200), 2);
+        MUST_THROW("Nope.", m.compact_keys([](auto, auto){throw std::runtime_error("Nope.");}));
+        Check(m.keys_size() == 2 && m[PagedIndexMap<int>::key(100)] == 1 && m[PagedIndexMap<int>::key(200)] == 2);
+    }
+    { // Change tracking.
+        em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<em::IndexMapOptions>> m;
+        for (int i = 0; i < 4; i++)
+            (void)m.insert(i);
+        m.erase(decltype(m)::key(1));
+        (void)m.consume_changes();
+        // Keys 0, 3, 2 become 0, 1, 2.
+        m.compact_keys();
+        auto changes = m.consume_changes();
+        Check(changes.erased == std::vector{decltype(m)::key(3)});
+        Check(changes.inserted == std::vector{decltype(m)::key(1)});
+        Check(changes.modified.empty());
+    }
+
+    sort_checks.operator()<em::IndexMap<MoveCounter>>();
+    sort_checks.operator()<SegmentedIndexMap<MoveCounter>>();
+    sort_checks.operator()<PagedIndexMap<MoveCounter>>();
+    sort_checks.operator()<SeparateIndexMap<MoveCounter>>();
+    sort_checks.operator()<GenerationIndexMap<MoveCounter>>();
+
+    { // Bad permutations, stable sorting, and throwing moves.
+        em::IndexMap<std::string> m;
+        for (const char *str : {"bb", "a", "ccc", "dd", "e"})
+            (void)m.insert(str);
+        std::vector<std::size_t> order = {0, 1, 2, 3};
+        MUST_THROW("Invalid index map permutation.", m.reorder(order));
+        order = {0, 1, 2, 3, 3};
+        MUST_THROW("Invalid index map permutation.", m.reorder(order));
+        order = {0, 1, 2, 3, 5};
+        MUST_THROW("Invalid index map permutation.", m.reorder(order));
+        Check(m[0] == "bb");
+
+        m.stable_sort_by(&std::string::size);
+        Check(std::ranges::equal(m.values(), std::vector<std::string>{"a", "e", "bb", "dd", "ccc"}));
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(m.key_to_index(m.index_to_key(i)) == i);
+
+        struct ThrowingMove
+        {
+            int x = 0;
+            ThrowingMove(int x) : x(x) {}
+            ThrowingMove(ThrowingMove &&other) : x(other.x) {}
+            ThrowingMove &operator=(ThrowingMove &&other) {x = other.x; return *this;}
+        };
+        em::IndexMap<ThrowingMove> m2;
+        for (int i = 0; i < 10; i++)
+            (void)m2.emplace(9 - i);
+        m2.sort_by(&ThrowingMove::x);
+        for (std::size_t i = 0; i < m2.size(); i++)
+        {
+            Check(m2[i].x == int(i));
+            Check(std::size_t(m2.index_to_key(i)) == 9 - i);
+            Check(m2.key_to_index(m2.index_to_key(i)) == i);
+        }
+    }
+
+    // Key reuse policies.
+    constexpr auto key_reuse_checks = []<em::KeyReuse Policy, typename BaseOptions>() PREFER_CONSTEVAL_LAMBDA
+    {
+        using M = em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, ReuseKeys<BaseOptions, Policy>>;
+        using key = typename M::key;
+        auto expect = [](std::vector<unsigned> lifo, std::vector<unsigned> fifo, std::vector<unsigned> lowest)
+        {
+            return Policy == em::KeyReuse::lifo ? lifo : Policy == em::KeyReuse::fifo ? fifo : lowest;
+        };
+        auto insert_keys = [](M &m, std::size_t n)
+        {
+            std::vector<unsigned> ret;
+            for (std::size_t i = 0; i < n; i++)
+                ret.push_back(unsigned(m.insert(int(i)).key));
+            return ret;
+        };
+        auto check_keys = [](const M &m)
+        {
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(m.key_to_index(m.index_to_key(i)) == i);
+            for (std::size_t i = m.size(); i < m.keys_size(); i++)
+                Check(!m.contains(m.index_to_key_relaxed(i)));
+        };
+
+        M m;
+        Check(insert_keys(m, 8) == std::vector<unsigned>{0, 1, 2, 3, 4, 5, 6, 7});
+        for (unsigned k : {5u, 1u, 6u})
+            m.erase(key(k));
+        Check(insert_keys(m, 4) == expect({6, 1, 5, 8}, {5, 1, 6, 8}, {1, 5, 6, 8}));
+
+        m.erase(key(3));
+        m.erase(key(0));
+        Check(insert_keys(m, 1) == expect({0}, {3}, {0}));
+        m.erase(key(2));
+        Check(insert_keys(m, 2) == expect({2, 3}, {0, 2}, {2, 3}));
+        check_keys(m);
+
+        // Bulk insertion and erasure.
+        m.erase(key(7));
+        m.erase(key(4));
+        m.erase(key(1));
+        std::vector<key> new_keys;
+        m.insert_range(std::vector<int>{10, 20, 30}, std::back_inserter(new_keys));
+        Check(new_keys == std::vector<key>{key(expect({1}, {7}, {1})[0]), key(expect({4}, {4}, {4})[0]), key(expect({7}, {1}, {7})[0])});
+        Check(insert_keys(m, 1) == std::vector<unsigned>{9});
+        Check(em::erase_if(m.values(), [](int x){return x == 10 || x == 30;}) == 2);
+        Check(insert_keys(m, 2).size() == 2);
+        check_keys(m);
+
+        // The smallest keys are reused first, so the largest ones can be removed.
+        m.erase(key(2));
+        m.erase(key(9));
+        m.erase(key(8));
+        Check(insert_keys(m, 1) == expect({8}, {2}, {2}));
+        while (m.remove_unused_key()) {}
+        if (Policy != em::KeyReuse::lifo)
+            Check(m.keys_size() == m.size());
+        check_keys(m);
+        Check(insert_keys(m, 2).size() == 2);
+        check_keys(m);
+
+        // Copies reuse the same keys.
+        M copy = m;
+        m.erase(key(4));
+        m.erase(key(0));
+        copy.erase(key(4));
+        copy.erase(key(0));
+        Check(insert_keys(m, 1) == insert_keys(copy, 1));
+        M moved = std::move(copy);
+        Check(insert_keys(moved, 1) == insert_keys(m, 1));
+        copy = M{};
+        Check(insert_keys(copy, 2) == std::vector<unsigned>{0, 1});
+
+        m.clear();
+        Check(insert_keys(m, 3) == std::vector<unsigned>{0, 1, 2});
+        m.soft_clear();
+        Check(insert_keys(m, 3) == expect({0, 1, 2}, {2, 1, 0}, {0, 1, 2}));
+        check_keys(m);
+    };
+    key_reuse_checks.operator()<em::KeyReuse::lifo, em::IndexMapOptions>();
+    key_reuse_checks.operator()<em::KeyReuse::fifo, em::IndexMapOptions>();
+    key_reuse_checks.operator()<em::KeyReuse::lowest, em::IndexMapOptions>();
+    key_reuse_checks.operator()<em::KeyReuse::fifo, SeparateLayout>();
+    key_reuse_checks.operator()<em::KeyReuse::lowest, PagedLayout>();
+    key_reuse_checks.operator()<em::KeyReuse::fifo, TrackChanges<PagedLayout>>();
+    { // Retired keys, reserved keys, `insert_at()`, and many keys.
+        GenerationIndexMap<int, ReuseKeys<Generations<em::IndexMapOptions>, em::KeyReuse::fifo>> m;
+        for (int i = 0; i < 3; i++)
+            (void)m.insert(i);
+        // Reuse the keys until they're retired.
+        for (int i = 0; i < 1000; i++)
+        {
+            m.erase(m.index_to_key(0));
+            (void)m.insert(i);
+        }
+        Check(m.retired_keys_size() > 0 && m.size() == 3);
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(m.key_to_index(m.index_to_key(i)) == i);
+
+        using M = em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, ReuseKeys<PagedLayout, em::KeyReuse::lowest>>;
+        M m2;
+        for (int i = 0; i < 6; i++)
+            (void)m2.insert(i);
+        for (unsigned k : {4u, 1u, 3u})
+            m2.erase(M::key(k));
+        auto reserver = m2.make_key_reserver(2);
+        Check(reserver.reserve() == M::key(1));
+        Check(reserver.reserve() == M::key(3));
+        m2.commit_reserved_keys(reserver, 42);
+        Check(m2[M::key(1)] == 42 && m2[M::key(3)] == 42);
+        (void)m2.insert_at(M::key(100), 100);
+        Check(m2.insert(7).key == M::key(4));
+        Check(m2.insert(8).key == M::key(6));
+        MUST_THROW("Nope.", m2.insert_range(std::views::iota(0, 3) | std::views::transform([](int x) -> int {if (x == 2) throw std::runtime_error("Nope."); return x;})));
+        Check(m2.insert(9).key == M::key(7));
+
+        // A failed bulk insertion removes the keys it created, even if they were lower than the free ones.
+        em::IndexMap<int, unsigned int, int, std::allocator<unsigned int>, std::vector, std::vector, ReuseKeys<PagedLayout, em::KeyReuse::lowest>> m4;
+        using M4 = decltype(m4);
+        for (int i = 0; i < 8; i++)
+            m4.get_persistent_data(m4.insert(i).key) = 777;
+        m4.erase(M4::key(2));
+        Check(m4.remove_unused_key() && !m4.contains_relaxed(M4::key(2)));
+        m4.erase(M4::key(7));
+        m4.erase(M4::key(6));
+        MUST_THROW("Nope.", m4.insert_range(std::views::iota(0, 3) | std::views::transform([](int x) -> int {if (x == 2) throw std::runtime_error("Nope."); return x;})));
+        Check(m4.size() == 5 && m4.keys_size() == 7 && !m4.contains_relaxed(M4::key(2)));
+        Check(m4.get_persistent_data(M4::key(6)) == 777 && m4.get_persistent_data(M4::key(7)) == 777);
+        Check(m4.insert(0).key == M4::key(6) && m4.insert(0).key == M4::key(7));
+
+        // Enough keys for several levels of the bitset.
+        M m3;
+        for (int i = 0; i < 10000; i++)
+            (void)m3.insert(i);
+        for (unsigned k = 9999; k >= 7; k -= 7)
+            m3.erase(M::key(k));
+        Check(m3.insert(0).key == M::key(10));
+        Check(m3.insert(0).key == M::key(17));
+        m3.erase(M::key(3));
+        Check(m3.insert(0).key == M::key(3));
+    }
+
+    // Automatic shrinking.
+    constexpr auto auto_shrink_checks = []<typename M>(bool removes_keys) PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        M m;
+        for (int i = 0; i < 1000; i++)
+            (void)m.insert(i);
+        std::size_t peak_keys_capacity = m.keys_capacity();
+        std::size_t peak_values_capacity = m.values_capacity();
+
+        for (unsigned k = 999; k >= 100; k--)
+        {
+            m.erase(key(k));
+            // Never less than 25% full, unless small.
+            Check(m.values_capacity() <= std::max(std::size_t(64), m.size() * 4));
+            if (removes_keys)
+                Check(m.keys_size() == m.size() && m.keys_capacity() <= std::max(std::size_t(64), m.keys_size() * 4));
+        }
+        Check(m.values_capacity() < peak_values_capacity);
+        Check(removes_keys ? m.keys_capacity() < peak_keys_capacity : m.keys_capacity() == peak_keys_capacity);
+        for (unsigned k = 0; k < 100; k++)
+            Check(m[key(k)] == int(k));
+
+        // Reinserting after a shrink keeps some headroom.
+        std::size_t capacity = m.values_capacity();
+        (void)m.insert(100);
+        Check(m.values_capacity() == capacity);
+
+        // One erasure removes a bounded number of keys.
+        em::erase_if(m.values(), [](int){return true;});
+        Check(m.values_capacity() <= 64);
+        if (removes_keys)
+            Check(m.keys_size() == 101 - 16);
+    };
+    auto_shrink_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, AutoShrink<em::IndexMapOptions>>>(true);
+    auto_shrink_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, AutoShrink<SeparateLayout>>>(true);
+    auto_shrink_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, AutoShrink<PagedLayout>>>(true);
+    auto_shrink_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, TinySegmentedVector, AutoShrink<em::IndexMapOptions>>>(true);
+    auto_shrink_checks.operator()<GenerationIndexMap<int, AutoShrink<Generations<em::IndexMapOptions>>>>(false);
+    { // Values that can throw when moved aren't reallocated, and the default is to never shrink.
+        struct ThrowingMove
+        {
+            int x = 0;
+            ThrowingMove(int x) : x(x) {}
+            ThrowingMove(ThrowingMove &&other) : x(other.x) {}
+            ThrowingMove &operator=(ThrowingMove &&other) {x = other.x; return *this;}
+        };
+        em::IndexMap<ThrowingMove, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, AutoShrink<em::IndexMapOptions>> m;
+        em::IndexMap<int> manual;
+        for (int i = 0; i < 1000; i++)
+        {
+            (void)m.emplace(i);
+            (void)manual.emplace(i);
+        }
+        std::size_t values_capacity = m.values_capacity();
+        std::size_t keys_capacity = manual.keys_capacity();
+        for (unsigned k = 999; k > 0; k--)
+        {
+            m.erase(decltype(m)::key(k));
+            manual.erase(em::IndexMap<int>::key(k));
+        }
+        Check(m.values_capacity() == values_capacity && m.keys_capacity() < keys_capacity);
+        Check(manual.values_capacity() == values_capacity && manual.keys_capacity() == keys_capacity && manual.keys_size() == 1000);
+    }
+
+    // Statistics and memory usage.
+    constexpr auto statistics_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        M m;
+        for (int i = 0; i < 10; i++)
+            (void)m.insert(i);
+        (void)m.insert_range(std::vector<int>{10, 11});
+        auto stats = m.get_statistics();
+        Check(stats.inserts == 12 && stats.erases == 0 && stats.moves == 0);
+        Check(stats.keys_reallocations > 0 && stats.values_reallocations > 0);
+        Check(stats.peak_size == 12 && stats.peak_keys_size == 12);
+
+        m.erase(key(0)); // Moves the last element into the hole.
+        m.erase(m.size() - 1); // Nothing to move.
+        stats = m.get_statistics();
+        Check(stats.erases == 2 && stats.moves == 1);
+        m.swap_elems(0, 1);
+        Check(m.get_statistics().moves == 3);
+        m.sort_by();
+        Check(m.get_statistics().moves > 3);
+
+        std::uint64_t reallocations = m.get_statistics().values_reallocations;
+        m.values_reserve(1000);
+        Check(m.get_statistics().values_reallocations == reallocations + 1);
+
+        m.clear();
+        stats = m.get_statistics();
+        Check(stats.erases == 12 && stats.peak_size == 12 && stats.peak_keys_size == 12);
+        m.reset_statistics();
+        stats = m.get_statistics();
+        Check(stats.inserts == 0 && stats.erases == 0 && stats.moves == 0 && stats.keys_reallocations == 0 && stats.values_reallocations == 0);
+        Check(stats.peak_size == 0 && stats.peak_keys_size == 0);
+    };
+    statistics_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, CollectStatistics<em::IndexMapOptions>>>();
+    statistics_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, CollectStatistics<PagedLayout>>>();
+    statistics_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, TinySegmentedVector, CollectStatistics<SeparateLayout>>>();
+    static_assert(![]<typename M>(){return requires(M &m){m.get_statistics();};}.operator()<em::IndexMap<int>>());
+
+    constexpr auto memory_usage_checks = []<typename M>(std::size_t key_entry_size, bool has_bookkeeping) PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        Check(m.memory_usage().total() == 0);
+        for (int i = 0; i < 100; i++)
+            (void)m.insert(i);
+        auto usage = m.memory_usage();
+        Check(usage.values == m.values_capacity() * sizeof(int));
+        if (key_entry_size)
+            Check(usage.keys == m.keys_capacity() * key_entry_size);
+        else
+            Check(usage.keys > m.keys_capacity() * sizeof(unsigned int));
+        Check((usage.bookkeeping > 0) == has_bookkeeping);
+        Check(usage.total() == usage.keys + usage.values + usage.bookkeeping);
+    };
+    memory_usage_checks.operator()<em::IndexMap<int>>(sizeof(unsigned int) * 2, false);
+    memory_usage_checks.operator()<em::IndexMap<int, unsigned int, Data>>(sizeof(unsigned int) * 2 + sizeof(Data), false);
+    memory_usage_checks.operator()<SeparateIndexMap<int, unsigned int, Data>>(sizeof(unsigned int) * 2 + sizeof(Data), false);
+    memory_usage_checks.operator()<PagedIndexMap<int>>(0, false);
+    memory_usage_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, TrackChanges<em::IndexMapOptions>>>(sizeof(unsigned int) * 2, true);
+    memory_usage_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, ReuseKeys<em::IndexMapOptions, em::KeyReuse::lowest>>>(sizeof(unsigned int) * 2, true);
+
+    // Erasing with tombstones.
+    constexpr auto tombstone_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        M m;
+        for (int i = 0; i < 10; i++)
+            (void)m.insert(i);
+        auto live_values = [&]
+        {
+            std::vector<int> ret;
+            m.for_each_live_index([&](std::size_t i){ret.push_back(m.values()[i]);});
+            return ret;
+        };
+
+        // Erasing leaves the other elements in place.
+        m.erase(key(2));
+        m.erase(std::size_t(5));
+        Check(m.size() == 10 && m.tombstones_size() == 2);
+        Check(m.is_tombstone(2) && m.is_tombstone(5) && !m.is_tombstone(3));
+        Check(!m.contains(key(2)) && !m.contains(key(5)) && !m.valid_index(2));
+        Check(m[key(3)] == 3 && m.key_to_index(key(9)) == 9);
+        Check(live_values() == std::vector{0, 1, 3, 4, 6, 7, 8, 9});
+        static_assert(M::keeps_tombstones && !em::IndexMap<int>::keeps_tombstones);
+        static_assert(std::forward_iterator<typename M::live_key_value_iterator>);
+        std::vector<int> live_view_values;
+        for (auto elem : std::as_const(m).live_keys_and_values())
+            live_view_values.push_back(elem.value());
+        Check(live_view_values == live_values() && m.live_keys_and_values().size() == 8);
+        std::array<key, 3> lookup{key(1), key(2), key(3)};
+        std::array<std::uint64_t, 1> found{};
+        Check(m.contains_many(lookup, found) == 2 && found[0] == 0b101);
+
+        // The keys of the tombstones aren't reused until compacting.
+        key new_key = m.insert(10).key;
+        Check(std::size_t(new_key) == 10 && m.key_to_index(new_key) == 10);
+
+        // The tombstones at the end are removed right away.
+        m.erase(new_key);
+        Check(m.size() == 10 && m.tombstones_size() == 2);
+        m.erase(key(8));
+        m.erase(key(9));
+        Check(m.size() == 8 && m.tombstones_size() == 2);
+
+        // The bulk erasures leave tombstones too, and only see the live elements.
+        std::array<key, 2> erased{key(0), key(7)};
+        m.erase_keys(erased);
+        Check(m.size() == 7 && m.tombstones_size() == 3);
+        Check(em::erase_if(m.values(), [](int x){Check(x != 2 && x != 5); return x == 3;}) == 1);
+        Check(m.size() == 7 && m.tombstones_size() == 4);
+        Check(live_values() == std::vector{1, 4, 6});
+
+        // Compacting keeps the order, and frees the keys.
+        m.compact();
+        Check(m.size() == 3 && m.tombstones_size() == 0);
+        Check(std::vector(m.values().begin(), m.values().end()) == std::vector{1, 4, 6});
+        Check(m.key_to_index(key(1)) == 0 && m.key_to_index(key(4)) == 1 && m.key_to_index(key(6)) == 2);
+        Check(m.insert(11).key != key(11));
+        Check(m.size() == 4 && m.values()[3] == 11);
+
+        // Erasing everything leaves an empty map.
+        em::erase_if(m.values(), [](int){return true;});
+        Check(m.empty() && m.tombstones_size() == 0);
+
+        // The usual `it = erase(it)` loop. The returned iterator skips the tombstones, and stops at `end()` when the trailing ones are removed.
+        for (int i = 0; i < 6; i++)
+            (void)m.insert(i);
+        for (auto it = m.values().begin(); it != m.values().end();)
+            it = *it % 2 == 0 ? m.values().erase(it) : std::next(it);
+        Check(m.size() == 6 && m.tombstones_size() == 3 && live_values() == std::vector{1, 3, 5});
+        auto kv = m.keys_and_values();
+        for (auto it = kv.begin(); it != kv.end();)
+            it = !m.is_tombstone(it->index()) && it->value() > 2 ? kv.erase(it) : std::next(it);
+        Check(m.size() == 2 && m.tombstones_size() == 1 && live_values() == std::vector{1});
+    };
+    tombstone_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<em::IndexMapOptions>>>();
+    tombstone_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<SeparateLayout>>>();
+    tombstone_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<PagedLayout>>>();
+    tombstone_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, TinySegmentedVector, KeepTombstones<em::IndexMapOptions>>>();
+    tombstone_checks.operator()<GenerationIndexMap<int, KeepTombstones<Generations<em::IndexMapOptions>>>>();
+    tombstone_checks.operator()<em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<ReuseKeys<em::IndexMapOptions, em::KeyReuse::fifo>>>>();
+    { // Compacting automatically, and the interaction with the other features.
+        using M = em::IndexMap<int, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<CollectStatistics<TrackChanges<Generations<em::IndexMapOptions>>>, em::ErasePolicy::tombstones<50, 4>>>;
+        M m;
+        std::vector<M::handle> handles;
+        for (int i = 0; i < 10; i++)
+            handles.push_back(m.insert(i).handle);
+        (void)m.consume_changes();
+
+        for (unsigned k = 0; k < 4; k++)
+            m.erase(M::key(k));
+        Check(m.size() == 10 && m.tombstones_size() == 4); // 40% are tombstones.
+        Check(!m.contains(handles[0]) && m.try_get(handles[1]) == nullptr && m.contains(handles[4]));
+        Check(m.consume_changes().erased.size() == 4);
+        Check(m.get_statistics().erases == 4 && m.get_statistics().moves == 0);
+        MUST_THROW("Invalid index map index.", (void)m[std::size_t(0)]);
+        MUST_THROW("This index map key is already in use.", (void)m.insert_at(M::key(0), 0));
+        MUST_THROW("Can't save an index map with tombstones.", m.save([](std::span<const std::byte>){}));
+
+        m.erase(M::key(4)); // Now 50%.
+        Check(m.size() == 5 && m.tombstones_size() == 0);
+        Check(std::vector(m.values().begin(), m.values().end()) == std::vector{5, 6, 7, 8, 9});
+        Check(m.get_statistics().erases == 5 && m.get_statistics().moves == 5);
+        Check(m.consume_changes().erased.size() == 1);
+        Check(m.get(handles[7]) == 7);
+        Check(m.memory_usage().bookkeeping > 0);
+
+        // Sorting compacts first.
+        m.erase(M::key(6));
+        m.sort_by([](int x){return -x;});
+        Check(m.tombstones_size() == 0 && std::vector(m.values().begin(), m.values().end()) == std::vector{9, 8, 7, 5});
+
+        // Without tombstones, the same functions work trivially.
+        em::IndexMap<int> plain;
+        (void)plain.insert(1);
+        (void)plain.insert(2);
+        plain.erase(em::IndexMap<int>::key(0));
+        std::size_t visited = 0;
+        plain.for_each_live_index([&](std::size_t i){Check(plain.values()[i] == 2); visited++;});
+        plain.compact();
+        Check(visited == 1 && plain.size() == 1 && plain.tombstones_size() == 0);
+    }
+    { // Iterating over the tombstones doesn't throw, and the live iterators skip them.
+        using M = em::IndexMap<int, unsigned int, int, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<PagedLayout>>;
+        M m;
+        for (int i = 0; i < 4; i++)
+            m.get_persistent_data(m.insert(i).key) = i * 10;
+        m.erase(M::key(1));
+        int sum = 0;
+        for (auto elem : m.keys_and_values())
+            sum += elem.persistent_data(); // The tombstone has the data of the erased element.
+        Check(sum == 60);
+        sum = 0;
+        for (auto elem : m.live_keys_and_values())
+            sum += elem.persistent_data() + elem.value();
+        Check(sum == 55);
+
+        // Swapping or moving a tombstone throws, instead of leaving the tombstone mark on the wrong element.
+        MUST_THROW("Invalid index map index.", std::ranges::iter_swap(m.keys_and_values().begin(), m.keys_and_values().begin() + 1));
+        MUST_THROW("Invalid index map index.", std::ranges::iter_swap(m.keys_and_values().begin() + 1, m.keys_and_values().begin()));
+        MUST_THROW("Invalid index map index.", m.move_elem(1, 0));
+        MUST_THROW("Invalid index map index.", m.move_elem(0, 1));
+        Check(m.contains(M::key(0)) && !m.contains(M::key(1)) && m[M::key(0)] == 0 && m.is_tombstone(1));
+        std::ranges::iter_swap(m.keys_and_values().begin(), m.keys_and_values().begin() + 2);
+        Check(m.key_to_index(M::key(0)) == 2 && m[M::key(0)] == 0 && m.is_tombstone(1));
+
+        using G = GenerationIndexMap<int, KeepTombstones<Generations<em::IndexMapOptions>>, int>;
+        G g;
+        std::vector<G::handle> handles;
+        for (int i = 0; i < 4; i++)
+            handles.push_back(g.insert(i).handle);
+        g.erase(handles[2]);
+        Check(g.keys_and_values()[2].handle() == handles[2] && !g.contains(g.keys_and_values()[2].handle()));
+        std::size_t live = 0;
+        for (auto elem : g.live_keys_and_values())
+            Check(g.contains(elem.handle()) && elem.handle() == handles[std::size_t(elem.value())] && ++live);
+        Check(live == 3);
+    }
+
+    // Parallel algorithms.
+    auto parallel_checks = []<typename M>(auto policy)
+    {
+        // Several chunks, the last one incomplete.
+        constexpr int n = int(em::index_map_parallel_chunk_size) * 2 + 100;
+        auto make_map = []
+        {
+            M m;
+            for (int i = 0; i < n; i++)
+                (void)m.emplace(i);
+            return m;
+        };
+        auto check_keys = [](const M &m)
+        {
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(m.key_to_index(m.index_to_key(i)) == i);
+            for (std::size_t i = m.size(); i < m.keys_size(); i++)
+                Check(!m.contains(m.index_to_key_relaxed(i)));
+        };
+
+        { // `for_each_parallel()` visits every element once.
+            M m = make_map();
+            em::for_each_parallel(policy, m.keys_and_values(), [](typename M::key_value_reference elem)
+            {
+                Check(std::size_t(elem.key()) == std::size_t(elem.value()));
+                elem.value() += 1;
+                elem.persistent_data() = elem.value() * 2;
+            });
+            em::for_each_parallel(policy, std::as_const(m).keys_and_values(), [](typename M::key_value_const_reference elem)
+            {
+                Check(elem.value() == int(elem.key()) + 1);
+                Check(elem.persistent_data() == elem.value() * 2);
+            });
+
+            M empty;
+            em::for_each_parallel(policy, empty.keys_and_values(), [](typename M::key_value_reference){Check(false);});
+        }
+
+        { // Unordered `erase_if()`.
+            M m = make_map();
+            Check(em::erase_if(policy, m.values(), [](int x){return x % 3 == 0;}) == std::size_t(n + 2) / 3);
+            Check(m.size() == std::size_t(n) - std::size_t(n + 2) / 3);
+            for (std::size_t i = 0; i < m.size(); i++)
+            {
+                Check(m[i] % 3 != 0);
+                Check(std::size_t(m.index_to_key(i)) == std::size_t(m[i]));
+            }
+            check_keys(m);
+
+            Check(em::erase_if(policy, m.keys_and_values(), [](const typename M::key_value_const_reference &){return false;}) == 0);
+            Check(em::erase_if(policy, m.keys_and_values(), [](const typename M::key_value_const_reference &){return true;}) == std::size_t(n) - std::size_t(n + 2) / 3);
+            Check(m.empty());
+            Check(em::erase_if(policy, m.values(), [](int){return true;}) == 0);
+        }
+
+        { // Ordered `stable_erase_if()`.
+            M m = make_map();
+            Check(em::stable_erase_if(policy, m.keys_and_values(), [](const typename M::key_value_const_reference &x){return x.value() % 2 == 1;}) == std::size_t(n) / 2);
+            Check(m.size() == std::size_t(n + 1) / 2);
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(m[i] == int(i) * 2);
+            check_keys(m);
+
+            Check(em::stable_erase_if(policy, m.values(), [](int x){return x < 10;}) == 5);
+            Check(m[0] == 10);
+            check_keys(m);
+        }
+
+        { // Sorting.
+            M m = make_map();
+            em::sort_by(policy, m, [](int x){return x % 100;});
+            for (std::size_t i = 1; i < m.size(); i++)
+                Check(m[i - 1] % 100 <= m[i] % 100);
+            for (std::size_t i = 0; i < m.size(); i++)
+                Check(std::size_t(m.index_to_key(i)) == std::size_t(m[i]));
+            check_keys(m);
+
+            em::stable_sort_by(policy, m, [](int x){return x % 10;}, std::ranges::greater{});
+            for (std::size_t i = 1; i < m.size(); i++)
+                Check(m[i - 1] % 10 > m[i] % 10 || (m[i - 1] % 10 == m[i] % 10 && m[i - 1] % 100 <= m[i] % 100));
+            check_keys(m);
+
+            em::sort_by(policy, m, [](int x){return std::to_string(x);});
+            for (std::size_t i = 1; i < m.size(); i++)
+                Check(std::to_string(m[i - 1]) < std::to_string(m[i]));
+            check_keys(m);
+        }
+    };
+    parallel_checks.operator()<em::IndexMap<int, unsigned int, int>>(std::execution::seq);
+    parallel_checks.operator()<em::IndexMap<int, unsigned int, int>>(std::execution::par);
+    parallel_checks.operator()<SegmentedIndexMap<int, unsigned int, int>>(std::execution::par_unseq);
+    parallel_checks.operator()<PagedIndexMap<int, unsigned int, int>>(std::execution::par);
+    parallel_checks.operator()<SeparateIndexMap<int, unsigned int, int>>(std::execution::par);
+    { // The parallel algorithms skip the tombstones, like the serial ones.
+        using M = em::IndexMap<int, unsigned int, int, std::allocator<unsigned int>, std::vector, std::vector, KeepTombstones<PagedLayout>>;
+        M m;
+        for (int i = 0; i < 5; i++)
+            (void)m.insert(i);
+        m.erase(M::key(1));
+        std::atomic<int> num_calls = 0;
+        em::for_each_parallel(std::execution::par, m.keys_and_values(), [&](M::key_value_reference elem)
+        {
+            Check(elem.value() != 1);
+            elem.persistent_data() = elem.value() * 10;
+            num_calls++;
+        });
+        Check(num_calls == 4);
+
+        num_calls = 0;
+        Check(em::erase_if(std::execution::par, m.keys_and_values(), [&](const M::key_value_const_reference &elem){num_calls++; return elem.persistent_data() == 30;}) == 1);
+        Check(num_calls == 4 && m.tombstones_size() == 2);
+
+        num_calls = 0;
+        Check(em::stable_erase_if(std::execution::par, m.values(), [&](int x){num_calls++; return x == 1 || x == 3;}) == 0);
+        Check(num_calls == 3 && m.size() == 5);
+    }
 
     constexpr auto clear_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
     {
@@ -976,4 +2112,1326 @@ int main()
         }
     };
     clear_checks.operator()<em::IndexMap<int>>();
+
+    // Bulk insertion.
+    constexpr auto bulk_insertion_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        (void)m.insert(10);
+        (void)m.insert(20);
+        (void)m.insert(30);
+        (void)m.insert(40);
+        m.erase(typename M::key(1));
+        m.erase(typename M::key(2));
+
+        // [0:10, 3:40], free keys: [2, 1]
+
+        std::vector<int> new_values = {100, 200, 300};
+        Check(m.insert_range(new_values) == 2);
+
+        Check(m.size() == 5);
+        Check(m.keys_size() == 5);
+        Check(m[0] == 10);
+        Check(m[1] == 40);
+        Check(m[2] == 100);
+        Check(m[3] == 200);
+        Check(m[4] == 300);
+        // The free keys are reused first.
+        Check(m.index_to_key(2) == typename M::key(2));
+        Check(m.index_to_key(3) == typename M::key(1));
+        Check(m.index_to_key(4) == typename M::key(4));
+        Check(m[typename M::key(2)] == 100);
+        Check(m[typename M::key(1)] == 200);
+        Check(m[typename M::key(4)] == 300);
+
+        m.erase(typename M::key(0));
+
+        // Output the keys.
+        std::vector<typename M::key> keys;
+        (void)m.insert_range(std::vector<int>{1, 2}, std::back_inserter(keys));
+        Check(keys.size() == 2);
+        Check(keys[0] == typename M::key(0));
+        Check(keys[1] == typename M::key(5));
+        Check(m[keys[0]] == 1);
+        Check(m[keys[1]] == 2);
+
+        // Empty ranges do nothing.
+        Check(m.insert_range(std::vector<int>{}) == 6);
+        Check(m.size() == 6);
+        Check(m.keys_size() == 6);
+
+        // `emplace_n`.
+        Check(m.emplace_n(3, 7) == 6);
+        Check(m.size() == 9);
+        Check(m.keys_size() == 9);
+        for (std::size_t i = 6; i < 9; i++)
+        {
+            Check(m[i] == 7);
+            Check(m.index_to_key(i) == typename M::key(i));
+        }
+    };
+    bulk_insertion_checks.operator()<em::IndexMap<int>>();
+    bulk_insertion_checks.operator()<SegmentedIndexMap<int>>();
+    bulk_insertion_checks.operator()<PagedIndexMap<int>>();
+    bulk_insertion_checks.operator()<SeparateIndexMap<int>>();
+
+    // Erasing several keys at once.
+    constexpr auto erase_keys_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        m.values_reserve(8); // Don't count the moves caused by the reallocation.
+        for (int i = 0; i < 8; i++)
+            (void)m.emplace(i * 10);
+
+        std::vector<typename M::key> keys = {typename M::key(1), typename M::key(6), typename M::key(3), typename M::key(7)};
+        m.erase_keys(keys);
+
+        // The holes at 1 and 3 are filled with the elements from 4 and 5. 6 and 7 are erased without moving anything.
+        Check(m.size() == 4);
+        Check(m.keys_size() == 8);
+        Check(m[0].x == 0);
+        Check(m[1].x == 40);
+        Check(m[2].x == 20);
+        Check(m[3].x == 50);
+        for (std::size_t i = 0; i < 4; i++)
+        {
+            Check(m[i].moves <= 1);
+            Check(m[m.index_to_key(i)].x == m[i].x);
+            Check(std::size_t(m.index_to_key(i)) * 10 == std::size_t(m[i].x));
+        }
+        for (typename M::key k : keys)
+        {
+            Check(!m.contains(k));
+            Check(m.contains_relaxed(k));
+        }
+
+        // Erase everything.
+        std::vector<typename M::key> rest = {typename M::key(5), typename M::key(0), typename M::key(2), typename M::key(4)};
+        m.erase_keys(rest);
+        Check(m.empty());
+        Check(m.keys_size() == 8);
+
+        m.erase_keys({});
+        Check(m.empty());
+    };
+    erase_keys_checks.operator()<em::IndexMap<MoveCounter>>();
+    erase_keys_checks.operator()<SegmentedIndexMap<MoveCounter>>();
+    erase_keys_checks.operator()<PagedIndexMap<MoveCounter>>();
+    erase_keys_checks.operator()<SeparateIndexMap<MoveCounter>>();
+
+    { // Erasing several keys at once, with invalid or repeated keys.
+        em::IndexMap<int> m;
+        for (int i = 0; i < 4; i++)
+            (void)m.emplace(i * 10);
+
+        std::vector<em::IndexMap<int>::key> keys = {em::IndexMap<int>::key(1), em::IndexMap<int>::key(0), em::IndexMap<int>::key(4)};
+        MUST_THROW("Invalid index map key.", m.erase_keys(keys));
+        keys.back() = em::IndexMap<int>::key(1);
+        MUST_THROW("Duplicate index map key.", m.erase_keys(keys));
+
+        // Nothing was erased.
+        Check(m.size() == 4);
+        for (std::size_t i = 0; i < 4; i++)
+        {
+            Check(m[i] == int(i) * 10);
+            Check(m.index_to_key(i) == em::IndexMap<int>::key(i));
+        }
+    }
+
+    // The paged index layout.
+    constexpr auto paged_layout_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+
+        // Any key can be used without `prepare_keys_for_insertion()`.
+        typename M::insert_result r = m.emplace_at(typename M::key(1000), 10);
+        r.persistent_data.data = 100;
+        Check(m.keys_size() == 1);
+        Check(m.contains(typename M::key(1000)));
+        Check(!m.contains_relaxed(typename M::key(999)));
+        Check(!m.contains_relaxed(typename M::key(0)));
+        Check(m[typename M::key(1000)] == 10);
+
+        // New keys are the smallest unused ones.
+        Check(m.emplace(20).key == typename M::key(0));
+        Check(m.emplace(30).key == typename M::key(1));
+        (void)m.emplace_at(typename M::key(2), 40);
+        Check(m.emplace(50).key == typename M::key(3));
+        Check(m.emplace(60).key == typename M::key(4)); // The next page.
+        Check(m.keys_size() == 6);
+        Check(m.key_to_index(typename M::key(1000)) == 0);
+        Check(m.key_to_index(typename M::key(4)) == 5);
+
+        // Erased keys keep their persistent data until they are removed.
+        m.erase(typename M::key(1000));
+        Check(!m.contains(typename M::key(1000)));
+        Check(m.contains_relaxed(typename M::key(1000)));
+        Check(m.get_persistent_data(typename M::key(1000)).data == 100);
+        Check(m.keys_size() == 6);
+
+        // Any unused key can be removed, not just the largest one.
+        m.erase(typename M::key(1));
+        Check(m.remove_unused_key());
+        Check(m.remove_unused_key());
+        Check(!m.remove_unused_key());
+        Check(m.keys_size() == 4);
+        Check(!m.contains_relaxed(typename M::key(1000)));
+        Check(!m.contains_relaxed(typename M::key(1)));
+        Check(m.size() == 4);
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(m.key_to_index(m.index_to_key(i)) == i);
+
+        // The removed keys are reused, and their persistent data is reset.
+        Check(m.emplace(70).key == typename M::key(1));
+        typename M::insert_result r2 = m.emplace_at(typename M::key(1000), 80);
+        Check(r2.persistent_data.data == 0);
+        Check(m[typename M::key(1000)] == 80);
+        Check(m[typename M::key(1)] == 70);
+
+        // Copying.
+        M m2 = m;
+        m.clear();
+        Check(m.keys_size() == 0);
+        Check(!m.contains_relaxed(typename M::key(0)));
+        Check(m2.size() == 6);
+        Check(m2[typename M::key(1000)] == 80);
+        Check(m2[typename M::key(2)] == 40);
+        m = m2;
+        Check(m[typename M::key(1000)] == 80);
+        Check(m.emplace(90).key == typename M::key(5));
+    };
+    paged_layout_checks.operator()<PagedIndexMap<int, unsigned int, Data>>();
+
+    // Segmented value storage.
+    constexpr auto segmented_storage_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        int *first = &m.emplace(10).value;
+        for (int i = 1; i < 7; i++)
+            (void)m.emplace(i * 10 + 10);
+
+        // Growing doesn't move the elements.
+        Check(first == &m[typename M::key(0)]);
+        Check(m.values_capacity() == 8);
+        Check(std::as_const(m).values().segment_count() == 4);
+
+        // The segments cover all values in order.
+        int expected = 10;
+        std::size_t num_segments = 0;
+        for (std::span<int> segment : m.values().segments())
+        {
+            Check(segment.size() == (num_segments < 3 ? 2 : 1));
+            for (int &x : segment)
+            {
+                Check(x == expected);
+                x++;
+                expected += 10;
+            }
+            num_segments++;
+        }
+        Check(num_segments == 4);
+        Check(m[typename M::key(6)] == 71);
+
+        // Erasing refills the holes across segment boundaries.
+        Check(em::erase_if(m.values(), [](int x){return x % 20 == 1;}) == 3); // 21, 41, 61
+        Check(m.size() == 4);
+        Check(std::as_const(m).values().segment_count() == 2);
+        Check(std::ranges::equal(m.values(), std::array{11, 71, 31, 51}));
+        Check(std::ranges::equal(std::as_const(m).values() | std::views::reverse, std::array{51, 31, 71, 11}));
+
+        // Bulk insertion allocates just the needed segments.
+        (void)m.emplace_n(5, 0);
+        Check(m.size() == 9);
+        Check(m.values_capacity() == 10);
+
+        m.erase(typename M::key(0));
+        m.values_shrink_to_fit();
+        Check(m.values_capacity() == 8);
+
+        // Copying and moving.
+        M m2 = m;
+        Check(std::ranges::equal(m2.values(), m.values()));
+        M m3 = std::move(m);
+        Check(m.size() == 0 && m.values_capacity() == 0);
+        Check(std::as_const(m3).values() == std::as_const(m2).values());
+        m = std::move(m3);
+        m3 = m2;
+        Check(std::as_const(m3).values() == std::as_const(m).values());
+    };
+    segmented_storage_checks.operator()<SegmentedIndexMap<int>>();
+
+    // Multi-column storage.
+    constexpr auto multi_column_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        using key = typename M::key;
+        M m;
+        std::vector<key> keys;
+        for (int i = 0; i < 10; i++)
+            keys.push_back(m.insert(i, i * 0.5, char('a' + i)).key);
+        // The columns stay in sync, and match the keys.
+        auto check_consistent = [&]
+        {
+            Check(m.template column<int>().size() == m.size() && m.template column<1>().size() == m.size() && m.template column<char>().size() == m.size());
+            for (std::size_t i = 0; i < m.size(); i++)
+            {
+                int x = m.template column<int>()[i];
+                Check(m.template column<double>()[i] == x * 0.5);
+                Check(m.template column<2>()[i] == char('a' + x));
+                Check(m.key_to_index(keys[std::size_t(x)]) == i);
+            }
+        };
+        auto ints = [&]{return std::vector(m.template column<int>().begin(), m.template column<int>().end());};
+
+        check_consistent();
+        Check(m.template get<double>(keys[4]) == 2.0 && m.template get<2>(keys[4]) == 'e');
+        m.template get<int>(keys[4]) = 4; // Writable.
+        static_assert(M::template column_index<char> == 2 && M::column_count == 3);
+
+        // Erasing moves the last element into the hole, in all columns.
+        m.erase(keys[2]);
+        Check(!m.contains(keys[2]) && m.size() == 9);
+        Check(ints() == std::vector{0, 1, 9, 3, 4, 5, 6, 7, 8});
+        check_consistent();
+
+        // Bulk erasure keeps the order.
+        Check(m.erase_if_index([&](std::size_t i){return m.template column<int>()[i] % 2 == 0;}) == 4);
+        Check(ints() == std::vector{1, 9, 3, 5, 7});
+        check_consistent();
+
+        m.template sort_by<int>();
+        Check(ints() == std::vector{1, 3, 5, 7, 9});
+        check_consistent();
+        m.template sort_by<1>(std::identity{}, std::ranges::greater{});
+        Check(ints() == std::vector{9, 7, 5, 3, 1});
+        check_consistent();
+        m.swap_elems(0, 4);
+        Check(ints() == std::vector{1, 7, 5, 3, 9});
+        check_consistent();
+
+        // The freed keys are reused.
+        keys[2] = m.insert(2, 1.0, 'c').key;
+        check_consistent();
+        m.reserve(100);
+        Check(m.memory_usage().values >= 100 * (sizeof(int) + sizeof(double) + sizeof(char)));
+
+        m.clear();
+        Check(m.empty() && m.template column<double>().empty());
+    };
+    multi_column_checks.operator()<em::IndexMultiColumn<int, double, char>>();
+    multi_column_checks.operator()<em::BasicIndexMultiColumn<em::Columns<int, double, char>, unsigned short, Data, std::allocator<unsigned int>, std::vector, std::vector, SeparateLayout>>();
+    multi_column_checks.operator()<em::BasicIndexMultiColumn<em::Columns<int, double, char>, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, PagedLayout>>();
+    multi_column_checks.operator()<em::BasicIndexMultiColumn<em::Columns<int, double, char>, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, Generations<em::IndexMapOptions>>>();
+
+    // Generational handles.
+    constexpr auto generation_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        typename M::insert_result r0 = m.emplace(10);
+        typename M::handle h0 = r0.handle;
+        typename M::handle h1 = m.emplace(20).handle;
+        typename M::handle h2 = m.emplace(30).handle;
+
+        Check(h0 == m.key_to_handle(r0.key));
+        Check(M::handle_to_key(h1) == typename M::key(1));
+        Check(M::handle_to_generation(h1) == 0);
+        Check(m.contains(h0) && m.contains(h1) && m.contains(h2));
+        Check(m.get(h1) == 20);
+        Check(*m.try_get(h2) == 30);
+        Check(m.keys_and_values()[1].handle() == h1);
+        Check(m.index_to_handle(m.handle_to_index_or_throw(h2)) == h2);
+
+        // Erasing increments the generation, so the handle stops matching even after the key is reused.
+        m.erase(h1);
+        Check(!m.contains(h1));
+        Check(m.try_get(h1) == nullptr);
+        Check(m.get_generation(typename M::key(1)) == 1);
+        typename M::handle h3 = m.emplace(40).handle;
+        Check(M::handle_to_key(h3) == typename M::key(1));
+        Check(h3 != h1);
+        Check(!m.contains(h1) && m.contains(h3));
+        Check(m.get(h3) == 40);
+
+        // Same for the other kinds of erasure.
+        Check(em::erase_if(m.values(), [](int x){return x == 10;}) == 1);
+        Check(!m.contains(h0) && m.contains(h2) && m.contains(h3));
+        typename M::key k2 = M::handle_to_key(h2);
+        m.erase_keys(std::span(&k2, 1));
+        Check(!m.contains(h2));
+        m.soft_clear();
+        Check(!m.contains(h3));
+        Check(m.get_generation(typename M::key(1)) == 2);
+        Check(m.keys_size() == 3);
+
+        // After `clear()`, the generations start over.
+        m.clear();
+        Check(m.emplace(50).handle == h0);
+    };
+    generation_checks.operator()<GenerationIndexMap<int>>();
+    generation_checks.operator()<GenerationIndexMap<int, Generations<SeparateLayout>>>();
+    generation_checks.operator()<GenerationIndexMap<int, Generations<PagedLayout>>>();
+    generation_checks.operator()<GenerationIndexMap<int, Generations<em::IndexMapOptions, em::GenerationOverflow::wrap>, Data>>();
+
+    // Keys are retired when their generation would overflow.
+    constexpr auto generation_retire_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        (void)m.emplace(1);
+        (void)m.emplace(2);
+        for (int i = 0; i < 254; i++)
+        {
+            Check(m.emplace(3).key == typename M::key(2));
+            m.erase(typename M::key(2));
+        }
+        Check(m.get_generation(typename M::key(2)) == 254);
+        (void)m.emplace(3);
+        m.erase(typename M::key(2));
+        Check(m.retired_keys_size() == 1);
+        Check(m.keys_size() == 3);
+
+        // The retired key is never reused. The new keys are created before it in `dense_to_sparse`.
+        Check(m.emplace(4).key == typename M::key(3));
+        Check(m.emplace_n(3, 5) == 3);
+        Check(m.size() == 6);
+        Check(m.keys_size() == 7);
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(m.index_to_key(i) != typename M::key(2));
+        Check(m.index_to_key_relaxed(6) == typename M::key(2));
+        Check(!m.contains(typename M::key(2)));
+
+        // Erasing several keys at once, one of which gets retired.
+        Check(m.emplace(6).key == typename M::key(7));
+        for (int i = 0; i < 254; i++)
+        {
+            m.erase(typename M::key(0));
+            Check(m.emplace(7).key == typename M::key(0));
+        }
+        Check(m.get_generation(typename M::key(0)) == 254);
+        Check(m.keys_size() == 8);
+        std::array<typename M::key, 2> keys = {typename M::key(0), typename M::key(1)};
+        m.erase_keys(keys);
+        Check(m.retired_keys_size() == 2);
+        Check(m.size() == 5);
+        Check(m.emplace(8).key == typename M::key(1));
+        Check(m.emplace(9).key == typename M::key(8));
+        Check(m.keys_size() == 9);
+    };
+    generation_retire_checks.operator()<GenerationIndexMap<int>>();
+    generation_retire_checks.operator()<GenerationIndexMap<int, Generations<PagedLayout>>>();
+
+    // Or they wrap around.
+    constexpr auto generation_wrap_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        typename M::handle h = m.emplace(1).handle;
+        m.erase(h);
+        for (int i = 0; i < 255; i++)
+        {
+            Check(!m.contains(h));
+            m.erase(m.emplace(2).handle);
+        }
+        Check(m.retired_keys_size() == 0);
+        Check(m.get_generation(typename M::key(0)) == 0);
+        Check(m.emplace(3).handle == h);
+    };
+    generation_wrap_checks.operator()<GenerationIndexMap<int, Generations<em::IndexMapOptions, em::GenerationOverflow::wrap>>>();
+
+    // Command buffers.
+    constexpr auto command_buffer_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        Check(m.emplace_n(6, 0) == 0);
+        for (std::size_t i = 0; i < m.size(); i++)
+            m[i] = int(i) * 10;
+
+        typename M::command_buffer a, b;
+        a.emplace(100);
+        a.erase(typename M::key(1));
+        a.assign(typename M::key(2), 21);
+        b.erase(typename M::key(1)); // Duplicate erasures are fine.
+        b.erase(typename M::key(3));
+        b.emplace(101);
+        b.emplace(102);
+        b.assign(typename M::key(2), 22); // The later assignment wins.
+        b.assign(typename M::key(3), 31); // Assigned, then erased.
+        Check(a.num_emplaced() == 1 && a.num_erased() == 1 && a.num_assigned() == 1);
+
+        Check(m.apply(a, b) == 4);
+        Check(a.empty() && b.empty());
+        Check(m.size() == 7);
+        Check(m[typename M::key(2)] == 22);
+        Check(m[std::size_t(4)] == 100);
+        Check(m[std::size_t(5)] == 101);
+        Check(m[std::size_t(6)] == 102);
+        // The erased keys were reused first.
+        std::array<typename M::key, 3> new_keys = {m.index_to_key(4), m.index_to_key(5), m.index_to_key(6)};
+        std::ranges::sort(new_keys);
+        Check(new_keys == std::array{typename M::key(1), typename M::key(3), typename M::key(6)});
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(m.key_to_index(m.index_to_key(i)) == i);
+
+        // A span of buffers, with nothing to insert.
+        std::vector<typename M::command_buffer> buffers(3);
+        buffers[0].erase(typename M::key(0));
+        buffers[2].erase(m.index_to_key(6));
+        Check(m.apply(buffers) == 5);
+        Check(m.size() == 5);
+        Check(!m.contains(typename M::key(0)));
+
+        // Nothing at all.
+        Check(m.apply() == 5);
+    };
+    command_buffer_checks.operator()<em::IndexMap<int>>();
+    command_buffer_checks.operator()<SegmentedIndexMap<int>>();
+    command_buffer_checks.operator()<PagedIndexMap<int>>();
+    command_buffer_checks.operator()<SeparateIndexMap<int>>();
+
+    // Batched lookup.
+    constexpr auto batch_lookup_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        for (int i = 0; i < 40; i++)
+            (void)m.emplace(i * 10);
+        for (unsigned int k = 0; k < 40; k += 3)
+            m.erase(typename M::key(k));
+
+        // Enough keys to go past both prefetch distances, including erased and out-of-range ones.
+        std::vector<typename M::key> keys;
+        for (unsigned int k = 0; k < 50; k++)
+            keys.push_back(typename M::key((k * 7) % 50));
+
+        std::vector<std::size_t> indices(keys.size());
+        std::vector<std::uint64_t> mask(M::lookup_mask_size(keys.size()), std::uint64_t(-1));
+        Check(mask.size() == 1);
+        std::size_t num_found = m.lookup_many(keys, indices, mask);
+        Check(num_found == m.size());
+        for (std::size_t j = 0; j < keys.size(); j++)
+        {
+            bool found = mask[j / 64] >> (j % 64) & 1;
+            Check(found == m.contains(keys[j]));
+            Check(indices[j] == (found ? m.key_to_index(keys[j]) : m.size()));
+        }
+
+        // Without the mask.
+        Check(m.lookup_many(keys, indices) == num_found);
+
+        std::vector<int> values;
+        Check(m.for_each_key(keys, [&](typename M::key_value_reference elem){elem.value()++;}) == num_found);
+        Check(std::as_const(m).for_each_key(keys, [&](typename M::key_value_const_reference elem){values.push_back(elem.value());}) == num_found);
+        Check(values.size() == num_found);
+        std::size_t n = 0;
+        for (typename M::key k : keys)
+        {
+            if (m.contains(k))
+                Check(values[n++] == int(k) * 10 + 1);
+        }
+
+        Check(m.lookup_many({}, {}) == 0);
+    };
+    batch_lookup_checks.operator()<em::IndexMap<int>>();
+    batch_lookup_checks.operator()<SegmentedIndexMap<int>>();
+    batch_lookup_checks.operator()<PagedIndexMap<int>>();
+    batch_lookup_checks.operator()<SeparateIndexMap<int>>();
+
+    // Batched key checks. At compile-time this only tests the scalar path, the SIMD one is tested below.
+    constexpr auto check_keys_checks = []<typename M>() PREFER_CONSTEVAL_LAMBDA
+    {
+        M m;
+        for (int i = 0; i < 20; i++)
+            (void)m.emplace(i);
+        for (unsigned int k = 0; k < 20; k += 3)
+            m.erase(typename M::key(k));
+
+        std::vector<typename M::key> keys;
+        for (unsigned int k = 0; k < 70; k++)
+            keys.push_back(typename M::key(k % 23));
+
+        std::vector<std::uint64_t> mask(M::lookup_mask_size(keys.size()), std::uint64_t(-1));
+        std::size_t num_valid = m.contains_many(keys, mask);
+        std::size_t expected_num_valid = 0;
+        for (std::size_t j = 0; j < keys.size(); j++)
+        {
+            bool found = mask[j / 64] >> (j % 64) & 1;
+            Check(found == m.contains(keys[j]));
+            expected_num_valid += found;
+        }
+        Check(num_valid == expected_num_valid);
+        Check(mask[1] >> (keys.size() % 64) == 0);
+
+        std::erase_if(keys, [&](typename M::key k){return !m.contains(k);});
+        std::vector<std::size_t> indices(keys.size());
+        m.keys_to_indices(keys, indices);
+        for (std::size_t j = 0; j < keys.size(); j++)
+            Check(indices[j] == m.key_to_index(keys[j]));
+    };
+    check_keys_checks.operator()<em::IndexMap<int>>();
+    check_keys_checks.operator()<em::IndexMap<int, unsigned long long, Data>>();
+    check_keys_checks.operator()<PagedIndexMap<int>>();
+    check_keys_checks.operator()<SeparateIndexMap<int, unsigned short>>();
+
+    { // Batched key checks at runtime, which use SIMD if available. Compared with `contains()` on random keys.
+        auto test = []<typename M>()
+        {
+            std::uint64_t seed = 1;
+            auto random = [&]{seed = seed * 6364136223846793005ull + 1442695040888963407ull; return seed >> 33;};
+
+            M m;
+            for (int i = 0; i < 1000; i++)
+                (void)m.emplace(i);
+            for (int i = 0; i < 400; i++)
+            {
+                typename M::key k = typename M::key(random() % 1000);
+                if (m.contains(k))
+                    m.erase(k);
+            }
+
+            std::vector<typename M::key> keys;
+            for (int i = 0; i < 1000; i++)
+            {
+                // Some keys are far out of range, including the ones with the sign bit set.
+                std::uint64_t k = random();
+                keys.push_back(typename M::key(i % 3 == 0 ? k % 1200 : i % 3 == 1 ? ~k : std::uint64_t(-1) - k % 4));
+            }
+
+            std::vector<std::uint64_t> mask(M::lookup_mask_size(keys.size()));
+            std::size_t num_valid = m.contains_many(keys, mask);
+            std::size_t expected_num_valid = 0;
+            for (std::size_t j = 0; j < keys.size(); j++)
+            {
+                bool found = mask[j / 64] >> (j % 64) & 1;
+                Check(found == m.contains(keys[j]));
+                expected_num_valid += found;
+            }
+            Check(num_valid == expected_num_valid);
+            Check(num_valid > 100);
+
+            std::vector<std::size_t> indices(keys.size());
+            MUST_THROW("Invalid index map key.", m.keys_to_indices(keys, indices));
+            std::erase_if(keys, [&](typename M::key k){return !m.contains(k);});
+            indices.resize(keys.size());
+            m.keys_to_indices(keys, indices);
+            for (std::size_t j = 0; j < keys.size(); j++)
+                Check(indices[j] == m.key_to_index(keys[j]));
+        };
+        test.operator()<em::IndexMap<int>>();
+        test.operator()<em::IndexMap<int, unsigned long long>>();
+        test.operator()<em::IndexMap<int, unsigned int, Data>>();
+        test.operator()<em::IndexMap<long, unsigned long long, Data>>();
+        test.operator()<SeparateIndexMap<int, unsigned long long>>();
+        test.operator()<SeparateIndexMap<int, unsigned int, Data>>();
+        test.operator()<PagedIndexMap<int>>();
+    }
+
+    { // Stale handles, and the retired keys.
+        using M = GenerationIndexMap<int>;
+        M m;
+        M::handle h = m.emplace(1).handle;
+        m.erase(h);
+        MUST_THROW("Stale or invalid index map handle.", (void)m.get(h));
+        MUST_THROW("Stale or invalid index map handle.", m.erase(h));
+        MUST_THROW("Stale or invalid index map handle.", (void)m.get(M::handle(42)));
+
+        for (int i = 0; i < 254; i++)
+            m.erase(m.emplace(2).handle);
+        Check(m.retired_keys_size() == 1);
+        MUST_THROW("This index map key is retired.", (void)m.insert_at(M::key(0), 3));
+        Check(m.size() == 0);
+
+        // Bulk insertion rollback keeps the retired key in place.
+        m.prepare_keys_for_insertion(2);
+        Check(m.keys_size() == 3);
+        std::vector<int> values = {1, 2, 3, 4, 5};
+        MUST_THROW("Third.", (void)m.insert_range(values | std::views::transform([n = 0](int x) mutable {if (n++ == 2) throw std::runtime_error("Third."); return x;})));
+        Check(m.size() == 0);
+        Check(m.keys_size() == 3);
+        Check(m.index_to_key_relaxed(2) == M::key(0));
+        Check(m.insert_range(values) == 0);
+        Check(m.keys_size() == 6);
+        Check(m.index_to_key_relaxed(5) == M::key(0));
+    }
+
+    { // Command buffers with invalid keys don't change the map.
+        using M = em::IndexMap<int>;
+        M m;
+        Check(m.emplace_n(3, 1) == 0);
+        M::command_buffer a, b;
+        a.emplace(2);
+        a.erase(M::key(0));
+        b.assign(M::key(5), 3);
+        MUST_THROW("Invalid index map key.", m.apply(a, b));
+        Check(m.size() == 3);
+        Check(m.contains(M::key(0)));
+        Check(a.num_emplaced() == 1);
+
+        // Void values.
+        em::IndexMap<void> v;
+        em::IndexMap<void>::command_buffer c;
+        c.emplace();
+        c.emplace();
+        Check(v.apply(c) == 0);
+        Check(v.size() == 2);
+    }
+
+    { // Reserving keys from many threads, then committing them.
+        using M = em::IndexMap<int>;
+        M m;
+        Check(m.emplace_n(10, 1) == 0);
+        for (unsigned int k = 0; k < 10; k += 2)
+            m.erase(M::key(k));
+
+        constexpr int num_threads = 4, keys_per_thread = 50;
+        auto reserver = m.make_key_reserver(num_threads * keys_per_thread + 10);
+        Check(m.keys_size() >= 5 + reserver.capacity());
+
+        std::vector<std::vector<M::key>> keys(num_threads);
+        {
+            std::vector<std::thread> threads;
+            for (int t = 0; t < num_threads; t++)
+            {
+                threads.emplace_back([&, t]
+                {
+                    for (int i = 0; i < keys_per_thread / 2; i++)
+                        keys[std::size_t(t)].push_back(reserver.reserve());
+                    std::array<M::key, keys_per_thread / 2> more{};
+                    reserver.reserve(more);
+                    keys[std::size_t(t)].insert(keys[std::size_t(t)].end(), more.begin(), more.end());
+                });
+            }
+            for (std::thread &t : threads)
+                t.join();
+        }
+        Check(reserver.size() == num_threads * keys_per_thread);
+        MUST_THROW("Reserving too many index map keys.", std::array<M::key, 11> too_many{}; reserver.reserve(too_many));
+        Check(reserver.size() == num_threads * keys_per_thread);
+
+        // The reserved keys are unique, and are the erased keys first.
+        std::vector<M::key> all_keys;
+        for (const auto &v : keys)
+            all_keys.insert(all_keys.end(), v.begin(), v.end());
+        std::ranges::sort(all_keys);
+        Check(std::ranges::adjacent_find(all_keys) == all_keys.end());
+        for (M::key k : all_keys)
+            Check(!m.contains(k));
+        Check(all_keys[0] == M::key(0) && all_keys[4] == M::key(8) && all_keys[5] == M::key(10));
+
+        Check(m.commit_reserved_keys(reserver, 2) == 5);
+        Check(m.size() == 5 + all_keys.size());
+        for (M::key k : all_keys)
+            Check(m[k] == 2);
+        Check(m.emplace(3).key == M::key(5 + all_keys.size()));
+    }
+
+    { // Reserved keys can also be inserted one by one.
+        using M = PagedIndexMap<int>;
+        M m;
+        auto reserver = m.make_key_reserver(3);
+        M::key a = reserver.reserve();
+        M::key b = reserver.reserve();
+        (void)m.emplace_at(b, 20);
+        (void)m.emplace_at(a, 10);
+        Check(m.size() == 2);
+        Check(m[a] == 10 && m[b] == 20);
+        Check(m.emplace(30).key == M::key(2));
+    }
+
+    { // Snapshots of a concurrent map are kept while pinned.
+        em::ConcurrentIndexMap<em::IndexMap<int>> cm(2);
+        auto r1 = cm.make_reader();
+        auto r2 = cm.make_reader();
+        MUST_THROW("Too many concurrent index map readers.", (void)cm.make_reader());
+
+        auto k = cm.map().emplace(1).key;
+        {
+            auto s1 = r1.pin();
+            Check(s1.version() == 1);
+            Check(s1->empty());
+
+            cm.publish();
+            Check(cm.version() == 2);
+            Check(s1->empty());
+            Check(cm.reclaim() == 1);
+
+            cm.map()[k] = 2;
+            cm.publish();
+            auto s2 = r2.pin();
+            Check(s2.version() == 3);
+            Check(s2.map()[k] == 2);
+            Check(cm.reclaim() == 2); // `s1` keeps all snapshots since version 1 alive.
+        }
+        Check(cm.reclaim() == 0);
+
+        // Freed readers can be reused.
+        r1 = {};
+        r1 = cm.make_reader();
+        Check(r1.pin()->size() == 1);
+    }
+
+    { // A concurrent map stress test: one writer modifies and publishes, the readers check that each snapshot is consistent.
+        using M = em::IndexMap<int>;
+        constexpr int num_readers = 4, num_publishes = 300;
+        em::ConcurrentIndexMap<M> cm(num_readers);
+        std::atomic<bool> done = false;
+        std::atomic<int> num_failures = 0;
+
+        std::vector<std::thread> readers;
+        for (int i = 0; i < num_readers; i++)
+        {
+            readers.emplace_back([&, r = cm.make_reader()]
+            {
+                std::uint64_t last_version = 0;
+                while (!done.load())
+                {
+                    auto s = r.pin();
+                    // The versions never go back.
+                    bool ok = s.version() >= last_version;
+                    last_version = s.version();
+                    // Every element of a snapshot has the same value, which is its version.
+                    for (auto elem : s->keys_and_values())
+                    {
+                        ok = ok && elem.value() == int(s.version()) && s->key_to_index(elem.key()) == elem.index();
+                    }
+                    if (!ok)
+                        num_failures++;
+                }
+            });
+        }
+
+        std::uint64_t seed = 1;
+        auto random = [&]{seed = seed * 6364136223846793005ull + 1442695040888963407ull; return std::size_t(seed >> 33);};
+        for (int i = 0; i < num_publishes; i++)
+        {
+            M &m = cm.map();
+            for (int j = 0; j < 20 && !m.empty(); j++)
+                m.erase(random() % m.size());
+            for (int j = 0; j < 25; j++)
+                (void)m.emplace();
+            for (int &value : m.values())
+                value = int(cm.version() + 1);
+            cm.publish();
+        }
+        done = true;
+        for (std::thread &t : readers)
+            t.join();
+
+        Check(num_failures == 0);
+        Check(cm.version() == num_publishes + 1);
+    }
+
+    { // Multi-column storage: errors and handles.
+        using M = em::BasicIndexMultiColumn<em::Columns<std::string, int>, unsigned int, void, std::allocator<unsigned int>, std::vector, std::vector, Generations<em::IndexMapOptions>>;
+        M m;
+        M::handle h = m.insert("a", 1).handle;
+        (void)m.insert(std::string(100, 'b'), 2);
+        Check(m.contains(h));
+        MUST_THROW("Invalid index map key.", m.erase(M::key(2)));
+        MUST_THROW("Invalid index map index.", m.erase(std::size_t(2)));
+        std::array<std::size_t, 2> bad_order{0, 0};
+        MUST_THROW("Invalid index map permutation.", m.reorder(bad_order));
+        Check(m.column<std::string>()[0] == "a" && m.column<int>()[1] == 2);
+
+        // If a column value fails to construct, nothing is inserted.
+        struct Throws
+        {
+            Throws(int) {throw std::runtime_error("Construction failed.");}
+            Throws(Throws &&) noexcept {}
+            Throws &operator=(Throws &&) noexcept {return *this;}
+        };
+        em::IndexMultiColumn<std::string, Throws> t;
+        MUST_THROW("Construction failed.", (void)t.insert("x", 1));
+        Check(t.empty() && t.column<std::string>().empty() && t.keys().keys_size() == 0);
+
+        // Access by handle.
+        Check(m.get<std::string>(h) == "a" && m.get<1>(h) == 1);
+        m.get<int>(h) = 10;
+        Check(m.try_get<1>(h) && *m.try_get<1>(h) == 10 && m.key_to_handle(m.index_to_key(0)) == h && m.index_to_handle(0) == h);
+
+        m.erase(h);
+        Check(!m.contains(h) && m.size() == 1 && m.column<std::string>()[0] == std::string(100, 'b'));
+        Check(!m.try_get<std::string>(h) && !std::as_const(m).try_get<1>(h));
+        MUST_THROW("Stale or invalid index map handle.", (void)m.get<int>(h));
+
+        // The persistent data is writable, and survives erasing the element.
+        em::BasicIndexMultiColumn<em::Columns<int>, unsigned int, int> p;
+        auto k = p.insert(1).key;
+        p.get_persistent_data(k) = 42;
+        Check(p.get_persistent_data(std::size_t(0)) == 42);
+        p.erase(k);
+        Check(std::as_const(p).get_persistent_data(k) == 42);
+    }
+
+    { // Checked access.
+        em::SegmentedVector<int> v;
+        v.push_back(1);
+        Check(v.at(0) == 1);
+        MUST_THROW("Invalid segmented vector index.", (void)v.at(1));
+    }
+
+    #if HAS_RESERVED_VECTOR
+    { // Reserved vector.
+        em::BasicReservedVector<std::string, std::allocator<std::string>, std::size_t(1) << 24> v;
+        Check(v.capacity() == 0);
+        v.emplace_back("a");
+        const std::string *first = &v[0];
+        const std::size_t old_capacity = v.capacity();
+        for (int i = 1; i < 10000; i++)
+            v.push_back(std::to_string(i));
+        // Growing doesn't move the elements.
+        Check(&v[0] == first);
+        Check(v.capacity() > old_capacity);
+        Check(v.size() == 10000 && v[0] == "a" && v.back() == "9999");
+        MUST_THROW("Invalid reserved vector index.", (void)v.at(10000));
+        MUST_THROW("Reserved vector would be too large.", v.reserve(v.max_size() + 1));
+
+        auto copy = v;
+        Check(copy == v);
+        Check(copy.data() != v.data());
+
+        // Shrinking gives the pages back, also without moving anything.
+        v.resize(10);
+        v.shrink_to_fit();
+        Check(&v[0] == first);
+        Check(v.capacity() < old_capacity * 16 && v.capacity() >= 10);
+        Check(v[9] == "9");
+        v.push_back("x");
+        Check(v.back() == "x");
+
+        v = std::move(copy);
+        Check(v.size() == 10000);
+        v.clear();
+        v.shrink_to_fit();
+        Check(v.capacity() == 0 && v.data() == nullptr);
+
+        // Both the keys and the values can use it.
+        using M = em::IndexMap<std::string, unsigned int, void, std::allocator<unsigned int>, em::ReservedVector, em::ReservedVector, AutoShrink<CollectStatistics<em::IndexMapOptions>>>;
+        M m;
+        std::vector<M::key> keys;
+        for (int i = 0; i < 5000; i++)
+            keys.push_back(m.emplace(std::to_string(i)).key);
+        const std::string *values = m.values().data();
+        m.values_reserve(100000);
+        Check(m.values().data() == values);
+        Check(m.values().segments().size() == 1);
+        Check(m.get_statistics().moves == 0);
+        for (int i = 0; i < 4990; i++)
+            m.erase(keys[std::size_t(i)]);
+        Check(m.size() == 10);
+        Check(m.values_capacity() < 5000);
+        Check(m[keys[4995]] == "4995");
+        Check(m.memory_usage().values == m.values_capacity() * sizeof(std::string));
+    }
+    #endif
+
+    { // `insert_at()` doesn't change the map if it throws.
+        em::IndexMap<int> m;
+        (void)m.emplace(1);
+        (void)m.emplace(2);
+        MUST_THROW("Invalid index map key.", m.insert_at(em::IndexMap<int>::key(2), 3));
+        MUST_THROW("This index map key is already in use.", m.insert_at(em::IndexMap<int>::key(0), 3));
+        Check(m.size() == 2);
+        Check(m.keys_size() == 2);
+
+        // The most recently erased key can be reused.
+        m.erase(em::IndexMap<int>::key(1));
+        Check(m.insert_at(em::IndexMap<int>::key(1), 4).key == em::IndexMap<int>::key(1));
+        Check(m[em::IndexMap<int>::key(1)] == 4);
+        Check(m.size() == 2);
+    }
+
+    { // Bulk insertion without values.
+        em::IndexMap<void> m;
+        Check(m.emplace_n(3) == 0);
+        m.erase(em::IndexMap<void>::key(1));
+        Check(m.emplace_n(2) == 2);
+        Check(m.size() == 4);
+        Check(m.keys_size() == 4);
+        Check(m.index_to_key(2) == em::IndexMap<void>::key(1));
+        Check(m.index_to_key(3) == em::IndexMap<void>::key(3));
+    }
+
+    { // Bulk insertion leaves the map unchanged if an element throws.
+        struct ThrowOnCopy
+        {
+            int x = 0;
+            ThrowOnCopy(int x) : x(x) {}
+            ThrowOnCopy(const ThrowOnCopy &other) : x(other.x) {if (x < 0) throw std::runtime_error("Copy failed.");}
+            ThrowOnCopy(ThrowOnCopy &&other) noexcept : x(other.x) {}
+            ThrowOnCopy &operator=(const ThrowOnCopy &) = default;
+            ThrowOnCopy &operator=(ThrowOnCopy &&) noexcept = default;
+        };
+
+        em::IndexMap<ThrowOnCopy> m;
+        (void)m.emplace(1);
+        (void)m.emplace(2);
+        m.erase(em::IndexMap<ThrowOnCopy>::key(0));
+
+        std::vector<ThrowOnCopy> new_values;
+        for (int x : {10, 20, -1, 30})
+            new_values.emplace_back(x);
+        MUST_THROW("Copy failed.", (void)m.insert_range(new_values));
+        MUST_THROW("Copy failed.", (void)m.emplace_n(5, ThrowOnCopy(-1)));
+
+        Check(m.size() == 1);
+        Check(m.keys_size() == 2);
+        Check(m[em::IndexMap<ThrowOnCopy>::key(1)].x == 2);
+        Check(m.index_to_key_relaxed(1) == em::IndexMap<ThrowOnCopy>::key(0));
+
+        MUST_THROW("Index map would be too large.", (void)em::IndexMap<void, unsigned char>{}.emplace_n(257));
+    }
+
+    // Snapshots.
+    auto snapshot_checks = []<typename M>(auto &&fill)
+    {
+        // `b` is either a map or a view.
+        auto check_same = [](const M &a, const auto &b)
+        {
+            Check(a.size() == b.size());
+            Check(a.keys_size() == b.keys_size());
+            Check(a.retired_keys_size() == b.retired_keys_size());
+            for (std::size_t i = 0; i < a.size(); i++)
+            {
+                Check(a.index_to_key(i) == b.index_to_key(i));
+                Check(b.key_to_index(a.index_to_key(i)) == i);
+                if constexpr (M::has_value_type)
+                {
+                    Check(a[i] == b[i]);
+                    Check(a[a.index_to_key(i)] == b[a.index_to_key(i)]);
+                }
+            }
+            for (unsigned int k = 0; k < 1100; k++)
+            {
+                auto key = typename M::key(k);
+                Check(a.contains(key) == b.contains(key));
+                Check(a.contains_relaxed(key) == b.contains_relaxed(key));
+                if (!a.contains_relaxed(key))
+                    continue;
+                if constexpr (M::has_persistent_data_type)
+                    Check(a.get_persistent_data(key).data == b.get_persistent_data(key).data);
+                if constexpr (M::has_generations)
+                    Check(a.get_generation(key) == b.get_generation(key));
+            }
+        };
+
+        M m;
+        fill(m);
+
+        std::vector<std::byte> bytes;
+        m.save([&](std::span<const std::byte> part){bytes.insert(bytes.end(), part.begin(), part.end());});
+        Check(bytes.size() % 64 == 0);
+
+        // Loading.
+        M loaded;
+        (void)loaded.emplace_n(3); // Replaced by the snapshot.
+        std::size_t position = 0;
+        loaded.load([&](std::span<std::byte> part)
+        {
+            Check(position + part.size() <= bytes.size());
+            std::copy_n(bytes.begin() + std::ptrdiff_t(position), part.size(), part.begin());
+            position += part.size();
+        });
+        check_same(m, loaded);
+
+        // The loaded map reuses the same keys as the original.
+        for (int i = 0; i < 5; i++)
+            Check(m.emplace().key == loaded.emplace().key);
+        check_same(m, loaded);
+        for (std::size_t i = 0; i < m.size(); i++)
+            m.erase(m.index_to_key(0));
+        loaded.clear();
+
+        // The view, from a buffer aligned for any type.
+        std::vector<std::uint64_t> aligned_bytes((bytes.size() + 7) / 8);
+        std::memcpy(aligned_bytes.data(), bytes.data(), bytes.size());
+        std::span<const std::byte> view_bytes = std::as_bytes(std::span(aligned_bytes)).first(bytes.size());
+
+        M original;
+        fill(original);
+        em::IndexMapView<M> view(view_bytes);
+        check_same(original, view);
+        if constexpr (M::has_value_type)
+        {
+            Check(std::ranges::equal(original.values(), view.values()));
+            if (original.size() > 0)
+                MUST_THROW("Invalid index map index.", (void)view[original.size()]);
+        }
+        MUST_THROW("Invalid index map key.", (void)view.key_to_index(typename M::key(5000)));
+
+        // Invalid snapshots.
+        auto load_bytes = [](M &target, std::span<const std::byte> source)
+        {
+            std::size_t pos = 0;
+            target.load([&](std::span<std::byte> part)
+            {
+                if (pos + part.size() > source.size())
+                    throw std::invalid_argument("Invalid or incompatible index map snapshot.");
+                std::copy_n(source.begin() + std::ptrdiff_t(pos), part.size(), part.begin());
+                pos += part.size();
+            });
+        };
+        M broken;
+        (void)broken.emplace_n(2);
+        MUST_THROW("Invalid or incompatible index map snapshot.", load_bytes(broken, std::span(bytes).first(bytes.size() - 64)));
+        Check(broken.empty() && broken.keys_size() == 0);
+        MUST_THROW("Invalid or incompatible index map snapshot.", (void)em::IndexMapView<M>(view_bytes.first(view_bytes.size() - 64)));
+        std::vector<std::byte> bad_magic = bytes;
+        bad_magic[0] = std::byte('x');
+        MUST_THROW("Invalid or incompatible index map snapshot.", load_bytes(broken, bad_magic));
+        if (original.keys_size() >= 2)
+        {
+            // Repeat the first key.
+            std::vector<std::byte> repeated_key = bytes;
+            using key_type = std::underlying_type_t<typename M::key>;
+            std::memcpy(repeated_key.data() + 64 + sizeof(key_type), repeated_key.data() + 64, sizeof(key_type));
+            MUST_THROW("Invalid or incompatible index map snapshot.", load_bytes(broken, repeated_key));
+            Check(broken.empty() && broken.keys_size() == 0);
+        }
+        MUST_THROW("Misaligned index map snapshot.", (void)em::IndexMapView<M>(std::as_bytes(std::span(aligned_bytes)).subspan(1)));
+
+        // A header claiming the maximum number of keys, followed by nothing. Fails before allocating for all of them.
+        em::detail::IndexMap::SnapshotHeader huge_header;
+        std::memcpy(&huge_header, bytes.data(), sizeof(huge_header));
+        huge_header.keys_size = huge_header.sparse_size = broken.max_size();
+        huge_header.size = huge_header.retired_keys_size = 0;
+        MUST_THROW("Invalid or incompatible index map snapshot.", load_bytes(broken, std::as_bytes(std::span(&huge_header, 1))));
+        Check(broken.empty() && broken.memory_usage().total() < (1 << 20));
+    };
+    auto fill_some = [](auto &m)
+    {
+        for (int i = 0; i < 100; i++)
+            m.emplace(i).persistent_data.data = i * 10;
+        for (unsigned int k = 0; k < 100; k += 3)
+            m.erase(typename std::remove_cvref_t<decltype(m)>::key(k));
+    };
+    snapshot_checks.operator()<em::IndexMap<int, unsigned int, Data>>(fill_some);
+    snapshot_checks.operator()<em::IndexMap<int, unsigned int, Data>>([](auto &){});
+    snapshot_checks.operator()<em::IndexMap<long, unsigned short, Data>>(fill_some);
+    snapshot_checks.operator()<SeparateIndexMap<int, unsigned int, Data>>(fill_some);
+    snapshot_checks.operator()<SegmentedIndexMap<int, unsigned int, Data>>(fill_some);
+    snapshot_checks.operator()<em::IndexMap<int, unsigned int, Data, std::allocator<unsigned int>, std::vector, std::vector, ReuseKeys<em::IndexMapOptions, em::KeyReuse::lowest>>>(fill_some);
+    snapshot_checks.operator()<PagedIndexMap<int, unsigned int, Data>>([&](auto &m)
+    {
+        fill_some(m);
+        // Sparse keys.
+        (void)m.emplace_at(PagedIndexMap<int, unsigned int, Data>::key(1000), 1000);
+        (void)m.emplace_at(PagedIndexMap<int, unsigned int, Data>::key(501), 501);
+        m.erase(PagedIndexMap<int, unsigned int, Data>::key(501));
+    });
+    { // With `IndexLayout::paged`, the snapshot size doesn't depend on how large the keys are.
+        using M = PagedIndexMap<int, unsigned int, Data>;
+        M m;
+        for (unsigned int k : {1'000'003u, 7u, 600'042u, 100'011u})
+            m.emplace_at(M::key(k), int(k % 1000)).persistent_data.data = int(k / 1000);
+        m.erase(M::key(7));
+        std::vector<std::byte> bytes;
+        m.save([&](std::span<const std::byte> part){bytes.insert(bytes.end(), part.begin(), part.end());});
+        Check(bytes.size() <= 64 * 5);
+
+        std::vector<std::uint64_t> aligned_bytes((bytes.size() + 7) / 8);
+        std::memcpy(aligned_bytes.data(), bytes.data(), bytes.size());
+        em::IndexMapView<M> view(std::as_bytes(std::span(aligned_bytes)).first(bytes.size()));
+        M loaded;
+        std::size_t position = 0;
+        auto read = [&](std::span<std::byte> part)
+        {
+            if (position + part.size() > bytes.size())
+                throw std::invalid_argument("Invalid or incompatible index map snapshot.");
+            std::copy_n(bytes.begin() + std::ptrdiff_t(position), part.size(), part.begin());
+            position += part.size();
+        };
+        loaded.load(read);
+        for (unsigned int k : {1'000'003u, 600'042u, 100'011u})
+        {
+            Check(view.key_to_index(M::key(k)) == m.key_to_index(M::key(k)) && loaded.key_to_index(M::key(k)) == m.key_to_index(M::key(k)));
+            Check(view[M::key(k)] == int(k % 1000) && loaded[M::key(k)] == int(k % 1000));
+            Check(view.get_persistent_data(M::key(k)).data == int(k / 1000) && loaded.get_persistent_data(M::key(k)).data == int(k / 1000));
+        }
+        Check(!view.contains(M::key(7)) && view.contains_relaxed(M::key(7)) && loaded.contains_relaxed(M::key(7)) && !loaded.contains(M::key(7)));
+        Check(!view.contains_relaxed(M::key(8)) && !view.contains_relaxed(M::key(800'000u)));
+        MUST_THROW("Invalid index map key.", (void)view.get_persistent_data(M::key(8)));
+
+        // The sorted indices must be in the order of the keys. Swap the first two.
+        std::vector<std::byte> unsorted = bytes;
+        std::swap_ranges(unsorted.begin() + 128, unsorted.begin() + 132, unsorted.begin() + 132);
+        bytes = unsorted;
+        position = 0;
+        MUST_THROW("Invalid or incompatible index map snapshot.", loaded.load(read));
+        Check(loaded.empty());
+    }
+    snapshot_checks.operator()<GenerationIndexMap<int, Generations<em::IndexMapOptions>, Data>>([](auto &m)
+    {
+        using M = std::remove_cvref_t<decltype(m)>;
+        for (int i = 0; i < 10; i++)
+            (void)m.emplace(i);
+        // Retire key 0, and bump some other generations.
+        for (int i = 0; i < 255; i++)
+            m.erase(m.emplace().key);
+        m.erase(typename M::key(3));
+        Check(m.retired_keys_size() == 1);
+    });
+    snapshot_checks.operator()<em::IndexMap<void>>([](auto &m)
+    {
+        (void)m.emplace_n(10);
+        m.erase(em::IndexMap<void>::key(4));
+    });
+
+    { // Incompatible map types.
+        em::IndexMap<int> m;
+        (void)m.emplace(1);
+        std::vector<std::byte> bytes;
+        m.save([&](std::span<const std::byte> part){bytes.insert(bytes.end(), part.begin(), part.end());});
+
+        // Only the type sizes are checked.
+        em::IndexMap<double> other;
+        std::size_t position = 0;
+        MUST_THROW("Invalid or incompatible index map snapshot.", other.load([&](std::span<std::byte> part)
+        {
+            std::copy_n(bytes.begin() + std::ptrdiff_t(position), part.size(), part.begin());
+            position += part.size();
+        }));
+        // Same value size, but the snapshot has no persistent data.
+        em::IndexMap<int, unsigned int, Data> with_data;
+        position = 0;
+        MUST_THROW("Invalid or incompatible index map snapshot.", with_data.load([&](std::span<std::byte> part)
+        {
+            std::copy_n(bytes.begin() + std::ptrdiff_t(position), part.size(), part.begin());
+            position += part.size();
+        }));
+    }
+
+    #if DETAIL_EM_INDEXMAP_POSIX
+    { // Snapshot files.
+        using M = em::IndexMap<int, unsigned int, Data>;
+        M m;
+        fill_some(m);
+
+        char path[] = "/tmp/index_map_test_XXXXXX";
+        int fd = ::mkstemp(path);
+        Check(fd != -1);
+        em::save_snapshot(fd, m);
+        Check(::lseek(fd, 0, SEEK_SET) == 0);
+        M loaded;
+        em::load_snapshot(fd, loaded);
+        Check(std::ranges::equal(m.values(), loaded.values()));
+        Check(m.keys_size() == loaded.keys_size());
+
+        em::IndexMapView<M> view = em::IndexMapView<M>::map_fd(fd);
+        ::close(fd);
+        Check(std::ranges::equal(m.values(), view.values()));
+        view = em::IndexMapView<M>::map_file(path);
+        Check(std::ranges::equal(m.values(), view.values()));
+        for (std::size_t i = 0; i < m.size(); i++)
+            Check(view.get_persistent_data(m.index_to_key(i)).data == m.get_persistent_data(m.index_to_key(i)).data);
+        em::IndexMapView<M> moved = std::move(view);
+        Check(view.empty());
+        Check(moved.size() == m.size());
+        ::unlink(path);
+
+        MUST_THROW("Can't open an index map snapshot file: No such file or directory", (void)em::IndexMapView<M>::map_file(path));
+
+        // A truncated file is rejected by its size, before loading anything.
+        char truncated_path[] = "/tmp/index_map_test_XXXXXX";
+        fd = ::mkstemp(truncated_path);
+        Check(fd != -1);
+        em::save_snapshot(fd, m);
+        Check(::ftruncate(fd, 128) == 0 && ::lseek(fd, 0, SEEK_SET) == 0);
+        MUST_THROW("Invalid or incompatible index map snapshot.", em::load_snapshot(fd, loaded));
+        Check(loaded.empty());
+        ::close(fd);
+        ::unlink(truncated_path);
+    }
+    #endif
+
+    { // Arrow export.
+        struct Point
+        {
+            float x = 0;
+            std::int16_t y = 0;
+            bool visible = false;
+        };
+
+        auto arrow_checks = [&]<typename M>()
+        {
+            em::ArrowExporter<M> exporter;
+            for (int i = 0; i < 5; i++)
+                (void)exporter.modify().insert(Point{float(i), std::int16_t(i * 10), i % 2 == 0});
+            exporter.modify().erase(exporter.map().index_to_key(1));
+
+            ArrowArray keys;
+            ArrowSchema keys_schema;
+            exporter.export_keys(&keys, &keys_schema);
+            Check(keys.length == 4 && keys.n_buffers == 2 && keys.buffers[0] == nullptr && keys.null_count == 0);
+            Check(std::string_view(keys_schema.format) == "I" && std::string_view(keys_schema.name) == "key");
+            if constexpr (M::has_contiguous_keys)
+                Check(keys.buffers[1] == exporter.map().contiguous_keys().data());
+            for (std::size_t i = 0; i < 4; i++)
+                Check(static_cast<const unsigned int *>(keys.buffers[1])[i] == unsigned(exporter.map().index_to_key(i)));
+            keys_schema.release(&keys_schema);
+            Check(keys_schema.release == nullptr);
+
+            // Zero-copy values, pinning the map.
+            ArrowArray values;
+            exporter.export_values(&values);
+            Check(values.buffers[1] == exporter.map().values().data());
+            Check(std::string_view(em::detail::ArrowExport::Format<Point>()) == "w:" + std::to_string(sizeof(Point)));
+            Check(exporter.num_exports() == 2);
+            MUST_THROW("This index map is pinned by an Arrow export.", (void)exporter.modify());
+            keys.release(&keys);
+            Check(keys.release == nullptr);
+            Check(exporter.pinned());
+            values.release(&values);
+            Check(!exporter.pinned());
+            (void)exporter.modify().insert(Point{});
+
+            // A table with a column per field. A child can outlive its parent.
+            ArrowArray table;
+            ArrowSchema table_schema;
+            exporter.export_table(&table, &table_schema, em::ArrowField("x", &Point::x), em::ArrowField("y", &Point::y), em::ArrowField("visible", &Point::visible));
+            Check(std::string_view(table_schema.format) == "+s" && table_schema.n_children == 4);
+            Check(table.n_buffers == 1 && table.n_children == 4 && table.length == 5);
+            const char *formats[] = {"I", "f", "s", "b"};
+            const char *names[] = {"key", "x", "y", "visible"};
+            for (std::size_t j = 0; j < 4; j++)
+            {
+                Check(std::string_view(table_schema.children[j]->format) == formats[j]);
+                Check(std::string_view(table_schema.children[j]->name) == names[j]);
+                Check(table.children[j]->length == 5);
+            }
+            table_schema.release(&table_schema);
+
+            ArrowArray ys = *table.children[2];
+            table.children[2]->release = nullptr; // Moved out.
+            ArrowArray visible = *table.children[3];
+            table.children[3]->release = nullptr;
+            table.release(&table);
+            Check(exporter.pinned());
+            for (std::size_t i = 0; i < 5; i++)
+            {
+                const Point &p = exporter.map().values()[i];
+                Check(static_cast<const std::int16_t *>(ys.buffers[1])[i] == p.y);
+                Check(bool(static_cast<const std::uint8_t *>(visible.buffers[1])[i / 8] >> (i % 8) & 1) == p.visible);
+            }
+            ys.release(&ys);
+            Check(exporter.pinned());
+            visible.release(&visible);
+            Check(!exporter.pinned());
+
+            // Empty maps still export non-null buffers.
+            exporter.modify().clear();
+            exporter.export_table(&table, nullptr);
+            Check(table.n_children == 2 && table.length == 0);
+            Check(table.children[0]->buffers[1] != nullptr && table.children[1]->buffers[1] != nullptr);
+            table.release(&table);
+        };
+        static_assert(!em::IndexMap<Point>::has_contiguous_keys && SeparateIndexMap<Point>::has_contiguous_keys && PagedIndexMap<Point>::has_contiguous_keys);
+        arrow_checks.operator()<em::IndexMap<Point>>();
+        arrow_checks.operator()<SeparateIndexMap<Point>>();
+        arrow_checks.operator()<PagedIndexMap<Point>>();
+
+        em::ArrowExporter<em::IndexMap<void, std::uint16_t>> void_exporter;
+        (void)void_exporter.modify().emplace();
+        ArrowArray keys;
+        ArrowSchema schema;
+        void_exporter.export_table(&keys, &schema);
+        Check(keys.n_children == 1 && std::string_view(schema.children[0]->format) == "S");
+        keys.release(&keys);
+        schema.release(&schema);
+    }
 }